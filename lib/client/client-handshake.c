@@ -397,7 +397,7 @@ lws_client_connect_2(struct lws *wsi)
 	pfd.events = LWS_POLLIN;
 	pfd.revents = LWS_POLLIN;
 
-	n = lws_service_fd(context, &pfd);
+	n = lws_service_fd_tsi(context, &pfd, wsi->tsi);
 	if (n < 0) {
 		cce = "first service failed";
 		goto failed;
@@ -447,12 +447,16 @@ failed1:
  * port:	port to connect to
  * path:	uri path to connect to on the new server
  * host:	host header to send to the new server
+ *
+ * address, path and host may point into wsi's own headers, eg, the Location:
+ * of the redirect, so they are copied before the headers are reset.
  */
 LWS_VISIBLE struct lws *
 lws_client_reset(struct lws **pwsi, int ssl, const char *address, int port,
 		 const char *path, const char *host)
 {
 	char origin[300] = "", protocol[300] = "", method[32] = "", iface[16] = "", *p;
+	char ads[128] = "", uri[300] = "/", hst[128] = "";
 	struct lws *wsi = *pwsi;
 
 	if (wsi->redirects == 3) {
@@ -461,6 +465,10 @@ lws_client_reset(struct lws **pwsi, int ssl, const char *address, int port,
 	}
 	wsi->redirects++;
 
+	strncpy(ads, address, sizeof(ads) - 1);
+	strncpy(&uri[1], path, sizeof(uri) - 2);
+	strncpy(hst, host, sizeof(hst) - 1);
+
 	p = lws_hdr_simple_ptr(wsi, _WSI_TOKEN_CLIENT_ORIGIN);
 	if (p)
 		strncpy(origin, p, sizeof(origin) - 1);
@@ -475,10 +483,10 @@ lws_client_reset(struct lws **pwsi, int ssl, const char *address, int port,
 
 	p = lws_hdr_simple_ptr(wsi, _WSI_TOKEN_CLIENT_IFACE);
 	if (p)
-		strncpy(method, p, sizeof(iface) - 1);
+		strncpy(iface, p, sizeof(iface) - 1);
 
 	lwsl_info("redirect ads='%s', port=%d, path='%s', ssl = %d\n",
-		   address, port, path, ssl);
+		   ads, port, uri, ssl);
 
 	/* close the connection by hand */
 
@@ -521,10 +529,10 @@ lws_client_reset(struct lws **pwsi, int ssl, const char *address, int port,
 	wsi->hdr_parsing_completed = 0;
 	_lws_header_table_reset(wsi->u.hdr.ah);
 
-	if (lws_hdr_simple_create(wsi, _WSI_TOKEN_CLIENT_PEER_ADDRESS, address))
+	if (lws_hdr_simple_create(wsi, _WSI_TOKEN_CLIENT_PEER_ADDRESS, ads))
 		return NULL;
 
-	if (lws_hdr_simple_create(wsi, _WSI_TOKEN_CLIENT_HOST, host))
+	if (lws_hdr_simple_create(wsi, _WSI_TOKEN_CLIENT_HOST, hst))
 		return NULL;
 
 	if (origin[0])
@@ -545,9 +553,7 @@ lws_client_reset(struct lws **pwsi, int ssl, const char *address, int port,
 					  iface))
 			return NULL;
 
-	origin[0] = '/';
-	strncpy(&origin[1], path, sizeof(origin) - 2);
-	if (lws_hdr_simple_create(wsi, _WSI_TOKEN_CLIENT_URI, origin))
+	if (lws_hdr_simple_create(wsi, _WSI_TOKEN_CLIENT_URI, uri))
 		return NULL;
 
 	*pwsi = lws_client_connect_2(wsi);
@@ -555,134 +561,6 @@ lws_client_reset(struct lws **pwsi, int ssl, const char *address, int port,
 	return *pwsi;
 }
 
-#ifdef LWS_WITH_HTTP_PROXY
-static hubbub_error
-html_parser_cb(const hubbub_token *token, void *pw)
-{
-	struct lws_rewrite *r = (struct lws_rewrite *)pw;
-	char buf[1024], *start = buf + LWS_PRE, *p = start,
-	     *end = &buf[sizeof(buf) - 1];
-	size_t i;
-
-	switch (token->type) {
-	case HUBBUB_TOKEN_DOCTYPE:
-
-		p += lws_snprintf(p, end - p, "<!DOCTYPE %.*s %s ",
-				(int) token->data.doctype.name.len,
-				token->data.doctype.name.ptr,
-				token->data.doctype.force_quirks ?
-						"(force-quirks) " : "");
-
-		if (token->data.doctype.public_missing)
-			lwsl_debug("\tpublic: missing\n");
-		else
-			p += lws_snprintf(p, end - p, "PUBLIC \"%.*s\"\n",
-				(int) token->data.doctype.public_id.len,
-				token->data.doctype.public_id.ptr);
-
-		if (token->data.doctype.system_missing)
-			lwsl_debug("\tsystem: missing\n");
-		else
-			p += lws_snprintf(p, end - p, " \"%.*s\">\n",
-				(int) token->data.doctype.system_id.len,
-				token->data.doctype.system_id.ptr);
-
-		break;
-	case HUBBUB_TOKEN_START_TAG:
-		p += lws_snprintf(p, end - p, "<%.*s", (int)token->data.tag.name.len,
-				token->data.tag.name.ptr);
-
-/*				(token->data.tag.self_closing) ?
-						"(self-closing) " : "",
-				(token->data.tag.n_attributes > 0) ?
-						"attributes:" : "");
-*/
-		for (i = 0; i < token->data.tag.n_attributes; i++) {
-			if (!hstrcmp(&token->data.tag.attributes[i].name, "href", 4) ||
-			    !hstrcmp(&token->data.tag.attributes[i].name, "action", 6) ||
-			    !hstrcmp(&token->data.tag.attributes[i].name, "src", 3)) {
-				const char *pp = (const char *)token->data.tag.attributes[i].value.ptr;
-				int plen = (int) token->data.tag.attributes[i].value.len;
-
-				if (strncmp(pp, "http:", 5) && strncmp(pp, "https:", 6)) {
-
-					if (!hstrcmp(&token->data.tag.attributes[i].value,
-						     r->from, r->from_len)) {
-						pp += r->from_len;
-						plen -= r->from_len;
-					}
-					p += lws_snprintf(p, end - p, " %.*s=\"%s/%.*s\"",
-					       (int) token->data.tag.attributes[i].name.len,
-					       token->data.tag.attributes[i].name.ptr,
-					       r->to, plen, pp);
-					continue;
-				}
-			}
-
-			p += lws_snprintf(p, end - p, " %.*s=\"%.*s\"",
-				(int) token->data.tag.attributes[i].name.len,
-				token->data.tag.attributes[i].name.ptr,
-				(int) token->data.tag.attributes[i].value.len,
-				token->data.tag.attributes[i].value.ptr);
-		}
-		p += lws_snprintf(p, end - p, ">");
-		break;
-	case HUBBUB_TOKEN_END_TAG:
-		p += lws_snprintf(p, end - p, "</%.*s", (int) token->data.tag.name.len,
-				token->data.tag.name.ptr);
-/*
-				(token->data.tag.self_closing) ?
-						"(self-closing) " : "",
-				(token->data.tag.n_attributes > 0) ?
-						"attributes:" : "");
-*/
-		for (i = 0; i < token->data.tag.n_attributes; i++) {
-			p += lws_snprintf(p, end - p, " %.*s='%.*s'\n",
-				(int) token->data.tag.attributes[i].name.len,
-				token->data.tag.attributes[i].name.ptr,
-				(int) token->data.tag.attributes[i].value.len,
-				token->data.tag.attributes[i].value.ptr);
-		}
-		p += lws_snprintf(p, end - p, ">");
-		break;
-	case HUBBUB_TOKEN_COMMENT:
-		p += lws_snprintf(p, end - p, "<!-- %.*s -->\n",
-				(int) token->data.comment.len,
-				token->data.comment.ptr);
-		break;
-	case HUBBUB_TOKEN_CHARACTER:
-		if (token->data.character.len == 1) {
-			if (*token->data.character.ptr == '<') {
-				p += lws_snprintf(p, end - p, "&lt;");
-				break;
-			}
-			if (*token->data.character.ptr == '>') {
-				p += lws_snprintf(p, end - p, "&gt;");
-				break;
-			}
-			if (*token->data.character.ptr == '&') {
-				p += lws_snprintf(p, end - p, "&amp;");
-				break;
-			}
-		}
-
-		p += lws_snprintf(p, end - p, "%.*s", (int) token->data.character.len,
-				token->data.character.ptr);
-		break;
-	case HUBBUB_TOKEN_EOF:
-		p += lws_snprintf(p, end - p, "\n");
-		break;
-	}
-
-	if (user_callback_handle_rxflow(r->wsi->protocol->callback,
-			r->wsi, LWS_CALLBACK_RECEIVE_CLIENT_HTTP_READ,
-			r->wsi->user_space, start, p - start))
-		return -1;
-
-	return HUBBUB_OK;
-}
-#endif
-
 LWS_VISIBLE struct lws *
 lws_client_connect_via_info(struct lws_client_connect_info *i)
 {
@@ -704,6 +582,9 @@ lws_client_connect_via_info(struct lws_client_connect_info *i)
 	/* assert the mode and union status (hdr) clearly */
 	lws_union_transition(wsi, LWSCM_HTTP_CLIENT);
 	wsi->desc.sockfd = LWS_SOCK_INVALID;
+	/* a child is serviced by the same thread as its parent */
+	if (i->parent_wsi)
+		wsi->tsi = i->parent_wsi->tsi;
 
 	/* 1) fill up the wsi with stuff from the connect_info as far as it
 	 * can go.  It's because not only is our connection async, we might
@@ -801,18 +682,10 @@ lws_client_connect_via_info(struct lws_client_connect_info *i)
 	if (i->pwsi)
 		*i->pwsi = wsi;
 
-	/* if we went on the waiting list, no probs just return the wsi
-	 * when we get the ah, now or later, he will call
-	 * lws_client_connect_via_info2() below.
+	/*
+	 * the parent must know about us before we can connect, since that
+	 * may complete, or fail, inside lws_header_table_attach()
 	 */
-	if (lws_header_table_attach(wsi, 0) < 0) {
-		/*
-		 * if we failed here, the connection is already closed
-		 * and freed.
-		 */
-		goto bail1;
-	}
-
 	if (i->parent_wsi) {
 		lwsl_info("%s: created child %p of parent %p\n", __func__,
 				wsi, i->parent_wsi);
@@ -822,11 +695,22 @@ lws_client_connect_via_info(struct lws_client_connect_info *i)
 	}
 #ifdef LWS_WITH_HTTP_PROXY
 	if (i->uri_replace_to)
-		wsi->rw = lws_rewrite_create(wsi, html_parser_cb,
-					     i->uri_replace_from,
+		wsi->rw = lws_rewrite_create(wsi, i->uri_replace_from,
 					     i->uri_replace_to);
 #endif
 
+	/* if we went on the waiting list, no probs just return the wsi
+	 * when we get the ah, now or later, he will call
+	 * lws_client_connect_via_info2() below.
+	 */
+	if (lws_header_table_attach(wsi, 0) < 0) {
+		/*
+		 * if we failed here, the connection is already closed
+		 * and freed.
+		 */
+		goto bail1;
+	}
+
 	return wsi;
 
 bail:
@@ -884,6 +768,29 @@ lws_client_connect_via_info2(struct lws *wsi)
 					  stash->iface))
 			goto bail1;
 
+#if defined(LWS_WITH_HTTP_PROXY)
+	if (wsi->pxy_reused && lws_socket_is_valid(wsi->desc.sockfd)) {
+		struct lws_pollfd pfd;
+
+		/*
+		 * a kept-alive upstream connection taken from a proxy pool,
+		 * it's already connected so go straight to sending the
+		 * request on it
+		 */
+		lws_set_timeout(wsi, PENDING_TIMEOUT_SENT_CLIENT_HANDSHAKE,
+				AWAITING_TIMEOUT);
+		wsi->mode = LWSCM_WSCL_ISSUE_HANDSHAKE2;
+		pfd.fd = wsi->desc.sockfd;
+		pfd.events = LWS_POLLIN;
+		pfd.revents = LWS_POLLIN;
+
+		if (lws_service_fd_tsi(wsi->context, &pfd, wsi->tsi))
+			return NULL;
+
+		return wsi;
+	}
+#endif
+
 #if defined(LWS_WITH_SOCKS5)
 	if (!wsi->vhost->socks_proxy_port)
 		lws_free_set_NULL(wsi->u.hdr.stash);
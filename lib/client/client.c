@@ -468,6 +468,12 @@ lws_http_transaction_completed_client(struct lws *wsi)
 		return 1;
 	}
 
+#if defined(LWS_WITH_HTTP_PROXY)
+	/* a proxy mount may keep it for its next request to the upstream */
+	if (!lws_proxy_park(wsi))
+		return 0;
+#endif
+
 	/* we don't support chained client connections yet */
 	return 1;
 #if 0
@@ -693,6 +699,12 @@ lws_client_interpret_server_handshake(struct lws *wsi)
 			if (!wsi->chunked)
 				wsi->u.http.connection_type = HTTP_CONNECTION_CLOSE;
 
+		/* he may also tell us he's closing after this */
+		if (lws_hdr_total_length(wsi, WSI_TOKEN_CONNECTION) &&
+		    !strcasecmp(lws_hdr_simple_ptr(wsi, WSI_TOKEN_CONNECTION),
+				"close"))
+			wsi->u.http.connection_type = HTTP_CONNECTION_CLOSE;
+
 		/*
 		 * we seem to be good to go, give client last chance to check
 		 * headers and OK it
@@ -1158,9 +1170,11 @@ lws_generate_client_handshake(struct lws *wsi, char *pkt)
 				wsi->user_space, NULL, 0))
 			return NULL;
 
+		/* the ah and stash are gone from u.hdr after the transition */
+		lws_free_set_NULL(wsi->u.hdr.stash);
 		lws_header_table_force_to_detachable_state(wsi);
-		lws_union_transition(wsi, LWSCM_RAW);
 		lws_header_table_detach(wsi, 1);
+		lws_union_transition(wsi, LWSCM_RAW);
 
 		return NULL;
 	}
@@ -308,11 +308,20 @@ lws_callback_http_dummy(struct lws *wsi, enum lws_callback_reasons reason,
 #ifdef LWS_WITH_CGI
 	struct lws_cgi_args *args;
 #endif
-#if defined(LWS_WITH_CGI) || defined(LWS_WITH_HTTP_PROXY)
+#if defined(LWS_WITH_CGI)
 	char buf[512];
 	int n;
 #endif
 
+#if defined(LWS_WITH_HTTP_PROXY)
+	if (lws_proxy_wsi(wsi))
+		return lws_proxy_callback(wsi, reason, in, len);
+#endif
+#if defined(LWS_WITH_FASTCGI)
+	if (lws_fcgi_wsi(wsi))
+		return lws_fcgi_callback(wsi, reason, in, len);
+#endif
+
 	switch (reason) {
 	case LWS_CALLBACK_HTTP:
 #ifndef LWS_NO_SERVER
@@ -352,99 +361,18 @@ lws_callback_http_dummy(struct lws *wsi, enum lws_callback_reasons reason,
 		}
 
 		if (wsi->reason_bf & LWS_CB_REASON_AUX_BF__CGI_CHUNK_END) {
-			if (!wsi->http2_substream) {
-				memcpy(buf + LWS_PRE, "0\x0d\x0a\x0d\x0a", 5);
-				lwsl_debug("writing chunk term and exiting\n");
-				n = lws_write(wsi, (unsigned char *)buf +
-						   LWS_PRE, 5, LWS_WRITE_HTTP);
-			} else
-				n = lws_write(wsi, (unsigned char *)buf +
-						   LWS_PRE, 0,
-						   LWS_WRITE_HTTP_FINAL);
+			/* h1 gets the zero-length chunk, h2 END_STREAM */
+			lwsl_debug("writing chunk term and exiting\n");
+			n = lws_write(wsi, (unsigned char *)buf + LWS_PRE, 0,
+				      LWS_WRITE_HTTP_FINAL |
+				      LWS_WRITE_HTTP_CHUNK);
 
 			/* always close after sending it */
 			return -1;
 		}
 #endif
-#if defined(LWS_WITH_HTTP_PROXY)
-		if (wsi->reason_bf & LWS_CB_REASON_AUX_BF__PROXY) {
-			char *px = buf + LWS_PRE;
-			int lenx = sizeof(buf) - LWS_PRE;
-
-			/*
-			 * our sink is writeable and our source has something
-			 * to read.  So read a lump of source material of
-			 * suitable size to send or what's available, whichever
-			 * is the smaller.
-			 */
-			wsi->reason_bf &= ~LWS_CB_REASON_AUX_BF__PROXY;
-			if (!lws_get_child(wsi))
-				break;
-			if (lws_http_client_read(lws_get_child(wsi), &px,
-						 &lenx) < 0)
-				return -1;
-			break;
-		}
-#endif
-		break;
-
-#if defined(LWS_WITH_HTTP_PROXY)
-	case LWS_CALLBACK_RECEIVE_CLIENT_HTTP:
-		assert(lws_get_parent(wsi));
-		if (!lws_get_parent(wsi))
-			break;
-		lws_get_parent(wsi)->reason_bf |= LWS_CB_REASON_AUX_BF__PROXY;
-		lws_callback_on_writable(lws_get_parent(wsi));
 		break;
 
-	case LWS_CALLBACK_RECEIVE_CLIENT_HTTP_READ:
-		assert(lws_get_parent(wsi));
-		n = lws_write(lws_get_parent(wsi), (unsigned char *)in,
-				len, LWS_WRITE_HTTP);
-		if (n < 0)
-			return -1;
-		break;
-
-	case LWS_CALLBACK_ESTABLISHED_CLIENT_HTTP: {
-		unsigned char *p, *end;
-		char ctype[64], ctlen = 0;
-	
-		p = (unsigned char *)buf + LWS_PRE;
-		end = p + sizeof(buf) - LWS_PRE;
-
-		if (lws_add_http_header_status(lws_get_parent(wsi),
-					       HTTP_STATUS_OK, &p, end))
-			return 1;
-		if (lws_add_http_header_by_token(lws_get_parent(wsi),
-				WSI_TOKEN_HTTP_SERVER,
-			    	(unsigned char *)"libwebsockets",
-				13, &p, end))
-			return 1;
-
-		ctlen = lws_hdr_copy(wsi, ctype, sizeof(ctype),
-				     WSI_TOKEN_HTTP_CONTENT_TYPE);
-		if (ctlen > 0) {
-			if (lws_add_http_header_by_token(lws_get_parent(wsi),
-				WSI_TOKEN_HTTP_CONTENT_TYPE,
-				(unsigned char *)ctype, ctlen, &p, end))
-				return 1;
-		}
-
-		if (lws_finalize_http_header(lws_get_parent(wsi), &p, end))
-			return 1;
-
-		*p = '\0';
-		n = lws_write(lws_get_parent(wsi),
-			      (unsigned char *)buf + LWS_PRE,
-			      p - ((unsigned char *)buf + LWS_PRE),
-			      LWS_WRITE_HTTP_HEADERS);
-		if (n < 0)
-			return -1;
-
-		break; }
-
-#endif
-
 #ifdef LWS_WITH_CGI
 	/* CGI IO events (POLLIN/OUT) appear here, our default policy is:
 	 *
@@ -557,7 +485,7 @@ lws_create_vhost(struct lws_context *context,
 	struct lws_plugin *plugin = context->plugin_list;
 #endif
 	struct lws_protocols *lwsp;
-	int m, f = !info->pvo;
+	int m, f = !info->pvo, builtin = 0;
 #ifdef LWS_HAVE_GETENV
 	char *p;
 #endif
@@ -637,10 +565,10 @@ lws_create_vhost(struct lws_context *context,
 
 	/*
 	 * give the vhost a unified list of protocols including the
-	 * ones that came from plugins
+	 * ones that came from plugins, and room for a built in one
 	 */
 	lwsp = lws_zalloc(sizeof(struct lws_protocols) * (vh->count_protocols +
-				   context->plugin_protocol_count + 1),
+				   context->plugin_protocol_count + 2),
 				   "vhost-specific plugin table");
 	if (!lwsp) {
 		lwsl_err("OOM\n");
@@ -681,11 +609,28 @@ lws_create_vhost(struct lws_context *context,
 	}
 #endif
 
+#if defined(LWS_WITH_SERVER_STATUS)
+	/*
+	 * built in protocols are only added when the vhost's pvo ask for them,
+	 * and a plugin or the user's own protocol of the same name wins
+	 */
+	for (n = 0; n < m; n++)
+		if (!strcmp(lwsp[n].name, lws_openmetrics_protocol.name))
+			break;
+	if (n == m && lws_vhost_protocol_options(vh,
+					lws_openmetrics_protocol.name)) {
+		memcpy(&lwsp[m++], &lws_openmetrics_protocol,
+		       sizeof(struct lws_protocols));
+		vh->count_protocols++;
+		builtin = 1;
+	}
+#endif
+
 	if (
 #ifdef LWS_WITH_PLUGINS
 	    (context->plugin_list) ||
 #endif
-	    context->options & LWS_SERVER_OPTION_EXPLICIT_VHOSTS)
+	    builtin || context->options & LWS_SERVER_OPTION_EXPLICIT_VHOSTS)
 		vh->protocols = lwsp;
 	else {
 		vh->protocols = info->protocols;
@@ -697,6 +642,18 @@ lws_create_vhost(struct lws_context *context,
 				   "same vh list");
 
 	vh->mount_list = info->mounts;
+	if (lws_vhost_mount_trie_build(vh)) {
+		lwsl_err("%s: OOM indexing mounts\n", __func__);
+		goto bail;
+	}
+	if (lws_proxy_vhost_init(vh)) {
+		lwsl_err("%s: unable to set up proxy mounts\n", __func__);
+		goto bail;
+	}
+	if (lws_fcgi_vhost_init(vh)) {
+		lwsl_err("%s: unable to set up fastcgi mounts\n", __func__);
+		goto bail;
+	}
 
 #ifdef LWS_WITH_UNIX_SOCK
 	if (LWS_UNIX_SOCK_ENABLED(context)) {
@@ -818,20 +775,8 @@ lws_create_vhost(struct lws_context *context,
 
 #ifdef LWS_WITH_ACCESS_LOG
 	if (info->log_filepath) {
-		vh->log_fd = open(info->log_filepath,
-				  O_CREAT | O_APPEND | O_RDWR, 0600);
-		if (vh->log_fd == (int)LWS_INVALID_FILE) {
-			lwsl_err("unable to open log filepath %s\n",
-				 info->log_filepath);
+		if (lws_access_log_vhost_init(vh, info->log_filepath))
 			goto bail;
-		}
-#ifndef WIN32
-		if (context->uid != -1)
-			if (chown(info->log_filepath, context->uid,
-				  context->gid) == -1)
-				lwsl_err("unable to chown log file %s\n",
-						info->log_filepath);
-#endif
 	} else
 		vh->log_fd = (int)LWS_INVALID_FILE;
 #endif
@@ -852,6 +797,9 @@ lws_create_vhost(struct lws_context *context,
 		vh1 = &(*vh1)->vhost_next;
 	};
 
+	if (lws_vhost_index_add(vh))
+		lwsl_err("%s: unable to index vhost %s\n", __func__, vh->name);
+
 	/* for the case we are adding a vhost much later, after server init */
 
 	if (context->protocol_init_done)
@@ -860,6 +808,9 @@ lws_create_vhost(struct lws_context *context,
 	return vh;
 
 bail:
+	lws_proxy_vhost_destroy(vh);
+	lws_fcgi_vhost_destroy(vh);
+	lws_vhost_mount_trie_destroy(vh);
 	lws_free(vh);
 
 	return NULL;
@@ -880,6 +831,7 @@ lws_init_vhost_client_ssl(const struct lws_context_creation_info *info,
 LWS_VISIBLE void
 lws_cancel_service_pt(struct lws *wsi)
 {
+	wsi->context->pt[(int)wsi->tsi].cancel_pending = 1;
 	lws_plat_pipe_signal(wsi);
 }
 
@@ -892,12 +844,80 @@ lws_cancel_service(struct lws_context *context)
 	lwsl_notice("%s\n", __func__);
 
 	while (m--) {
-		if (pt->pipe_wsi)
+		if (pt->pipe_wsi) {
+			pt->cancel_pending = 1;
 			lws_plat_pipe_signal(pt->pipe_wsi);
+		}
 		pt++;
 	}
 }
 
+LWS_VISIBLE int
+lws_pt_work_post(struct lws_context *context, int tsi,
+		 struct lws_pt_work *work)
+{
+#if defined(LWS_HAVE_ATOMIC_BUILTINS)
+	struct lws_context_per_thread *pt;
+	struct lws_pt_work *head;
+
+	if (tsi < 0 || tsi >= context->count_threads || !work->cb)
+		return 1;
+
+	pt = &context->pt[tsi];
+
+	/* push it on the front of the list, racing other producers */
+	head = __atomic_load_n(&pt->work_head, __ATOMIC_RELAXED);
+	do {
+		work->next = head;
+	} while (!__atomic_compare_exchange_n(&pt->work_head, &head, work, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	/*
+	 * If the list had something on it, the service thread was already
+	 * woken for it and has not taken the list yet, so it will see ours
+	 * too.  Only the producer who found it empty has to wake it.
+	 */
+	if (!head && pt->pipe_wsi)
+		lws_plat_pipe_signal(pt->pipe_wsi);
+
+	return 0;
+#else
+	lwsl_err("%s: needs atomic builtins\n", __func__);
+
+	return 1;
+#endif
+}
+
+void
+lws_pt_work_run(struct lws_context *context, int tsi)
+{
+#if defined(LWS_HAVE_ATOMIC_BUILTINS)
+	struct lws_context_per_thread *pt = &context->pt[tsi];
+	struct lws_pt_work *w, *next, *fifo = NULL;
+
+	if (!__atomic_load_n(&pt->work_head, __ATOMIC_RELAXED))
+		return;
+
+	/* take the whole list in one go, producers start a new one */
+	w = __atomic_exchange_n(&pt->work_head, NULL, __ATOMIC_ACQUIRE);
+
+	/* it's newest-first, reverse it so we run them in posting order */
+	while (w) {
+		next = w->next;
+		w->next = fifo;
+		fifo = w;
+		w = next;
+	}
+
+	while (fifo) {
+		next = fifo->next;
+		fifo->cb(context, tsi, fifo);
+		fifo = next;
+	}
+#endif
+}
+
 int
 lws_create_event_pipes(struct lws_context *context)
 {
@@ -1199,14 +1219,17 @@ lws_create_context(struct lws_context_creation_info *info)
 		  (long)context->count_threads,
 		  context->pt_serv_buf_size);
 
-	lwsl_info(" mem: http hdr rsvd:   %5lu B (%u thr x (%u + %lu) x %u))\n",
+	lwsl_info(" mem: http hdr max:    %5lu B (%u thr x (%u + %lu) x %u)), "
+		  "allocated on demand from %u B\n",
 		    (long)(context->max_http_header_data +
 		     sizeof(struct allocated_headers)) *
 		    context->max_http_header_pool * context->count_threads,
 		    context->count_threads,
 		    context->max_http_header_data,
 		    (long)sizeof(struct allocated_headers),
-		    context->max_http_header_pool);
+		    context->max_http_header_pool,
+		    context->max_http_header_data < LWS_AH_DATA_INITIAL ?
+			context->max_http_header_data : LWS_AH_DATA_INITIAL);
 	n = sizeof(struct lws_pollfd) * context->count_threads *
 	    context->fd_limit_per_thread;
 	context->pt[0].fds = lws_zalloc(n, "fds table");
@@ -1470,6 +1493,9 @@ lws_vhost_destroy1(struct lws_vhost *vh)
 		}
 	} lws_end_foreach_llp(pv, vhost_next);
 
+	if (!context->being_destroyed)
+		lws_vhost_index_rebuild(context);
+
 	/* add ourselves to the pending destruction list */
 
 	vh->vhost_next = vh->context->vhost_pending_destruction_list;
@@ -1527,6 +1553,11 @@ lws_vhost_destroy2(struct lws_vhost *vh)
 	}
 	if (vh->protocol_vh_privs)
 		lws_free(vh->protocol_vh_privs);
+#if defined(LWS_WITH_STATS)
+	for (n = 0; n < LWS_MAX_SMP; n++)
+		if (vh->lat_hist[n])
+			lws_free_set_NULL(vh->lat_hist[n]);
+#endif
 	lws_ssl_SSL_CTX_destroy(vh);
 	lws_free(vh->same_vh_protocol_list);
 #ifdef LWS_WITH_PLUGINS
@@ -1547,11 +1578,13 @@ lws_vhost_destroy2(struct lws_vhost *vh)
 #endif
 #endif
 #ifdef LWS_WITH_ACCESS_LOG
-	if (vh->log_fd != (int)LWS_INVALID_FILE)
-		close(vh->log_fd);
+	lws_access_log_vhost_destroy(vh);
 #endif
 
 	lws_free_set_NULL(vh->alloc_cert_path);
+	lws_vhost_mount_trie_destroy(vh);
+	lws_proxy_vhost_destroy(vh);
+	lws_fcgi_vhost_destroy(vh);
 
 	/*
 	 * although async event callbacks may still come for wsi handles with
@@ -1632,6 +1665,13 @@ lws_context_destroy(struct lws_context *context)
 	memset(&wsi, 0, sizeof(wsi));
 	wsi.context = context;
 
+	/*
+	 * let anything posted to the pts but not yet run be cleaned up...
+	 * the service threads are no longer running, so it's ours to do
+	 */
+	for (n = 0; n < m; n++)
+		lws_pt_work_run(context, n);
+
 #ifdef LWS_LATENCY
 	if (context->worst_latency_info[0])
 		lwsl_notice("Worst latency: %s\n", context->worst_latency_info);
@@ -1692,9 +1732,9 @@ lws_context_destroy(struct lws_context *context)
 		lws_libevent_destroyloop(context, n);
 
 		lws_free_set_NULL(context->pt[n].serv_buf);
+		lws_free_set_NULL(context->pt[n].ping_wheel);
 
-		while (pt->ah_list)
-			_lws_destroy_ah(pt, pt->ah_list);
+		_lws_ah_slabs_destroy(pt);
 	}
 	lws_plat_context_early_destroy(context);
 
@@ -1719,6 +1759,10 @@ lws_context_destroy2(struct lws_context *context)
 
 	lwsl_info("%s: ctx %p\n", __func__, context);
 
+	/* write out any queued access log lines before the logs close */
+
+	lws_access_log_context_destroy(context);
+
 	/*
 	 * free all the per-vhost allocations
 	 */
@@ -1737,6 +1781,10 @@ lws_context_destroy2(struct lws_context *context)
 		lws_vhost_destroy2(context->vhost_pending_destruction_list);
 
 
+	lws_free_set_NULL(context->vhost_hash_table);
+	lws_access_log_context_destroy2(context);
+	lws_pubsub_context_destroy(context);
+
 	lws_stats_log_dump(context);
 
 	lws_ssl_context_destroy(context);
@@ -1761,7 +1809,7 @@ lws_context_destroy2(struct lws_context *context)
 	lws_check_deferred_free(context, 1);
 
 #if LWS_MAX_SMP > 1
-	pthread_mutex_destroy(&context->lock, NULL);
+	pthread_mutex_destroy(&context->lock);
 #endif
 
 	lws_free(context);
@@ -197,6 +197,20 @@ http_postbody:
 				if ((int)n < 0)
 					goto bail;
 			} else {
+#endif
+#ifdef LWS_WITH_HTTP_PROXY
+				/* it goes to the upstream connection */
+				if (wsi->pxy_req)
+					n = lws_proxy_req_body(wsi, buf,
+							(size_t)body_chunk_len);
+				else
+#endif
+#ifdef LWS_WITH_FASTCGI
+				/* ...or the worker connection */
+				if (wsi->fcgi_req)
+					n = lws_fcgi_req_body(wsi, buf,
+							(size_t)body_chunk_len);
+				else
 #endif
 				n = wsi->protocol->callback(wsi,
 					LWS_CALLBACK_HTTP_BODY, wsi->user_space,
@@ -225,6 +239,10 @@ postbody_completion:
 				lws_set_timeout(wsi, PENDING_TIMEOUT_CGI,
 						wsi->context->timeout_secs);
 			else
+#endif
+#ifdef LWS_WITH_FASTCGI
+			/* ...nor if it was for a fastcgi worker */
+			if (!wsi->fcgi_req)
 #endif
 			lws_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
 #ifdef LWS_WITH_CGI
@@ -232,6 +250,15 @@ postbody_completion:
 #endif
 			{
 				lwsl_notice("HTTP_BODY_COMPLETION\n");
+				n = 0;
+#ifdef LWS_WITH_HTTP_PROXY
+				/* the upstream's response completes it */
+				if (!wsi->pxy_req)
+#endif
+#ifdef LWS_WITH_FASTCGI
+				/* ...or the worker's */
+				if (!wsi->fcgi_req)
+#endif
 				n = wsi->protocol->callback(wsi,
 					LWS_CALLBACK_HTTP_BODY_COMPLETION,
 					wsi->user_space, NULL, 0);
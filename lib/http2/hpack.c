@@ -256,6 +256,9 @@ static int lws_frag_append(struct lws *wsi, unsigned char c)
 {
 	struct allocated_headers * ah = wsi->u.h2.http.ah;
 
+	if (ah->pos == ah->data_length && _lws_ah_data_grow(wsi->context, ah))
+		return 1;
+
 	ah->data[ah->pos++] = c;
 	ah->frags[ah->nfrag].len++;
 
@@ -498,6 +498,63 @@ int lws_h2_frame_write(struct lws *wsi, int type, int flags,
 	return n;
 }
 
+/*
+ * As lws_h2_frame_write(), but the payload is scattered across count
+ * fragments and needs no headroom; the frame header is prepared locally.
+ */
+int lws_h2_frame_writev(struct lws *wsi, int type, int flags,
+			unsigned int sid, const struct lws_iovec *iov,
+			int count)
+{
+	struct lws_iovec v[LWS_WRITEV_MAX_FRAGS + 1];
+	unsigned char hdr[LWS_H2_FRAME_HEADER_LENGTH];
+	struct lws *nwsi = lws_get_network_wsi(wsi);
+	unsigned int len = 0;
+	int n;
+
+	if (count > LWS_WRITEV_MAX_FRAGS)
+		return -1;
+
+	for (n = 0; n < count; n++) {
+		v[n + 1] = iov[n];
+		len += (unsigned int)iov[n].len;
+	}
+
+	hdr[0] = len >> 16;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+	hdr[3] = type;
+	hdr[4] = flags;
+	hdr[5] = sid >> 24;
+	hdr[6] = sid >> 16;
+	hdr[7] = sid >> 8;
+	hdr[8] = sid;
+
+	v[0].base = hdr;
+	v[0].len = sizeof(hdr);
+
+	lwsl_debug("%s: %p (eff %p). typ %d, fl 0x%x, sid=%d, len=%d, "
+		  "txcr=%d, nwsi->txcr=%d\n", __func__, wsi, nwsi, type, flags,
+		  sid, len, wsi->u.h2.tx_cr, nwsi->u.h2.tx_cr);
+
+	if (type == LWS_H2_FRAME_TYPE_DATA) {
+		if (wsi->u.h2.tx_cr < (int)len)
+			lwsl_err("%s: %p: sending payload len %d"
+				 " but tx_cr only %d!\n", __func__, wsi,
+				 len, wsi->u.h2.tx_cr);
+		lws_h2_tx_cr_consume(wsi, len);
+	}
+
+	n = lws_issue_rawv(nwsi, v, count + 1);
+	if (n < 0)
+		return n;
+
+	if (n >= LWS_H2_FRAME_HEADER_LENGTH)
+		return n - LWS_H2_FRAME_HEADER_LENGTH;
+
+	return n;
+}
+
 static void lws_h2_set_bin(struct lws *wsi, int n, unsigned char *buf)
 {
 	*buf++ = n >> 8;
@@ -78,6 +78,10 @@ lws_free_wsi(struct lws *wsi)
 
 	lws_free_set_NULL(wsi->rxflow_buffer);
 	lws_free_set_NULL(wsi->trunc_alloc);
+	lws_tx_queue_destroy(wsi);
+	lws_pubsub_wsi_destroy(wsi);
+	lws_proxy_wsi_destroy(wsi);
+	lws_fcgi_wsi_destroy(wsi);
 
 	/* we may not have an ah, but may be on the waiting list... */
 	lwsl_info("ah det due to close\n");
@@ -121,6 +125,7 @@ lws_free_wsi(struct lws *wsi)
 
 	lws_ssl_remove_wsi_from_buffered_list(wsi);
 	lws_remove_from_timeout_list(wsi);
+	lws_ping_wheel_remove(wsi);
 
 	wsi->context->count_wsi_allocated--;
 	lwsl_debug("%s: %p, remaining wsi %d\n", __func__, wsi,
@@ -468,14 +473,14 @@ lws_close_free_wsi(struct lws *wsi, enum lws_close_status reason)
 		goto just_kill_connection;
 
 	case LWSS_FLUSHING_STORED_SEND_BEFORE_CLOSE:
-		if (wsi->trunc_len) {
+		if (lws_tx_pending(wsi)) {
 			lws_callback_on_writable(wsi);
 			return;
 		}
 		lwsl_info("%p: end FLUSHING_STORED_SEND_BEFORE_CLOSE\n", wsi);
 		goto just_kill_connection;
 	default:
-		if (wsi->trunc_len) {
+		if (lws_tx_pending(wsi)) {
 			lwsl_info("%p: FLUSHING_STORED_SEND_BEFORE_CLOSE\n", wsi);
 			wsi->state = LWSS_FLUSHING_STORED_SEND_BEFORE_CLOSE;
 			lws_set_timeout(wsi,
@@ -690,6 +695,7 @@ just_kill_connection:
 	 */
 	lws_ssl_remove_wsi_from_buffered_list(wsi);
 	lws_remove_from_timeout_list(wsi);
+	lws_ping_wheel_remove(wsi);
 
 	/* checking return redundant since we anyway close */
 	if (wsi->desc.sockfd != LWS_SOCK_INVALID)
@@ -742,6 +748,7 @@ just_kill_connection:
 		if (wsi->trunc_alloc)
 			/* not going to be completed... nuke it */
 			lws_free_set_NULL(wsi->trunc_alloc);
+		lws_tx_queue_destroy(wsi);
 
 		wsi->u.ws.ping_payload_len = 0;
 		wsi->u.ws.ping_pending_flag = 0;
@@ -1915,7 +1922,7 @@ lws_get_ssl(struct lws *wsi)
 LWS_VISIBLE int
 lws_partial_buffered(struct lws *wsi)
 {
-	return !!wsi->trunc_len;
+	return !!lws_tx_pending(wsi);
 }
 
 LWS_VISIBLE size_t
@@ -2440,9 +2447,135 @@ lws_get_addr_scope(const char *ipaddr)
 }
 #endif
 
+static void
+lws_ping_wheel_insert(struct lws *wsi, time_t due)
+{
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+	struct lws **slot;
+
+	if (!pt->ping_wheel) {
+		pt->ping_wheel = lws_zalloc(sizeof(struct lws *) *
+					    LWS_PING_WHEEL_SLOTS, "ping wheel");
+		if (!pt->ping_wheel) {
+			lwsl_err("%s: OOM\n", __func__);
+			return;
+		}
+		pt->ping_wheel_last = (time_t)lws_now_secs();
+	}
+
+	slot = &pt->ping_wheel[due & (LWS_PING_WHEEL_SLOTS - 1)];
+
+	wsi->ping_wheel_due = due;
+	wsi->ping_wheel_next = *slot;
+	if (*slot)
+		(*slot)->ping_wheel_prev = &wsi->ping_wheel_next;
+	wsi->ping_wheel_prev = slot;
+	*slot = wsi;
+}
+
+void
+lws_ping_wheel_remove(struct lws *wsi)
+{
+	if (!wsi->ping_wheel_prev) /* ie, not on the wheel */
+		return;
+
+	if (wsi->ping_wheel_next)
+		wsi->ping_wheel_next->ping_wheel_prev = wsi->ping_wheel_prev;
+	*wsi->ping_wheel_prev = wsi->ping_wheel_next;
+
+	wsi->ping_wheel_prev = NULL;
+	wsi->ping_wheel_next = NULL;
+}
+
+/*
+ * Called once a second by each service thread for its own wheel.  The slots
+ * since the last run hold the ws connections that may need a PING now.
+ *
+ * If more than LWS_PING_BATCH are due, the wheel is left pointing at the
+ * slot we stopped in, and the rest are found when we come back next second.
+ *
+ * Traffic restarts a connection's ping timer just by updating
+ * time_next_ping_check, it is left where it is on the wheel.  So when we find
+ * it, we either start the PING, or move it on to its new deadline.  An
+ * active connection is touched here once per interval at most.
+ */
+void
+lws_ping_wheel_service(struct lws_context_per_thread *pt, time_t now)
+{
+	struct lws *wsi, *next;
+	int budget = LWS_PING_BATCH;
+	time_t t, due;
+
+	pt->ping_wheel_ran = now;
+
+	if (!pt->ping_wheel) {
+		pt->ping_wheel_last = now;
+		return;
+	}
+
+	t = pt->ping_wheel_last;
+	if (now - t > LWS_PING_WHEEL_SLOTS)
+		/* we have been away a while, look at every slot once */
+		t = now - LWS_PING_WHEEL_SLOTS;
+
+	while (t < now) {
+		wsi = pt->ping_wheel[++t & (LWS_PING_WHEEL_SLOTS - 1)];
+
+		while (wsi) {
+			next = wsi->ping_wheel_next;
+
+			if (wsi->ping_wheel_due > now) {
+				/* it's waiting for a later lap */
+				wsi = next;
+				continue;
+			}
+
+			lws_ping_wheel_remove(wsi);
+
+			if (wsi->state != LWSS_ESTABLISHED ||
+			    wsi->socket_is_permanently_unusable) {
+				/* it's closing, no more checks */
+				wsi = next;
+				continue;
+			}
+
+			due = wsi->u.ws.time_next_ping_check - wsi->ping_jitter;
+			if (due <= now) {
+				if (!budget--) {
+					/* the rest wait for next second */
+					lws_ping_wheel_insert(wsi, now + 1);
+					pt->ping_wheel_last = t - 1;
+					return;
+				}
+
+				if (!wsi->u.ws.send_check_ping) {
+					lwsl_info("req pp on wsi %p\n", wsi);
+					wsi->u.ws.send_check_ping = 1;
+					lws_set_timeout(wsi,
+					  PENDING_TIMEOUT_WS_PONG_CHECK_SEND_PING,
+						wsi->context->timeout_secs);
+					lws_callback_on_writable(wsi);
+				}
+				wsi->u.ws.time_next_ping_check = now +
+					wsi->context->ws_ping_pong_interval;
+				due = wsi->u.ws.time_next_ping_check -
+				      wsi->ping_jitter;
+			}
+
+			lws_ping_wheel_insert(wsi, due);
+			wsi = next;
+		}
+	}
+
+	pt->ping_wheel_last = now;
+}
+
 LWS_EXTERN void
 lws_restart_ws_ping_pong_timer(struct lws *wsi)
 {
+	struct lws_context_per_thread *pt;
+	uint32_t r;
+
 	if (!wsi->context->ws_ping_pong_interval)
 		return;
 	if (wsi->state != LWSS_ESTABLISHED)
@@ -2450,6 +2583,33 @@ lws_restart_ws_ping_pong_timer(struct lws *wsi)
 
 	wsi->u.ws.time_next_ping_check = (time_t)lws_now_secs() +
 				    wsi->context->ws_ping_pong_interval;
+
+	/*
+	 * The wheel finds out about the new deadline when it gets to us, so
+	 * after the first time, restarting the timer is just the store above
+	 */
+	if (wsi->ping_wheel_prev || (wsi->mode != LWSCM_WS_SERVING &&
+				     wsi->mode != LWSCM_WS_CLIENT))
+		return;
+
+	/*
+	 * Each connection pings up to a quarter of the interval early, by an
+	 * amount picked now, so connections that came up together don't all
+	 * ping in the same second ever after
+	 */
+	pt = &wsi->context->pt[(int)wsi->tsi];
+	r = pt->ping_jitter_seed;
+	if (!r)
+		r = (uint32_t)lws_now_secs() ^ (uint32_t)(lws_intptr_t)wsi;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	pt->ping_jitter_seed = r;
+	wsi->ping_jitter = (unsigned short)(r %
+			((wsi->context->ws_ping_pong_interval / 4) + 1));
+
+	lws_ping_wheel_insert(wsi, wsi->u.ws.time_next_ping_check -
+				   wsi->ping_jitter);
 }
 
 static const char *hex = "0123456789ABCDEF";
@@ -2664,8 +2824,43 @@ lws_sum_stats(const struct lws_context *ctx, struct lws_conn_stats *cs)
 	}
 }
 
+#if defined(LWS_WITH_STATS)
+/* json / log names, indexed by LWSSTATS_LAT_... */
+static const char * const lws_stats_lat_names[] = {
+	"accept_tls",
+	"first_byte",
+	"writable",
+	"service_loop",
+};
+#endif
+
 #ifdef LWS_WITH_SERVER_STATUS
 
+#if defined(LWS_WITH_STATS)
+static int
+lws_json_dump_latency(char *buf, int len, int which,
+		      const struct lws_stats_hist *h)
+{
+	struct lws_stats_latency_info li;
+
+	lws_stats_hist_info(h, &li);
+
+	return lws_snprintf(buf, len,
+			"\"%s\":{\"count\":\"%llu\",\"avg_us\":\"%llu\","
+			"\"p50_us\":\"%llu\",\"p90_us\":\"%llu\","
+			"\"p99_us\":\"%llu\",\"p999_us\":\"%llu\","
+			"\"max_us\":\"%llu\"}",
+			lws_stats_lat_names[which],
+			(unsigned long long)li.count,
+			(unsigned long long)(li.count ? li.sum_us / li.count : 0),
+			(unsigned long long)li.p50_us,
+			(unsigned long long)li.p90_us,
+			(unsigned long long)li.p99_us,
+			(unsigned long long)li.p999_us,
+			(unsigned long long)li.max_us);
+}
+#endif
+
 LWS_EXTERN int
 lws_json_dump_vhost(const struct lws_vhost *vh, char *buf, int len)
 {
@@ -2718,6 +2913,29 @@ lws_json_dump_vhost(const struct lws_vhost *vh, char *buf, int len)
 			vh->conn_stats.h2_subs
 	);
 
+#if defined(LWS_WITH_STATS)
+	{
+		/* each is the sum of the vhost's pt shards */
+		struct lws_stats_hist *h = lws_malloc(sizeof(*h), "json hist");
+
+		if (h) {
+			buf += lws_snprintf(buf, end - buf,
+					    ",\n \"latency\":{");
+			for (n = 0; n < LWSSTATS_LAT_SERVICE_LOOP; n++) {
+				memset(h, 0, sizeof(*h));
+				lws_stats_vh_hist_sum(h, vh,
+						(enum lws_stats_latency)n);
+				buf += lws_snprintf(buf, end - buf, "%s\n  ",
+						    n ? "," : "");
+				buf += lws_json_dump_latency(buf, end - buf,
+							     n, h);
+			}
+			buf += lws_snprintf(buf, end - buf, "\n }");
+			lws_free(h);
+		}
+	}
+#endif
+
 	if (vh->mount_list) {
 		const struct lws_http_mount *m = vh->mount_list;
 
@@ -2840,11 +3058,30 @@ lws_json_dump_context(const struct lws_context *context, char *buf, int len,
 				"\n  {\n"
 				"    \"fds_count\":\"%d\",\n"
 				"    \"ah_pool_inuse\":\"%d\",\n"
-				"    \"ah_wait_list\":\"%d\"\n"
-				"    }",
+				"    \"ah_wait_list\":\"%d\"",
 				pt->fds_count,
 				pt->ah_count_in_use,
 				pt->ah_wait_list_length);
+#if LWS_MAX_SMP > 1
+		buf += lws_snprintf(buf, end - buf, ",\n"
+				"    \"busy_us\":\"%u\",\n"
+				"    \"bytes\":\"%u\",\n"
+				"    \"txq_bytes\":\"%ld\",\n"
+				"    \"migrated_in\":\"%lu\",\n"
+				"    \"migrated_out\":\"%lu\"",
+				pt->load.busy_us_avg,
+				pt->load.bytes_avg,
+				pt->load.txq_bytes,
+				pt->load.migrated_in,
+				pt->load.migrated_out);
+#endif
+#if defined(LWS_WITH_STATS)
+		buf += lws_snprintf(buf, end - buf, ",\n    ");
+		buf += lws_json_dump_latency(buf, end - buf,
+					     LWSSTATS_LAT_SERVICE_LOOP,
+					     &pt->service_hist);
+#endif
+		buf += lws_snprintf(buf, end - buf, "\n    }");
 	}
 
 	buf += lws_snprintf(buf, end - buf, "]");
@@ -2892,6 +3129,40 @@ lws_json_dump_context(const struct lws_context *context, char *buf, int len,
 			cs.h2_subs,
 			cs.h2_upg);
 
+#if defined(LWS_WITH_STATS)
+	{
+		/* the same histograms summed over all vhosts / pts */
+		struct lws_stats_hist *h = lws_malloc(sizeof(*h), "json hist");
+
+		if (h) {
+			buf += lws_snprintf(buf, end - buf,
+					    ",\n \"latency\":{");
+			for (n = 0; n < LWSSTATS_LAT_COUNT; n++) {
+				int m;
+
+				memset(h, 0, sizeof(*h));
+				if (n == LWSSTATS_LAT_SERVICE_LOOP)
+					for (m = 0; m < context->count_threads;
+					     m++)
+						lws_stats_hist_sum(h,
+						  &context->pt[m].service_hist);
+				else
+					for (vh = context->vhost_list; vh;
+					     vh = vh->vhost_next)
+						lws_stats_vh_hist_sum(h, vh,
+						    (enum lws_stats_latency)n);
+
+				buf += lws_snprintf(buf, end - buf, "%s\n  ",
+						    n ? "," : "");
+				buf += lws_json_dump_latency(buf, end - buf,
+							     n, h);
+			}
+			buf += lws_snprintf(buf, end - buf, "\n }");
+			lws_free(h);
+		}
+	}
+#endif
+
 #ifdef LWS_WITH_CGI
 	for (n = 0; n < context->count_threads; n++) {
 		pt = &context->pt[n];
@@ -2922,10 +3193,195 @@ lws_json_dump_context(const struct lws_context *context, char *buf, int len,
 LWS_VISIBLE LWS_EXTERN uint64_t
 lws_stats_get(struct lws_context *context, int index)
 {
-	if (index >= LWSSTATS_SIZE)
+	uint64_t v = 0, s;
+	int n;
+
+	if (index < 0 || index >= LWSSTATS_SIZE)
 		return 0;
 
-	return context->lws_stats[index];
+	/* the shards are only summed here, off the hot path */
+
+	for (n = 0; n < context->count_threads; n++) {
+		s = lws_stats_load(&context->pt[n].lws_stats[index]);
+		if (index == LWSSTATS_MS_WORST_WRITABLE_DELAY) {
+			if (s > v)
+				v = s;
+		} else
+			v += s;
+	}
+
+	return v;
+}
+
+static int
+lws_stats_hist_index(uint64_t us)
+{
+	uint32_t v;
+	int msb;
+
+	if (us < (1 << LWS_STATS_HIST_SUB_BITS))
+		return (int)us;
+
+	v = us > 0xffffffff ? 0xffffffff : (uint32_t)us;
+#if defined(__GNUC__)
+	msb = 31 - __builtin_clz(v);
+#else
+	for (msb = 31; !(v & (1u << msb)); msb--)
+		;
+#endif
+
+	return ((msb - LWS_STATS_HIST_SUB_BITS + 1) << LWS_STATS_HIST_SUB_BITS) |
+	       (int)((v >> (msb - LWS_STATS_HIST_SUB_BITS)) &
+		     ((1 << LWS_STATS_HIST_SUB_BITS) - 1));
+}
+
+/* the largest value that lands in bucket n */
+
+static uint64_t
+lws_stats_hist_top(int n)
+{
+	int e = (n >> LWS_STATS_HIST_SUB_BITS) - 1;
+
+	if (n < (1 << LWS_STATS_HIST_SUB_BITS))
+		return n;
+
+	return (((uint64_t)((1 << LWS_STATS_HIST_SUB_BITS) |
+		 (n & ((1 << LWS_STATS_HIST_SUB_BITS) - 1))) + 1) << e) - 1;
+}
+
+void
+lws_stats_hist_record(struct lws_stats_hist *h, uint64_t us)
+{
+	lws_stats_add(&h->bucket[lws_stats_hist_index(us)], 1);
+	lws_stats_add(&h->sum_us, us);
+	lws_stats_max(&h->max_us, us);
+}
+
+void
+lws_stats_hist_sum(struct lws_stats_hist *dest, const struct lws_stats_hist *h)
+{
+	uint64_t m = lws_stats_load(&h->max_us);
+	int n;
+
+	for (n = 0; n < LWS_STATS_HIST_BUCKETS; n++)
+		dest->bucket[n] += lws_stats_load(&h->bucket[n]);
+	dest->sum_us += lws_stats_load(&h->sum_us);
+	if (m > dest->max_us)
+		dest->max_us = m;
+}
+
+void
+lws_stats_hist_info(const struct lws_stats_hist *h,
+		    struct lws_stats_latency_info *info)
+{
+	static const unsigned int bp[] = { 5000, 9000, 9900, 9990 };
+	uint64_t *pc[] = { &info->p50_us, &info->p90_us, &info->p99_us,
+			   &info->p999_us }, b[LWS_STATS_HIST_BUCKETS], c = 0,
+		 t;
+	int n, q = 0;
+
+	memset(info, 0, sizeof(*info));
+
+	/* snapshot it once, so the percentiles agree with the count */
+	for (n = 0; n < LWS_STATS_HIST_BUCKETS; n++) {
+		b[n] = lws_stats_load(&h->bucket[n]);
+		info->count += b[n];
+	}
+	info->sum_us = lws_stats_load(&h->sum_us);
+	info->max_us = lws_stats_load(&h->max_us);
+
+	if (!info->count)
+		return;
+
+	for (n = 0; n < LWS_STATS_HIST_BUCKETS && q < (int)ARRAY_SIZE(bp); n++) {
+		c += b[n];
+		while (q < (int)ARRAY_SIZE(bp)) {
+			/* rank of the sample at this percentile, from 1 */
+			t = (info->count * bp[q] + 9999) / 10000;
+			if (c < t)
+				break;
+			*pc[q] = lws_stats_hist_top(n);
+			if (*pc[q] > info->max_us)
+				*pc[q] = info->max_us;
+			q++;
+		}
+	}
+}
+
+void
+lws_stats_vh_latency(struct lws_vhost *vh, struct lws_context_per_thread *pt,
+		     enum lws_stats_latency which, uint64_t us)
+{
+	struct lws_stats_hist *h;
+
+	if (!vh)
+		return;
+
+	/* only this pt ever sets its slot, so there is no race to create it */
+	h = vh->lat_hist[pt->tid];
+	if (!h) {
+		h = lws_zalloc(sizeof(*h) * LWSSTATS_LAT_SERVICE_LOOP,
+			       "vh lat hist");
+		if (!h)
+			return;
+		/* readers on other threads must see it zeroed */
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS)
+		__atomic_store_n(&vh->lat_hist[pt->tid], h, __ATOMIC_RELEASE);
+#else
+		vh->lat_hist[pt->tid] = h;
+#endif
+	}
+
+	lws_stats_hist_record(&h[which], us);
+}
+
+void
+lws_stats_vh_hist_sum(struct lws_stats_hist *dest, const struct lws_vhost *vh,
+		      enum lws_stats_latency which)
+{
+	const struct lws_stats_hist *h;
+	int n;
+
+	for (n = 0; n < vh->context->count_threads; n++) {
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS)
+		h = __atomic_load_n(&vh->lat_hist[n], __ATOMIC_ACQUIRE);
+#else
+		h = vh->lat_hist[n];
+#endif
+		if (h)
+			lws_stats_hist_sum(dest, &h[which]);
+	}
+}
+
+LWS_VISIBLE LWS_EXTERN int
+lws_stats_latency_get(struct lws_context *context, struct lws_vhost *vh,
+		      enum lws_stats_latency which,
+		      struct lws_stats_latency_info *info)
+{
+	struct lws_stats_hist *h;
+	int n;
+
+	if ((int)which < 0 || which >= LWSSTATS_LAT_COUNT)
+		return -1;
+
+	h = lws_zalloc(sizeof(*h), "stats hist");
+	if (!h)
+		return -1;
+
+	if (which == LWSSTATS_LAT_SERVICE_LOOP)
+		for (n = 0; n < context->count_threads; n++)
+			lws_stats_hist_sum(h, &context->pt[n].service_hist);
+	else
+		if (vh)
+			lws_stats_vh_hist_sum(h, vh, which);
+		else
+			for (vh = context->vhost_list; vh; vh = vh->vhost_next)
+				lws_stats_vh_hist_sum(h, vh, which);
+
+	lws_stats_hist_info(h, info);
+	lws_free(h);
+
+	return 0;
 }
 
 LWS_VISIBLE LWS_EXTERN void
@@ -2936,6 +3392,12 @@ lws_stats_log_dump(struct lws_context *context)
 
 	(void)m;
 
+	for (n = 0; n < context->count_threads; n++)
+		if (context->pt[n].lws_stats_updated) {
+			context->pt[n].lws_stats_updated = 0;
+			context->updated = 1;
+		}
+
 	if (!context->updated)
 		return;
 
@@ -2988,6 +3450,9 @@ lws_stats_log_dump(struct lws_context *context)
 	lwsl_notice("LWSSTATS_C_PEER_LIMIT_WSI_DENIED:           %8llu\n",
 		(unsigned long long)lws_stats_get(context,
 					LWSSTATS_C_PEER_LIMIT_WSI_DENIED));
+	lwsl_notice("LWSSTATS_C_ACCESS_LOG_DROPPED:              %8llu\n",
+		(unsigned long long)lws_stats_get(context,
+					LWSSTATS_C_ACCESS_LOG_DROPPED));
 
 	lwsl_notice("LWSSTATS_C_TIMEOUTS:                        %8llu\n",
 		(unsigned long long)lws_stats_get(context,
@@ -3032,6 +3497,21 @@ lws_stats_log_dump(struct lws_context *context)
 			(unsigned long long)(lws_stats_get(context,
 					LWSSTATS_MS_WRITABLE_DELAY) /
 			lws_stats_get(context, LWSSTATS_C_WRITEABLE_CB)));
+	for (n = 0; n < LWSSTATS_LAT_COUNT; n++) {
+		struct lws_stats_latency_info li;
+
+		if (lws_stats_latency_get(context, NULL, n, &li) || !li.count)
+			continue;
+
+		lwsl_notice("Latency %-12s n %llu: p50 %lluus, p99 %lluus, "
+			    "p999 %lluus, max %lluus\n",
+			    lws_stats_lat_names[n],
+			    (unsigned long long)li.count,
+			    (unsigned long long)li.p50_us,
+			    (unsigned long long)li.p99_us,
+			    (unsigned long long)li.p999_us,
+			    (unsigned long long)li.max_us);
+	}
 	lwsl_notice("Simultaneous SSL restriction:               %8d/%d/%d\n",
 			context->simultaneous_ssl,
 			context->simultaneous_ssl_restriction,
@@ -3086,7 +3566,7 @@ lws_stats_log_dump(struct lws_context *context)
 
 #if defined(LWS_WITH_PEER_LIMITS)
 	m = 0;
-	for (n = 0; n < context->pl_hash_elements; n++)	{
+	for (n = 0; n < (int)context->pl_hash_elements; n++)	{
 		lws_start_foreach_llp(struct lws_peer **, peer,
 				      context->pl_hash_table[n]) {
 			m++;
@@ -3100,7 +3580,7 @@ lws_stats_log_dump(struct lws_context *context)
 	}
 
 	if (m) {
-		for (n = 0; n < context->pl_hash_elements; n++)	{
+		for (n = 0; n < (int)context->pl_hash_elements; n++)	{
 			char buf[72];
 
 			lws_start_foreach_llp(struct lws_peer **, peer,
@@ -3124,28 +3604,5 @@ lws_stats_log_dump(struct lws_context *context)
 	lwsl_notice("\n");
 }
 
-void
-lws_stats_atomic_bump(struct lws_context * context,
-		struct lws_context_per_thread *pt, int index, uint64_t bump)
-{
-	lws_pt_lock(pt);
-	context->lws_stats[index] += bump;
-	if (index != LWSSTATS_C_SERVICE_ENTRY)
-		context->updated = 1;
-	lws_pt_unlock(pt);
-}
-
-void
-lws_stats_atomic_max(struct lws_context * context,
-		struct lws_context_per_thread *pt, int index, uint64_t val)
-{
-	lws_pt_lock(pt);
-	if (val > context->lws_stats[index]) {
-		context->lws_stats[index] = val;
-		context->updated = 1;
-	}
-	lws_pt_unlock(pt);
-}
-
 #endif
 
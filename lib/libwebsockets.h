@@ -1428,6 +1428,17 @@ enum lws_callback_reasons {
 	 * protocol wants to take some action with this information.
 	 * \p in is the lws_vhost and \p len is the number of days left
 	 * before it expires, as a (ssize_t) */
+	LWS_CALLBACK_TX_QUEUE_HIGH				= 73,
+	/**< The protocol set .tx_queue_hwm or .tx_queue_hwm_msgs, and what
+	 * is waiting to be sent on this connection has just reached the high
+	 * watermark.  lws_send_pipe_choked() reports 1 until it drains, and
+	 * writing more before then is an error.  \p len is the number of
+	 * bytes pending.  Return nonzero to close the connection. */
+	LWS_CALLBACK_TX_QUEUE_LOW				= 74,
+	/**< After LWS_CALLBACK_TX_QUEUE_HIGH, what is waiting to be sent
+	 * has drained down to .tx_queue_lwm / .tx_queue_lwm_msgs, so the
+	 * protocol may resume producing.  \p len is the number of bytes
+	 * still pending.  Return nonzero to close the connection. */
 
 	/****** add new things just above ---^ ******/
 
@@ -2217,6 +2228,22 @@ struct lws_protocols {
 	 * to restrict one fragment you are trying to send to match this
 	 * size.
 	 */
+	unsigned int tx_queue_hwm;
+	/**< 0 keeps the old behaviour, where only one partial send may be
+	 * pending and the protocol must not write again until it is gone.
+	 * Nonzero enables a per-connection output queue: while a send is
+	 * pending, further writes are copied onto the queue and several are
+	 * sent together when the socket becomes writable.  When this many
+	 * bytes are pending, lws_send_pipe_choked() reports 1 and
+	 * LWS_CALLBACK_TX_QUEUE_HIGH is sent. */
+	unsigned int tx_queue_lwm;
+	/**< with the output queue enabled, LWS_CALLBACK_TX_QUEUE_LOW is sent
+	 * once the pending bytes drain to this or fewer (0 = fully drained) */
+	unsigned short tx_queue_hwm_msgs;
+	/**< as .tx_queue_hwm, but counting pending messages.  Either or both
+	 * may be set; the queue is enabled if either is nonzero. */
+	unsigned short tx_queue_lwm_msgs;
+	/**< as .tx_queue_lwm, but counting pending messages */
 
 	/* Add new things just above here ---^
 	 * This is part of the ABI, don't needlessly break compatibility */
@@ -2508,6 +2535,11 @@ enum lws_context_options {
 	 * example the ACME plugin was configured to fetch a cert, this lets
 	 * you bootstrap your vhost from having no cert to start with.
 	 */
+	LWS_SERVER_OPTION_NO_PT_MIGRATION			= (1 << 27),
+	/**< (CTX) With more than one service thread, don't hand idle
+	 * keepalive connections from a busy service thread to a less loaded
+	 * one.  New connections are still placed by load.
+	 */
 
 	/****** add new things just above ---^ ******/
 };
@@ -2659,7 +2691,8 @@ struct lws_context_creation_info {
 	 * client to hold on to an idle HTTP/1.1 connection */
 	const char *log_filepath;
 	/**< VHOST: filepath to append logs to... this is opened before
-	 *		any dropping of initial privileges */
+	 *		any dropping of initial privileges.  See also
+	 *		lws_access_log_reopen() */
 	const struct lws_http_mount *mounts;
 	/**< VHOST: optional linked list of mounts for this vhost */
 	const char *server_string;
@@ -2690,7 +2723,9 @@ struct lws_context_creation_info {
 	 * less than the interval given here will never send PINGs / expect
 	 * PONGs.  Conversely as soon as the ws connection is established, an
 	 * idle connection will do the PING / PONG roundtrip as soon as
-	 * ws_ping_pong_interval seconds has passed without traffic
+	 * ws_ping_pong_interval seconds has passed without traffic.
+	 * To spread the PINGs out, each connection picks a fixed amount of
+	 * up to a quarter of the interval by which its PINGs come early.
 	 */
 	const struct lws_protocol_vhost_options *headers;
 		/**< VHOST: pointer to optional linked list of per-vhost
@@ -2896,6 +2931,21 @@ lws_context_deprecate(struct lws_context *context, lws_reload_func cb);
 LWS_VISIBLE LWS_EXTERN int
 lws_context_is_deprecated(struct lws_context *context);
 
+#if defined(LWS_WITH_ACCESS_LOG)
+/**
+ * lws_access_log_reopen() - reopen every vhost access log file
+ *
+ * \param context:	Websocket context
+ *
+ *	Asks for each vhost's log_filepath to be opened again within the next
+ *	second, so logging continues into a new file after the old one was
+ *	renamed, eg, by logrotate.  It only sets a flag, so it is safe to call
+ *	from a SIGHUP or other signal handler.
+ */
+LWS_VISIBLE LWS_EXTERN void
+lws_access_log_reopen(struct lws_context *context);
+#endif
+
 /**
  * lws_set_proxy() - Setups proxy to lws_context.
  * \param vhost:	pointer to struct lws_vhost you want set proxy for
@@ -3073,6 +3123,46 @@ LWS_VISIBLE LWS_EXTERN int
 lws_json_dump_context(const struct lws_context *context, char *buf, int len,
 		      int hide_vhosts);
 
+/** struct lws_openmetrics_state - where an OpenMetrics dump has got to
+ *
+ * Zero it before the first lws_openmetrics_dump() call of a scrape and then
+ * leave it alone, apart from \p hide_vhosts which you may set before the
+ * first call.
+ */
+struct lws_openmetrics_state {
+	int family; /**< private: index of the current metric family */
+	int item; /**< private: vhost or service thread within the family */
+	unsigned char header_done; /**< private: family metadata was sent */
+	unsigned char finished; /**< private: "# EOF" was sent */
+	unsigned char hide_vhosts; /**< nonzero: skip the per-vhost families */
+
+	/* Add new things just above here ---^
+	 * This is part of the ABI, don't needlessly break compatibility */
+	void *_unused[4]; /**< dummy */
+};
+
+/**
+ * lws_openmetrics_dump() - produce the next part of an OpenMetrics exposition
+ *
+ * \param context: the context
+ * \param st: resumable position, zeroed for the start of a scrape
+ * \param buf: buffer to fill
+ * \param len: max length of buf, at least 4096 is recommended
+ *
+ * Fills \p buf with as many whole samples as fit, in the OpenMetrics text
+ * format, covering per-vhost connection stats, LWSSTATS_*, ah pool and fd
+ * usage per service thread, peer limits and the latency histograms that were
+ * built in.  Call it again with the same \p st for the next part, eg, once
+ * per writable callback, so a large exposition never holds up the service
+ * thread for long.
+ *
+ * Returns the number of bytes used in \p buf, 0 when the dump is complete,
+ * or -1 if \p len is too small to hold even one sample.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_openmetrics_dump(struct lws_context *context,
+		     struct lws_openmetrics_state *st, char *buf, size_t len);
+
 /**
  * lws_vhost_user() - get the user data associated with the vhost
  * \param vhost: Websocket vhost
@@ -3127,6 +3217,18 @@ enum lws_mount_protocols {
 	LWSMPRO_REDIR_HTTP	= 4, /**< redirect to http:// url */
 	LWSMPRO_REDIR_HTTPS	= 5, /**< redirect to https:// url */
 	LWSMPRO_CALLBACK	= 6, /**< hand by named protocol's callback */
+	LWSMPRO_FASTCGI		= 7, /**< pass to a pool of FastCGI workers */
+};
+
+/** enum lws_proxy_lb_policy
+ * How an http:// or https:// proxy mount with more than one upstream chooses
+ * the upstream for each request.  Upstreams that are failing their health
+ * checks are skipped, unless they all are.
+ */
+enum lws_proxy_lb_policy {
+	LWS_PROXY_LB_ROUND_ROBIN	= 0, /**< each upstream in turn */
+	LWS_PROXY_LB_LEAST_CONN		= 1, /**< fewest requests in flight */
+	LWS_PROXY_LB_HASH		= 2, /**< consistent hash of the path */
 };
 
 /** struct lws_http_mount
@@ -3147,7 +3249,8 @@ struct lws_http_mount {
 
 	const struct lws_protocol_vhost_options *cgienv;
 	/**< optional linked-list of cgi options.  These are created
-	 * as environment variables for the cgi process
+	 * as environment variables for the cgi process, or as extra params
+	 * for fastcgi:// mounts
 	 */
 	const struct lws_protocol_vhost_options *extra_mimetypes;
 	/**< optional linked-list of mimetype mappings */
@@ -3155,7 +3258,8 @@ struct lws_http_mount {
 	/**< optional linked-list of files to be interpreted */
 
 	int cgi_timeout;
-	/**< seconds cgi is allowed to live, if cgi://mount type */
+	/**< seconds cgi is allowed to live, if cgi://mount type, or for the
+	 * worker to complete the response, if fastcgi:// */
 	int cache_max_age;
 	/**< max-age for reuse of client cache of files, seconds */
 	unsigned int auth_mask;
@@ -3171,6 +3275,48 @@ struct lws_http_mount {
 	const char *basic_auth_login_file;
 	/**<NULL, or filepath to use to check basic auth logins against */
 
+	const struct lws_protocol_vhost_options *upstreams;
+	/**< NULL, or linked-list of more upstreams for http:// and https://
+	 * proxy mounts.  The name of each is "host" or "host:port", they
+	 * serve the same path as the one in origin, whose host is always
+	 * the first upstream */
+	const char *health_check_path;
+	/**< NULL, or a path to GET on each upstream every
+	 * health_check_interval seconds.  An upstream that doesn't answer
+	 * with 2xx or 3xx is skipped until it does again */
+	unsigned short health_check_interval;
+	/**< seconds between active health checks, 0 for 10 */
+	unsigned short fail_timeout;
+	/**< seconds an upstream is skipped after max_fails consecutive
+	 * connection or response failures, 0 for 10 */
+	unsigned char max_fails; /**< failures to skip an upstream, 0 for 1 */
+	unsigned char lb_policy; /**< one of enum lws_proxy_lb_policy */
+	unsigned char upstream_keepalive;
+	/**< max idle keep-alive connections kept to each upstream, per
+	 * service thread, for reuse by later requests.  0 for none */
+	unsigned char ws_passthrough;
+	/**< nonzero to pass websocket upgrades on proxy mounts through to
+	 * the upstream: the handshake and all the frames after it are
+	 * relayed as they are, without lws parsing or reframing them */
+	unsigned long proxy_cache_mem;
+	/**< proxy mounts: nonzero enables caching cacheable GET responses,
+	 * keeping up to this many bytes of them in memory */
+	unsigned long proxy_cache_disk;
+	/**< max bytes of cached responses spilled to proxy_cache_dir, 0 for
+	 * the default of 256MiB */
+	const char *proxy_cache_dir;
+	/**< NULL, or a directory where cached responses too big for memory,
+	 * or pushed out of it, are kept */
+	unsigned short fastcgi_conns;
+	/**< fastcgi:// mounts: max connections open to each worker, per
+	 * service thread, 0 for 8.  Requests wait for one beyond that.  The
+	 * origin is the first worker, "/path.sock" for a unix socket or
+	 * "host[:port]" for tcp, upstreams lists any more */
+	unsigned short fastcgi_mpxs;
+	/**< fastcgi:// mounts: requests in flight at once on one worker
+	 * connection, 0 for 1.  Only set it higher for workers that can
+	 * multiplex requests, which php-fpm can't */
+
 	/* Add new things just above here ---^
 	 * This is part of the ABI, don't needlessly break compatibility
 	 *
@@ -3503,6 +3649,55 @@ lws_cancel_service_pt(struct lws *wsi);
 LWS_VISIBLE LWS_EXTERN void
 lws_cancel_service(struct lws_context *context);
 
+struct lws_pt_work;
+
+/**
+ * lws_pt_work_cb - called on the service thread to perform posted work
+ * \param context:	Websocket context
+ * \param tsi:	the service thread index the work was posted to
+ * \param work:	the struct lws_pt_work that was posted, which the
+ *			callback now owns and may free or reuse
+ */
+typedef void (*lws_pt_work_cb)(struct lws_context *context, int tsi,
+			       struct lws_pt_work *work);
+
+/** struct lws_pt_work - caller-owned work item to run on a service thread
+ *
+ * Embed this in your own message struct, or use .opaque to point to it.
+ * lws does not allocate or free these.
+ */
+struct lws_pt_work {
+	struct lws_pt_work *next;	/**< private to lws */
+	lws_pt_work_cb cb;		/**< called on the service thread */
+	void *opaque;			/**< for the user, ignored by lws */
+};
+
+/**
+ * lws_pt_work_post() - queue work for a service thread from any thread
+ * \param context:	Websocket context
+ * \param tsi:	service thread index to run it on, 0 if only one
+ * \param work:	work item with .cb set, owned by lws until .cb is called
+ *
+ * This is the cheap way for other threads to hand things to lws.  The work
+ * is pushed onto a per-service-thread lock-free multi-producer list and
+ * .cb is called on the service thread, in the order the work was posted,
+ * at the start of its next service iteration.
+ *
+ * The service thread is only woken if the list was empty.  A single event
+ * fd write then covers everything posted until the service thread takes the
+ * list, so posting is usually just one atomic operation.  Unlike
+ * lws_cancel_service(), no LWS_CALLBACK_EVENT_WAIT_CANCELLED is broadcast.
+ *
+ * Work still pending at lws_context_destroy() has its .cb called at the
+ * start of the destroy, so it can be freed.
+ *
+ * Returns 0 if queued, or nonzero if tsi is invalid or the platform lacks
+ * the atomics needed.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_pt_work_post(struct lws_context *context, int tsi,
+		 struct lws_pt_work *work);
+
 /**
  * lws_service_fd() - Service polled socket with something waiting
  * \param context:	Websocket context
@@ -3594,6 +3789,8 @@ lws_handle_POLLOUT_event(struct lws *wsi, struct lws_pollfd *pollfd);
  *
  * This uses a canned list of known filetypes first, if no match and m is
  * non-NULL, then tries a list of per-mount file suffix to mimtype mappings.
+ * If lws was built with LWS_WITH_FULL_MIMETYPES, a larger table of common
+ * file extensions is tried last.
  *
  * Returns either NULL or a pointer to the mimetype matching the file.
  */
@@ -3736,6 +3933,11 @@ lws_chunked_html_process(struct lws_process_html_args *args,
  *
  *  As a convenience, lws has an api that will find the fragment with a
  *  given name= part, lws_get_urlarg_by_name().
+ *
+ *  The header storage starts small and is reallocated bigger as headers are
+ *  added to it, up to max_http_header_data.  So a pointer into a header is
+ *  only good until the next header is parsed or created on that connection;
+ *  use the _copy apis to keep anything for longer than that.
  */
 ///@{
 
@@ -4129,6 +4331,73 @@ lws_spa_create(struct lws *wsi, const char * const *param_names,
 	       int count_params, int max_storage, lws_spa_fileupload_cb opt_cb,
 	       void *opt_data);
 
+/** enum lws_spa_options - option flags for lws_spa_create_via_info() */
+enum lws_spa_options {
+	LWS_SPA_OPT_FILE_ZERO_COPY			= (1 << 0),
+	/**< file upload content is passed to opt_cb pointing directly into
+	 * the buffer given to lws_spa_process(), instead of being copied
+	 * through the max_storage buffer first.  The chunks are then as large
+	 * as the runs of content in the input, and opt_cb must not modify
+	 * them or use them after it returns. */
+};
+
+/** struct lws_spa_create_info - parameters for lws_spa_create_via_info() */
+struct lws_spa_create_info {
+	const char * const *param_names;
+	/**< array of form parameter names, like "username" */
+	int count_params;
+	/**< count of param_names */
+	int max_storage;
+	/**< total amount of form parameter values we can store */
+	lws_spa_fileupload_cb opt_cb;
+	/**< NULL, or callback to receive file upload data */
+	void *opt_data;
+	/**< NULL, or user pointer provided to opt_cb */
+	unsigned int options;
+	/**< 0, or LWS_SPA_OPT_ flags */
+
+	/* Add new things just above here ---^
+	 * This is part of the ABI, don't needlessly break compatibility
+	 *
+	 * The below is to ensure later library versions with new
+	 * members added above will see 0 (default) even if the app
+	 * was not built against the newer headers.
+	 */
+
+	void *_unused[4]; /**< dummy */
+};
+
+/**
+ * lws_spa_create_via_info() - create urldecode parser with options
+ *
+ * \param wsi: lws connection (used to find Content Type)
+ * \param info: parser creation parameters, see struct lws_spa_create_info
+ *
+ * As lws_spa_create(), but taking its parameters from an info struct, which
+ * also allows options like LWS_SPA_OPT_FILE_ZERO_COPY to be selected.
+ */
+LWS_VISIBLE LWS_EXTERN struct lws_spa *
+lws_spa_create_via_info(struct lws *wsi,
+			const struct lws_spa_create_info *info);
+
+/**
+ * lws_spa_file_sink() - write the current file upload straight to a file
+ *
+ * \param spa: the parser object previously created
+ * \param fop_fd: open vfs file to write the uploaded file content to
+ *
+ * May be called from opt_cb when it sees LWS_UFS_OPEN.  The content of that
+ * file part is then written directly to \p fop_fd, and opt_cb only gets a
+ * zero-length LWS_UFS_FINAL_CONTENT call when the part ends, at which point
+ * it may close the file.  Combined with LWS_SPA_OPT_FILE_ZERO_COPY the
+ * content goes from the network buffer to the file without further copies.
+ *
+ * Returns 0 if OK or -1 if no file part is being received.
+ */
+struct lws_fop_fd;
+LWS_VISIBLE LWS_EXTERN int
+lws_spa_file_sink(struct lws_spa *spa, struct lws_fop_fd *fop_fd);
+
 /**
  * lws_spa_process() - parses a chunk of input data
  *
@@ -4519,6 +4788,15 @@ enum lws_write_protocol {
 
 	/* flags */
 
+	LWS_WRITE_HTTP_CHUNK = 0x20,
+	/**< With LWS_WRITE_HTTP or LWS_WRITE_HTTP_FINAL on an http/1
+	 * connection, send the payload as one chunk of a chunked body.  lws
+	 * adds the chunk size line and the CRLF after it, and for
+	 * LWS_WRITE_HTTP_FINAL the terminating zero-length chunk as well, so
+	 * FINAL with no payload just ends the body.  They go out in the same
+	 * send as the payload, which needs no space reserved for them.  On
+	 * http/2 the flag is ignored, it has its own framing. */
+
 	LWS_WRITE_NO_FIN = 0x40,
 	/**< This part of the message is not the end of the message */
 
@@ -4636,6 +4914,230 @@ lws_write(struct lws *wsi, unsigned char *buf, size_t len,
 /* helper for case where buffer may be const */
 #define lws_write_http(wsi, buf, len) \
 	lws_write(wsi, (unsigned char *)(buf), len, LWS_WRITE_HTTP)
+
+/* the most fragments lws_writev() will accept in one call */
+#define LWS_WRITEV_MAX_FRAGS 16
+
+/** struct lws_iovec - one caller-owned fragment of a lws_writev() payload */
+struct lws_iovec {
+	const void *base;
+	/**< start of the fragment, no LWS_PRE needed in front of it */
+	size_t len;
+	/**< count of bytes in the fragment */
+};
+
+/**
+ * lws_writev() - Apply protocol then write scattered payload to client
+ * \param wsi:	Websocket instance (available from user callback)
+ * \param iov:	array of fragments that together make up the payload
+ * \param iov_count:	number of entries in iov, 0 .. LWS_WRITEV_MAX_FRAGS
+ * \param protocol:	as for lws_write()
+ *
+ * This is the same as lws_write(), except the payload is the concatenation
+ * of the fragments listed in iov, and none of them need LWS_PRE bytes of
+ * headroom: lws generates any ws or http/2 framing separately and issues it
+ * together with the fragments.  The fragments are
+ * only read and may be reused by the caller as soon as this returns.
+ *
+ * On a plain socket, the framing and fragments go out in a single sendmsg()
+ * without being copied.  Where the payload itself must be transformed or
+ * encrypted (TLS, client masking, active extensions...) the fragments are
+ * coalesced into one buffer first and sent via lws_write().
+ *
+ * If the kernel only accepts part of it, only the unsent remainder is kept
+ * in the connection's partial send buffer, and it is sent before the next
+ * WRITEABLE callback as with lws_write().
+ *
+ * With LWS_WRITE_HTTP_CHUNK, the chunk size line and trailer are two more
+ * fragments of the same send, so a chunked body costs no extra copy or
+ * syscall per chunk.
+ *
+ * Returns -1 for a fatal error needing connection close, otherwise the
+ * number of payload bytes consumed as lws_write() does.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_writev(struct lws *wsi, const struct lws_iovec *iov, int iov_count,
+	   enum lws_write_protocol protocol);
+
+/** struct lws_shared_msg - opaque ws message framed once for many connections */
+struct lws_shared_msg;
+
+/**
+ * lws_shared_msg_create() - frame a ws message once for sending to many wsi
+ * \param payload:	the message payload, copied into the new object
+ * \param len:	length of payload
+ * \param protocol:	LWS_WRITE_TEXT, LWS_WRITE_BINARY etc as for lws_write()
+ *
+ * Broadcast protocols can create the message once and pass it to
+ * lws_write_shared() for every subscriber.  The object is created holding one
+ * reference for the caller, drop it with lws_shared_msg_unref() when you no
+ * longer need it.  Connections that could not send all of it immediately
+ * hold their own reference until they have.
+ *
+ * Returns NULL on OOM or a bad protocol.
+ */
+LWS_VISIBLE LWS_EXTERN struct lws_shared_msg *
+lws_shared_msg_create(const void *payload, size_t len,
+		      enum lws_write_protocol protocol);
+
+/**
+ * lws_shared_msg_unref() - drop a reference on a shared message
+ * \param sm:	shared message from lws_shared_msg_create()
+ *
+ * The message is freed when the last reference has gone.
+ */
+LWS_VISIBLE LWS_EXTERN void
+lws_shared_msg_unref(struct lws_shared_msg *sm);
+
+/**
+ * lws_write_shared() - send a shared message on one connection
+ * \param wsi:	server ws connection to send on
+ * \param sm:	shared message from lws_shared_msg_create()
+ *
+ * Like lws_write(), this should be called from the WRITEABLE callback.  On
+ * an unmasked server connection with no active extensions, the frame
+ * prepared by lws_shared_msg_create() is sent directly.  If it can't all
+ * go at once, the connection takes a reference and just remembers how far
+ * it got, so nothing is copied per connection.  Protocols that enabled the
+ * output queue (.tx_queue_hwm) can keep writing shared messages until
+ * lws_send_pipe_choked() reports 1, and the connection queues references
+ * to them.
+ *
+ * Other connections, eg, those using permessage-deflate, are sent the
+ * payload as with lws_write().
+ *
+ * Returns -1 for a fatal error needing connection close, otherwise the
+ * payload length.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_write_shared(struct lws *wsi, struct lws_shared_msg *sm);
+///@}
+
+/** \defgroup pubsub Topic publish / subscribe
+ * ##Topic publish / subscribe
+ *
+ * Server ws connections subscribe to named topics, and anything, on any
+ * thread, can publish a message to a topic.
+ *
+ * A publish frames the message once as a shared message and hands one
+ * reference to each service thread that has subscribers for the topic, via
+ * lws_pt_work_post().  The service thread keeps the most recent messages for
+ * the topic in a small ring, and only asks for WRITEABLE on its own
+ * subscribers that were idle: subscribers who are already behind have a
+ * WRITEABLE callback coming anyway.  Each subscriber just remembers where
+ * it got to in the ring.
+ *
+ * In the WRITEABLE callback, call lws_pubsub_write_pending() to send what is
+ * waiting for the connection.  A subscriber that falls more than its
+ * max_lag messages behind is brought back within it according to its
+ * policy, so a slow consumer costs nothing but a few ring slots.
+ *
+ * Message order is kept per topic, but not between different topics.  Needs
+ * the gcc / clang __atomic builtins, the apis fail otherwise.
+ */
+///@{
+
+/** struct lws_pubsub_topic - opaque topic handle, valid until context destroy */
+struct lws_pubsub_topic;
+
+/** enum lws_pubsub_lag_policy - what to do with a subscriber over max_lag */
+enum lws_pubsub_lag_policy {
+	LWS_PUBSUB_LAG_DROP,
+	/**< skip the oldest messages, leaving the newest max_lag to send */
+	LWS_PUBSUB_LAG_COALESCE,
+	/**< skip everything but the newest message, eg, for topics where
+	 * each message is a complete new state */
+};
+
+/**
+ * lws_pubsub_topic_get() - find or create a topic by name
+ * \param context:	lws_context
+ * \param name:	topic name
+ *
+ * Topics are created on first use and live until the context is destroyed,
+ * so the handle can be looked up once and kept.  May be called from any
+ * thread.
+ *
+ * Returns NULL on OOM.
+ */
+LWS_VISIBLE LWS_EXTERN struct lws_pubsub_topic *
+lws_pubsub_topic_get(struct lws_context *context, const char *name);
+
+/**
+ * lws_pubsub_subscribe() - subscribe a ws connection to a topic
+ * \param wsi:	server ws connection, from one of its callbacks
+ * \param topic:	topic from lws_pubsub_topic_get()
+ * \param max_lag:	how many unsent messages the connection may fall behind
+ *			by, 0 for the default of 32, limited to 1024
+ * \param policy:	what to do when it falls further behind than that
+ *
+ * The connection gets messages published from now on.  Subscribing again
+ * to the same topic updates max_lag and policy.  Subscriptions are
+ * dropped automatically when the connection closes.
+ *
+ * Returns 0 if OK, or nonzero on OOM or if wsi is not a server ws connection.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_pubsub_subscribe(struct lws *wsi, struct lws_pubsub_topic *topic,
+		     unsigned int max_lag, enum lws_pubsub_lag_policy policy);
+
+/**
+ * lws_pubsub_unsubscribe() - stop a connection getting a topic's messages
+ * \param wsi:	ws connection, from one of its callbacks
+ * \param topic:	topic it subscribed to
+ *
+ * Anything published to the topic but not yet sent on the connection is
+ * forgotten.  Returns 0 if it was subscribed, else nonzero.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_pubsub_unsubscribe(struct lws *wsi, struct lws_pubsub_topic *topic);
+
+/**
+ * lws_pubsub_publish() - send a message to every subscriber of a topic
+ * \param topic:	topic from lws_pubsub_topic_get()
+ * \param payload:	message payload, copied
+ * \param len:	length of payload
+ * \param protocol:	LWS_WRITE_TEXT or LWS_WRITE_BINARY
+ *
+ * May be called from any thread, including service threads inside a
+ * callback.  The message is delivered to each service thread on its next
+ * service loop.
+ *
+ * Returns the number of service threads the message was queued for, 0 if
+ * the topic has no subscribers, or -1 on OOM.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_pubsub_publish(struct lws_pubsub_topic *topic, const void *payload,
+		   size_t len, enum lws_write_protocol protocol);
+
+/**
+ * lws_pubsub_write_pending() - send waiting topic messages on a connection
+ * \param wsi:	subscribed ws connection
+ *
+ * Call from the connection's WRITEABLE callback.  It sends messages waiting
+ * for the connection, across all its topics, until the connection can't
+ * take any more without blocking, or a batch of 32 has been sent.  If
+ * anything is left, it asks for another WRITEABLE callback itself.
+ *
+ * Protocols that enable the output queue (.tx_queue_hwm) let more messages
+ * go per callback.
+ *
+ * Returns -1 for a fatal error needing connection close, otherwise the
+ * number of messages sent.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_pubsub_write_pending(struct lws *wsi);
+
+/**
+ * lws_pubsub_dropped() - count of messages a subscriber skipped
+ * \param wsi:	subscribed ws connection
+ * \param topic:	topic it subscribed to
+ *
+ * Returns how many of the topic's messages were skipped for this connection
+ * by its lag policy since it subscribed.
+ */
+LWS_VISIBLE LWS_EXTERN unsigned int
+lws_pubsub_dropped(struct lws *wsi, struct lws_pubsub_topic *topic);
 ///@}
 
 /** \defgroup callback-when-writeable Callback when writeable
@@ -6539,6 +7041,10 @@ typedef signed char (*lejp_callback)(struct lejp_ctx *ctx, char reason);
 #ifndef LEJP_MAX_PATH
 #define LEJP_MAX_PATH 128
 #endif
+#ifndef LEJP_MAX_TRIE_STATES
+/* compiled path trie branches followed at once before testing each path */
+#define LEJP_MAX_TRIE_STATES 4
+#endif
 #ifndef LEJP_STRING_CHUNK
 /* must be >= 30 to assemble floats */
 #define LEJP_STRING_CHUNK 255
@@ -6558,6 +7064,38 @@ struct _lejp_stack {
 	char b; /* user bitfield */
 };
 
+struct _lejp_trie_level {
+	unsigned short node[LEJP_MAX_TRIE_STATES]; /* trie nodes reached */
+	unsigned char count; /* nodes in node[], or 0xff if too many */
+	unsigned char match; /* lowest path a trailing '*' matched, or 0 */
+};
+
+/**
+ * struct lejp_path_node - one node of a compiled path trie
+ *
+ * Filled in by lejp_paths_compile(), you only need to provide the storage.
+ */
+struct lejp_path_node {
+	unsigned short child; /**< index of first child node, 0 = none */
+	unsigned short sibling; /**< index of next sibling node, 0 = none */
+	char c; /**< path character, or '*' for a wildcard */
+	unsigned char match; /**< lowest paths[] index + 1 ending here, or 0 */
+};
+
+/**
+ * struct lejp_paths - a path list compiled into a trie
+ *
+ * A compiled path list is read-only once lejp_paths_compile() has filled it,
+ * so one instance can be shared by any number of lejp_construct_compiled()
+ * contexts, including concurrently.
+ */
+struct lejp_paths {
+	const char * const *paths; /**< the original path list */
+	struct lejp_path_node *nodes; /**< caller-provided node storage */
+	unsigned short count_nodes; /**< nodes used by the trie */
+	unsigned char count_paths; /**< ARRAY_SIZE() of paths */
+};
+
 struct lejp_ctx {
 
 	/* sorted by type for most compact alignment
@@ -6568,10 +7106,12 @@ struct lejp_ctx {
 	signed char (*callback)(struct lejp_ctx *ctx, char reason);
 	void *user;
 	const char * const *paths;
+	const struct lejp_paths *compiled;
 
 	/* arrays */
 
 	struct _lejp_stack st[LEJP_MAX_DEPTH];
+	struct _lejp_trie_level tst[LEJP_MAX_DEPTH]; /* trie walk per st[] */
 	unsigned short i[LEJP_MAX_INDEX_DEPTH]; /* index array */
 	unsigned short wild[LEJP_MAX_INDEX_DEPTH]; /* index array */
 	char path[LEJP_MAX_PATH];
@@ -6604,6 +7144,66 @@ lejp_construct(struct lejp_ctx *ctx,
 	       signed char (*callback)(struct lejp_ctx *ctx, char reason),
 	       void *user, const char * const *paths, unsigned char paths_count);
 
+/**
+ * lejp_paths_size() - count of nodes needed to compile a path list
+ *
+ * \param paths:	your array of name elements you are interested in
+ * \param count_paths:	ARRAY_SIZE() of @paths
+ *
+ * Returns the number of struct lejp_path_node you must provide to
+ * lejp_paths_compile() for this path list.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lejp_paths_size(const char * const *paths, unsigned char count_paths);
+
+/**
+ * lejp_paths_compile() - compile a path list into a trie
+ *
+ * \param lp:		struct lejp_paths to fill
+ * \param nodes:	storage for at least lejp_paths_size() nodes
+ * \param max_nodes:	count of nodes at @nodes
+ * \param paths:	your array of name elements you are interested in
+ * \param count_paths:	ARRAY_SIZE() of @paths
+ *
+ * lejp_construct() contexts test the current path against every entry in
+ * paths[] each time the path changes.  If you parse many documents with the
+ * same path list, or the list is long, compile it once with this and use
+ * lejp_construct_compiled() instead.  The context keeps where the trie walk
+ * got to at each stack level, so matching only walks the part of the path
+ * added since the enclosing object or array, whatever the number of paths.
+ * If more than LEJP_MAX_TRIE_STATES wildcard branches are live at once it
+ * falls back to testing each path.
+ *
+ * Matching semantics, including which path wins when several match and the
+ * wildcard positions reported, are identical to the uncompiled list.
+ *
+ * No allocation is performed, @paths and @nodes must stay valid while any
+ * context is using @lp.  Returns 0 if OK or -1 if @max_nodes is too small,
+ * or a path has more than LEJP_MAX_INDEX_DEPTH wildcards.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lejp_paths_compile(struct lejp_paths *lp, struct lejp_path_node *nodes,
+		   int max_nodes, const char * const *paths,
+		   unsigned char count_paths);
+
+/**
+ * lejp_construct_compiled() - lejp_construct() using a compiled path list
+ *
+ * \param ctx:	pointer to your struct lejp_ctx
+ * \param callback:	your user callback which will received parsed tokens
+ * \param user:	optional user data pointer untouched by lejp
+ * \param lp:	path list previously compiled by lejp_paths_compile()
+ *
+ * As lejp_construct(), but path matching uses the trie in @lp.
+ * ctx->paths and ctx->count_paths are still set from @lp, so callbacks
+ * can use ctx->path_match to index the original list as usual.
+ */
+LWS_VISIBLE LWS_EXTERN void
+lejp_construct_compiled(struct lejp_ctx *ctx,
+			signed char (*callback)(struct lejp_ctx *ctx,
+						char reason),
+			void *user, const struct lejp_paths *lp);
+
 LWS_VISIBLE LWS_EXTERN void
 lejp_destruct(struct lejp_ctx *ctx);
 
@@ -6652,23 +7252,81 @@ enum {
 	LWSSTATS_MS_SSL_RX_DELAY, /**< aggregate delay between ssl accept complete and first RX */
 	LWSSTATS_C_PEER_LIMIT_AH_DENIED, /**< number of times we would have given an ah but for the peer limit */
 	LWSSTATS_C_PEER_LIMIT_WSI_DENIED, /**< number of times we would have given a wsi but for the peer limit */
+	LWSSTATS_C_ACCESS_LOG_DROPPED, /**< access log lines dropped because the async log writer fell behind */
 
 	/* Add new things just above here ---^
 	 * This is part of the ABI, don't needlessly break compatibility */
 	LWSSTATS_SIZE
 };
 
+/*
+ * Latency histograms, in us.  The service loop one is kept per service
+ * thread, the others per vhost.
+ */
+
+enum lws_stats_latency {
+	LWSSTATS_LAT_ACCEPT_TLS, /**< tcp accept to tls handshake complete */
+	LWSSTATS_LAT_FIRST_BYTE, /**< http headers complete to first lws_write() of the response */
+	LWSSTATS_LAT_WRITABLE, /**< asking for writable to getting the cb */
+	LWSSTATS_LAT_SERVICE_LOOP, /**< time spent servicing fds after each poll wait */
+
+	/* Add new things just above here ---^
+	 * This is part of the ABI, don't needlessly break compatibility */
+	LWSSTATS_LAT_COUNT
+};
+
+/** struct lws_stats_latency_info - summary of one latency histogram
+ *
+ * Percentiles are the top of the histogram bucket they fall in, so they
+ * are at most 12.5% above the true value, and never above max_us.
+ */
+struct lws_stats_latency_info {
+	uint64_t count; /**< number of samples */
+	uint64_t sum_us; /**< sum of all samples, for computing the mean */
+	uint64_t max_us; /**< largest sample */
+	uint64_t p50_us; /**< median */
+	uint64_t p90_us; /**< 90th percentile */
+	uint64_t p99_us; /**< 99th percentile */
+	uint64_t p999_us; /**< 99.9th percentile */
+
+	/* Add new things just above here ---^
+	 * This is part of the ABI, don't needlessly break compatibility */
+	uint64_t _unused[4]; /**< dummy */
+};
+
 #if defined(LWS_WITH_STATS)
 
 LWS_VISIBLE LWS_EXTERN uint64_t
 lws_stats_get(struct lws_context *context, int index);
 LWS_VISIBLE LWS_EXTERN void
 lws_stats_log_dump(struct lws_context *context);
+/**
+ * lws_stats_latency_get() - summarize a latency histogram
+ *
+ * \param context: the lws_context
+ * \param vh: the vhost to report on, or NULL for all vhosts together
+ * \param which: LWSSTATS_LAT_...
+ * \param info: filled with the summary
+ *
+ * LWSSTATS_LAT_SERVICE_LOOP is not per-vhost, \p vh is ignored for it and
+ * the result covers all service threads.
+ *
+ * Returns 0 if \p info was filled, or -1 if \p which is out of range or
+ * there was no memory to sum the per service thread histograms in.
+ */
+LWS_VISIBLE LWS_EXTERN int
+lws_stats_latency_get(struct lws_context *context, struct lws_vhost *vh,
+		      enum lws_stats_latency which,
+		      struct lws_stats_latency_info *info);
 #else
 static LWS_INLINE uint64_t
 lws_stats_get(struct lws_context *context, int index) { return 0; }
 static LWS_INLINE void
 lws_stats_log_dump(struct lws_context *context) { }
+static LWS_INLINE int
+lws_stats_latency_get(struct lws_context *context, struct lws_vhost *vh,
+		      enum lws_stats_latency which,
+		      struct lws_stats_latency_info *info) { return -1; }
 #endif
 
 #ifdef __cplusplus
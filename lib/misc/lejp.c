@@ -22,6 +22,11 @@
 #include <libwebsockets.h>
 #include <string.h>
 #include <stdio.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 /**
  * lejp_construct - prepare a struct lejp_ctx for use
@@ -52,11 +57,112 @@ lejp_construct(struct lejp_ctx *ctx,
 	ctx->callback = callback;
 	ctx->user = user;
 	ctx->paths = paths;
+	ctx->compiled = NULL;
 	ctx->count_paths = count_paths;
 	ctx->line = 1;
 	ctx->callback(ctx, LEJPCB_CONSTRUCTED);
 }
 
+/**
+ * lejp_paths_size - count of nodes needed to compile a path list
+ *
+ * \param paths:	your array of name elements you are interested in
+ * \param count_paths:	ARRAY_SIZE() of @paths
+ *
+ * Every path character may need its own node, plus one for the root
+ */
+
+int
+lejp_paths_size(const char * const *paths, unsigned char count_paths)
+{
+	int n, size = 1;
+
+	for (n = 0; n < count_paths; n++)
+		size += strlen(paths[n]);
+
+	return size;
+}
+
+/**
+ * lejp_paths_compile - compile a path list into a trie
+ *
+ * \param lp:		struct lejp_paths to fill
+ * \param nodes:	storage for at least lejp_paths_size() nodes
+ * \param max_nodes:	count of nodes at @nodes
+ * \param paths:	your array of name elements you are interested in
+ * \param count_paths:	ARRAY_SIZE() of @paths
+ *
+ * Paths sharing a prefix share trie nodes; a node's match member holds the
+ * lowest paths[] index + 1 that ends there, so where paths are duplicated the
+ * first one wins, as it does when the list is scanned in order.
+ */
+
+int
+lejp_paths_compile(struct lejp_paths *lp, struct lejp_path_node *nodes,
+		   int max_nodes, const char * const *paths,
+		   unsigned char count_paths)
+{
+	const char *q;
+	int n, cur, c, wc;
+
+	if (max_nodes < 1)
+		return -1;
+	if (max_nodes > 0xffff) /* node indexes are unsigned short */
+		max_nodes = 0xffff;
+
+	lp->paths = paths;
+	lp->nodes = nodes;
+	lp->count_paths = count_paths;
+	lp->count_nodes = 1;
+	memset(&nodes[0], 0, sizeof(nodes[0]));
+
+	for (n = 0; n < count_paths; n++) {
+		cur = 0;
+		wc = 0;
+		for (q = paths[n]; *q; q++) {
+			/* the uncompiled matcher can't report more wildcards */
+			if (*q == '*' && ++wc > LEJP_MAX_INDEX_DEPTH)
+				return -1;
+			for (c = nodes[cur].child; c; c = nodes[c].sibling)
+				if (nodes[c].c == *q)
+					break;
+			if (!c) {
+				if (lp->count_nodes >= max_nodes)
+					return -1;
+				c = lp->count_nodes++;
+				nodes[c].c = *q;
+				nodes[c].match = 0;
+				nodes[c].child = 0;
+				nodes[c].sibling = nodes[cur].child;
+				nodes[cur].child = c;
+			}
+			cur = c;
+		}
+		if (!nodes[cur].match)
+			nodes[cur].match = n + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * lejp_construct_compiled - prepare a struct lejp_ctx using a compiled list
+ *
+ * \param ctx:	pointer to your struct lejp_ctx
+ * \param callback:	your user callback which will received parsed tokens
+ * \param user:	optional user data pointer untouched by lejp
+ * \param lp:	path list previously compiled by lejp_paths_compile()
+ */
+
+void
+lejp_construct_compiled(struct lejp_ctx *ctx,
+	signed char (*callback)(struct lejp_ctx *ctx, char reason), void *user,
+			const struct lejp_paths *lp)
+{
+	lejp_construct(ctx, callback, user, lp->paths, lp->count_paths);
+	ctx->compiled = lp;
+}
+
 /**
  * lejp_destruct - retire a previously constructed struct lejp_ctx
  *
@@ -107,47 +213,165 @@ lejp_change_callback(struct lejp_ctx *ctx,
 }
 
 static void
-lejp_check_path_match(struct lejp_ctx *ctx)
+lejp_trie_add(struct _lejp_trie_level *t, int node)
 {
-	const char *p, *q;
-	int n;
+	if (t->count == 0xff)
+		return;
+	if (t->count == LEJP_MAX_TRIE_STATES) {
+		t->count = 0xff;
+		return;
+	}
+	t->node[t->count++] = node;
+}
 
-	/* we only need to check if a match is not active */
-	for (n = 0; !ctx->path_match && n < ctx->count_paths; n++) {
-		ctx->wildcount = 0;
-		p = ctx->path;
-		q = ctx->paths[n];
-		while (*p && *q) {
-			if (*q != '*') {
-				if (*p != *q)
-					break;
-				p++;
-				q++;
-				continue;
-			}
-			ctx->wild[ctx->wildcount++] = p - ctx->path;
-			q++;
-			/*
-			 * if * has something after it, match to .
-			 * if ends with *, eat everything.
-			 * This implies match sequences must be ordered like
-			 *  x.*.*
-			 *  x.*
-			 * if both options are possible
-			 */
-			while (*p && (*p != '.' || !*q))
-				p++;
+/*
+ * Add to t the states reached from node, which has consumed the path so far,
+ * by the next path char ch.  A '*' child matches whatever is left if a path
+ * ends there, and eats up to the next '.' if paths continue after it, as the
+ * uncompiled matcher does.  So a '*' node in t is one still eating.
+ */
+
+static void
+lejp_trie_step(const struct lejp_path_node *nodes, int node, char ch,
+	       struct _lejp_trie_level *t)
+{
+	const struct lejp_path_node *n;
+	int c;
+
+	for (c = nodes[node].child; c; c = n->sibling) {
+		n = &nodes[c];
+
+		if (n->c != '*') {
+			if (n->c == ch)
+				lejp_trie_add(t, c);
+			continue;
 		}
-		if (*p || *q)
+
+		if (n->match && (!t->match || n->match < t->match))
+			t->match = n->match;
+		if (ch == '.')
+			/* it matched nothing, its children get the '.' */
+			lejp_trie_step(nodes, c, ch, t);
+		else if (n->child)
+			lejp_trie_add(t, c);
+	}
+}
+
+/*
+ * Fill t with the trie states for the path up to len, carrying on from the
+ * states stored for the enclosing stack level.  Leaving a level needs
+ * nothing, the level below it still has its states.
+ */
+
+static void
+lejp_trie_resume(struct lejp_ctx *ctx, struct _lejp_trie_level *t, int len)
+{
+	const struct lejp_path_node *nodes = ctx->compiled->nodes;
+	unsigned short from[LEJP_MAX_TRIE_STATES];
+	int n, m, pos = 0;
+
+	if (ctx->sp) {
+		*t = ctx->tst[ctx->sp - 1];
+		pos = (unsigned char)ctx->st[ctx->sp - 1].p;
+	} else {
+		t->node[0] = 0;
+		t->count = 1;
+		t->match = 0;
+	}
+
+	for (; pos < len && t->count && t->count != 0xff; pos++) {
+		m = t->count;
+		memcpy(from, t->node, m * sizeof(from[0]));
+		t->count = 0;
+		for (n = 0; n < m; n++)
+			if (nodes[from[n]].c == '*' && ctx->path[pos] != '.')
+				lejp_trie_add(t, from[n]);
+			else
+				lejp_trie_step(nodes, from[n], ctx->path[pos], t);
+	}
+}
+
+/* 0 if paths[n] matches the current path, setting the wildcards */
+
+static int
+lejp_path_cmp(struct lejp_ctx *ctx, int n)
+{
+	const char *p = ctx->path, *q = ctx->paths[n];
+
+	ctx->wildcount = 0;
+	while (*p && *q) {
+		if (*q != '*') {
+			if (*p != *q)
+				break;
+			p++;
+			q++;
 			continue;
+		}
+		if (ctx->wildcount == LEJP_MAX_INDEX_DEPTH)
+			break;
+		ctx->wild[ctx->wildcount++] = p - ctx->path;
+		q++;
+		/*
+		 * if * has something after it, match to .
+		 * if ends with *, eat everything.
+		 * This implies match sequences must be ordered like
+		 *  x.*.*
+		 *  x.*
+		 * if both options are possible
+		 */
+		while (*p && (*p != '.' || !*q))
+			p++;
+	}
+
+	return *p || *q;
+}
+
+static void
+lejp_check_path_match(struct lejp_ctx *ctx)
+{
+	const struct lejp_path_node *nodes;
+	struct _lejp_trie_level t;
+	int n, m;
 
-		ctx->path_match = n + 1;
-		ctx->path_match_len = ctx->ppos;
+	/* we only need to check if a match is not active */
+	if (ctx->path_match)
 		return;
+
+	if (ctx->compiled) {
+		nodes = ctx->compiled->nodes;
+		lejp_trie_resume(ctx, &t, ctx->ppos);
+		if (t.count != 0xff) {
+			/* the lowest path ending here, if any */
+			for (n = 0; n < t.count; n++) {
+				m = nodes[t.node[n]].match;
+				if (m && nodes[t.node[n]].c != '*' &&
+				    (!t.match || m < t.match))
+					t.match = m;
+			}
+			if (!t.match) {
+				ctx->wildcount = 0;
+				return;
+			}
+			/* it does match, this just finds the wildcards */
+			if (!strchr(ctx->paths[t.match - 1], '*'))
+				ctx->wildcount = 0;
+			else
+				lejp_path_cmp(ctx, t.match - 1);
+			ctx->path_match = t.match;
+			ctx->path_match_len = ctx->ppos;
+			return;
+		}
+		/* too many wildcard branches to follow, try each path */
 	}
 
-	if (!ctx->path_match)
-		ctx->wildcount = 0;
+	for (n = 0; n < ctx->count_paths; n++)
+		if (!lejp_path_cmp(ctx, n)) {
+			ctx->path_match = n + 1;
+			ctx->path_match_len = ctx->ppos;
+			return;
+		}
+
+	ctx->wildcount = 0;
 }
 
 int
@@ -170,6 +394,118 @@ lejp_get_wildcard(struct lejp_ctx *ctx, int wildcard, char *dest, int len)
 	return n - ctx->wild[wildcard];
 }
 
+/*
+ * Length of the run at p of string bytes needing no attention from the state
+ * machine, ie, until the first '"', '\\' or control char.  Long string values
+ * are mostly such runs, so they are scanned 16 (or 8) bytes at a time.
+ */
+
+#define LEJP_ONES (~(uint64_t)0 / 255)
+#define lejp_has_byte(v, c) \
+	((((v) ^ (LEJP_ONES * (uint8_t)(c))) - LEJP_ONES) & \
+	 ~((v) ^ (LEJP_ONES * (uint8_t)(c))) & (LEJP_ONES << 7))
+#define lejp_has_less(v, c) \
+	(((v) - LEJP_ONES * (uint8_t)(c)) & ~(v) & (LEJP_ONES << 7))
+
+static int
+lejp_string_run(const unsigned char *p, int len)
+{
+	int n = 0;
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('\"'), bs = _mm_set1_epi8('\\'),
+		      ctl = _mm_set1_epi8(0x1f);
+	__m128i v;
+	int m;
+
+	while (n + 16 <= len) {
+		v = _mm_loadu_si128((const __m128i *)(p + n));
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+			_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bs)),
+			_mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl)));
+		if (m)
+			return n + __builtin_ctz(m);
+		n += 16;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint8x16_t v;
+
+	while (n + 16 <= len) {
+		v = vld1q_u8(p + n);
+		if (vmaxvq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('\"')),
+						vceqq_u8(v, vdupq_n_u8('\\'))),
+				       vcltq_u8(v, vdupq_n_u8(0x20)))))
+			break;
+		n += 16;
+	}
+#else
+	uint64_t v;
+
+	while (n + 8 <= len) {
+		memcpy(&v, p + n, 8);
+		if (lejp_has_byte(v, '\"') | lejp_has_byte(v, '\\') |
+		    lejp_has_less(v, 0x20))
+			break;
+		n += 8;
+	}
+#endif
+	while (n < len && p[n] != '\"' && p[n] != '\\' && p[n] >= ' ')
+		n++;
+
+	return n;
+}
+
+/*
+ * Length of the run at p of ' ', '\t' and '\r', which outside of strings
+ * need nothing but skipping.  Indented JSON has one after every newline.
+ */
+
+static int
+lejp_ws_run(const unsigned char *p, int len)
+{
+	int n = 0;
+#if defined(__SSE2__)
+	const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'),
+		      cr = _mm_set1_epi8('\r');
+	__m128i v;
+	int m;
+
+	while (n + 16 <= len) {
+		v = _mm_loadu_si128((const __m128i *)(p + n));
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+			_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+			_mm_cmpeq_epi8(v, cr))) ^ 0xffff;
+		if (m)
+			return n + __builtin_ctz(m);
+		n += 16;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	uint8x16_t v;
+
+	while (n + 16 <= len) {
+		v = vld1q_u8(p + n);
+		if (vminvq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+						vceqq_u8(v, vdupq_n_u8('\t'))),
+				       vceqq_u8(v, vdupq_n_u8('\r')))) != 0xff)
+			break;
+		n += 16;
+	}
+#else
+	uint64_t v;
+
+	/* long runs are nearly always of spaces */
+	while (n + 8 <= len) {
+		memcpy(&v, p + n, 8);
+		if (v != LEJP_ONES * ' ')
+			break;
+		n += 8;
+	}
+#endif
+	while (n < len && (p[n] == ' ' || p[n] == '\t' || p[n] == '\r'))
+		n++;
+
+	return n;
+}
+
 /**
  * lejp_parse - interpret some more incoming data incrementally
  *
@@ -190,6 +526,8 @@ int
 lejp_parse(struct lejp_ctx *ctx, const unsigned char *json, int len)
 {
 	unsigned char c, n, s, ret = LEJP_REJECT_UNKNOWN;
+	const unsigned char *q;
+	int m;
 	static const char esc_char[] = "\"\\/bfnrt";
 	static const char esc_tran[] = "\"\\/\b\f\n\r\t";
 	static const char tokens[] = "rue alse ull ";
@@ -212,12 +550,24 @@ lejp_parse(struct lejp_ctx *ctx, const unsigned char *json, int len)
 				if (c == '#')
 					ctx->st[ctx->sp].s |=
 						LEJP_FLAG_WS_COMMENTLINE;
+				else {
+					/* and the rest of the indent with it */
+					m = lejp_ws_run(json, len);
+					json += m;
+					len -= m;
+				}
 				continue;
 			}
 		}
 
-		if (ctx->st[ctx->sp].s & LEJP_FLAG_WS_COMMENTLINE)
+		if (ctx->st[ctx->sp].s & LEJP_FLAG_WS_COMMENTLINE) {
+			/* nothing matters until the newline */
+			q = memchr(json, '\n', len);
+			m = q ? lws_ptr_diff(q, json) : len;
+			json += m;
+			len -= m;
 			continue;
+		}
 
 		switch (s) {
 		case LEJP_IDLE:
@@ -275,7 +625,33 @@ lejp_parse(struct lejp_ctx *ctx, const unsigned char *json, int len)
 				ret = LEJP_REJECT_MP_ILLEGAL_CTRL;
 				goto reject;
 			}
-			goto emit_string_char;
+			if (ctx->sp && ctx->st[ctx->sp - 1].s == LEJP_MP_DELIM)
+				goto emit_string_char;
+
+			/*
+			 * string value: take the whole run of plain chars at
+			 * once, still spilling it in the same chunks
+			 */
+			json--;
+			m = lejp_string_run(json, len + 1);
+			len -= m - 1;
+			while (m) {
+				n = sizeof(ctx->buf) - 1 - ctx->npos;
+				if (n > m)
+					n = m;
+				memcpy(ctx->buf + ctx->npos, json, n);
+				ctx->npos += n;
+				json += n;
+				m -= n;
+				if (ctx->npos != sizeof(ctx->buf) - 1)
+					continue;
+				if (ctx->callback(ctx, LEJPCB_VAL_STR_CHUNK)) {
+					ret = LEJP_REJECT_CALLBACK;
+					goto reject;
+				}
+				ctx->npos = 0;
+			}
+			continue;
 
 		case LEJP_MP_STRING_ESC:
 			if (c == 'u') {
@@ -432,8 +808,14 @@ lejp_parse(struct lejp_ctx *ctx, const unsigned char *json, int len)
 					goto reject;
 				}
 				/* drop the path [n] bit */
-				ctx->ppos = ctx->st[ctx->sp - 1].p;
-				ctx->ipos = ctx->st[ctx->sp - 1].i;
+				if (ctx->sp) {
+					ctx->ppos = ctx->st[ctx->sp - 1].p;
+					ctx->ipos = ctx->st[ctx->sp - 1].i;
+				} else {
+					/* array was the root object's value */
+					ctx->ppos = 0;
+					ctx->ipos = 0;
+				}
 				ctx->path[ctx->ppos] = '\0';
 				if (ctx->path_match &&
 					       ctx->ppos <= ctx->path_match_len)
@@ -615,8 +997,14 @@ lejp_parse(struct lejp_ctx *ctx, const unsigned char *json, int len)
 					goto reject;
 				}
 				/* drop the path [n] bit */
-				ctx->ppos = ctx->st[ctx->sp - 1].p;
-				ctx->ipos = ctx->st[ctx->sp - 1].i;
+				if (ctx->sp) {
+					ctx->ppos = ctx->st[ctx->sp - 1].p;
+					ctx->ipos = ctx->st[ctx->sp - 1].i;
+				} else {
+					/* array was the root object's value */
+					ctx->ppos = 0;
+					ctx->ipos = 0;
+				}
 				ctx->path[ctx->ppos] = '\0';
 				if (ctx->path_match &&
 					       ctx->ppos <= ctx->path_match_len)
@@ -642,8 +1030,13 @@ lejp_parse(struct lejp_ctx *ctx, const unsigned char *json, int len)
 				}
 				/* pop */
 				ctx->sp--;
-				ctx->ppos = ctx->st[ctx->sp - 1].p;
-				ctx->ipos = ctx->st[ctx->sp - 1].i;
+				if (ctx->sp) {
+					ctx->ppos = ctx->st[ctx->sp - 1].p;
+					ctx->ipos = ctx->st[ctx->sp - 1].i;
+				} else {
+					ctx->ppos = 0;
+					ctx->ipos = 0;
+				}
 				ctx->path[ctx->ppos] = '\0';
 				if (ctx->path_match &&
 					       ctx->ppos <= ctx->path_match_len)
@@ -713,6 +1106,9 @@ add_stack_level:
 
 		ctx->st[ctx->sp].p = ctx->ppos;
 		ctx->st[ctx->sp].i = ctx->ipos;
+		/* nothing below a string level looks at its trie states */
+		if (ctx->compiled && c != LEJP_MP_STRING)
+			lejp_trie_resume(ctx, &ctx->tst[ctx->sp], ctx->ppos);
 		if (++ctx->sp == ARRAY_SIZE(ctx->st)) {
 			ret = LEJP_REJECT_STACK_OVERFLOW;
 			goto reject;
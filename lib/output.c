@@ -40,6 +40,426 @@ lws_0405_frame_mask_generate(struct lws *wsi)
 	return 0;
 }
 
+/*
+ * prepare wsi->trunc_alloc to take len bytes of unsent remainder
+ */
+static int
+lws_trunc_alloc(struct lws *wsi, size_t len)
+{
+	/*
+	 *  - if we still have a suitable malloc lying around, use it
+	 *  - or, if too small, reallocate it
+	 *  - or, if no buffer, create it
+	 */
+	if (!wsi->trunc_alloc || len > wsi->trunc_alloc_len) {
+		lws_free(wsi->trunc_alloc);
+
+		wsi->trunc_alloc_len = (unsigned int)len;
+		wsi->trunc_alloc = lws_malloc(len, "truncated send alloc");
+		if (!wsi->trunc_alloc) {
+			lwsl_err("truncated send: unable to malloc %lu\n",
+				 (unsigned long)len);
+			return 1;
+		}
+	}
+	wsi->trunc_offset = 0;
+	wsi->trunc_len = (unsigned int)len;
+
+	return 0;
+}
+
+/*
+ * gather the fragments into one heap buffer with headroom bytes free in front
+ * of the payload.  The caller must lws_free() the result.
+ */
+static unsigned char *
+lws_iov_coalesce(const struct lws_iovec *iov, int count, size_t len,
+		 size_t headroom)
+{
+	unsigned char *buf, *p;
+	int n;
+
+	buf = lws_malloc(headroom + len + 1, "writev coalesce");
+	if (!buf)
+		return NULL;
+
+	p = buf + headroom;
+	for (n = 0; n < count; n++) {
+		if (!iov[n].len)
+			continue;
+		memcpy(p, iov[n].base, iov[n].len);
+		p += iov[n].len;
+	}
+
+	return buf;
+}
+
+#if defined(LWS_HAVE_SENDMSG)
+/*
+ * Send up to limit bytes from the fragments in one syscall.  Returns the
+ * amount the kernel took, or an LWS_SSL_CAPABLE_ status.
+ */
+static int
+lws_capable_writev_no_ssl(struct lws *wsi, const struct lws_iovec *iov,
+			  int count, size_t limit)
+{
+	struct iovec io[LWS_WRITEV_MAX_FRAGS + 2];
+	struct msghdr mh;
+	int n, m = 0;
+
+	for (n = 0; n < count && limit &&
+	     m < (int)(sizeof(io) / sizeof(io[0])); n++) {
+		if (!iov[n].len)
+			continue;
+		io[m].iov_base = (void *)iov[n].base;
+		io[m].iov_len = iov[n].len > limit ? limit : iov[n].len;
+		limit -= io[m].iov_len;
+		m++;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = io;
+	mh.msg_iovlen = m;
+
+	n = sendmsg(wsi->desc.sockfd, &mh, MSG_NOSIGNAL);
+	if (n >= 0)
+		return n;
+
+	if (LWS_ERRNO == LWS_EAGAIN ||
+	    LWS_ERRNO == LWS_EWOULDBLOCK ||
+	    LWS_ERRNO == LWS_EINTR)
+		return LWS_SSL_CAPABLE_MORE_SERVICE;
+
+	lwsl_debug("ERROR writev %d frags to skt fd %d err %d / errno %d\n",
+		   m, wsi->desc.sockfd, n, LWS_ERRNO);
+
+	return LWS_SSL_CAPABLE_ERROR;
+}
+#endif
+
+/*
+ * The optional output queue holds whole messages written while an earlier
+ * send was still pending.  They go out after the truncated send, if any, in
+ * the order they were written.  Only the head message may be partially sent,
+ * wsi->txq_head_offset tracks how much of it already went.
+ */
+
+static int
+lws_txq_enabled(struct lws *wsi)
+{
+	return wsi->protocol && (wsi->protocol->tx_queue_hwm ||
+				 wsi->protocol->tx_queue_hwm_msgs);
+}
+
+static int
+lws_txq_pending_over(struct lws *wsi, unsigned int bytes, unsigned int msgs)
+{
+	return (bytes && wsi->trunc_len + wsi->txq_bytes >= bytes) ||
+	       (msgs && wsi->txq_msgs + !!wsi->trunc_len >= msgs);
+}
+
+static int
+lws_txq_pending_under(struct lws *wsi, unsigned int bytes, unsigned int msgs)
+{
+	return wsi->trunc_len + wsi->txq_bytes <= bytes &&
+	       wsi->txq_msgs + !!wsi->trunc_len <= msgs;
+}
+
+/*
+ * new writes may only join the queue if the protocol enabled it and it is
+ * not already over the high watermark
+ */
+static int
+lws_txq_refuse(struct lws *wsi, size_t len)
+{
+	if (!lws_txq_enabled(wsi)) {
+		lwsl_err("** %p: Sending new %lu, pending truncated ...\n"
+			 "   It's illegal to do an lws_write outside of\n"
+			 "   the writable callback: fix your code\n",
+			 wsi, (unsigned long)len);
+		assert(0);
+
+		return 1;
+	}
+
+	if (!lws_txq_pending_over(wsi, wsi->protocol->tx_queue_hwm,
+				  wsi->protocol->tx_queue_hwm_msgs))
+		return 0;
+
+	lwsl_err("%p: write of %lu while tx queue over high watermark\n"
+		 "   check lws_send_pipe_choked() before writing\n",
+		 wsi, (unsigned long)len);
+
+	return 1;
+}
+
+static int
+lws_txq_link(struct lws *wsi, struct lws_txq_msg *m)
+{
+	const struct lws_protocols *pr = wsi->protocol;
+
+	m->next = NULL;
+	if (wsi->txq_tail)
+		wsi->txq_tail->next = m;
+	else {
+		wsi->txq_head = m;
+		wsi->txq_head_offset = 0;
+	}
+	wsi->txq_tail = m;
+	wsi->txq_bytes += (unsigned int)m->len;
+	lws_pt_load_txq(&wsi->context->pt[(int)wsi->tsi], m->len);
+	wsi->txq_msgs++;
+
+	if (wsi->txq_over_hwm || !lws_txq_enabled(wsi) ||
+	    !lws_txq_pending_over(wsi, pr->tx_queue_hwm, pr->tx_queue_hwm_msgs))
+		return 0;
+
+	wsi->txq_over_hwm = 1;
+
+	return pr->callback(wsi, LWS_CALLBACK_TX_QUEUE_HIGH, wsi->user_space,
+			    NULL, wsi->trunc_len + wsi->txq_bytes) ? -1 : 0;
+}
+
+static int
+lws_txq_enqueue(struct lws *wsi, const struct lws_iovec *iov, int count,
+		size_t len)
+{
+	struct lws_txq_msg *m;
+	unsigned char *p;
+	int n;
+
+	if (lws_txq_refuse(wsi, len))
+		return -1;
+
+	m = lws_malloc(sizeof(*m) + len, "txq msg");
+	if (!m) {
+		lwsl_err("%p: OOM queueing %lu\n", wsi, (unsigned long)len);
+		return -1;
+	}
+
+	m->shared = NULL;
+	m->data = p = (unsigned char *)(m + 1);
+	m->len = len;
+	for (n = 0; n < count; n++) {
+		memcpy(p, iov[n].base, iov[n].len);
+		p += iov[n].len;
+	}
+
+	return lws_txq_link(wsi, m);
+}
+
+static void
+lws_txq_retire_head(struct lws *wsi)
+{
+	struct lws_txq_msg *m = wsi->txq_head;
+
+	wsi->txq_head = m->next;
+	if (!wsi->txq_head)
+		wsi->txq_tail = NULL;
+	wsi->txq_bytes -= (unsigned int)(m->len - wsi->txq_head_offset);
+	lws_pt_load_txq(&wsi->context->pt[(int)wsi->tsi],
+			-(long)(m->len - wsi->txq_head_offset));
+	wsi->txq_head_offset = 0;
+	wsi->txq_msgs--;
+
+	if (m->shared)
+		lws_shared_msg_unref(m->shared);
+	lws_free(m);
+}
+
+/* account for sent bytes having gone from the head of the queue onwards */
+static void
+lws_txq_consume(struct lws *wsi, size_t sent)
+{
+	size_t left;
+
+	while (sent && wsi->txq_head) {
+		left = wsi->txq_head->len - wsi->txq_head_offset;
+		if (sent < left) {
+			wsi->txq_head_offset += (unsigned int)sent;
+			wsi->txq_bytes -= (unsigned int)sent;
+			lws_pt_load_txq(&wsi->context->pt[(int)wsi->tsi],
+					-(long)sent);
+			return;
+		}
+		sent -= left;
+		lws_txq_retire_head(wsi);
+	}
+}
+
+void
+lws_tx_queue_destroy(struct lws *wsi)
+{
+	while (wsi->txq_head)
+		lws_txq_retire_head(wsi);
+	wsi->txq_over_hwm = 0;
+}
+
+int
+lws_tx_queue_choked(struct lws *wsi)
+{
+	if (!lws_tx_pending(wsi))
+		return 0;
+
+	if (!lws_txq_enabled(wsi))
+		return 1;
+
+	return lws_txq_pending_over(wsi, wsi->protocol->tx_queue_hwm,
+				    wsi->protocol->tx_queue_hwm_msgs);
+}
+
+#if defined(LWS_HAVE_SENDMSG)
+static int
+lws_socket_can_writev(struct lws *wsi)
+{
+	return
+#ifdef LWS_OPENSSL_SUPPORT
+	       !wsi->ssl &&
+#endif
+#ifndef LWS_NO_EXTENSIONS
+	       !wsi->count_act_ext &&
+#endif
+	       !wsi->http2_substream && lws_socket_is_valid(wsi->desc.sockfd);
+}
+
+/*
+ * send the truncated remainder and as many queued messages as fit in one
+ * sendmsg(), then retire whatever the kernel took
+ */
+static int
+lws_txq_drain_writev(struct lws *wsi)
+{
+	struct lws_iovec v[LWS_WRITEV_MAX_FRAGS];
+	struct lws_txq_msg *m;
+	size_t total = 0, sent;
+	int count = 0, n;
+
+	if (wsi->trunc_len) {
+		v[0].base = wsi->trunc_alloc + wsi->trunc_offset;
+		v[0].len = wsi->trunc_len;
+		total = wsi->trunc_len;
+		count = 1;
+	}
+	for (m = wsi->txq_head; m && count < (int)LWS_WRITEV_MAX_FRAGS;
+	     m = m->next) {
+		v[count].base = m->data;
+		v[count].len = m->len;
+		if (m == wsi->txq_head) {
+			v[count].base = m->data + wsi->txq_head_offset;
+			v[count].len -= wsi->txq_head_offset;
+		}
+		total += v[count++].len;
+	}
+
+	if (wsi->protocol->tx_packet_size &&
+	    total > wsi->protocol->tx_packet_size + LWS_PRE + 4)
+		total = wsi->protocol->tx_packet_size + LWS_PRE + 4;
+
+	lws_latency_pre(wsi->context, wsi);
+	n = lws_capable_writev_no_ssl(wsi, v, count, total);
+	lws_latency(wsi->context, wsi, "send txq drain", n, n == (int)total);
+
+	switch (n) {
+	case LWS_SSL_CAPABLE_ERROR:
+		wsi->socket_is_permanently_unusable = 1;
+		return -1;
+	case LWS_SSL_CAPABLE_MORE_SERVICE:
+		n = 0;
+		break;
+	}
+
+	sent = n;
+	if (wsi->trunc_len) {
+		if (sent < wsi->trunc_len) {
+			wsi->trunc_offset += (unsigned int)sent;
+			wsi->trunc_len -= (unsigned int)sent;
+			sent = 0;
+		} else {
+			sent -= wsi->trunc_len;
+			wsi->trunc_len = 0;
+		}
+	}
+	lws_txq_consume(wsi, sent);
+
+	lwsl_info("%p txq drain sent %d, %u pending\n", wsi, n,
+		  wsi->trunc_len + wsi->txq_bytes);
+
+	return n;
+}
+#endif
+
+/*
+ * Called when the socket is writable while something is pending: send as
+ * much of the truncated send and the queued messages behind it as the socket
+ * takes.  Returns < 0 if the connection should close.
+ */
+int
+lws_tx_queue_drain(struct lws *wsi)
+{
+	const struct lws_protocols *pr = wsi->protocol;
+	int n = 0;
+
+	if (!wsi->txq_head)
+		n = lws_issue_raw(wsi, wsi->trunc_alloc + wsi->trunc_offset,
+				  wsi->trunc_len);
+	else
+#if defined(LWS_HAVE_SENDMSG)
+	if (lws_socket_can_writev(wsi))
+		n = lws_txq_drain_writev(wsi);
+	else
+#endif
+	{
+		/*
+		 * one message at a time, lws_issue_raw() takes a copy of
+		 * anything the socket would not take as the new truncated send
+		 */
+		wsi->txq_draining = 1;
+		do {
+			if (wsi->trunc_len) {
+				n = lws_issue_raw(wsi, wsi->trunc_alloc +
+						  wsi->trunc_offset,
+						  wsi->trunc_len);
+				if (n < 0 || wsi->trunc_len)
+					break;
+			}
+			if (!wsi->txq_head)
+				break;
+
+			n = lws_issue_raw(wsi, (unsigned char *)
+				wsi->txq_head->data + wsi->txq_head_offset,
+				wsi->txq_head->len - wsi->txq_head_offset);
+			if (n < 0)
+				break;
+			lws_txq_retire_head(wsi);
+		} while (!wsi->trunc_len);
+		wsi->txq_draining = 0;
+	}
+
+	if (n < 0)
+		return n;
+
+	if (!lws_tx_pending(wsi) &&
+	    wsi->state == LWSS_FLUSHING_STORED_SEND_BEFORE_CLOSE) {
+		lwsl_info("** %p signalling to close now\n", wsi);
+		return -1; /* retry closing now */
+	}
+
+	/* always callback on writeable */
+	lws_callback_on_writable(wsi);
+
+	if (!wsi->txq_over_hwm ||
+	    !lws_txq_pending_under(wsi, pr->tx_queue_lwm, pr->tx_queue_lwm_msgs))
+		return n;
+
+	wsi->txq_over_hwm = 0;
+
+	if (pr->callback(wsi, LWS_CALLBACK_TX_QUEUE_LOW, wsi->user_space,
+			 NULL, wsi->trunc_len + wsi->txq_bytes))
+		return -1;
+
+	return n;
+}
+
 /*
  * notice this returns number of bytes consumed, or -1
  */
@@ -57,12 +477,25 @@ int lws_issue_raw(struct lws *wsi, unsigned char *buf, size_t len)
 		return 0;
 	/* just ignore sends after we cleared the truncation buffer */
 	if (wsi->state == LWSS_FLUSHING_STORED_SEND_BEFORE_CLOSE &&
-	    !wsi->trunc_len)
+	    !lws_tx_pending(wsi))
 		return (int)len;
 
-	if (wsi->trunc_len && (buf < wsi->trunc_alloc ||
-	    buf > (wsi->trunc_alloc + wsi->trunc_len + wsi->trunc_offset))) {
+	if ((wsi->trunc_len && (buf < wsi->trunc_alloc ||
+	    buf > (wsi->trunc_alloc + wsi->trunc_len + wsi->trunc_offset))) ||
+	    (wsi->txq_head && !wsi->txq_draining)) {
 		char dump[20];
+
+		if (lws_txq_enabled(wsi)) {
+			struct lws_iovec v;
+
+			v.base = buf;
+			v.len = len;
+			if (lws_txq_enqueue(wsi, &v, 1, len))
+				return -1;
+
+			return (int)len;
+		}
+
 		strncpy(dump, (char *)buf, sizeof(dump) - 1);
 		dump[sizeof(dump) - 1] = '\0';
 #if defined(LWS_WITH_ESP8266)
@@ -137,7 +570,8 @@ handle_truncated_send:
 			lwsl_info("** %p partial send completed\n", wsi);
 			/* done with it, but don't free it */
 			n = (int)real_len;
-			if (wsi->state == LWSS_FLUSHING_STORED_SEND_BEFORE_CLOSE) {
+			if (wsi->state == LWSS_FLUSHING_STORED_SEND_BEFORE_CLOSE &&
+			    !wsi->txq_head) {
 				lwsl_info("** %p signalling to close now\n", wsi);
 				return -1; /* retry closing now */
 			}
@@ -162,44 +596,284 @@ handle_truncated_send:
 	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_C_WRITE_PARTIALS, 1);
 	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_B_PARTIALS_ACCEPTED_PARTS, n);
 
-	/*
-	 *  - if we still have a suitable malloc lying around, use it
-	 *  - or, if too small, reallocate it
-	 *  - or, if no buffer, create it
-	 */
-	if (!wsi->trunc_alloc || real_len - n > wsi->trunc_alloc_len) {
-		lws_free(wsi->trunc_alloc);
+	if (lws_trunc_alloc(wsi, real_len - n))
+		return -1;
+	memcpy(wsi->trunc_alloc, buf + n, real_len - n);
 
-		wsi->trunc_alloc_len = (unsigned int)(real_len - n);
-		wsi->trunc_alloc = lws_malloc(real_len - n,
-					      "truncated send alloc");
-		if (!wsi->trunc_alloc) {
-			lwsl_err("truncated send: unable to malloc %lu\n",
-				 (unsigned long)(real_len - n));
+	/* since something buffered, force it to get another chance to send */
+	lws_callback_on_writable(wsi);
+
+	return (int)real_len;
+}
+
+/*
+ * As lws_issue_raw(), but the data to send is the concatenation of the
+ * fragments.  Where the socket can take them directly they go out in one
+ * syscall, and only the part of them the kernel didn't accept gets copied
+ * into the truncated send buffer.
+ */
+int
+lws_issue_rawv(struct lws *wsi, const struct lws_iovec *iov, int count)
+{
+#if defined(LWS_HAVE_SENDMSG)
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+	size_t limit, skip;
+	unsigned char *p;
+#endif
+	unsigned char *buf;
+	size_t real_len = 0;
+	int n;
+
+	for (n = 0; n < count; n++)
+		real_len += iov[n].len;
+
+	if (!real_len)
+		return 0;
+
+	if (lws_tx_pending(wsi) && !wsi->txq_draining) {
+		if (lws_txq_enqueue(wsi, iov, count, real_len))
 			return -1;
+
+		return (int)real_len;
+	}
+
+	if (count == 1)
+		return lws_issue_raw(wsi, (unsigned char *)iov[0].base,
+				     iov[0].len);
+
+#if defined(LWS_HAVE_SENDMSG)
+	if (!lws_socket_can_writev(wsi))
+		goto coalesce;
+
+	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_C_API_WRITE, 1);
+
+	/* just ignore sends after we cleared the truncation buffer */
+	if (wsi->state == LWSS_FLUSHING_STORED_SEND_BEFORE_CLOSE &&
+	    !lws_tx_pending(wsi))
+		return (int)real_len;
+
+	/* only an explicit tx_packet_size hint limits what we try to send */
+	limit = real_len;
+	if (wsi->protocol->tx_packet_size &&
+	    limit > wsi->protocol->tx_packet_size + LWS_PRE + 4)
+		limit = wsi->protocol->tx_packet_size + LWS_PRE + 4;
+
+	lws_latency_pre(wsi->context, wsi);
+	n = lws_capable_writev_no_ssl(wsi, iov, count, limit);
+	lws_latency(wsi->context, wsi, "send lws_issue_rawv", n,
+		    n == (int)real_len);
+
+	switch (n) {
+	case LWS_SSL_CAPABLE_ERROR:
+		/* we're going to close, let close know sends aren't possible */
+		wsi->socket_is_permanently_unusable = 1;
+		return -1;
+	case LWS_SSL_CAPABLE_MORE_SERVICE:
+		/* nothing got sent, not fatal, buffer the whole thing */
+		n = 0;
+		break;
+	}
+
+	if ((size_t)n == real_len)
+		return n;
+
+	lwsl_debug("%p new partial writev %d from %lu total\n", wsi, n,
+		    (unsigned long)real_len);
+
+	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_C_WRITE_PARTIALS, 1);
+	lws_stats_atomic_bump(wsi->context, pt,
+			      LWSSTATS_B_PARTIALS_ACCEPTED_PARTS, n);
+
+	if (lws_trunc_alloc(wsi, real_len - n))
+		return -1;
+
+	/* copy only what the kernel did not take */
+	p = wsi->trunc_alloc;
+	skip = n;
+	for (n = 0; n < count; n++) {
+		if (skip >= iov[n].len) {
+			skip -= iov[n].len;
+			continue;
 		}
+		memcpy(p, (const unsigned char *)iov[n].base + skip,
+		       iov[n].len - skip);
+		p += iov[n].len - skip;
+		skip = 0;
 	}
-	wsi->trunc_offset = 0;
-	wsi->trunc_len = (unsigned int)(real_len - n);
-	memcpy(wsi->trunc_alloc, buf + n, real_len - n);
 
 	/* since something buffered, force it to get another chance to send */
 	lws_callback_on_writable(wsi);
 
 	return (int)real_len;
+
+coalesce:
+#endif
+	buf = lws_iov_coalesce(iov, count, real_len, 0);
+	if (!buf)
+		return -1;
+
+	n = lws_issue_raw(wsi, buf, real_len);
+	lws_free(buf);
+
+	return n;
+}
+
+/*
+ * Write the ws frame header for a payload of len into the headroom in front
+ * of buf, leaving room for the 4-byte mask right before buf if masked7.
+ * Returns the number of headroom bytes used, or -1 for a bad write type.
+ */
+static int
+lws_ws_frame_header(unsigned char *buf, size_t len, int wp, int masked7)
+{
+	unsigned char is_masked_bit = 0;
+	int pre = 0, n;
+
+	if (masked7) {
+		pre += 4;
+		is_masked_bit = 0x80;
+	}
+
+	switch (wp & 0xf) {
+	case LWS_WRITE_TEXT:
+		n = LWSWSOPC_TEXT_FRAME;
+		break;
+	case LWS_WRITE_BINARY:
+		n = LWSWSOPC_BINARY_FRAME;
+		break;
+	case LWS_WRITE_CONTINUATION:
+		n = LWSWSOPC_CONTINUATION;
+		break;
+
+	case LWS_WRITE_CLOSE:
+		n = LWSWSOPC_CLOSE;
+		break;
+	case LWS_WRITE_PING:
+		n = LWSWSOPC_PING;
+		break;
+	case LWS_WRITE_PONG:
+		n = LWSWSOPC_PONG;
+		break;
+	default:
+		return -1;
+	}
+
+	if (!(wp & LWS_WRITE_NO_FIN))
+		n |= 1 << 7;
+
+	if (len < 126) {
+		pre += 2;
+		buf[-pre] = n;
+		buf[-pre + 1] = (unsigned char)(len | is_masked_bit);
+	} else {
+		if (len < 65536) {
+			pre += 4;
+			buf[-pre] = n;
+			buf[-pre + 1] = 126 | is_masked_bit;
+			buf[-pre + 2] = (unsigned char)(len >> 8);
+			buf[-pre + 3] = (unsigned char)len;
+		} else {
+			pre += 10;
+			buf[-pre] = n;
+			buf[-pre + 1] = 127 | is_masked_bit;
+#if defined __LP64__
+				buf[-pre + 2] = (len >> 56) & 0x7f;
+				buf[-pre + 3] = len >> 48;
+				buf[-pre + 4] = len >> 40;
+				buf[-pre + 5] = len >> 32;
+#else
+				buf[-pre + 2] = 0;
+				buf[-pre + 3] = 0;
+				buf[-pre + 4] = 0;
+				buf[-pre + 5] = 0;
+#endif
+			buf[-pre + 6] = (unsigned char)(len >> 24);
+			buf[-pre + 7] = (unsigned char)(len >> 16);
+			buf[-pre + 8] = (unsigned char)(len >> 8);
+			buf[-pre + 9] = (unsigned char)len;
+		}
+	}
+
+	return pre;
 }
 
+#ifdef LWS_WITH_HTTP2
+/*
+ * Pick the h2 frame type and flags for an http write of len, updating the
+ * stream's END_STREAM and content length accounting.  *wp may be promoted
+ * to LWS_WRITE_HTTP_FINAL if this write completes the declared content.
+ */
+static int
+lws_h2_write_type_flags(struct lws *wsi, enum lws_write_protocol *wp,
+			size_t len, unsigned char *flags)
+{
+	int n = LWS_H2_FRAME_TYPE_DATA;
+
+	if ((*wp & 0x1f) == LWS_WRITE_HTTP_HEADERS) {
+		n = LWS_H2_FRAME_TYPE_HEADERS;
+		if (!(*wp & LWS_WRITE_NO_FIN))
+			*flags = LWS_H2_FLAG_END_HEADERS;
+		if (wsi->u.h2.send_END_STREAM ||
+		    (*wp & LWS_WRITE_H2_STREAM_END)) {
+			*flags |= LWS_H2_FLAG_END_STREAM;
+			wsi->u.h2.send_END_STREAM = 1;
+		}
+	}
+
+	if ((*wp & 0x1f) == LWS_WRITE_HTTP_HEADERS_CONTINUATION) {
+		n = LWS_H2_FRAME_TYPE_CONTINUATION;
+		if (!(*wp & LWS_WRITE_NO_FIN))
+			*flags = LWS_H2_FLAG_END_HEADERS;
+		if (wsi->u.h2.send_END_STREAM ||
+		    (*wp & LWS_WRITE_H2_STREAM_END)) {
+			*flags |= LWS_H2_FLAG_END_STREAM;
+			wsi->u.h2.send_END_STREAM = 1;
+		}
+	}
+
+	if (((*wp & 0x1f) == LWS_WRITE_HTTP ||
+	     (*wp & 0x1f) == LWS_WRITE_HTTP_FINAL) &&
+	    wsi->u.http.tx_content_length) {
+		wsi->u.http.tx_content_remain -= len;
+		lwsl_info("%s: content_remain = %llu\n", __func__,
+			  (unsigned long long)wsi->u.http.tx_content_remain);
+		if (!wsi->u.http.tx_content_remain) {
+			lwsl_info("%s: selecting final write mode\n",
+				  __func__);
+			*wp = LWS_WRITE_HTTP_FINAL;
+		}
+	}
+
+	if ((*wp & 0x1f) == LWS_WRITE_HTTP_FINAL ||
+	    (*wp & LWS_WRITE_H2_STREAM_END)) {
+		lwsl_info("%s: setting END_STREAM\n", __func__);
+		*flags |= LWS_H2_FLAG_END_STREAM;
+		wsi->u.h2.send_END_STREAM = 1;
+	}
+
+	return n;
+}
+#endif
+
 LWS_VISIBLE int lws_write(struct lws *wsi, unsigned char *buf, size_t len,
 			  enum lws_write_protocol wp)
 {
 	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
 	int masked7 = (wsi->mode == LWSCM_WS_CLIENT);
-	unsigned char is_masked_bit = 0;
 	unsigned char *dropmask = NULL;
 	struct lws_tokens eff_buf;
 	size_t orig_len = len;
+	struct lws_iovec v;
 	int pre = 0, n;
 
+	if (wp & LWS_WRITE_HTTP_CHUNK) {
+		/* the chunk framing is done by gathering it with the payload */
+		v.base = buf;
+		v.len = len;
+
+		return lws_writev(wsi, &v, 1, wp);
+	}
+
 	if (wsi->parent_carries_io) {
 		struct lws_write_passthru pas;
 
@@ -218,6 +892,14 @@ LWS_VISIBLE int lws_write(struct lws *wsi, unsigned char *buf, size_t len,
 	}
 
 	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_C_API_LWS_WRITE, 1);
+#if defined(LWS_WITH_STATS)
+	if (wsi->http_hdr_done_us) {
+		lws_stats_vh_latency(wsi->vhost, pt, LWSSTATS_LAT_FIRST_BYTE,
+				     time_in_microseconds() -
+				     wsi->http_hdr_done_us);
+		wsi->http_hdr_done_us = 0;
+	}
+#endif
 
 	if ((int)len < 0) {
 		lwsl_err("%s: suspicious len int %d, ulong %lu\n", __func__,
@@ -226,6 +908,7 @@ LWS_VISIBLE int lws_write(struct lws *wsi, unsigned char *buf, size_t len,
 	}
 
 	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_B_WRITE, len);
+	lws_pt_load_bytes(pt, len);
 
 #ifdef LWS_WITH_ACCESS_LOG
 	wsi->access_log.sent += len;
@@ -368,72 +1051,14 @@ LWS_VISIBLE int lws_write(struct lws *wsi, unsigned char *buf, size_t len,
 
 	switch (wsi->ietf_spec_revision) {
 	case 13:
-		if (masked7) {
-			pre += 4;
-			dropmask = &buf[0 - pre];
-			is_masked_bit = 0x80;
-		}
-
-		switch (wp & 0xf) {
-		case LWS_WRITE_TEXT:
-			n = LWSWSOPC_TEXT_FRAME;
-			break;
-		case LWS_WRITE_BINARY:
-			n = LWSWSOPC_BINARY_FRAME;
-			break;
-		case LWS_WRITE_CONTINUATION:
-			n = LWSWSOPC_CONTINUATION;
-			break;
+		if (masked7)
+			dropmask = &buf[-4];
 
-		case LWS_WRITE_CLOSE:
-			n = LWSWSOPC_CLOSE;
-			break;
-		case LWS_WRITE_PING:
-			n = LWSWSOPC_PING;
-			break;
-		case LWS_WRITE_PONG:
-			n = LWSWSOPC_PONG;
-			break;
-		default:
+		pre = lws_ws_frame_header(buf, len, wp, masked7);
+		if (pre < 0) {
 			lwsl_warn("lws_write: unknown write opc / wp\n");
 			return -1;
 		}
-
-		if (!(wp & LWS_WRITE_NO_FIN))
-			n |= 1 << 7;
-
-		if (len < 126) {
-			pre += 2;
-			buf[-pre] = n;
-			buf[-pre + 1] = (unsigned char)(len | is_masked_bit);
-		} else {
-			if (len < 65536) {
-				pre += 4;
-				buf[-pre] = n;
-				buf[-pre + 1] = 126 | is_masked_bit;
-				buf[-pre + 2] = (unsigned char)(len >> 8);
-				buf[-pre + 3] = (unsigned char)len;
-			} else {
-				pre += 10;
-				buf[-pre] = n;
-				buf[-pre + 1] = 127 | is_masked_bit;
-#if defined __LP64__
-					buf[-pre + 2] = (len >> 56) & 0x7f;
-					buf[-pre + 3] = len >> 48;
-					buf[-pre + 4] = len >> 40;
-					buf[-pre + 5] = len >> 32;
-#else
-					buf[-pre + 2] = 0;
-					buf[-pre + 3] = 0;
-					buf[-pre + 4] = 0;
-					buf[-pre + 5] = 0;
-#endif
-				buf[-pre + 6] = (unsigned char)(len >> 24);
-				buf[-pre + 7] = (unsigned char)(len >> 16);
-				buf[-pre + 8] = (unsigned char)(len >> 8);
-				buf[-pre + 9] = (unsigned char)len;
-			}
-		}
 		break;
 	}
 
@@ -478,49 +1103,7 @@ send_raw:
 		if (wsi->mode == LWSCM_HTTP2_SERVING) {
 			unsigned char flags = 0;
 
-			n = LWS_H2_FRAME_TYPE_DATA;
-			if ((wp & 0x1f) == LWS_WRITE_HTTP_HEADERS) {
-				n = LWS_H2_FRAME_TYPE_HEADERS;
-				if (!(wp & LWS_WRITE_NO_FIN))
-					flags = LWS_H2_FLAG_END_HEADERS;
-				if (wsi->u.h2.send_END_STREAM ||
-				    (wp & LWS_WRITE_H2_STREAM_END)) {
-					flags |= LWS_H2_FLAG_END_STREAM;
-					wsi->u.h2.send_END_STREAM = 1;
-				}
-			}
-
-			if ((wp & 0x1f) == LWS_WRITE_HTTP_HEADERS_CONTINUATION) {
-				n = LWS_H2_FRAME_TYPE_CONTINUATION;
-				if (!(wp & LWS_WRITE_NO_FIN))
-					flags = LWS_H2_FLAG_END_HEADERS;
-				if (wsi->u.h2.send_END_STREAM ||
-				    (wp & LWS_WRITE_H2_STREAM_END)) {
-					flags |= LWS_H2_FLAG_END_STREAM;
-					wsi->u.h2.send_END_STREAM = 1;
-				}
-			}
-
-			if (((wp & 0x1f) == LWS_WRITE_HTTP ||
-			     (wp & 0x1f) == LWS_WRITE_HTTP_FINAL) &&
-			    wsi->u.http.tx_content_length) {
-				wsi->u.http.tx_content_remain -= len;
-				lwsl_info("%s: content_remain = %llu\n", __func__,
-					  (unsigned long long)wsi->u.http.tx_content_remain);
-				if (!wsi->u.http.tx_content_remain) {
-					lwsl_info("%s: selecting final write mode\n",
-						  __func__);
-					wp = LWS_WRITE_HTTP_FINAL;
-				}
-			}
-
-			if ((wp & 0x1f) == LWS_WRITE_HTTP_FINAL ||
-			    (wp & LWS_WRITE_H2_STREAM_END)) {
-			    //lws_get_network_wsi(wsi)->u.h2.END_STREAM) {
-				lwsl_info("%s: setting END_STREAM\n", __func__);
-				flags |= LWS_H2_FLAG_END_STREAM;
-				wsi->u.h2.send_END_STREAM = 1;
-			}
+			n = lws_h2_write_type_flags(wsi, &wp, len, &flags);
 
 			return lws_h2_frame_write(wsi, n, flags,
 					wsi->u.h2.my_sid, (int)len, buf);
@@ -571,6 +1154,341 @@ send_raw:
 	return n - pre;
 }
 
+LWS_VISIBLE int
+lws_writev(struct lws *wsi, const struct lws_iovec *iov, int iov_count,
+	   enum lws_write_protocol wp)
+{
+	static const char chunk_end[] = "\x0d\x0a" "0\x0d\x0a\x0d\x0a";
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+	struct lws_iovec v[LWS_WRITEV_MAX_FRAGS + 2];
+	unsigned char hdr[LWS_PRE], *buf;
+	char chdr[LWS_HTTP_CHUNK_HDR_SIZE];
+	int n, pre, is_http, chunked = 0, final;
+	size_t len = 0, payload = 0;
+
+	if (iov_count < 0 || iov_count > LWS_WRITEV_MAX_FRAGS) {
+		lwsl_err("%s: bad iov_count %d\n", __func__, iov_count);
+		return -1;
+	}
+
+	for (n = 0; n < iov_count; n++)
+		len += iov[n].len;
+
+	if ((int)len < 0) {
+		lwsl_err("%s: suspicious len %lu\n", __func__,
+			 (unsigned long)len);
+		return -1;
+	}
+
+	if (wp & LWS_WRITE_HTTP_CHUNK) {
+		wp = (enum lws_write_protocol)(wp & ~LWS_WRITE_HTTP_CHUNK);
+		chunked = ((wp & 0x1f) == LWS_WRITE_HTTP ||
+			   (wp & 0x1f) == LWS_WRITE_HTTP_FINAL) &&
+			  !wsi->http2_substream &&
+			  wsi->mode != LWSCM_HTTP2_SERVING;
+	}
+
+	if (chunked) {
+		/*
+		 * Wrap the payload in the chunk size line and its CRLF, and
+		 * on the last write the zero-length chunk too, as extra
+		 * fragments of the same gather
+		 */
+		final = (wp & 0x1f) == LWS_WRITE_HTTP_FINAL;
+		payload = len;
+		n = 0;
+		if (len) {
+			v[n].base = chdr;
+			v[n++].len = lws_snprintf(chdr, sizeof(chdr),
+						  "%X\x0d\x0a",
+						  (unsigned int)len);
+			memcpy(&v[n], iov, iov_count * sizeof(*iov));
+			n += iov_count;
+			v[n].base = chunk_end;
+			v[n].len = final ? 7 : 2;
+		} else {
+			if (!final)
+				return 0;
+			v[n].base = chunk_end + 2;
+			v[n].len = 5;
+		}
+		len += v[0].len + (len ? v[n].len : 0);
+		iov = v;
+		iov_count = n + 1;
+	}
+
+	is_http = (wp & 0x1f) == LWS_WRITE_HTTP ||
+		  (wp & 0x1f) == LWS_WRITE_HTTP_FINAL ||
+		  (wp & 0x1f) == LWS_WRITE_HTTP_HEADERS_CONTINUATION ||
+		  (wp & 0x1f) == LWS_WRITE_HTTP_HEADERS;
+
+	/*
+	 * Anything that must see or transform the payload as one piece,
+	 * or that carries ws frame state over from a previous lws_write(),
+	 * takes the coalesce + lws_write() path
+	 */
+	if (wsi->parent_carries_io || wsi->mode == LWSCM_WS_CLIENT ||
+	    (wp & 0x1f) == LWS_WRITE_CLOSE ||
+	    (!is_http && wsi->state == LWSS_ESTABLISHED &&
+	     (wsi->u.ws.inside_frame || wsi->u.ws.tx_draining_ext ||
+	      wsi->u.ws.stashed_write_pending
+#ifndef LWS_NO_EXTENSIONS
+	      || wsi->count_act_ext
+#endif
+	     )))
+		goto coalesce;
+
+	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_C_API_LWS_WRITE, 1);
+	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_B_WRITE, len);
+	lws_pt_load_bytes(pt, len);
+
+#ifdef LWS_WITH_ACCESS_LOG
+	wsi->access_log.sent += len;
+#endif
+	if (wsi->vhost)
+		wsi->vhost->conn_stats.tx += len;
+
+	lws_restart_ws_ping_pong_timer(wsi);
+
+	if (is_http) {
+#ifdef LWS_WITH_HTTP2
+		if (wsi->mode == LWSCM_HTTP2_SERVING) {
+			unsigned char flags = 0;
+
+			n = lws_h2_write_type_flags(wsi, &wp, len, &flags);
+
+			return lws_h2_frame_writev(wsi, n, flags,
+					wsi->u.h2.my_sid, iov, iov_count);
+		}
+#endif
+		n = lws_issue_rawv(wsi, iov, iov_count);
+		if (n <= 0 || !chunked)
+			return n;
+
+		/* it was all sent or buffered, report the payload part */
+		return (int)payload;
+	}
+
+	/* if not in a state to send stuff, then just send nothing */
+
+	if (wsi->state != LWSS_ESTABLISHED)
+		return 0;
+
+	wsi->u.ws.clean_buffer = 1;
+
+	pre = lws_ws_frame_header(&hdr[sizeof(hdr)], len, wp, 0);
+	if (pre < 0) {
+		lwsl_warn("%s: unknown write opc / wp\n", __func__);
+		return -1;
+	}
+
+	v[0].base = &hdr[sizeof(hdr) - pre];
+	v[0].len = pre;
+	for (n = 0; n < iov_count; n++)
+		v[n + 1] = iov[n];
+
+	/* lws_issue_rawv() either sends or buffers all of it */
+	n = lws_issue_rawv(wsi, v, iov_count + 1);
+	if (n <= 0)
+		return n;
+
+	return (int)len;
+
+coalesce:
+	buf = lws_iov_coalesce(iov, iov_count, len, LWS_PRE);
+	if (!buf)
+		return -1;
+
+	n = lws_write(wsi, buf + LWS_PRE, len, wp);
+	lws_free(buf);
+	if (n > 0 && chunked)
+		n = (int)payload;
+
+	return n;
+}
+
+LWS_VISIBLE struct lws_shared_msg *
+lws_shared_msg_create(const void *payload, size_t len,
+		      enum lws_write_protocol wp)
+{
+	struct lws_shared_msg *sm;
+	unsigned char *p;
+	int pre;
+
+	sm = lws_malloc(sizeof(*sm) + LWS_PRE + len, "shared msg");
+	if (!sm)
+		return NULL;
+
+	p = (unsigned char *)(sm + 1) + LWS_PRE;
+	if (len)
+		memcpy(p, payload, len);
+
+	/* we only send these as server, so the frame is never masked */
+	pre = lws_ws_frame_header(p, len, wp, 0);
+	if (pre < 0) {
+		lwsl_err("%s: unknown write opc / wp\n", __func__);
+		lws_free(sm);
+
+		return NULL;
+	}
+
+	sm->frame = p - pre;
+	sm->len = len + pre;
+	sm->payload_len = len;
+	sm->wp = wp;
+	sm->refcount = 1;
+#if LWS_MAX_SMP > 1
+	pthread_mutex_init(&sm->lock, NULL);
+#endif
+
+	return sm;
+}
+
+void
+lws_shared_msg_ref(struct lws_shared_msg *sm)
+{
+#if LWS_MAX_SMP > 1
+	pthread_mutex_lock(&sm->lock);
+#endif
+	sm->refcount++;
+#if LWS_MAX_SMP > 1
+	pthread_mutex_unlock(&sm->lock);
+#endif
+}
+
+LWS_VISIBLE void
+lws_shared_msg_unref(struct lws_shared_msg *sm)
+{
+	int n;
+
+#if LWS_MAX_SMP > 1
+	pthread_mutex_lock(&sm->lock);
+#endif
+	n = --sm->refcount;
+#if LWS_MAX_SMP > 1
+	pthread_mutex_unlock(&sm->lock);
+#endif
+	if (n)
+		return;
+
+#if LWS_MAX_SMP > 1
+	pthread_mutex_destroy(&sm->lock);
+#endif
+	lws_free(sm);
+}
+
+LWS_VISIBLE int
+lws_write_shared(struct lws *wsi, struct lws_shared_msg *sm)
+{
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+	struct lws_txq_msg *m;
+	struct lws_iovec v;
+	int n = 0;
+
+	/*
+	 * Connections that have to mask, transform or reframe the payload
+	 * can't use the shared frame, give them the payload the usual way
+	 */
+	if (wsi->mode != LWSCM_WS_SERVING || wsi->state != LWSS_ESTABLISHED ||
+	    wsi->parent_carries_io || wsi->u.ws.inside_frame ||
+	    wsi->u.ws.tx_draining_ext || wsi->u.ws.stashed_write_pending
+#ifndef LWS_NO_EXTENSIONS
+	    || wsi->count_act_ext
+#endif
+	   ) {
+		v.base = sm->frame + sm->len - sm->payload_len;
+		v.len = sm->payload_len;
+
+		return lws_writev(wsi, &v, 1, sm->wp);
+	}
+
+	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_C_API_LWS_WRITE, 1);
+	lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_B_WRITE,
+			      sm->payload_len);
+	lws_pt_load_bytes(pt, sm->payload_len);
+
+#ifdef LWS_WITH_ACCESS_LOG
+	wsi->access_log.sent += sm->payload_len;
+#endif
+	if (wsi->vhost)
+		wsi->vhost->conn_stats.tx += sm->payload_len;
+
+	lws_restart_ws_ping_pong_timer(wsi);
+	wsi->u.ws.clean_buffer = 1;
+
+	if (lws_tx_pending(wsi)) {
+		if (lws_txq_refuse(wsi, sm->len))
+			return -1;
+
+		goto queue;
+	}
+
+#if defined(LWS_HAVE_SENDMSG)
+	if (lws_socket_can_writev(wsi)) {
+		size_t limit = sm->len;
+
+		if (wsi->protocol->tx_packet_size &&
+		    limit > wsi->protocol->tx_packet_size + LWS_PRE + 4)
+			limit = wsi->protocol->tx_packet_size + LWS_PRE + 4;
+
+		lws_stats_atomic_bump(wsi->context, pt, LWSSTATS_C_API_WRITE, 1);
+
+		v.base = sm->frame;
+		v.len = sm->len;
+
+		lws_latency_pre(wsi->context, wsi);
+		n = lws_capable_writev_no_ssl(wsi, &v, 1, limit);
+		lws_latency(wsi->context, wsi, "send lws_write_shared", n,
+			    n == (int)sm->len);
+
+		switch (n) {
+		case LWS_SSL_CAPABLE_ERROR:
+			wsi->socket_is_permanently_unusable = 1;
+			return -1;
+		case LWS_SSL_CAPABLE_MORE_SERVICE:
+			n = 0;
+			break;
+		}
+
+		if ((size_t)n == sm->len)
+			return (int)sm->payload_len;
+
+		lws_stats_atomic_bump(wsi->context, pt,
+				      LWSSTATS_C_WRITE_PARTIALS, 1);
+		lws_stats_atomic_bump(wsi->context, pt,
+				      LWSSTATS_B_PARTIALS_ACCEPTED_PARTS, n);
+
+		goto queue;
+	}
+#endif
+
+	/* the transport will take a copy of anything it could not send */
+	n = lws_issue_raw(wsi, sm->frame, sm->len);
+	if (n < 0)
+		return n;
+
+	return (int)sm->payload_len;
+
+queue:
+	/* we just hold a reference and track how far we got */
+	m = lws_malloc(sizeof(*m), "txq shared");
+	if (!m)
+		return -1;
+
+	lws_shared_msg_ref(sm);
+	m->shared = sm;
+	m->data = sm->frame;
+	m->len = sm->len;
+
+	if (lws_txq_link(wsi, m))
+		return -1;
+	lws_txq_consume(wsi, n);
+
+	lws_callback_on_writable(wsi);
+
+	return (int)sm->payload_len;
+}
+
 LWS_VISIBLE int lws_serve_http_file_fragment(struct lws *wsi)
 {
 	struct lws_context *context = wsi->context;
@@ -587,10 +1505,8 @@ LWS_VISIBLE int lws_serve_http_file_fragment(struct lws *wsi)
 
 	while (!lws_send_pipe_choked(wsi)) {
 
-		if (wsi->trunc_len) {
-			if (lws_issue_raw(wsi, wsi->trunc_alloc +
-					  wsi->trunc_offset,
-					  wsi->trunc_len) < 0) {
+		if (lws_tx_pending(wsi)) {
+			if (lws_tx_queue_drain(wsi) < 0) {
 				lwsl_info("%s: closing\n", __func__);
 				goto file_had_it;
 			}
@@ -756,7 +1672,7 @@ LWS_VISIBLE int lws_serve_http_file_fragment(struct lws *wsi)
 		}
 
 all_sent:
-		if ((!wsi->trunc_len && wsi->u.http.filepos >= wsi->u.http.filelen)
+		if ((!lws_tx_pending(wsi) && wsi->u.http.filepos >= wsi->u.http.filelen)
 #if defined(LWS_WITH_RANGES)
 		    || finished)
 #else
@@ -823,6 +1739,7 @@ lws_ssl_capable_read_no_ssl(struct lws *wsi, unsigned char *buf, int len)
 		if (wsi->vhost)
 			wsi->vhost->conn_stats.rx += n;
 		lws_stats_atomic_bump(context, pt, LWSSTATS_B_READ, n);
+		lws_pt_load_bytes(pt, n);
 		lws_restart_ws_ping_pong_timer(wsi);
 		return n;
 	}
@@ -67,9 +67,12 @@ lws_send_pipe_choked(struct lws *wsi)
 	wsi_eff = lws_get_network_wsi(wsi);
 #endif
 
-	/* treat the fact we got a truncated send pending as if we're choked */
-	if (wsi_eff->trunc_len)
-		return 1;
+	/*
+	 * treat the fact we got a truncated send pending as if we're choked,
+	 * unless the protocol's output queue can still take more
+	 */
+	if (lws_tx_pending(wsi_eff))
+		return lws_tx_queue_choked(wsi_eff);
 
 	FD_ZERO(&writefds);
 	FD_SET(wsi_eff->desc.sockfd, &writefds);
@@ -43,7 +43,7 @@ lws_send_pipe_choked(struct lws *wsi)
 	struct lws_pollfd fds;
 
 	/* treat the fact we got a truncated send pending as if we're choked */
-	if (wsi->trunc_len)
+	if (lws_tx_pending(wsi))
 		return 1;
 
 	fds.fd = wsi->desc.sockfd;
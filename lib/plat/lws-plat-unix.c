@@ -34,21 +34,33 @@ lws_plat_pipe_create(struct lws *wsi)
 {
 	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
 
+#if defined(LWS_HAVE_EVENTFD)
+	/* one fd that any number of signals just add to */
+	pt->dummy_pipe_fds[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	pt->dummy_pipe_fds[1] = pt->dummy_pipe_fds[0];
+
+	return pt->dummy_pipe_fds[0] < 0;
+#else
 	return pipe(pt->dummy_pipe_fds);
+#endif
 }
 
 int
 lws_plat_pipe_signal(struct lws *wsi)
 {
 	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+#if defined(LWS_HAVE_EVENTFD)
+	uint64_t buf = 1;
+#else
 	char buf = 0;
+#endif
 	int n;
 
-	n = write(pt->dummy_pipe_fds[1], &buf, 1);
+	n = write(pt->dummy_pipe_fds[1], &buf, sizeof(buf));
 
 	lwsl_debug("%s: fd %d %d\n", __func__, pt->dummy_pipe_fds[1], n);
 
-	return n != 1;
+	return n != sizeof(buf);
 }
 
 void
@@ -58,7 +70,8 @@ lws_plat_pipe_close(struct lws *wsi)
 
 	if (pt->dummy_pipe_fds[0] && pt->dummy_pipe_fds[0] != -1)
 		close(pt->dummy_pipe_fds[0]);
-	if (pt->dummy_pipe_fds[1] && pt->dummy_pipe_fds[1] != -1)
+	if (pt->dummy_pipe_fds[1] && pt->dummy_pipe_fds[1] != -1 &&
+	    pt->dummy_pipe_fds[1] != pt->dummy_pipe_fds[0])
 		close(pt->dummy_pipe_fds[1]);
 
 	pt->dummy_pipe_fds[0] = pt->dummy_pipe_fds[1] = -1;
@@ -87,9 +100,12 @@ lws_send_pipe_choked(struct lws *wsi)
 #if defined(LWS_WITH_HTTP2)
 	wsi_eff = lws_get_network_wsi(wsi);
 #endif
-	/* treat the fact we got a truncated send pending as if we're choked */
-	if (wsi_eff->trunc_len)
-		return 1;
+	/*
+	 * treat the fact we got a truncated send pending as if we're choked,
+	 * unless the protocol's output queue can still take more
+	 */
+	if (lws_tx_pending(wsi_eff))
+		return lws_tx_queue_choked(wsi_eff);
 
 	fds.fd = wsi_eff->desc.sockfd;
 	fds.events = POLLOUT;
@@ -138,6 +154,12 @@ _lws_plat_service_tsi(struct lws_context *context, int timeout_ms, int tsi)
 {
 	struct lws_context_per_thread *pt;
 	int n = -1, m, c;
+#if LWS_MAX_SMP > 1 || defined(LWS_WITH_STATS)
+	unsigned long long us;
+#endif
+#if defined(LWS_WITH_STATS)
+	int serviced = 0;
+#endif
 
 	/* stay dead once we are dead */
 
@@ -148,6 +170,9 @@ _lws_plat_service_tsi(struct lws_context *context, int timeout_ms, int tsi)
 
 	lws_stats_atomic_bump(context, pt, LWSSTATS_C_SERVICE_ENTRY, 1);
 
+	/* run anything other threads posted for us first */
+	lws_pt_work_run(context, tsi);
+
 	if (timeout_ms < 0)
 		goto faked_service;
 
@@ -192,6 +217,9 @@ _lws_plat_service_tsi(struct lws_context *context, int timeout_ms, int tsi)
 	}
 
 faked_service:
+#if LWS_MAX_SMP > 1 || defined(LWS_WITH_STATS)
+	us = time_in_microseconds();
+#endif
 	m = lws_service_flag_pending(context, tsi);
 	if (m)
 		c = -1; /* unknown limit */
@@ -209,6 +237,9 @@ faked_service:
 			continue;
 
 		c--;
+#if defined(LWS_WITH_STATS)
+		serviced++;
+#endif
 
 		m = lws_service_fd_tsi(context, &pt->fds[n], tsi);
 		if (m < 0)
@@ -218,6 +249,19 @@ faked_service:
 			n--;
 	}
 
+#if LWS_MAX_SMP > 1 || defined(LWS_WITH_STATS)
+	us = time_in_microseconds() - us;
+#endif
+#if LWS_MAX_SMP > 1
+	/* account time spent servicing, as a load signal for the pt */
+	pt->load.busy_us += us;
+#endif
+#if defined(LWS_WITH_STATS)
+	/* a wake with nothing to do would only tell us how fast that is */
+	if (serviced)
+		lws_stats_hist_record(&pt->service_hist, us);
+#endif
+
 	return 0;
 }
 
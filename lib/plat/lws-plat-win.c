@@ -130,9 +130,12 @@ lws_get_random(struct lws_context *context, void *buf, int len)
 LWS_VISIBLE int
 lws_send_pipe_choked(struct lws *wsi)
 {
-	/* treat the fact we got a truncated send pending as if we're choked */
-	if (wsi->trunc_len)
-		return 1;
+	/*
+	 * treat the fact we got a truncated send pending as if we're choked,
+	 * unless the protocol's output queue can still take more
+	 */
+	if (lws_tx_pending(wsi))
+		return lws_tx_queue_choked(wsi);
 
 	return (int)wsi->sock_send_blocking;
 }
@@ -226,7 +229,7 @@ _lws_plat_service_tsi(struct lws_context *context, int timeout_ms, int tsi)
 		/*
 		 * any wsi has truncated, force him signalled
 		 */
-		if (wsi->trunc_len)
+		if (lws_tx_pending(wsi))
 			WSASetEvent(pt->events[0]);
 	}
 
@@ -93,9 +93,12 @@ char *ets_strchr(const char *s, int c);
 #define STORE_IN_ROM
 #include <assert.h>
 #endif
-#if LWS_MAX_SMP > 1
+#if LWS_MAX_SMP > 1 || defined(LWS_WITH_ACCESS_LOG_ASYNC)
 #include <pthread.h>
 #endif
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC) && !defined(LWS_HAVE_ATOMIC_BUILTINS)
+#error "LWS_WITH_ACCESS_LOG_ASYNC needs compiler atomic builtins"
+#endif
 
 #ifdef LWS_HAVE_SYS_STAT_H
 #include <sys/stat.h>
@@ -186,10 +189,12 @@ int kill(int pid, int sig);
 
 #else
 #include <sys/socket.h>
+#if defined(LWS_HAVE_SENDMSG)
+#include <sys/uio.h>
+#endif
+#if defined(LWS_HAVE_EVENTFD)
+#include <sys/eventfd.h>
 #endif
-#ifdef LWS_WITH_HTTP_PROXY
-#include <hubbub/hubbub.h>
-#include <hubbub/parser.h>
 #endif
 #if defined(LWS_BUILTIN_GETIFADDRS)
  #include "./misc/getifaddrs.h"
@@ -455,6 +460,14 @@ extern "C" {
 #ifndef LWS_DEF_HEADER_POOL
 #define LWS_DEF_HEADER_POOL 4
 #endif
+/* ah data starts at this size and grows towards max_http_header_data */
+#ifndef LWS_AH_DATA_INITIAL
+#define LWS_AH_DATA_INITIAL 1024
+#endif
+/* ah structs are allocated per-pt this many at a time */
+#ifndef LWS_AH_SLAB_COUNT
+#define LWS_AH_SLAB_COUNT 4
+#endif
 #ifndef LWS_MAX_PROTOCOLS
 #define LWS_MAX_PROTOCOLS 5
 #endif
@@ -464,6 +477,18 @@ extern "C" {
 #ifndef LWS_MAX_EXT_OFFERS
 #define LWS_MAX_EXT_OFFERS 8
 #endif
+/* ws ping checks are scheduled on a per-pt wheel of this many 1s slots */
+#ifndef LWS_PING_WHEEL_SLOTS
+#define LWS_PING_WHEEL_SLOTS 256
+#endif
+/* most ws PINGs one pt starts per second, any more wait for the next */
+#ifndef LWS_PING_BATCH
+#define LWS_PING_BATCH 4096
+#endif
+/* topic name hash buckets in the context, topics chain from these */
+#ifndef LWS_PUBSUB_HASH_SIZE
+#define LWS_PUBSUB_HASH_SIZE 64
+#endif
 #ifndef SPEC_LATEST_SUPPORTED
 #define SPEC_LATEST_SUPPORTED 13
 #endif
@@ -833,14 +858,112 @@ struct allocated_headers {
 	uint8_t nfrag;
 };
 
+/* a chunk of ah structs, kept until the context is destroyed */
+struct lws_ah_slab {
+	struct lws_ah_slab *next;
+	struct allocated_headers ah[LWS_AH_SLAB_COUNT];
+};
+
 /*
  * so we can have n connections being serviced simultaneously,
  * these things need to be isolated per-thread.
  */
 
+#if LWS_MAX_SMP > 1
+/*
+ * Load signals for one service thread, used to place new connections and to
+ * decide when to hand idle ones over to a less loaded pt.  Only the owning
+ * service thread writes them, other threads read them racily, which is fine
+ * for a heuristic.
+ */
+struct lws_pt_load {
+	unsigned long long busy_us; /* time spent servicing, this second */
+	unsigned long long bytes; /* bytes read + written, this second */
+	unsigned int busy_us_avg; /* decaying per-second averages of above */
+	unsigned int bytes_avg;
+	long txq_bytes; /* payload waiting in tx queues of our wsi */
+	unsigned long migrated_in;
+	unsigned long migrated_out;
+	time_t last_s;
+};
+
+/*
+ * Scale of each signal in the placement score, in units of "one more
+ * connection".  1ms per second of service time, 16KiB/s of traffic or 4KiB
+ * of queued tx each weigh the same as one idle connection.
+ */
+#define LWS_PT_LOAD_US_PER_CONN		1000
+#define LWS_PT_LOAD_BYTES_PER_CONN	16384
+#define LWS_PT_LOAD_TXQ_PER_CONN	4096
+/* ignore imbalances smaller than this many connections' worth */
+#define LWS_PT_MIGRATE_MIN_DIFF		16
+/* most idle connections a pt hands off per second */
+#define LWS_PT_MIGRATE_MAX		8
+/* how long a keepalive connection must have been idle to be handed off */
+#define LWS_PT_MIGRATE_IDLE_SECS	2
+
+#define lws_pt_load_bytes(_pt, _n) ((_pt)->load.bytes += (unsigned int)(_n))
+#define lws_pt_load_txq(_pt, _n) ((_pt)->load.txq_bytes += (long)(_n))
+#else
+#define lws_pt_load_bytes(_pt, _n)
+#define lws_pt_load_txq(_pt, _n)
+#endif
+
+#ifdef LWS_WITH_ACCESS_LOG
+/*
+ * The strings a request's log line is made from are kept in one block from
+ * a per-pt free list, so steady-state logging does no allocation
+ */
+#define LWS_ACCESS_LOG_BLK_SIZE 1024
+#define LWS_ACCESS_LOG_BLK_KEEP 128 /* free blocks kept per pt */
+
+struct lws_access_log_blk {
+	struct lws_access_log_blk *next;
+};
+
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+#ifndef LWS_ACCESS_LOG_RING_SIZE
+#define LWS_ACCESS_LOG_RING_SIZE (256 * 1024) /* per pt, power of 2 */
+#endif
+
+/*
+ * Single producer (the pt service thread), single consumer (the context's
+ * log writer thread).  Each line is stored as int fd, uint16_t len, line.
+ * head and tail only ever increase, they're masked to index buf.
+ */
+struct lws_access_log_ring {
+	char *buf;
+	uint32_t head; /* written by the service thread */
+	uint32_t tail; /* written by the log writer thread */
+	uint32_t dropped; /* lines lost because the ring was full */
+};
+#endif
+#endif
+
+#if defined(LWS_WITH_STATS)
+/* one cache line, enough for the common cpus */
+#define LWS_STATS_PAD 64
+
+/*
+ * Log-linear latency histogram in us: exact below 8us, then 8 buckets per
+ * power of two up to 2^32us, so each bucket spans at most 12.5% of its value.
+ * The last bucket also takes anything larger.
+ */
+#define LWS_STATS_HIST_SUB_BITS 3
+#define LWS_STATS_HIST_BUCKETS ((32 - LWS_STATS_HIST_SUB_BITS + 1) << \
+				LWS_STATS_HIST_SUB_BITS)
+
+struct lws_stats_hist {
+	uint64_t bucket[LWS_STATS_HIST_BUCKETS];
+	uint64_t sum_us;
+	uint64_t max_us;
+};
+#endif
+
 struct lws_context_per_thread {
 #if LWS_MAX_SMP > 1
 	pthread_mutex_t lock;
+	struct lws_pt_load load;
 #endif
 	struct lws_pollfd *fds;
 #if defined(LWS_WITH_ESP8266)
@@ -849,6 +972,11 @@ struct lws_context_per_thread {
 	struct lws *rx_draining_ext_list;
 	struct lws *tx_draining_ext_list;
 	struct lws *timeout_list;
+	/* ws wsi by second of their next ping check, mod LWS_PING_WHEEL_SLOTS */
+	struct lws **ping_wheel;
+	time_t ping_wheel_last; /* the wheel has been run up to here */
+	time_t ping_wheel_ran; /* second the wheel was last serviced in */
+	uint32_t ping_jitter_seed;
 #if defined(LWS_WITH_LIBUV) || defined(LWS_WITH_LIBEVENT)
 	struct lws_context *context;
 #endif
@@ -857,6 +985,8 @@ struct lws_context_per_thread {
 #endif
 	void *http_header_data;
 	struct allocated_headers *ah_list;
+	struct allocated_headers *ah_free_list; /* unused ah from the slabs */
+	struct lws_ah_slab *ah_slab_list;
 	struct lws *ah_wait_list;
 	int ah_wait_list_length;
 #ifdef LWS_OPENSSL_SUPPORT
@@ -894,6 +1024,21 @@ struct lws_context_per_thread {
 #endif
 	lws_sockfd_type dummy_pipe_fds[2];
 	struct lws *pipe_wsi;
+	/* lock-free LIFO of work from other threads, newest first */
+	struct lws_pt_work *work_head;
+#ifdef LWS_WITH_ACCESS_LOG
+	struct lws_access_log_blk *access_log_free; /* per-request arena */
+	int access_log_free_count;
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+	struct lws_access_log_ring access_log_ring;
+#endif
+#endif
+#ifdef LWS_WITH_HTTP_PROXY
+	/* proxied requests waiting for another one to fill the cache */
+	struct lws *pxc_waiters;
+	struct lws_pt_work pxc_wake;
+	char pxc_wake_pending; /* atomic: pxc_wake is posted to us */
+#endif
 
 	unsigned int fds_count;
 	uint32_t ah_pool_length;
@@ -901,6 +1046,20 @@ struct lws_context_per_thread {
 	short ah_count_in_use;
 	unsigned char tid;
 	unsigned char lock_depth;
+	/* someone wants EVENT_WAIT_CANCELLED broadcast, not just work run */
+	volatile unsigned char cancel_pending;
+#if defined(LWS_WITH_STATS)
+	/*
+	 * This thread's shard of the stats counters.  lws_stats_get() sums
+	 * the shards; the padding keeps each shard on cache lines no other
+	 * pt writes, so service threads don't bounce them between cores.
+	 */
+	char lws_stats_pad_pre[LWS_STATS_PAD];
+	uint64_t lws_stats[LWSSTATS_SIZE];
+	struct lws_stats_hist service_hist; /* LWSSTATS_LAT_SERVICE_LOOP */
+	unsigned char lws_stats_updated;
+	char lws_stats_pad_post[LWS_STATS_PAD];
+#endif
 };
 
 struct lws_conn_stats {
@@ -948,6 +1107,42 @@ struct http2_settings {
 
 struct lws_tls_ss_pieces;
 
+/*
+ * vhost mounts are compiled into a path-compressed trie keyed on the
+ * mountpoint, so lws_find_mount() only visits nodes along the request path.
+ * Each node's hits list the mounts ending there in mount_list order.
+ */
+
+/*
+ * a mount's extra_mimetypes are compiled into a trie of reversed suffixes,
+ * so the lookup only walks back along the end of the filename
+ */
+
+struct lws_suffix_node {
+	struct lws_suffix_node *child;
+	struct lws_suffix_node *sibling;
+	const char *value;
+	int ordinal; /* position in extra_mimetypes */
+	char c;
+};
+
+struct lws_mount_trie_hit {
+	struct lws_mount_trie_hit *next;
+	const struct lws_http_mount *hm;
+	struct lws_suffix_node *mimetypes;
+	const char *mimetype_any; /* first "*" entry in extra_mimetypes */
+	int mimetype_any_ordinal;
+	int ordinal; /* position in mount_list */
+};
+
+struct lws_mount_trie_node {
+	struct lws_mount_trie_node *child;
+	struct lws_mount_trie_node *sibling;
+	struct lws_mount_trie_hit *hits;
+	const char *edge; /* points into a mountpoint string */
+	int edge_len;
+};
+
 struct lws_vhost {
 #if !defined(LWS_WITH_ESP8266)
 	char http_proxy_address[128];
@@ -966,9 +1161,28 @@ struct lws_vhost {
 	esp_tcp tcp;
 #endif
 	struct lws_conn_stats conn_stats;
+#if defined(LWS_WITH_STATS)
+	/*
+	 * Indexed by pt, each pointing to that pt's histograms indexed by
+	 * LWSSTATS_LAT_..., all but the service loop one.  A pt allocates
+	 * its own the first time it records something for us, so idle vhosts
+	 * cost nothing and no two pts write the same lines.
+	 */
+	struct lws_stats_hist *lat_hist[LWS_MAX_SMP];
+#endif
 	struct lws_context *context;
 	struct lws_vhost *vhost_next;
+	struct lws_vhost *vhost_hash_next; /* first vhost per (port, name) */
+	struct lws_vhost *vhost_port_next; /* first vhost per port */
 	const struct lws_http_mount *mount_list;
+	struct lws_mount_trie_node *mount_trie;
+	struct lws_mount_trie_hit *mount_hits;
+#if defined(LWS_WITH_HTTP_PROXY)
+	struct lws_proxy_pool *proxy_pools;
+#endif
+#if defined(LWS_WITH_FASTCGI)
+	struct lws_fcgi_pool *fcgi_pools;
+#endif
 	struct lws *lserv_wsi;
 	const char *name;
 	const char *iface;
@@ -997,6 +1211,9 @@ struct lws_vhost {
 	void *user;
 
 	int listen_port;
+	int name_len;
+	uint32_t name_hash;
+	uint32_t ordinal; /* position in context->vhost_list */
 	unsigned int http_proxy_port;
 #if defined(LWS_WITH_SOCKS5)
 	unsigned int socks_proxy_port;
@@ -1010,6 +1227,7 @@ struct lws_vhost {
 	int timeout_secs_ah_idle;
 	int ssl_info_event_mask;
 #ifdef LWS_WITH_ACCESS_LOG
+	char *log_filepath; /* our copy, for reopening */
 	int log_fd;
 #endif
 
@@ -1071,7 +1289,9 @@ struct lws_peer {
 
 struct lws_context {
 	time_t last_timeout_check_s;
-	time_t last_ws_ping_pong_check_s;
+#if defined(LWS_WITH_HTTP_PROXY)
+	time_t proxy_hc_last;
+#endif
 	time_t last_cert_check_s;
 	time_t time_up;
 	const struct lws_plat_file_ops *fops;
@@ -1088,6 +1308,15 @@ struct lws_context {
 	pthread_mutex_t lock;
 	int lock_depth;
 #endif
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+	pthread_t access_log_thread;
+	pthread_mutex_t access_log_lock; /* held by whoever drains the rings */
+	pthread_cond_t access_log_cond;
+	char *access_log_batch;
+	uint64_t access_log_dropped;
+	unsigned char access_log_thread_running;
+	unsigned char access_log_thread_exit;
+#endif
 #ifdef _WIN32
 /* different implementation between unix and windows */
 	struct lws_fd_hashtable fd_hashtable[FD_HASHTABLE_MODULUS];
@@ -1103,6 +1332,11 @@ struct lws_context {
 #endif
 	struct lws_vhost *vhost_list;
 	struct lws_vhost *vhost_pending_destruction_list;
+	struct lws_vhost **vhost_hash_table;
+	struct lws_vhost *vhost_port_list;
+#ifndef LWS_NO_SERVER
+	struct lws_pubsub_topic *pubsub_hash[LWS_PUBSUB_HASH_SIZE];
+#endif
 	struct lws_plugin *plugin_list;
 	struct lws_deferred_free *deferred_free_list;
 #if defined(LWS_WITH_PEER_LIMITS)
@@ -1140,7 +1374,6 @@ struct lws_context {
 #endif
 
 #if defined(LWS_WITH_STATS)
-	uint64_t lws_stats[LWSSTATS_SIZE];
 	uint64_t last_dump;
 	int updated;
 #endif
@@ -1167,6 +1400,12 @@ struct lws_context {
 	int max_http_header_data;
 	int simultaneous_ssl_restriction;
 	int simultaneous_ssl;
+	uint32_t vhost_hash_elements;
+	uint32_t vhost_hash_count;
+	uint32_t vhost_ordinal;
+#ifdef LWS_WITH_ACCESS_LOG
+	volatile sig_atomic_t access_log_reopen; /* lws_access_log_reopen() */
+#endif
 #if defined(LWS_WITH_PEER_LIMITS)
 	uint32_t pl_hash_elements;	/* protected by context->lock */
 	uint32_t count_peers;		/* protected by context->lock */
@@ -1223,6 +1462,10 @@ lws_plat_plugins_destroy(struct lws_context * context);
 
 LWS_EXTERN void
 lws_restart_ws_ping_pong_timer(struct lws *wsi);
+LWS_EXTERN void
+lws_ping_wheel_remove(struct lws *wsi);
+LWS_EXTERN void
+lws_ping_wheel_service(struct lws_context_per_thread *pt, time_t now);
 
 struct lws *
 lws_adopt_socket_vhost(struct lws_vhost *vh, lws_sockfd_type accept_fd);
@@ -1812,10 +2055,10 @@ struct _lws_websocket_related {
 	unsigned int first_fragment:1;
 };
 
-#ifdef LWS_WITH_CGI
-
 #define LWS_HTTP_CHUNK_HDR_SIZE 16
 
+#ifdef LWS_WITH_CGI
+
 enum {
 	SIGNIFICANT_HDR_CONTENT_LENGTH,
 	SIGNIFICANT_HDR_LOCATION,
@@ -1883,6 +2126,71 @@ struct lws_access_log {
 };
 #endif
 
+/*
+ * a ws message framed once and shared by every wsi it was written to, freed
+ * when the last one has sent it
+ */
+struct lws_shared_msg {
+#if LWS_MAX_SMP > 1
+	pthread_mutex_t lock;
+#endif
+	int refcount;
+	enum lws_write_protocol wp;
+	size_t payload_len;
+	size_t len; /* frame header + payload */
+	unsigned char *frame; /* points into buf[] */
+	/* LWS_PRE + payload follows */
+};
+
+/*
+ * a whole message waiting in a wsi output queue.  The data either follows
+ * the struct in the same allocation, or belongs to a shared message.
+ */
+struct lws_txq_msg {
+	struct lws_txq_msg *next;
+	struct lws_shared_msg *shared;
+	const unsigned char *data;
+	size_t len;
+};
+
+/* there is something we still have to send before any new write */
+#define lws_tx_pending(wsi) ((wsi)->trunc_len || (wsi)->txq_head)
+
+#ifndef LWS_NO_SERVER
+/* a wsi's subscription to a topic, lives on its pt's part of the topic */
+struct lws_pubsub_sub {
+	struct lws_pubsub_sub *next; /* on the topic pt idle or busy list */
+	struct lws_pubsub_sub **prev;
+	struct lws_pubsub_sub *wsi_next; /* all this wsi's subscriptions */
+	struct lws_pubsub_topic *topic;
+	struct lws *wsi;
+	uint32_t seq; /* ring seq of the next message to send */
+	uint32_t max_lag;
+	unsigned int dropped;
+	unsigned char policy;
+	unsigned char busy; /* behind head, WRITEABLE already requested */
+};
+
+/* the part of a topic belonging to one service thread, only it touches it */
+struct lws_pubsub_topic_pt {
+	struct lws_shared_msg **ring; /* the last ring_size messages */
+	struct lws_pubsub_sub *idle; /* caught up, wake on next message */
+	struct lws_pubsub_sub *busy; /* still sending */
+	uint32_t ring_size; /* power of 2 */
+	uint32_t head; /* seq the next message will get */
+	uint32_t held; /* oldest seq still referenced in the ring */
+	int count_subs; /* also read by publishers on other threads */
+};
+
+struct lws_pubsub_topic {
+	struct lws_pubsub_topic *next; /* context hash bucket */
+	struct lws_context *context;
+	struct lws_pubsub_topic_pt *pt; /* [context->count_threads] */
+	uint32_t hash;
+	/* pt array then name follow */
+};
+#endif
+
 struct lws {
 
 	/* structs */
@@ -1924,6 +2232,9 @@ struct lws {
 	struct lws **same_vh_protocol_prev, *same_vh_protocol_next;
 	struct lws *timeout_list;
 	struct lws **timeout_list_prev;
+	struct lws *ping_wheel_next; /* same slot on the pt ping wheel */
+	struct lws **ping_wheel_prev;
+	time_t ping_wheel_due; /* second of the wheel slot we are in */
 #if defined(LWS_WITH_PEER_LIMITS)
 	struct lws_peer *peer;
 #endif
@@ -1934,6 +2245,11 @@ struct lws {
 	unsigned char *rxflow_buffer;
 	/* truncated send handling */
 	unsigned char *trunc_alloc; /* non-NULL means buffering in progress */
+	/* messages queued behind trunc_alloc, only if protocol enables it */
+	struct lws_txq_msg *txq_head, *txq_tail;
+#ifndef LWS_NO_SERVER
+	struct lws_pubsub_sub *pubsub_subs;
+#endif
 
 #if defined (LWS_WITH_ESP8266)
 	void *premature_rx;
@@ -1955,6 +2271,13 @@ struct lws {
 #endif
 #ifdef LWS_WITH_HTTP_PROXY
 	struct lws_rewrite *rw;
+	struct lws_proxy_req *pxy_req; /* the transaction we are proxying */
+	struct lws_proxy_upstream *pxy_up; /* we are idle in / checking it */
+	struct lws *pxy_idle_next;
+#endif
+#ifdef LWS_WITH_FASTCGI
+	struct lws_fcgi_req *fcgi_req; /* the request we are passing on */
+	struct lws_fcgi_conn *fcgi_conn; /* we are a worker connection */
 #endif
 #ifdef LWS_LATENCY
 	unsigned long action_start;
@@ -1963,6 +2286,7 @@ struct lws {
 	lws_sock_file_fd_type desc; /* .filefd / .sockfd */
 #if defined(LWS_WITH_STATS)
 	uint64_t active_writable_req_us;
+	uint64_t http_hdr_done_us; /* for LWSSTATS_LAT_FIRST_BYTE */
 #endif
 	/* ints */
 	int position_in_fds_table;
@@ -1971,6 +2295,9 @@ struct lws {
 	unsigned int trunc_alloc_len; /* size of malloc */
 	unsigned int trunc_offset; /* where we are in terms of spilling */
 	unsigned int trunc_len; /* how much is buffered */
+	unsigned int txq_bytes; /* payload in txq, not counting trunc */
+	unsigned int txq_msgs; /* messages in txq, not counting trunc */
+	unsigned int txq_head_offset; /* already sent from txq_head */
 #ifndef LWS_NO_CLIENT
 	int chunk_remaining;
 #endif
@@ -2000,6 +2327,8 @@ struct lws {
 	unsigned int seen_zero_length_recv:1;
 	unsigned int rxflow_will_be_applied:1;
 	unsigned int event_pipe:1;
+	unsigned int txq_over_hwm:1;
+	unsigned int txq_draining:1;
 
 #if defined(LWS_WITH_ESP8266)
 	unsigned int pending_send_completion:3;
@@ -2016,6 +2345,8 @@ struct lws {
 #endif
 #ifdef LWS_WITH_HTTP_PROXY
 	unsigned int perform_rewrite:1;
+	unsigned int pxy_hc:1; /* health check connection */
+	unsigned int pxy_reused:1; /* kept-alive upstream connection reused */
 #endif
 #ifndef LWS_NO_EXTENSIONS
 	unsigned int extension_data_pending:1;
@@ -2037,6 +2368,7 @@ struct lws {
 #ifndef LWS_NO_CLIENT
 	unsigned short c_port;
 #endif
+	unsigned short ping_jitter; /* our pings come this much early */
 
 	/* chars */
 #ifndef LWS_NO_EXTENSIONS
@@ -2114,6 +2446,8 @@ lws_client_rx_sm(struct lws *wsi, unsigned char c);
 
 LWS_EXTERN int LWS_WARN_UNUSED_RESULT
 lws_parse(struct lws *wsi, unsigned char c);
+LWS_EXTERN int
+lws_parse_span(struct lws *wsi, const unsigned char *buf, size_t len);
 
 LWS_EXTERN int LWS_WARN_UNUSED_RESULT
 lws_parse_urldecode(struct lws *wsi, uint8_t *_c);
@@ -2121,6 +2455,9 @@ lws_parse_urldecode(struct lws *wsi, uint8_t *_c);
 LWS_EXTERN int LWS_WARN_UNUSED_RESULT
 lws_http_action(struct lws *wsi);
 
+LWS_EXTERN int
+lws_clean_url(char *p);
+
 LWS_EXTERN int
 lws_b64_selftest(void);
 
@@ -2148,6 +2485,37 @@ insert_wsi_socket_into_fds(struct lws_context *context, struct lws *wsi);
 LWS_EXTERN int LWS_WARN_UNUSED_RESULT
 lws_issue_raw(struct lws *wsi, unsigned char *buf, size_t len);
 
+LWS_EXTERN int LWS_WARN_UNUSED_RESULT
+lws_issue_rawv(struct lws *wsi, const struct lws_iovec *iov, int count);
+
+LWS_EXTERN int LWS_WARN_UNUSED_RESULT
+lws_tx_queue_drain(struct lws *wsi);
+
+LWS_EXTERN int
+lws_tx_queue_choked(struct lws *wsi);
+
+LWS_EXTERN void
+lws_tx_queue_destroy(struct lws *wsi);
+
+LWS_EXTERN void
+lws_shared_msg_ref(struct lws_shared_msg *sm);
+
+LWS_EXTERN void
+lws_pt_work_run(struct lws_context *context, int tsi);
+#ifndef LWS_NO_SERVER
+LWS_EXTERN void
+lws_pubsub_wsi_destroy(struct lws *wsi);
+LWS_EXTERN void
+lws_pubsub_context_destroy(struct lws_context *context);
+#else
+#define lws_pubsub_wsi_destroy(_a)
+#define lws_pubsub_context_destroy(_a)
+#endif
+#if LWS_MAX_SMP > 1 && !defined(LWS_NO_SERVER)
+LWS_EXTERN void
+lws_pt_load_tick(struct lws_context *context, int tsi, time_t now);
+#endif
+
 
 LWS_EXTERN int LWS_WARN_UNUSED_RESULT
 lws_service_timeout_check(struct lws *wsi, unsigned int sec);
@@ -2176,6 +2544,10 @@ lws_client_connect_via_info2(struct lws *wsi);
 
 LWS_EXTERN int
 _lws_destroy_ah(struct lws_context_per_thread *pt, struct allocated_headers *ah);
+LWS_EXTERN void
+_lws_ah_slabs_destroy(struct lws_context_per_thread *pt);
+LWS_EXTERN int
+_lws_ah_data_grow(struct lws_context *context, struct allocated_headers *ah);
 
 /*
  * EXTENSIONS
@@ -2234,6 +2606,9 @@ LWS_EXTERN int lws_h2_do_pps_send(struct lws *wsi);
 LWS_EXTERN int lws_h2_frame_write(struct lws *wsi, int type, int flags,
 				     unsigned int sid, unsigned int len,
 				     unsigned char *buf);
+LWS_EXTERN int lws_h2_frame_writev(struct lws *wsi, int type, int flags,
+				      unsigned int sid,
+				      const struct lws_iovec *iov, int count);
 LWS_EXTERN struct lws *
 lws_h2_wsi_from_id(struct lws *wsi, unsigned int sid);
 LWS_EXTERN int lws_hpack_interpret(struct lws *wsi,
@@ -2261,6 +2636,8 @@ lws_hpack_dynamic_size(struct lws *wsi, int size);
 LWS_EXTERN int
 lws_h2_goaway(struct lws *wsi, uint32_t err, const char *reason);
 LWS_EXTERN int
+lws_h2_rst_stream(struct lws *wsi, uint32_t err, const char *reason);
+LWS_EXTERN int
 lws_h2_tx_cr_get(struct lws *wsi);
 LWS_EXTERN void
 lws_h2_tx_cr_consume(struct lws *wsi, int consumed);
@@ -2296,6 +2673,7 @@ lws_header_table_force_to_detachable_state(struct lws *wsi);
 int
 lws_header_table_is_in_detachable_state(struct lws *wsi);
 
+/* points into ah->data, which moves when a later header makes it grow */
 LWS_EXTERN char * LWS_WARN_UNUSED_RESULT
 lws_hdr_simple_ptr(struct lws *wsi, enum lws_token_indexes h);
 
@@ -2314,6 +2692,14 @@ int lws_context_init_server(struct lws_context_creation_info *info,
 LWS_EXTERN struct lws_vhost *
 lws_select_vhost(struct lws_context *context, int port, const char *servername);
 LWS_EXTERN int
+lws_vhost_index_add(struct lws_vhost *vh);
+LWS_EXTERN void
+lws_vhost_index_rebuild(struct lws_context *context);
+LWS_EXTERN int
+lws_vhost_mount_trie_build(struct lws_vhost *vh);
+LWS_EXTERN void
+lws_vhost_mount_trie_destroy(struct lws_vhost *vh);
+LWS_EXTERN int
 handshake_0405(struct lws_context *context, struct lws *wsi);
 LWS_EXTERN int LWS_WARN_UNUSED_RESULT
 lws_interpret_incoming_packet(struct lws *wsi, unsigned char **buf, size_t len);
@@ -2322,6 +2708,10 @@ lws_server_get_canonical_hostname(struct lws_context *context,
 				  struct lws_context_creation_info *info);
 #else
 #define lws_context_init_server(_a, _b) (0)
+#define lws_vhost_index_add(_a) (0)
+#define lws_vhost_index_rebuild(_a)
+#define lws_vhost_mount_trie_build(_a) (0)
+#define lws_vhost_mount_trie_destroy(_a)
 #define lws_interpret_incoming_packet(_a, _b, _c) (0)
 #define lws_server_get_canonical_hostname(_a, _b)
 #endif
@@ -2546,28 +2936,287 @@ lws_tls_check_cert_lifetime(struct lws_vhost *vhost);
 int lws_jws_selftest(void);
 
 #ifdef LWS_WITH_HTTP_PROXY
+#ifndef LWS_PROXY_HASH_POINTS
+/* points on the consistent hash ring for each upstream */
+#define LWS_PROXY_HASH_POINTS 64
+#endif
+#ifndef LWS_PROXY_BODY_MAX
+/* request body we hold while the upstream is slower than the client */
+#define LWS_PROXY_BODY_MAX (256 * 1024)
+#endif
+
+struct lws_proxy_pool;
+
+struct lws_proxy_upstream {
+	struct lws_proxy_pool *pool;
+	struct lws *idle[LWS_MAX_SMP]; /* kept-alive connections, per pt */
+	struct lws *hc_wsi; /* health check in flight, pt 0 only */
+	char address[64];
+	time_t down_until; /* atomic: skipped until then after max_fails */
+	int port;
+	int active; /* atomic: transactions in flight */
+	int fails; /* atomic: consecutive failures */
+	unsigned char count_idle[LWS_MAX_SMP];
+	char hc_down; /* atomic: failed its last active health check */
+};
+
+struct lws_proxy_hash_point {
+	uint32_t hash;
+	int index;
+};
+
+struct lws_proxy_pool {
+	struct lws_proxy_pool *next;
+	const struct lws_http_mount *mount;
+	struct lws_vhost *vhost;
+	struct lws_proxy_upstream *up;
+	struct lws_proxy_hash_point *ring;
+	const char *path; /* origin path, after the host part */
+	struct lws_proxy_cache *cache; /* NULL unless the mount caches */
+	time_t next_health_check;
+	int count_up;
+	int count_ring;
+	unsigned int rr; /* atomic: round robin position */
+	char ssl;
+};
+
+struct lws_proxy_req {
+	struct lws_proxy_pool *pool;
+	struct lws_proxy_upstream *up;
+	unsigned char *body; /* request body waiting to go upstream */
+	size_t body_len;
+	size_t body_alloc;
+	lws_filepos_t body_sent;
+	lws_filepos_t body_length; /* from the request content-length */
+	struct lws_pxc_entry *cent; /* cache entry we hold a reference on */
+	lws_fop_fd_t cache_fop; /* cent opened to serve it */
+	struct lws *cache_wait_next; /* pt list of waiting requests */
+	char path[256];
+	char method[16];
+	char ctype[64]; /* request body content-type */
+	uint32_t hash; /* of the request path, for LWS_PROXY_LB_HASH */
+	int tries; /* upstreams that failed to connect for us */
+
+	unsigned int counted:1; /* we are in up->active */
+	unsigned int retry:1; /* connect again, to another upstream */
+	unsigned int stale:1; /* ...or the same one, kept-alive conn died */
+	unsigned int failed:1;
+	unsigned int hdrs_sent:1; /* response headers went to the client */
+	unsigned int framed:1; /* response had content-length */
+	unsigned int no_body:1; /* response can have no body */
+	unsigned int done:1; /* response completed */
+	unsigned int ws:1; /* relaying a ws connection as it is */
+	unsigned int cache_hit:1; /* serve cent instead of the upstream */
+	unsigned int cache_wait:1; /* on the pt list until cent is filled */
+	unsigned int cache_again:1; /* cent was filled, look it up again */
+	unsigned int cache_owner:1; /* we are filling or revalidating cent */
+	unsigned int cache_reval:1; /* ...revalidating it with If-None-Match */
+	unsigned int cache_fill:1; /* ...storing the response body in it */
+	unsigned int cache_auth:1; /* the request had Authorization */
+};
+
+/* lws_proxy_cache_lookup() results */
+enum {
+	LWS_PXC_FETCH,	/* go to the upstream, maybe filling req->cent */
+	LWS_PXC_HIT,	/* req->cent can be served from the cache */
+	LWS_PXC_WAIT,	/* another request is filling it, wait for that */
+};
+
+LWS_EXTERN int
+lws_proxy_vhost_init(struct lws_vhost *vh);
+LWS_EXTERN void
+lws_proxy_vhost_destroy(struct lws_vhost *vh);
+LWS_EXTERN int
+lws_proxy_http_action(struct lws *wsi, const struct lws_http_mount *hit,
+		      const char *uri_ptr, const char *method);
+LWS_EXTERN int
+lws_proxy_req_body(struct lws *wsi, unsigned char *buf, size_t len);
+LWS_EXTERN int
+lws_proxy_ws_action(struct lws *wsi, const struct lws_http_mount *hit,
+		    const char *uri_ptr, unsigned char *buf, size_t len);
+LWS_EXTERN int
+lws_proxy_callback(struct lws *wsi, enum lws_callback_reasons reason,
+		   void *in, size_t len);
+LWS_EXTERN int
+lws_proxy_park(struct lws *wsi);
+LWS_EXTERN void
+lws_proxy_wsi_destroy(struct lws *wsi);
+LWS_EXTERN void
+lws_proxy_periodic(struct lws_context *context, time_t now);
+LWS_EXTERN uint32_t
+lws_proxy_hash(const char *s, size_t len);
+
+LWS_EXTERN struct lws_proxy_cache *
+lws_proxy_cache_create(const struct lws_http_mount *m);
+LWS_EXTERN void
+lws_proxy_cache_destroy(struct lws_proxy_cache *cache);
+LWS_EXTERN int
+lws_proxy_cache_lookup(struct lws *wsi, struct lws_proxy_req *req);
+LWS_EXTERN int
+lws_proxy_cache_append(struct lws_proxy_req *req, char **p, size_t len);
+LWS_EXTERN int
+lws_proxy_cache_response(struct lws *cwsi, struct lws *wsi,
+			 struct lws_proxy_req *req, unsigned int status);
+LWS_EXTERN void
+lws_proxy_cache_fill(struct lws *wsi, struct lws_proxy_req *req,
+		     const void *buf, size_t len);
+LWS_EXTERN void
+lws_proxy_cache_commit(struct lws *wsi, struct lws_proxy_req *req);
+LWS_EXTERN int
+lws_proxy_cache_serve(struct lws *wsi, struct lws_proxy_req *req);
+LWS_EXTERN void
+lws_proxy_cache_req_destroy(struct lws *wsi, struct lws_proxy_req *req);
+
+/* the wsi is a proxied transaction, or one of its upstream connections */
+#define lws_proxy_wsi(_w) ((_w)->pxy_req || (_w)->pxy_up || \
+			   ((_w)->parent && (_w)->parent->pxy_req))
+#else
+#define lws_proxy_vhost_init(_a) (0)
+#define lws_proxy_vhost_destroy(_a)
+#define lws_proxy_wsi_destroy(_a)
+#define lws_proxy_periodic(_a, _b)
+#endif
+
+#ifdef LWS_WITH_FASTCGI
+struct lws_fcgi_pool;
+struct lws_fcgi_conn;
+
+struct lws_fcgi_buf {
+	unsigned char *p;
+	size_t len;
+	size_t alloc;
+};
+
+struct lws_fcgi_worker {
+	struct lws_fcgi_pool *pool;
+	struct lws_fcgi_conn *conns[LWS_MAX_SMP]; /* open connections, per pt */
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	char name[108];
+	time_t down_until; /* skipped until then after a connect failure */
+	unsigned short count_conns[LWS_MAX_SMP];
+};
+
+struct lws_fcgi_pool {
+	struct lws_fcgi_pool *next;
+	const struct lws_http_mount *mount;
+	struct lws_vhost *vhost;
+	struct lws_fcgi_worker *w;
+	struct lws_fcgi_req *wait[LWS_MAX_SMP]; /* waiting for a conn, per pt */
+	unsigned int rr[LWS_MAX_SMP];
+	int count_w;
+	int max_conns; /* per worker, per pt */
+	int mpxs; /* requests in flight per connection */
+	int timeout; /* secs for the response */
+};
+
+struct lws_fcgi_conn {
+	struct lws_fcgi_worker *w;
+	struct lws_fcgi_conn *next;
+	struct lws *wsi;
+	struct lws_fcgi_req **req; /* mpxs slots, request id is slot + 1 */
+	struct lws_fcgi_buf tx; /* records waiting to go to the worker */
+	size_t tx_pos;
+	unsigned char hdr[8]; /* record header being received */
+	unsigned char end[8]; /* END_REQUEST body being received */
+	int hdr_len;
+	int content; /* left in the record being received */
+	int padding;
+	int rec_len;
+	int active; /* slots in use */
+	int aborted; /* ...by requests whose client went away */
+	int served; /* requests it completed */
+
+	unsigned int connected:1;
+	unsigned int paused:1; /* rx stopped until the clients catch up */
+	unsigned int doomed:1; /* closing, takes no more requests */
+};
+
+struct lws_fcgi_req {
+	struct lws_fcgi_pool *pool;
+	struct lws_fcgi_conn *conn;
+	struct lws *wsi;
+	struct lws_fcgi_req *wait_next;
+	struct lws_fcgi_buf params; /* encoded FCGI_PARAMS content */
+	struct lws_fcgi_buf body; /* request body not yet sent as FCGI_STDIN */
+	struct lws_fcgi_buf out; /* FCGI_STDOUT not yet sent to the client */
+	size_t out_pos;
+	lws_filepos_t body_in;
+	lws_filepos_t body_length; /* from the request content-length */
+	lws_filepos_t content_length; /* from the response, if framed */
+	lws_filepos_t content_sent;
+	char method[16];
+	int tries; /* connections that failed under us */
+	int id;
+
+	unsigned int begun:1; /* BEGIN_REQUEST went on conn */
+	unsigned int stdin_done:1; /* ...and the empty FCGI_STDIN */
+	unsigned int ended:1; /* END_REQUEST came */
+	unsigned int got_rx:1; /* some response came */
+	unsigned int again:1; /* find a conn again, we were waiting */
+	unsigned int retry:1; /* ...after the last one failed */
+	unsigned int failed:1;
+	unsigned int hdrs_sent:1;
+	unsigned int chunked:1;
+	unsigned int framed:1; /* response had content-length */
+	unsigned int no_body:1;
+	unsigned int head:1;
+	unsigned int paused:1; /* client rx stopped until the body went */
+};
+
+LWS_EXTERN int
+lws_fcgi_vhost_init(struct lws_vhost *vh);
+LWS_EXTERN void
+lws_fcgi_vhost_destroy(struct lws_vhost *vh);
+LWS_EXTERN int
+lws_fcgi_http_action(struct lws *wsi, const struct lws_http_mount *hit,
+		     const char *uri_ptr, const char *method);
+LWS_EXTERN int
+lws_fcgi_req_body(struct lws *wsi, unsigned char *buf, size_t len);
+LWS_EXTERN int
+lws_fcgi_callback(struct lws *wsi, enum lws_callback_reasons reason,
+		  void *in, size_t len);
+LWS_EXTERN void
+lws_fcgi_wsi_destroy(struct lws *wsi);
+
+/* the wsi is a request going to a worker, or a worker connection */
+#define lws_fcgi_wsi(_w) ((_w)->fcgi_req || (_w)->fcgi_conn)
+#else
+#define lws_fcgi_vhost_init(_a) (0)
+#define lws_fcgi_vhost_destroy(_a)
+#define lws_fcgi_wsi_destroy(_a)
+#endif
+
+#ifdef LWS_WITH_HTTP_PROXY
+#define LWS_REWRITE_OUT 2048
+#define LWS_REWRITE_NAME 8
 struct lws_rewrite {
-	hubbub_parser *parser;
-	hubbub_parser_optparams params;
-	const char *from, *to;
-	int from_len, to_len;
-	unsigned char *p, *end;
 	struct lws *wsi;
+	const char *from, *to;
+	const char *from_path; /* the path part of from */
+	const char *rawtext; /* the element whose end tag we look for */
+	int from_len, to_len, from_path_len;
+	int out_len;
+	unsigned short val_len, val_max;
+	unsigned char state;
+	unsigned char match;
+	unsigned char name_len, attr_len;
+	char name[LWS_REWRITE_NAME]; /* the tag's, lowercased */
+	char attr[LWS_REWRITE_NAME]; /* the attribute's, lowercased */
+	char quote; /* around the attribute value, or 0 */
+	unsigned int end_tag:1;
+	unsigned int capture:1; /* holding back the value */
+	unsigned char out[LWS_PRE + LWS_REWRITE_OUT];
+	char val[1]; /* overallocated to val_max */
 };
-static LWS_INLINE int hstrcmp(hubbub_string *s, const char *p, int len)
-{
-	if ((int)s->len != len)
-		return 1;
-
-	return strncmp((const char *)s->ptr, p, len);
-}
-typedef hubbub_error (*hubbub_callback_t)(const hubbub_token *token, void *pw);
 LWS_EXTERN struct lws_rewrite *
-lws_rewrite_create(struct lws *wsi, hubbub_callback_t cb, const char *from, const char *to);
+lws_rewrite_create(struct lws *wsi, const char *from, const char *to);
 LWS_EXTERN void
 lws_rewrite_destroy(struct lws_rewrite *r);
 LWS_EXTERN int
 lws_rewrite_parse(struct lws_rewrite *r, const unsigned char *in, int in_len);
+LWS_EXTERN int
+lws_rewrite_reset(struct lws_rewrite *r);
 #endif
 
 #ifndef LWS_NO_CLIENT
@@ -2618,8 +3267,26 @@ LWS_EXTERN int
 lws_access_log(struct lws *wsi);
 LWS_EXTERN void
 lws_prepare_access_log_info(struct lws *wsi, char *uri_ptr, int meth);
+LWS_EXTERN int
+lws_access_log_vhost_init(struct lws_vhost *vh, const char *filepath);
+LWS_EXTERN void
+lws_access_log_vhost_destroy(struct lws_vhost *vh);
+LWS_EXTERN void
+lws_access_log_periodic(struct lws_context *context);
+LWS_EXTERN void
+lws_access_log_context_destroy(struct lws_context *context);
+LWS_EXTERN void
+lws_access_log_context_destroy2(struct lws_context *context);
 #else
 #define lws_access_log(_a)
+#define lws_access_log_periodic(_a)
+#define lws_access_log_context_destroy(_a)
+#define lws_access_log_context_destroy2(_a)
+#endif
+
+#if defined(LWS_WITH_SERVER_STATUS)
+/* built in, so it doesn't need plugin support */
+LWS_EXTERN const struct lws_protocols lws_openmetrics_protocol;
 #endif
 
 LWS_EXTERN int
@@ -2725,12 +3392,92 @@ LWS_EXTERN int
 lws_broadcast(struct lws_context *context, int reason, void *in, size_t len);
 
 #if defined(LWS_WITH_STATS)
+/*
+ * Counters only ever go into the caller's pt shard.  With one service thread
+ * a plain add is enough; with several, another thread may be bumping the same
+ * shard (eg, adoption into a different pt) so use relaxed atomics, which are
+ * uncontended in the common case, or the pt lock if we don't have them.
+ */
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS_64)
+#define lws_stats_load(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define lws_stats_add(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#else
+#define lws_stats_load(p) (*(p))
+#define lws_stats_add(p, v) (*(p) += (v))
+#endif
+
+static LWS_INLINE void
+lws_stats_max(uint64_t *p, uint64_t val)
+{
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS_64)
+	uint64_t cur = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	do {
+		if (val <= cur)
+			return;
+	} while (!__atomic_compare_exchange_n(p, &cur, val, 1,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+#else
+	if (val > *p)
+		*p = val;
+#endif
+}
+
 void
-lws_stats_atomic_bump(struct lws_context * context,
-		struct lws_context_per_thread *pt, int index, uint64_t bump);
+lws_stats_hist_record(struct lws_stats_hist *h, uint64_t us);
+void
+lws_stats_hist_sum(struct lws_stats_hist *dest, const struct lws_stats_hist *h);
 void
+lws_stats_hist_info(const struct lws_stats_hist *h,
+		    struct lws_stats_latency_info *info);
+/* records into pt's shard of the vhost histogram, pt must be the caller's */
+void
+lws_stats_vh_latency(struct lws_vhost *vh, struct lws_context_per_thread *pt,
+		     enum lws_stats_latency which, uint64_t us);
+/* adds all the pt shards of one of the vhost's histograms to dest */
+void
+lws_stats_vh_hist_sum(struct lws_stats_hist *dest, const struct lws_vhost *vh,
+		      enum lws_stats_latency which);
+
+static LWS_INLINE void
+lws_stats_atomic_bump(struct lws_context * context,
+		struct lws_context_per_thread *pt, int index, uint64_t bump)
+{
+	(void)context;
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS_64)
+	lws_stats_add(&pt->lws_stats[index], bump);
+#else
+	lws_pt_lock(pt);
+	pt->lws_stats[index] += bump;
+	lws_pt_unlock(pt);
+#endif
+	/* only store if needed, so the line stays clean after the first */
+	if (index != LWSSTATS_C_SERVICE_ENTRY && !pt->lws_stats_updated)
+		pt->lws_stats_updated = 1;
+}
+
+static LWS_INLINE void
 lws_stats_atomic_max(struct lws_context * context,
-		struct lws_context_per_thread *pt, int index, uint64_t val);
+		struct lws_context_per_thread *pt, int index, uint64_t val)
+{
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS_64)
+	(void)context;
+	if (val <= __atomic_load_n(&pt->lws_stats[index], __ATOMIC_RELAXED))
+		return;
+	lws_stats_max(&pt->lws_stats[index], val);
+#else
+	(void)context;
+	lws_pt_lock(pt);
+	if (val <= pt->lws_stats[index]) {
+		lws_pt_unlock(pt);
+		return;
+	}
+	pt->lws_stats[index] = val;
+	lws_pt_unlock(pt);
+#endif
+	pt->lws_stats_updated = 1;
+}
 #else
 static inline uint64_t lws_stats_atomic_bump(struct lws_context * context,
 		struct lws_context_per_thread *pt, int index, uint64_t bump) {
@@ -37,84 +37,233 @@ static const char * const hver[] = {
 	"HTTP/1.0", "HTTP/1.1", "HTTP/2"
 };
 
+/*
+ * The header log, referrer and user agent for a request share one block:
+ * a log line is limited to 512 chars, so anything longer than these
+ * regions could never have been logged in full anyway.
+ */
+#define LWS_AL_HEADER_LEN	256
+#define LWS_AL_REFERRER		LWS_AL_HEADER_LEN
+#define LWS_AL_UA		(LWS_AL_REFERRER + 384)
+#define LWS_AL_REGION_LEN	384
+
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+#define LWS_ACCESS_LOG_BATCH	(64 * 1024)
+#define LWS_ACCESS_LOG_FLUSH_MS	200
+#endif
+
+static char *
+lws_access_log_blk_get(struct lws_context_per_thread *pt)
+{
+	struct lws_access_log_blk *b = pt->access_log_free;
+
+	if (!b)
+		return lws_malloc(LWS_ACCESS_LOG_BLK_SIZE, "access log");
+
+	pt->access_log_free = b->next;
+	pt->access_log_free_count--;
+
+	return (char *)b;
+}
+
+static void
+lws_access_log_blk_put(struct lws_context_per_thread *pt, char *p)
+{
+	struct lws_access_log_blk *b = (struct lws_access_log_blk *)p;
+
+	if (pt->access_log_free_count >= LWS_ACCESS_LOG_BLK_KEEP) {
+		lws_free(p);
+		return;
+	}
+
+	b->next = pt->access_log_free;
+	pt->access_log_free = b;
+	pt->access_log_free_count++;
+}
+
+static void
+lws_access_log_pt_destroy(struct lws_context_per_thread *pt)
+{
+	struct lws_access_log_blk *b;
+
+	while (pt->access_log_free) {
+		b = pt->access_log_free;
+		pt->access_log_free = b->next;
+		lws_free(b);
+	}
+	pt->access_log_free_count = 0;
+}
+
+/*
+ * copy header h into dest, truncated to len if necessary, with any '"'
+ * turned into '\'' so it can't break the log line structure
+ */
+
+static char *
+lws_access_log_hdr(struct lws *wsi, char *dest, int len,
+		   enum lws_token_indexes h)
+{
+	const char *p;
+	int l = lws_hdr_total_length(wsi, h), m;
+
+	if (!l)
+		return NULL;
+
+	if (l < len) {
+		if (lws_hdr_copy(wsi, dest, len, h) < 0)
+			return NULL;
+	} else {
+		p = lws_hdr_simple_ptr(wsi, h);
+		if (!p)
+			return NULL;
+		m = lws_hdr_fragment_length(wsi, h, 0);
+		if (m > len - 1)
+			m = len - 1;
+		memcpy(dest, p, m);
+		dest[m] = '\0';
+	}
+
+	for (m = 0; dest[m]; m++)
+		if (dest[m] == '\"')
+			dest[m] = '\'';
+
+	return dest;
+}
+
 void
 lws_prepare_access_log_info(struct lws *wsi, char *uri_ptr, int meth)
 {
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
 #ifdef LWS_WITH_IPV6
 	char ads[INET6_ADDRSTRLEN];
 #else
 	char ads[INET_ADDRSTRLEN];
 #endif
-	char da[64];
+	char da[64], *blk;
 	const char *pa, *me;
 	struct tm *tmp;
 	time_t t = time(NULL);
-	int l = 256, m;
 
 	if (wsi->access_log_pending)
 		lws_access_log(wsi);
 
-	wsi->access_log.header_log = lws_malloc(l, "access log");
-	if (wsi->access_log.header_log) {
+	blk = lws_access_log_blk_get(pt);
+	if (!blk)
+		return;
 
-		tmp = localtime(&t);
-		if (tmp)
-			strftime(da, sizeof(da), "%d/%b/%Y:%H:%M:%S %z", tmp);
-		else
-			strcpy(da, "01/Jan/1970:00:00:00 +0000");
+	tmp = localtime(&t);
+	if (tmp)
+		strftime(da, sizeof(da), "%d/%b/%Y:%H:%M:%S %z", tmp);
+	else
+		strcpy(da, "01/Jan/1970:00:00:00 +0000");
 
-		pa = lws_get_peer_simple(wsi, ads, sizeof(ads));
-		if (!pa)
-			pa = "(unknown)";
+	pa = lws_get_peer_simple(wsi, ads, sizeof(ads));
+	if (!pa)
+		pa = "(unknown)";
 
-		if (wsi->http2_substream)
-			me = lws_hdr_simple_ptr(wsi, WSI_TOKEN_HTTP_COLON_METHOD);
-		else
-			me = method_names[meth];
-		if (!me)
-			me = "(null)";
-
-		lws_snprintf(wsi->access_log.header_log, l,
-			 "%s - - [%s] \"%s %s %s\"",
-			 pa, da, me, uri_ptr,
-			 hver[wsi->u.http.request_version]);
-
-		l = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_USER_AGENT);
-		if (l) {
-			wsi->access_log.user_agent = lws_malloc(l + 2, "access log");
-			if (!wsi->access_log.user_agent) {
-				lwsl_err("OOM getting user agent\n");
-				lws_free_set_NULL(wsi->access_log.header_log);
-				return;
-			}
+	if (wsi->http2_substream)
+		me = lws_hdr_simple_ptr(wsi, WSI_TOKEN_HTTP_COLON_METHOD);
+	else
+		me = method_names[meth];
+	if (!me)
+		me = "(null)";
 
-			lws_hdr_copy(wsi, wsi->access_log.user_agent,
-					l + 1, WSI_TOKEN_HTTP_USER_AGENT);
+	wsi->access_log.header_log = blk;
+	lws_snprintf(blk, LWS_AL_HEADER_LEN, "%s - - [%s] \"%s %s %s\"",
+		     pa, da, me, uri_ptr, hver[wsi->u.http.request_version]);
 
-			for (m = 0; m < l; m++)
-				if (wsi->access_log.user_agent[m] == '\"')
-					wsi->access_log.user_agent[m] = '\'';
-		}
-		l = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_REFERER);
-		if (l) {
-			wsi->access_log.referrer = lws_malloc(l + 2, "referrer");
-			if (!wsi->access_log.referrer) {
-				lwsl_err("OOM getting user agent\n");
-				lws_free_set_NULL(wsi->access_log.user_agent);
-				lws_free_set_NULL(wsi->access_log.header_log);
-				return;
-			}
-			lws_hdr_copy(wsi, wsi->access_log.referrer,
-					l + 1, WSI_TOKEN_HTTP_REFERER);
+	wsi->access_log.referrer = lws_access_log_hdr(wsi,
+				blk + LWS_AL_REFERRER, LWS_AL_REGION_LEN,
+				WSI_TOKEN_HTTP_REFERER);
+	wsi->access_log.user_agent = lws_access_log_hdr(wsi,
+				blk + LWS_AL_UA, LWS_AL_REGION_LEN,
+				WSI_TOKEN_HTTP_USER_AGENT);
 
-			for (m = 0; m < l; m++)
-				if (wsi->access_log.referrer[m] == '\"')
-					wsi->access_log.referrer[m] = '\'';
-		}
-		wsi->access_log_pending = 1;
+	wsi->access_log_pending = 1;
+}
+
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+
+static void
+lws_access_log_ring_in(struct lws_access_log_ring *r, uint32_t pos,
+		       const void *src, int len)
+{
+	uint32_t o = pos & (LWS_ACCESS_LOG_RING_SIZE - 1);
+	int n = LWS_ACCESS_LOG_RING_SIZE - o;
+
+	if (n > len)
+		n = len;
+	memcpy(r->buf + o, src, n);
+	if (n < len)
+		memcpy(r->buf, (const char *)src + n, len - n);
+}
+
+static void
+lws_access_log_ring_out(struct lws_access_log_ring *r, uint32_t pos,
+			void *dest, int len)
+{
+	uint32_t o = pos & (LWS_ACCESS_LOG_RING_SIZE - 1);
+	int n = LWS_ACCESS_LOG_RING_SIZE - o;
+
+	if (n > len)
+		n = len;
+	memcpy(dest, r->buf + o, n);
+	if (n < len)
+		memcpy((char *)dest + n, r->buf, len - n);
+}
+
+/*
+ * Called on the pt service thread: never blocks, if the writer has fallen
+ * behind so far the ring is full, the line is counted and dropped.
+ */
+
+static void
+lws_access_log_queue(struct lws_context *context,
+		     struct lws_context_per_thread *pt, int fd,
+		     const char *line, int len)
+{
+	struct lws_access_log_ring *r = &pt->access_log_ring;
+	uint32_t head = r->head, used;
+	uint16_t l16 = len;
+	int need = sizeof(fd) + sizeof(l16) + len;
+
+	used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (used + need > LWS_ACCESS_LOG_RING_SIZE) {
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		lws_stats_atomic_bump(context, pt,
+				      LWSSTATS_C_ACCESS_LOG_DROPPED, 1);
+		return;
 	}
+
+	lws_access_log_ring_in(r, head, &fd, sizeof(fd));
+	lws_access_log_ring_in(r, head + sizeof(fd), &l16, sizeof(l16));
+	lws_access_log_ring_in(r, head + sizeof(fd) + sizeof(l16), line, len);
+	__atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+
+	/* otherwise the writer will find it on its next timed pass */
+	if (used < LWS_ACCESS_LOG_RING_SIZE / 2 &&
+	    used + need >= LWS_ACCESS_LOG_RING_SIZE / 2)
+		pthread_cond_signal(&context->access_log_cond);
 }
+#endif
 
+static void
+lws_access_log_write(int fd, const char *p, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			lwsl_err("Failed to write log\n");
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
 
 int
 lws_access_log(struct lws *wsi)
@@ -148,25 +297,295 @@ lws_access_log(struct lws *wsi)
 	l += lws_snprintf(ass + l, sizeof(ass) - 1 - l, "\" \"%s\"\n", p);
 
 	if (wsi->vhost->log_fd != (int)LWS_INVALID_FILE) {
-		if (write(wsi->vhost->log_fd, ass, l) != l)
-			lwsl_err("Failed to write log\n");
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+		if (wsi->context->access_log_thread_running)
+			lws_access_log_queue(wsi->context,
+					     &wsi->context->pt[(int)wsi->tsi],
+					     wsi->vhost->log_fd, ass, l);
+		else
+#endif
+			lws_access_log_write(wsi->vhost->log_fd, ass, l);
 	} else
 		lwsl_err("%s", ass);
 
-	if (wsi->access_log.header_log) {
-		lws_free(wsi->access_log.header_log);
-		wsi->access_log.header_log = NULL;
+	lws_access_log_blk_put(&wsi->context->pt[(int)wsi->tsi],
+			       wsi->access_log.header_log);
+	wsi->access_log.header_log = NULL;
+	wsi->access_log.user_agent = NULL;
+	wsi->access_log.referrer = NULL;
+	wsi->access_log_pending = 0;
+
+	return 0;
+}
+
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+
+/*
+ * Move everything queued on every pt into as few writes as possible.  Only
+ * one thread may drain at a time, the caller holds context->access_log_lock.
+ */
+
+static void
+lws_access_log_drain(struct lws_context *context)
+{
+	char *batch = context->access_log_batch;
+	struct lws_access_log_ring *r;
+	uint32_t head, tail, dropped = 0;
+	int n, fd, bfd = -1, blen = 0;
+	uint16_t l16;
+
+	for (n = 0; n < context->count_threads; n++) {
+		r = &context->pt[n].access_log_ring;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		tail = r->tail;
+
+		while (tail != head) {
+			lws_access_log_ring_out(r, tail, &fd, sizeof(fd));
+			lws_access_log_ring_out(r, tail + sizeof(fd), &l16,
+						sizeof(l16));
+			if (fd != bfd || blen + l16 > LWS_ACCESS_LOG_BATCH) {
+				if (blen)
+					lws_access_log_write(bfd, batch, blen);
+				bfd = fd;
+				blen = 0;
+			}
+			lws_access_log_ring_out(r, tail + sizeof(fd) +
+						sizeof(l16), batch + blen, l16);
+			blen += l16;
+			tail += sizeof(fd) + sizeof(l16) + l16;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		dropped += __atomic_exchange_n(&r->dropped, 0,
+					       __ATOMIC_RELAXED);
+	}
+
+	if (blen)
+		lws_access_log_write(bfd, batch, blen);
+
+	if (dropped) {
+		context->access_log_dropped += dropped;
+		lwsl_warn("access log: dropped %u lines (%llu total), "
+			  "log writes are not keeping up\n", dropped,
+			  (unsigned long long)context->access_log_dropped);
 	}
-	if (wsi->access_log.user_agent) {
-		lws_free(wsi->access_log.user_agent);
-		wsi->access_log.user_agent = NULL;
+}
+
+static void *
+lws_access_log_thread(void *d)
+{
+	struct lws_context *context = (struct lws_context *)d;
+	struct timespec ts;
+
+	pthread_mutex_lock(&context->access_log_lock);
+	while (!context->access_log_thread_exit) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LWS_ACCESS_LOG_FLUSH_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&context->access_log_cond,
+				       &context->access_log_lock, &ts);
+		lws_access_log_drain(context);
 	}
-	if (wsi->access_log.referrer) {
-		lws_free(wsi->access_log.referrer);
-		wsi->access_log.referrer = NULL;
+	lws_access_log_drain(context);
+	pthread_mutex_unlock(&context->access_log_lock);
+
+	return NULL;
+}
+
+static void
+lws_access_log_rings_free(struct lws_context *context)
+{
+	int n;
+
+	for (n = 0; n < context->count_threads; n++)
+		lws_free_set_NULL(context->pt[n].access_log_ring.buf);
+	lws_free_set_NULL(context->access_log_batch);
+}
+
+/*
+ * Start the writer the first time a vhost opens a log.  If we can't, lines
+ * are just written synchronously as they would be without the option.
+ */
+
+static void
+lws_access_log_thread_start(struct lws_context *context)
+{
+	struct lws_access_log_ring *r;
+	int n;
+
+	context->access_log_batch = lws_malloc(LWS_ACCESS_LOG_BATCH,
+					       "access log batch");
+	if (!context->access_log_batch)
+		goto bail;
+
+	for (n = 0; n < context->count_threads; n++) {
+		r = &context->pt[n].access_log_ring;
+		r->buf = lws_malloc(LWS_ACCESS_LOG_RING_SIZE,
+				    "access log ring");
+		if (!r->buf)
+			goto bail;
+		r->head = r->tail = r->dropped = 0;
 	}
-	wsi->access_log_pending = 0;
+
+	pthread_mutex_init(&context->access_log_lock, NULL);
+	pthread_cond_init(&context->access_log_cond, NULL);
+	context->access_log_thread_exit = 0;
+
+	if (pthread_create(&context->access_log_thread, NULL,
+			   lws_access_log_thread, context)) {
+		pthread_cond_destroy(&context->access_log_cond);
+		pthread_mutex_destroy(&context->access_log_lock);
+		goto bail;
+	}
+	context->access_log_thread_running = 1;
+
+	return;
+
+bail:
+	lwsl_err("%s: unable to start log writer, writing synchronously\n",
+		 __func__);
+	lws_access_log_rings_free(context);
+}
+#endif
+
+static int
+lws_access_log_open(struct lws_context *context, const char *filepath)
+{
+	int fd = open(filepath, O_CREAT | O_APPEND | O_RDWR, 0600);
+
+	if (fd == (int)LWS_INVALID_FILE) {
+		lwsl_err("unable to open log filepath %s\n", filepath);
+		return fd;
+	}
+#ifndef WIN32
+	if (context->uid != -1)
+		if (chown(filepath, context->uid, context->gid) == -1)
+			lwsl_err("unable to chown log file %s\n", filepath);
+#endif
+
+	return fd;
+}
+
+int
+lws_access_log_vhost_init(struct lws_vhost *vh, const char *filepath)
+{
+	vh->log_fd = lws_access_log_open(vh->context, filepath);
+	if (vh->log_fd == (int)LWS_INVALID_FILE)
+		return 1;
+
+	/* if we can't keep the path, we just won't be able to reopen it */
+	vh->log_filepath = lws_malloc(strlen(filepath) + 1, "log path");
+	if (vh->log_filepath)
+		strcpy(vh->log_filepath, filepath);
+
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+	if (!vh->context->access_log_thread_running)
+		lws_access_log_thread_start(vh->context);
+#endif
 
 	return 0;
 }
 
+void
+lws_access_log_vhost_destroy(struct lws_vhost *vh)
+{
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+	struct lws_context *context = vh->context;
+#endif
+
+	if (vh->log_fd != (int)LWS_INVALID_FILE) {
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+		/* lines queued for this fd must be written before it closes */
+		if (context->access_log_thread_running) {
+			pthread_mutex_lock(&context->access_log_lock);
+			lws_access_log_drain(context);
+			pthread_mutex_unlock(&context->access_log_lock);
+		}
+#endif
+		close(vh->log_fd);
+		vh->log_fd = (int)LWS_INVALID_FILE;
+	}
+	lws_free_set_NULL(vh->log_filepath);
+}
+
+void
+lws_access_log_context_destroy(struct lws_context *context)
+{
+#if defined(LWS_WITH_ACCESS_LOG_ASYNC)
+	if (!context->access_log_thread_running)
+		return;
+
+	/* the writer drains everything that is left before it exits */
+	pthread_mutex_lock(&context->access_log_lock);
+	context->access_log_thread_exit = 1;
+	pthread_cond_signal(&context->access_log_cond);
+	pthread_mutex_unlock(&context->access_log_lock);
+	pthread_join(context->access_log_thread, NULL);
+
+	context->access_log_thread_running = 0;
+	pthread_cond_destroy(&context->access_log_cond);
+	pthread_mutex_destroy(&context->access_log_lock);
+	lws_access_log_rings_free(context);
+
+	if (context->access_log_dropped)
+		lwsl_notice("access log: %llu lines were dropped\n",
+			    (unsigned long long)context->access_log_dropped);
+#endif
+}
+
+/* once the vhosts are gone, nothing can give us back another block */
+
+void
+lws_access_log_context_destroy2(struct lws_context *context)
+{
+	int n;
+
+	for (n = 0; n < context->count_threads; n++)
+		lws_access_log_pt_destroy(&context->pt[n]);
+}
+
+/*
+ * From the once-per-second service housekeeping: if a reopen was asked for,
+ * open each vhost's log path again and dup2() it over the old fd.  Anything
+ * writing to the fd, including the async writer, carries on uninterrupted
+ * but now into the new file.
+ */
+
+void
+lws_access_log_periodic(struct lws_context *context)
+{
+	struct lws_vhost *vh;
+	int fd;
+
+	/*
+	 * A signal arriving between these two is still served, by the
+	 * reopen below
+	 */
+	if (!context->access_log_reopen)
+		return;
+	context->access_log_reopen = 0;
+
+	for (vh = context->vhost_list; vh; vh = vh->vhost_next) {
+		if (vh->log_fd == (int)LWS_INVALID_FILE || !vh->log_filepath)
+			continue;
+
+		fd = lws_access_log_open(context, vh->log_filepath);
+		if (fd == (int)LWS_INVALID_FILE)
+			continue;
+		if (dup2(fd, vh->log_fd) < 0)
+			lwsl_err("unable to reopen log file %s\n",
+				 vh->log_filepath);
+		else
+			lwsl_notice("reopened access log %s\n",
+				    vh->log_filepath);
+		close(fd);
+	}
+}
+
+LWS_VISIBLE void
+lws_access_log_reopen(struct lws_context *context)
+{
+	context->access_log_reopen = 1;
+}
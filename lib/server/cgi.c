@@ -820,26 +820,19 @@ agin:
 	n = lws_get_socket_fd(wsi->cgi->stdwsi[LWS_STDOUT]);
 	if (n < 0)
 		return -1;
-	n = read(n, start, sizeof(buf) - LWS_PRE -
-			   (m ? LWS_HTTP_CHUNK_HDR_SIZE : 0));
+	n = read(n, start, sizeof(buf) - LWS_PRE);
 
 	if (n < 0 && errno != EAGAIN) {
 		lwsl_debug("%s: stdout read says %d\n", __func__, n);
 		return -1;
 	}
 	if (n > 0) {
-		if (!wsi->http2_substream && m) {
-			char chdr[LWS_HTTP_CHUNK_HDR_SIZE];
-			m = lws_snprintf(chdr, LWS_HTTP_CHUNK_HDR_SIZE - 3,
-					 "%X\x0d\x0a", n);
-			memmove(start + m, start, n);
-			memcpy(start, chdr, m);
-			memcpy(start + m + n, "\x0d\x0a", 2);
-			n += m + 2;
-		}
 		cmd = LWS_WRITE_HTTP;
 		if (wsi->cgi->content_length_seen + n == wsi->cgi->content_length)
 			cmd = LWS_WRITE_HTTP_FINAL;
+		/* lws sends the chunk framing in the same gather as the data */
+		if (!wsi->http2_substream && m)
+			cmd |= LWS_WRITE_HTTP_CHUNK;
 		m = lws_write(wsi, (unsigned char *)start, n, cmd);
 		//lwsl_notice("write %d\n", m);
 		if (m < 0) {
@@ -0,0 +1,1429 @@
+/*
+ * libwebsockets - FastCGI mounts with persistent worker pools
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+#include "private-libwebsockets.h"
+
+/*
+ * Each fastcgi:// mount gets a pool of workers when the vhost is created:
+ * the origin, then any in the mount's upstreams list.  The workers are
+ * already running, listening on a unix socket or tcp port, lws doesn't
+ * start them.
+ *
+ * Connections to the workers are RAW wsi in the event loop of the pt that
+ * opened them, and stay open after the request so the next one on that pt
+ * can use them.  A connection carries up to mpxs requests at once, each in
+ * its own slot, with the slot index + 1 as its FastCGI request id.  When
+ * there's no free slot and no more connections may be opened, requests wait
+ * in a per-pt list for the next slot to free up.
+ *
+ * The request wsi owns a struct lws_fcgi_req; the worker's FCGI_STDOUT is
+ * buffered there until the client can take it, and the connection stops
+ * reading while any request on it has more than LWS_FCGI_OUT_MAX waiting.
+ * The request body goes on as FCGI_STDIN as it arrives, with the client's
+ * rx stopped until the connection sent it.
+ */
+
+#define FCGI_VERSION_1		1
+
+#define FCGI_BEGIN_REQUEST	1
+#define FCGI_ABORT_REQUEST	2
+#define FCGI_END_REQUEST	3
+#define FCGI_PARAMS		4
+#define FCGI_STDIN		5
+#define FCGI_STDOUT		6
+#define FCGI_STDERR		7
+
+#define FCGI_RESPONDER		1
+#define FCGI_KEEP_CONN		1
+
+/* largest record content we send, a multiple of 8 under 64K */
+#define LWS_FCGI_REC_MAX	0xfff8
+#define LWS_FCGI_TX_CHUNK	4096
+#define LWS_FCGI_CHUNK		4096
+#define LWS_FCGI_HDRS_MAX	4096
+#ifndef LWS_FCGI_OUT_MAX
+#define LWS_FCGI_OUT_MAX	65536
+#endif
+/* request body queued for the worker before we give up on the client */
+#ifndef LWS_FCGI_BODY_MAX
+#define LWS_FCGI_BODY_MAX	(256 * 1024)
+#endif
+
+#define lws_fcgi_def(v, d) ((v) ? (v) : (d))
+
+/* sits in the slot of a request whose client went, until the worker ends it */
+static struct lws_fcgi_req lws_fcgi_aborted;
+
+#define lws_fcgi_live(r) ((r) && (r) != &lws_fcgi_aborted)
+
+static unsigned char *
+lws_fcgi_buf_reserve(struct lws_fcgi_buf *b, size_t len)
+{
+	unsigned char *p;
+	size_t n;
+
+	if (b->len + len > b->alloc) {
+		n = b->alloc * 2;
+		if (n < b->len + len)
+			n = b->len + len;
+		if (n < 256)
+			n = 256;
+		p = lws_realloc(b->p, n, "fcgi buf");
+		if (!p)
+			return NULL;
+		b->p = p;
+		b->alloc = n;
+	}
+
+	return b->p + b->len;
+}
+
+static int
+lws_fcgi_buf_append(struct lws_fcgi_buf *b, const void *p, size_t len)
+{
+	unsigned char *q;
+
+	if (!len)
+		return 0;
+
+	q = lws_fcgi_buf_reserve(b, len);
+	if (!q)
+		return 1;
+	memcpy(q, p, len);
+	b->len += len;
+
+	return 0;
+}
+
+/* drop what was used from the front, once it's most of the buffer */
+
+static void
+lws_fcgi_buf_consumed(struct lws_fcgi_buf *b, size_t *pos)
+{
+	if (*pos == b->len) {
+		*pos = 0;
+		b->len = 0;
+		return;
+	}
+
+	if (*pos < b->alloc / 2)
+		return;
+
+	memmove(b->p, b->p + *pos, b->len - *pos);
+	b->len -= *pos;
+	*pos = 0;
+}
+
+static void
+lws_fcgi_buf_free(struct lws_fcgi_buf *b)
+{
+	lws_free_set_NULL(b->p);
+	b->len = 0;
+	b->alloc = 0;
+}
+
+/*
+ * Name-value pairs have 1-byte lengths under 128, otherwise 4 bytes with
+ * the top bit set.  Returns where the value goes, there is room for it and
+ * a '\0' after.
+ */
+
+static unsigned char *
+lws_fcgi_param_start(struct lws_fcgi_buf *b, const char *name, int nlen,
+		     int vlen)
+{
+	unsigned char *p = lws_fcgi_buf_reserve(b, 8 + nlen + vlen + 1), *q;
+	int n, len[2] = { nlen, vlen };
+
+	if (!p)
+		return NULL;
+
+	q = p;
+	for (n = 0; n < 2; n++)
+		if (len[n] < 128)
+			*q++ = len[n];
+		else {
+			*q++ = 0x80 | (len[n] >> 24);
+			*q++ = len[n] >> 16;
+			*q++ = len[n] >> 8;
+			*q++ = len[n];
+		}
+	memcpy(q, name, nlen);
+	q += nlen;
+	b->len += q - p;
+
+	return q;
+}
+
+static int
+lws_fcgi_param(struct lws_fcgi_buf *b, const char *name, const char *value,
+	       int vlen)
+{
+	unsigned char *p;
+
+	if (vlen < 0)
+		vlen = strlen(value);
+
+	p = lws_fcgi_param_start(b, name, strlen(name), vlen);
+	if (!p)
+		return 1;
+	memcpy(p, value, vlen);
+	b->len += vlen;
+
+	return 0;
+}
+
+static int
+lws_fcgi_params(struct lws *wsi, struct lws_fcgi_req *req,
+		const struct lws_http_mount *hit, const char *uri_ptr)
+{
+	static const char * const protos[] = {
+		"HTTP/1.0", "HTTP/1.1", "HTTP/2"
+	};
+	const struct lws_protocol_vhost_options *pvo = hit->cgienv;
+	struct lws_fcgi_buf *b = &req->params;
+	char qs[1024], tok[512], name[64], *q = qs, *e = qs + sizeof(qs) - 1;
+	const char *s;
+	unsigned char *p;
+	int n, m, len, ml = hit->mountpoint_len;
+
+	/* the query string is in decoded fragments, put it back together */
+	for (m = 0; lws_hdr_copy_fragment(wsi, tok, sizeof(tok),
+					  WSI_TOKEN_HTTP_URI_ARGS, m) >= 0; m++) {
+		s = strchr(tok, '=');
+		if (s)
+			tok[s++ - tok] = '\0';
+		if (m && q < e)
+			*q++ = '&';
+		lws_urlencode(q, tok, e - q + 1);
+		q += strlen(q);
+		if (s && q < e) {
+			*q++ = '=';
+			lws_urlencode(q, s, e - q + 1);
+			q += strlen(q);
+		}
+	}
+	*q = '\0';
+
+	/* the script is the mountpoint, the rest of the path goes to it */
+	if (ml && hit->mountpoint[ml - 1] == '/')
+		ml--;
+
+	if (lws_fcgi_param(b, "GATEWAY_INTERFACE", "CGI/1.1", -1) ||
+	    lws_fcgi_param(b, "SERVER_SOFTWARE", "libwebsockets", -1) ||
+	    lws_fcgi_param(b, "SERVER_PROTOCOL",
+			   protos[wsi->u.http.request_version % 3], -1) ||
+	    lws_fcgi_param(b, "SERVER_NAME", wsi->vhost->name, -1) ||
+	    lws_fcgi_param(b, "REQUEST_METHOD", req->method, -1) ||
+	    lws_fcgi_param(b, "SCRIPT_NAME", hit->mountpoint, ml) ||
+	    lws_fcgi_param(b, "PATH_INFO", uri_ptr + ml, -1) ||
+	    lws_fcgi_param(b, "QUERY_STRING", qs, q - qs))
+		return 1;
+
+	len = strlen(uri_ptr);
+	p = lws_fcgi_param_start(b, "REQUEST_URI", 11,
+				 len + (q != qs) + (q - qs));
+	if (!p)
+		return 1;
+	memcpy(p, uri_ptr, len);
+	if (q != qs) {
+		p[len++] = '?';
+		memcpy(p + len, qs, q - qs);
+		len += q - qs;
+	}
+	b->len += len;
+
+	lws_snprintf(tok, sizeof(tok), "%d", wsi->vhost->listen_port);
+	if (lws_fcgi_param(b, "SERVER_PORT", tok, -1))
+		return 1;
+
+	if (lws_get_peer_simple(wsi, tok, sizeof(tok)) &&
+	    lws_fcgi_param(b, "REMOTE_ADDR", tok, -1))
+		return 1;
+
+	if (lws_is_ssl(lws_get_network_wsi(wsi)) &&
+	    lws_fcgi_param(b, "HTTPS", "on", -1))
+		return 1;
+
+	if (req->body_length) {
+		lws_snprintf(tok, sizeof(tok), "%llu",
+			     (unsigned long long)req->body_length);
+		if (lws_fcgi_param(b, "CONTENT_LENGTH", tok, -1))
+			return 1;
+	}
+
+	/* the request headers go as HTTP_..., content-type as CONTENT_TYPE */
+	for (n = 0; n < WSI_TOKEN_COUNT; n++) {
+		s = (const char *)lws_token_to_string(n);
+		if (!s || s[0] == ':' || n == WSI_TOKEN_HTTP_CONTENT_LENGTH)
+			continue;
+		len = strlen(s);
+		if (!len || s[len - 1] != ':' || len + 4 > (int)sizeof(name))
+			continue;
+		m = lws_hdr_total_length(wsi, n);
+		if (m <= 0)
+			continue;
+
+		if (n == WSI_TOKEN_HTTP_CONTENT_TYPE)
+			strcpy(name, "CONTENT_TYPE");
+		else {
+			strcpy(name, "HTTP_");
+			for (len = 0; s[len + 1]; len++)
+				name[5 + len] = s[len] == '-' ? '_' :
+						toupper((int)s[len]);
+			name[5 + len] = '\0';
+		}
+
+		p = lws_fcgi_param_start(b, name, strlen(name), m);
+		if (!p || lws_hdr_copy(wsi, (char *)p, m + 1, n) < 0)
+			return 1;
+		b->len += m;
+	}
+
+	/* then anything the mount adds, like SCRIPT_FILENAME */
+	while (pvo) {
+		if (lws_fcgi_param(b, pvo->name, pvo->value, -1))
+			return 1;
+		pvo = pvo->next;
+	}
+
+	return 0;
+}
+
+/* queue records of one type for the worker, splitting long content */
+
+static int
+lws_fcgi_record(struct lws_fcgi_conn *c, int type, int id,
+		const unsigned char *p, size_t len)
+{
+	static const unsigned char zeros[8];
+	unsigned char h[8];
+	size_t n;
+
+	do {
+		n = len > LWS_FCGI_REC_MAX ? LWS_FCGI_REC_MAX : len;
+
+		h[0] = FCGI_VERSION_1;
+		h[1] = type;
+		h[2] = id >> 8;
+		h[3] = id & 0xff;
+		h[4] = n >> 8;
+		h[5] = n & 0xff;
+		h[6] = (8 - (n & 7)) & 7; /* keep records 8-byte aligned */
+		h[7] = 0;
+
+		if (lws_fcgi_buf_append(&c->tx, h, sizeof(h)) ||
+		    lws_fcgi_buf_append(&c->tx, p, n) ||
+		    lws_fcgi_buf_append(&c->tx, zeros, h[6]))
+			return 1;
+
+		p += n;
+		len -= n;
+	} while (len);
+
+	lws_callback_on_writable(c->wsi);
+
+	return 0;
+}
+
+/* pass on the body we have, ending FCGI_STDIN when it's all here */
+
+static int
+lws_fcgi_stdin(struct lws_fcgi_conn *c, struct lws_fcgi_req *req)
+{
+	if (req->body.len) {
+		if (lws_fcgi_record(c, FCGI_STDIN, req->id, req->body.p,
+				    req->body.len))
+			return 1;
+		req->body.len = 0;
+	}
+
+	if (req->stdin_done || req->body_in != req->body_length)
+		return 0;
+
+	req->stdin_done = 1;
+
+	return lws_fcgi_record(c, FCGI_STDIN, req->id, NULL, 0);
+}
+
+static int
+lws_fcgi_begin(struct lws_fcgi_conn *c, struct lws_fcgi_req *req)
+{
+	unsigned char b[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN };
+
+	lwsl_debug("%s: %s: req %p id %d\n", __func__, c->w->name, req,
+		   req->id);
+
+	req->begun = 1;
+
+	if (lws_fcgi_record(c, FCGI_BEGIN_REQUEST, req->id, b, sizeof(b)) ||
+	    lws_fcgi_record(c, FCGI_PARAMS, req->id, req->params.p,
+			    req->params.len) ||
+	    lws_fcgi_record(c, FCGI_PARAMS, req->id, NULL, 0))
+		return 1;
+
+	return lws_fcgi_stdin(c, req);
+}
+
+static void
+lws_fcgi_worker_down(struct lws_fcgi_worker *w)
+{
+	const struct lws_http_mount *m = w->pool->mount;
+
+	lwsl_notice("%s: fastcgi worker %s down\n", __func__, w->name);
+	w->down_until = time(NULL) + lws_fcgi_def(m->fail_timeout, 10);
+}
+
+static int
+lws_fcgi_conn_attach(struct lws_fcgi_conn *c, struct lws_fcgi_req *req)
+{
+	int n;
+
+	for (n = 0; n < req->pool->mpxs; n++)
+		if (!c->req[n])
+			break;
+
+	c->req[n] = req;
+	c->active++;
+	req->conn = c;
+	req->id = n + 1;
+	req->begun = 0;
+	req->stdin_done = 0;
+
+	/* it begins when the connect completes */
+	if (!c->connected)
+		return 0;
+
+	/* no longer idle... unless it must still see aborted ones end */
+	if (!c->aborted)
+		lws_set_timeout(c->wsi, NO_PENDING_TIMEOUT, 0);
+
+	return lws_fcgi_begin(c, req);
+}
+
+static struct lws_fcgi_conn *
+lws_fcgi_conn_create(struct lws_fcgi_worker *w, struct lws_fcgi_req *req)
+{
+	struct lws_fcgi_pool *pool = w->pool;
+	struct lws_vhost *vh = pool->vhost;
+	struct lws_context *context = vh->context;
+	int tsi = req->wsi->tsi;
+	struct lws_fcgi_conn *c;
+	lws_sockfd_type fd;
+	struct lws *wsi;
+
+	if ((unsigned int)context->pt[tsi].fds_count >=
+	    context->fd_limit_per_thread - 1) {
+		lwsl_err("%s: no space for new conn\n", __func__);
+		return NULL;
+	}
+
+	fd = socket(w->sa.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		lwsl_err("%s: unable to create socket\n", __func__);
+		return NULL;
+	}
+
+	if ((w->sa.ss_family == AF_UNIX ? fcntl(fd, F_SETFL, O_NONBLOCK) < 0 :
+					  lws_plat_set_socket_options(vh, fd)) ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+		goto bail;
+
+	if (connect(fd, (struct sockaddr *)&w->sa, w->salen) < 0 &&
+	    LWS_ERRNO != LWS_EINPROGRESS) {
+		lwsl_info("%s: %s: connect: errno %d\n", __func__, w->name,
+			  LWS_ERRNO);
+		/* a unix socket with a full backlog is busy, not down */
+		if (LWS_ERRNO != LWS_EAGAIN)
+			lws_fcgi_worker_down(w);
+		goto bail;
+	}
+
+	c = lws_zalloc(sizeof(*c) + pool->mpxs * sizeof(c->req[0]),
+		       "fcgi conn");
+	if (!c)
+		goto bail;
+	c->req = (struct lws_fcgi_req **)(c + 1);
+	c->w = w;
+
+	/*
+	 * We can't adopt it: that picks the pt by load, and wants a peer
+	 * address it can't have until the connect completes
+	 */
+	wsi = lws_zalloc(sizeof(*wsi), "fcgi wsi");
+	if (!wsi)
+		goto bail1;
+
+	wsi->tsi = tsi;
+	wsi->context = context;
+	wsi->vhost = vh;
+	wsi->pending_timeout = NO_PENDING_TIMEOUT;
+	wsi->rxflow_change_to = LWS_RXFLOW_ALLOW;
+	wsi->position_in_fds_table = -1;
+	/* the one serving the mount, which brings RAW cbs back to us */
+	wsi->protocol = req->wsi->protocol;
+	wsi->state = LWSS_HTTP;
+	wsi->mode = LWSCM_RAW;
+	wsi->desc.sockfd = fd;
+	context->count_wsi_allocated++;
+
+	if (lws_ensure_user_space(wsi))
+		goto bail2;
+
+	lws_libev_accept(wsi, wsi->desc);
+	lws_libuv_accept(wsi, wsi->desc);
+	lws_libevent_accept(wsi, wsi->desc);
+
+	if (insert_wsi_socket_into_fds(context, wsi)) {
+		lwsl_err("%s: fail inserting socket\n", __func__);
+		goto bail2;
+	}
+
+	c->wsi = wsi;
+	wsi->fcgi_conn = c;
+	c->next = w->conns[tsi];
+	w->conns[tsi] = c;
+	w->count_conns[tsi]++;
+
+	lwsl_info("%s: %s: new conn %p\n", __func__, w->name, c);
+
+	/* writeable when the connect completes */
+	lws_set_timeout(wsi, PENDING_TIMEOUT_AWAITING_CONNECT_RESPONSE,
+			context->timeout_secs);
+	lws_callback_on_writable(wsi);
+
+	return c;
+
+bail2:
+	if (wsi->user_space)
+		lws_free(wsi->user_space);
+	lws_free(wsi);
+	context->count_wsi_allocated--;
+bail1:
+	lws_free(c);
+bail:
+	compatible_close(fd);
+
+	return NULL;
+}
+
+/*
+ * Find a connection with a free slot for the request, or open one, or else
+ * have it wait on the pt for a slot.  Workers that recently failed are only
+ * tried if every worker has.
+ */
+
+static int
+lws_fcgi_attach(struct lws_fcgi_req *req)
+{
+	struct lws_fcgi_pool *pool = req->pool;
+	int tsi = req->wsi->tsi, n, k, down, busy = 0;
+	struct lws_fcgi_req **pr;
+	struct lws_fcgi_worker *w;
+	struct lws_fcgi_conn *c;
+	time_t now = time(NULL);
+
+	for (down = 0; down < 2; down++) {
+		for (k = 0; k < pool->count_w; k++) {
+			w = &pool->w[(pool->rr[tsi] + k) % pool->count_w];
+			if (!down && w->down_until > now)
+				continue;
+			for (c = w->conns[tsi]; c; c = c->next)
+				if (!c->doomed && c->active < pool->mpxs) {
+					pool->rr[tsi]++;
+					return lws_fcgi_conn_attach(c, req);
+				}
+		}
+
+		for (k = 0; k < pool->count_w; k++) {
+			n = pool->rr[tsi]++ % pool->count_w;
+			w = &pool->w[n];
+			if (!down && w->down_until > now)
+				continue;
+			if (w->count_conns[tsi] >= pool->max_conns) {
+				busy = 1;
+				continue;
+			}
+			c = lws_fcgi_conn_create(w, req);
+			if (c)
+				return lws_fcgi_conn_attach(c, req);
+		}
+	}
+
+	if (!busy) {
+		lwsl_notice("%s: no fastcgi worker for %s\n", __func__,
+			    pool->mount->mountpoint);
+		req->failed = 1;
+		lws_callback_on_writable(req->wsi);
+
+		return 0;
+	}
+
+	/* every conn is full, wait for a slot */
+	pr = &pool->wait[tsi];
+	while (*pr)
+		pr = &(*pr)->wait_next;
+	*pr = req;
+
+	return 0;
+}
+
+/* a slot came free on c */
+
+static int
+lws_fcgi_conn_slot_free(struct lws_fcgi_conn *c)
+{
+	struct lws_fcgi_pool *pool = c->w->pool;
+	int tsi = c->wsi->tsi;
+	struct lws_fcgi_req *req = pool->wait[tsi];
+
+	if (req && !c->doomed) {
+		pool->wait[tsi] = req->wait_next;
+		req->wait_next = NULL;
+
+		return lws_fcgi_conn_attach(c, req);
+	}
+
+	if (!c->active && c->connected)
+		lws_set_timeout(c->wsi, PENDING_TIMEOUT_HTTP_KEEPALIVE_IDLE,
+				pool->vhost->keepalive_timeout);
+
+	return 0;
+}
+
+/* the client went before the request ended on the worker */
+
+static void
+lws_fcgi_abort(struct lws_fcgi_req *req)
+{
+	struct lws_fcgi_conn *c = req->conn;
+	int slot = req->id - 1;
+
+	req->conn = NULL;
+
+	if (!req->begun) {
+		c->req[slot] = NULL;
+		c->active--;
+		lws_fcgi_conn_slot_free(c);
+
+		return;
+	}
+
+	/*
+	 * The slot stays taken until the worker ends the request, anything
+	 * it sends for it is dropped.  If it does nothing else meanwhile,
+	 * don't wait forever for that.
+	 */
+	c->req[slot] = &lws_fcgi_aborted;
+	c->aborted++;
+	if (c->aborted == c->active)
+		lws_set_timeout(c->wsi, PENDING_TIMEOUT_CGI, req->pool->timeout);
+
+	if (lws_fcgi_record(c, FCGI_ABORT_REQUEST, req->id, NULL, 0)) {
+		c->doomed = 1;
+		lws_set_timeout(c->wsi, PENDING_TIMEOUT_CGI, LWS_TO_KILL_ASYNC);
+	}
+}
+
+static void
+lws_fcgi_req_destroy(struct lws *wsi)
+{
+	struct lws_fcgi_req *req = wsi->fcgi_req, **pr;
+	int tsi = wsi->tsi;
+
+	wsi->fcgi_req = NULL;
+
+	if (req->conn)
+		lws_fcgi_abort(req);
+
+	for (pr = &req->pool->wait[tsi]; *pr; pr = &(*pr)->wait_next)
+		if (*pr == req) {
+			*pr = req->wait_next;
+			break;
+		}
+
+	lws_fcgi_buf_free(&req->params);
+	lws_fcgi_buf_free(&req->body);
+	lws_fcgi_buf_free(&req->out);
+	lws_free(req);
+}
+
+/* stop reading the worker while any client on it has a backlog */
+
+static void
+lws_fcgi_conn_flow(struct lws_fcgi_conn *c)
+{
+	struct lws_fcgi_req *req;
+	int n, pause = 0;
+
+	for (n = 0; n < c->w->pool->mpxs; n++) {
+		req = c->req[n];
+		if (lws_fcgi_live(req) &&
+		    req->out.len - req->out_pos > LWS_FCGI_OUT_MAX)
+			pause = 1;
+	}
+
+	if (pause == c->paused)
+		return;
+
+	c->paused = pause;
+	lws_rx_flow_control(c->wsi, !pause);
+}
+
+static void
+lws_fcgi_end_request(struct lws_fcgi_conn *c, struct lws_fcgi_req *req)
+{
+	c->req[req->id - 1] = NULL;
+	c->active--;
+	c->served++;
+	req->conn = NULL;
+	req->ended = 1;
+
+	/* the worker refused it: overloaded, can't multiplex... */
+	if (c->end[4]) {
+		lwsl_notice("%s: %s: protocol status %d\n", __func__,
+			    c->w->name, c->end[4]);
+		if (!req->got_rx)
+			req->failed = 1;
+	}
+
+	lws_callback_on_writable(req->wsi);
+}
+
+static int
+lws_fcgi_record_done(struct lws_fcgi_conn *c)
+{
+	int id = (c->hdr[2] << 8) | c->hdr[3];
+	struct lws_fcgi_req *req;
+
+	if (c->hdr[1] != FCGI_END_REQUEST || !id ||
+	    id > c->w->pool->mpxs || !c->req[id - 1])
+		return 0;
+
+	req = c->req[id - 1];
+	if (req == &lws_fcgi_aborted) {
+		c->req[id - 1] = NULL;
+		c->active--;
+		c->aborted--;
+		if (!c->aborted)
+			lws_set_timeout(c->wsi, NO_PENDING_TIMEOUT, 0);
+	} else
+		lws_fcgi_end_request(c, req);
+
+	return lws_fcgi_conn_slot_free(c);
+}
+
+static void
+lws_fcgi_rx_content(struct lws_fcgi_conn *c, const unsigned char *p,
+		    size_t len)
+{
+	int id = (c->hdr[2] << 8) | c->hdr[3], n;
+	struct lws_fcgi_req *req = NULL;
+
+	if (id && id <= c->w->pool->mpxs && lws_fcgi_live(c->req[id - 1]))
+		req = c->req[id - 1];
+
+	switch (c->hdr[1]) {
+	case FCGI_STDOUT:
+		if (!req)
+			break;
+		if (lws_fcgi_buf_append(&req->out, p, len)) {
+			req->failed = 1;
+			lws_callback_on_writable(req->wsi);
+			break;
+		}
+		req->got_rx = 1;
+		lws_callback_on_writable(req->wsi);
+		break;
+
+	case FCGI_STDERR:
+		while (len && (p[len - 1] == '\n' || p[len - 1] == '\r'))
+			len--;
+		if (len)
+			lwsl_notice("FastCGI-stderr: %.*s\n", (int)len, p);
+		break;
+
+	case FCGI_END_REQUEST:
+		n = c->rec_len - c->content;
+		if (n + len > sizeof(c->end))
+			len = n < (int)sizeof(c->end) ? sizeof(c->end) - n : 0;
+		memcpy(c->end + n, p, len);
+		break;
+	}
+}
+
+static int
+lws_fcgi_conn_rx(struct lws_fcgi_conn *c, const unsigned char *in,
+		 size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (c->hdr_len < (int)sizeof(c->hdr)) {
+			n = sizeof(c->hdr) - c->hdr_len;
+			if (n > len)
+				n = len;
+			memcpy(c->hdr + c->hdr_len, in, n);
+			c->hdr_len += n;
+			in += n;
+			len -= n;
+			if (c->hdr_len < (int)sizeof(c->hdr))
+				break;
+
+			if (c->hdr[0] != FCGI_VERSION_1) {
+				lwsl_err("%s: %s: bad record\n", __func__,
+					 c->w->name);
+				return -1;
+			}
+			c->content = (c->hdr[4] << 8) | c->hdr[5];
+			c->rec_len = c->content;
+			c->padding = c->hdr[6];
+			memset(c->end, 0, sizeof(c->end));
+		} else if (c->content) {
+			n = c->content;
+			if (n > len)
+				n = len;
+			lws_fcgi_rx_content(c, in, n);
+			c->content -= n;
+			in += n;
+			len -= n;
+		} else {
+			n = c->padding;
+			if (n > len)
+				n = len;
+			c->padding -= n;
+			in += n;
+			len -= n;
+		}
+
+		if (!c->content && !c->padding) {
+			c->hdr_len = 0;
+			if (lws_fcgi_record_done(c))
+				return -1;
+		}
+	}
+
+	lws_fcgi_conn_flow(c);
+
+	return 0;
+}
+
+static int
+lws_fcgi_conn_writeable(struct lws_fcgi_conn *c)
+{
+	struct lws_fcgi_req *req;
+	socklen_t sl = sizeof(int);
+	int n, e = 0;
+	size_t m;
+
+	if (!c->connected) {
+		if (getsockopt(c->wsi->desc.sockfd, SOL_SOCKET, SO_ERROR,
+			       (char *)&e, &sl) || e) {
+			lwsl_info("%s: %s: connect failed: %d\n", __func__,
+				  c->w->name, e);
+			return -1;
+		}
+		c->connected = 1;
+		lws_set_timeout(c->wsi, NO_PENDING_TIMEOUT, 0);
+
+		for (n = 0; n < c->w->pool->mpxs; n++)
+			if (c->req[n] && lws_fcgi_begin(c, c->req[n]))
+				return -1;
+
+		/* they all went while we were connecting */
+		if (!c->active && lws_fcgi_conn_slot_free(c))
+			return -1;
+	}
+
+	if (c->tx_pos < c->tx.len) {
+		m = c->tx.len - c->tx_pos;
+		if (m > LWS_FCGI_TX_CHUNK)
+			m = LWS_FCGI_TX_CHUNK;
+		/* anything it can't send now it keeps and sends first */
+		if (lws_issue_raw(c->wsi, c->tx.p + c->tx_pos, m) < 0)
+			return -1;
+		c->tx_pos += m;
+		lws_fcgi_buf_consumed(&c->tx, &c->tx_pos);
+
+		if (c->tx_pos < c->tx.len) {
+			lws_callback_on_writable(c->wsi);
+			return 0;
+		}
+	}
+
+	/* the bodies that were waiting went, the clients can send more */
+	for (n = 0; n < c->w->pool->mpxs; n++) {
+		req = c->req[n];
+		if (lws_fcgi_live(req) && req->paused) {
+			req->paused = 0;
+			lws_rx_flow_control(req->wsi, 1);
+		}
+	}
+
+	return 0;
+}
+
+static void
+lws_fcgi_conn_destroy(struct lws_fcgi_conn *c)
+{
+	struct lws_fcgi_worker *w = c->w;
+	struct lws_fcgi_pool *pool = w->pool;
+	int tsi = c->wsi->tsi, n;
+	struct lws_fcgi_conn **pc;
+	struct lws_fcgi_req *req;
+
+	lwsl_info("%s: %s: conn %p closing, served %d\n", __func__, w->name,
+		  c, c->served);
+
+	c->wsi->fcgi_conn = NULL;
+
+	for (pc = &w->conns[tsi]; *pc; pc = &(*pc)->next)
+		if (*pc == c) {
+			*pc = c->next;
+			w->count_conns[tsi]--;
+			break;
+		}
+
+	if (!c->connected)
+		lws_fcgi_worker_down(w);
+
+	for (n = 0; n < pool->mpxs; n++) {
+		req = c->req[n];
+		if (!lws_fcgi_live(req))
+			continue;
+		req->conn = NULL;
+
+		/*
+		 * It can go again if nothing about it went to the worker, or
+		 * nothing we can't send again did and this was a kept-alive
+		 * conn the worker closed at the same time
+		 */
+		if (!req->got_rx &&
+		    (!req->begun || (c->served && !req->body_length)))
+			req->retry = 1;
+		else
+			req->failed = 1;
+		lws_callback_on_writable(req->wsi);
+	}
+
+	/* someone waiting for a slot can open a new conn instead */
+	req = pool->wait[tsi];
+	if (req) {
+		pool->wait[tsi] = req->wait_next;
+		req->wait_next = NULL;
+		req->again = 1;
+		lws_callback_on_writable(req->wsi);
+	}
+
+	lws_fcgi_buf_free(&c->tx);
+	lws_free(c);
+}
+
+/*
+ * The worker's response starts with CGI headers ending in a blank line.
+ * Returns 0 if we must wait for more of them, or they were sent (or found
+ * bad), or -1 to close.
+ */
+
+static int
+lws_fcgi_headers(struct lws *wsi, struct lws_fcgi_req *req)
+{
+	unsigned char buf[LWS_PRE + LWS_FCGI_HDRS_MAX + 512],
+		      *start = buf + LWS_PRE, *p = start,
+		      *end = &buf[sizeof(buf) - 1];
+	char *h = (char *)req->out.p + req->out_pos, *s, *e, *v, *c,
+	     name[64];
+	size_t len = req->out.len - req->out_pos;
+	int status = 0, location = 0, pass, n, vlen;
+	char *body = NULL;
+
+	/* find the blank line after them */
+	for (s = h; s < h + len; s = e + 1) {
+		e = memchr(s, '\n', h + len - s);
+		if (!e)
+			break;
+		if (e == s || (e == s + 1 && *s == '\r')) {
+			body = e + 1;
+			break;
+		}
+	}
+
+	if (!body) {
+		if (!req->ended && len < LWS_FCGI_HDRS_MAX)
+			return 0;
+		goto bad;
+	}
+
+	if (body - h > LWS_FCGI_HDRS_MAX)
+		goto bad;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (s = h; s < body; s = e + 1) {
+			e = memchr(s, '\n', body - s);
+			v = e;
+			if (v > s && v[-1] == '\r')
+				v--;
+			if (v == s)
+				break;
+
+			c = memchr(s, ':', v - s);
+			if (!c || c == s || c - s > (int)sizeof(name) - 2)
+				goto bad;
+			for (n = 0; n < c - s; n++)
+				name[n] = tolower((int)s[n]);
+			name[n++] = ':';
+			name[n] = '\0';
+			vlen = v - c - 1;
+			c++;
+			while (vlen && (*c == ' ' || *c == '\t')) {
+				c++;
+				vlen--;
+			}
+
+			if (!pass) {
+				if (!strcmp(name, "status:"))
+					status = atoi(c);
+				if (!strcmp(name, "location:"))
+					location = 1;
+				if (!strcmp(name, "content-length:")) {
+					req->content_length = atoll(c);
+					req->framed = 1;
+				}
+				continue;
+			}
+
+			if (!strcmp(name, "status:") ||
+			    !strcmp(name, "transfer-encoding:") ||
+			    !strcmp(name, "connection:") ||
+			    !strcmp(name, "keep-alive:"))
+				continue;
+
+			if (lws_add_http_header_by_name(wsi,
+					(unsigned char *)name,
+					(unsigned char *)c, vlen, &p, end))
+				return -1;
+		}
+
+		if (pass)
+			break;
+
+		if (!status)
+			status = location ? HTTP_STATUS_FOUND : HTTP_STATUS_OK;
+		if (status < 100 || status > 999)
+			goto bad;
+
+		req->no_body = req->head || status < 200 ||
+			       status == HTTP_STATUS_NO_CONTENT ||
+			       status == HTTP_STATUS_NOT_MODIFIED;
+
+		if (lws_add_http_header_status(wsi, status, &p, end))
+			return -1;
+	}
+
+	/* HTTP/1.1 without a length needs chunking to keep the connection */
+	if (!req->framed && !req->no_body && !wsi->http2_substream &&
+	    wsi->u.http.request_version == HTTP_VERSION_1_1) {
+		if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_TRANSFER_ENCODING,
+				(unsigned char *)"chunked", 7, &p, end))
+			return -1;
+		req->chunked = 1;
+	}
+
+	if (lws_finalize_http_header(wsi, &p, end))
+		return -1;
+
+	if (lws_write(wsi, start, p - start, LWS_WRITE_HTTP_HEADERS) < 0)
+		return -1;
+
+	req->hdrs_sent = 1;
+	req->out_pos += body - h;
+	lws_callback_on_writable(wsi);
+
+	return 0;
+
+bad:
+	lwsl_err("%s: bad response headers from %s\n", __func__,
+		 req->pool->mount->mountpoint);
+	req->failed = 1;
+	lws_callback_on_writable(wsi);
+
+	return 0;
+}
+
+static int
+lws_fcgi_finish(struct lws *wsi)
+{
+	struct lws_fcgi_req *req = wsi->fcgi_req;
+	unsigned char fin[LWS_PRE + 8], *p = fin + LWS_PRE;
+	int framed = req->framed || req->chunked || req->no_body,
+	    chunked = req->chunked;
+
+	/* a short response can only be ended by closing */
+	if (req->framed && !req->no_body &&
+	    req->content_sent != req->content_length)
+		framed = 0;
+
+	lws_fcgi_req_destroy(wsi);
+
+	if (wsi->http2_substream) {
+		if (lws_write(wsi, p, 0, LWS_WRITE_HTTP_FINAL) < 0)
+			return -1;
+	} else {
+		/* lws sends the terminating zero-length chunk */
+		if (chunked && lws_write(wsi, p, 0, LWS_WRITE_HTTP_FINAL |
+						    LWS_WRITE_HTTP_CHUNK) < 0)
+			return -1;
+		if (!framed)
+			return -1;
+	}
+
+	/* the worker didn't wait for all of the request body */
+	if (wsi->u.http.rx_content_remain)
+		return -1;
+
+	if (lws_http_transaction_completed(wsi))
+		return -1;
+
+	return 0;
+}
+
+static int
+lws_fcgi_req_writeable(struct lws *wsi)
+{
+	struct lws_fcgi_req *req = wsi->fcgi_req;
+	struct lws_iovec v;
+	size_t n;
+
+	if (req->again || req->retry) {
+		if (req->retry && ++req->tries > req->pool->count_w)
+			req->failed = 1;
+		else {
+			req->again = 0;
+			req->retry = 0;
+
+			return lws_fcgi_attach(req);
+		}
+	}
+
+	if (req->failed) {
+		if (req->hdrs_sent || wsi->u.http.rx_content_remain)
+			return -1;
+
+		/* we could not get a response from any worker */
+		lws_fcgi_req_destroy(wsi);
+		if (lws_return_http_status(wsi, HTTP_STATUS_BAD_GATEWAY, NULL))
+			return -1;
+
+		return lws_http_transaction_completed(wsi) ? -1 : 0;
+	}
+
+	if (!req->hdrs_sent)
+		return lws_fcgi_headers(wsi, req);
+
+	n = req->out.len - req->out_pos;
+	if (n > LWS_FCGI_CHUNK)
+		n = LWS_FCGI_CHUNK;
+
+	if (n && !req->no_body) {
+		/* straight from the stdout buffer, lws adds any chunk framing */
+		v.base = req->out.p + req->out_pos;
+		v.len = n;
+		if (lws_writev(wsi, &v, 1, LWS_WRITE_HTTP |
+			       (req->chunked ? LWS_WRITE_HTTP_CHUNK : 0)) < 0)
+			return -1;
+		req->content_sent += n;
+	}
+
+	req->out_pos += n;
+	lws_fcgi_buf_consumed(&req->out, &req->out_pos);
+
+	if (req->conn && req->conn->paused)
+		lws_fcgi_conn_flow(req->conn);
+
+	if (req->out_pos < req->out.len) {
+		lws_callback_on_writable(wsi);
+		return 0;
+	}
+
+	if (req->ended)
+		return lws_fcgi_finish(wsi);
+
+	return 0;
+}
+
+int
+lws_fcgi_http_action(struct lws *wsi, const struct lws_http_mount *hit,
+		     const char *uri_ptr, const char *method)
+{
+	struct lws_fcgi_pool *pool;
+	struct lws_fcgi_req *req;
+	char cl[32];
+
+	for (pool = wsi->vhost->fcgi_pools; pool; pool = pool->next)
+		if (pool->mount == hit)
+			break;
+	if (!pool)
+		return -1;
+
+	req = lws_zalloc(sizeof(*req), "fcgi req");
+	if (!req)
+		return -1;
+
+	req->pool = pool;
+	req->wsi = wsi;
+	wsi->fcgi_req = req;
+
+	/* h2 gives us the method separately */
+	if (method[0] == ':')
+		lws_hdr_copy(wsi, req->method, sizeof(req->method),
+			     WSI_TOKEN_HTTP_COLON_METHOD);
+	else
+		strncpy(req->method, method, sizeof(req->method) - 1);
+	req->head = !strcmp(req->method, "HEAD");
+
+	/* only a body with a length goes on, don't wait for one otherwise */
+	wsi->u.http.rx_content_length = 0;
+	if (lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_CONTENT_LENGTH)) {
+		lws_hdr_copy(wsi, cl, sizeof(cl), WSI_TOKEN_HTTP_CONTENT_LENGTH);
+		req->body_length = atoll(cl);
+		wsi->u.http.rx_content_length = req->body_length;
+	}
+
+	if (lws_fcgi_params(wsi, req, hit, uri_ptr))
+		return -1;
+
+	/* having made the params, we don't need the ah any more */
+	if (lws_header_table_is_in_detachable_state(wsi))
+		lws_header_table_detach(wsi, 0);
+
+	lws_set_timeout(wsi, PENDING_TIMEOUT_CGI, pool->timeout);
+
+	return lws_fcgi_attach(req);
+}
+
+int
+lws_fcgi_req_body(struct lws *wsi, unsigned char *buf, size_t len)
+{
+	struct lws_fcgi_req *req = wsi->fcgi_req;
+	size_t queued = req->body.len;
+
+	if (req->conn)
+		queued += req->conn->tx.len - req->conn->tx_pos;
+
+	if (queued + len > LWS_FCGI_BODY_MAX) {
+		/*
+		 * http/1 reads pause below until the worker conn sent what we
+		 * have, but we don't withhold window from h2 streams, so they
+		 * can get this far ahead of it.  Fail the stream.
+		 */
+		lwsl_notice("%s: %p: body too far ahead of worker\n",
+			    __func__, wsi);
+#ifdef LWS_WITH_HTTP2
+		if (wsi->http2_substream)
+			lws_h2_rst_stream(wsi, H2_ERR_ENHANCE_YOUR_CALM,
+					  "fastcgi body backlog");
+#endif
+		lws_set_timeout(wsi, PENDING_TIMEOUT_CLOSE_SEND,
+				LWS_TO_KILL_ASYNC);
+
+		return -1;
+	}
+
+	if (lws_fcgi_buf_append(&req->body, buf, len))
+		return -1;
+	req->body_in += len;
+
+	if (req->body_in == req->body_length)
+		lws_set_timeout(wsi, PENDING_TIMEOUT_CGI, req->pool->timeout);
+	else
+		/* hold off reading more until the worker conn sent it */
+		if (!wsi->http2_substream) {
+			req->paused = 1;
+			lws_rx_flow_control(wsi, 0);
+		}
+
+	if (req->conn && req->begun && lws_fcgi_stdin(req->conn, req))
+		return -1;
+
+	return 0;
+}
+
+int
+lws_fcgi_callback(struct lws *wsi, enum lws_callback_reasons reason,
+		  void *in, size_t len)
+{
+	switch (reason) {
+	case LWS_CALLBACK_HTTP_WRITEABLE:
+		if (wsi->fcgi_req)
+			return lws_fcgi_req_writeable(wsi);
+		break;
+
+	case LWS_CALLBACK_RAW_RX:
+		if (wsi->fcgi_conn)
+			return lws_fcgi_conn_rx(wsi->fcgi_conn, in, len);
+		break;
+
+	case LWS_CALLBACK_RAW_WRITEABLE:
+		if (wsi->fcgi_conn)
+			return lws_fcgi_conn_writeable(wsi->fcgi_conn);
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+void
+lws_fcgi_wsi_destroy(struct lws *wsi)
+{
+	if (wsi->fcgi_req)
+		lws_fcgi_req_destroy(wsi);
+
+	if (wsi->fcgi_conn)
+		lws_fcgi_conn_destroy(wsi->fcgi_conn);
+}
+
+/* "/path.sock" for a unix socket, or "host[:port]" for tcp */
+
+static int
+lws_fcgi_worker_init(struct lws_fcgi_worker *w, const char *addr)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)&w->sa;
+	struct addrinfo hints, *result;
+	const char *p, *port = "9000";
+	char host[128];
+	int n;
+
+	strncpy(w->name, addr, sizeof(w->name) - 1);
+
+	if (addr[0] == '/') {
+		if (strlen(addr) >= sizeof(sun->sun_path)) {
+			lwsl_err("%s: unix socket path too long: %s\n",
+				 __func__, addr);
+			return 1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, addr);
+		w->salen = sizeof(*sun);
+
+		return 0;
+	}
+
+	strncpy(host, addr + (addr[0] == '['), sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+	p = addr[0] == '[' ? strchr(host, ']') : strrchr(host, ':');
+	if (p) {
+		n = p - host;
+		if (host[n] == ']')
+			host[n++] = '\0';
+		if (host[n] == ':') {
+			host[n] = '\0';
+			port = &host[n + 1];
+		}
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	n = getaddrinfo(host, port, &hints, &result);
+	if (n || !result) {
+		lwsl_err("%s: unable to resolve %s\n", __func__, addr);
+		return 1;
+	}
+
+	memcpy(&w->sa, result->ai_addr, result->ai_addrlen);
+	w->salen = result->ai_addrlen;
+	freeaddrinfo(result);
+
+	return 0;
+}
+
+static int
+lws_fcgi_pool_create(struct lws_vhost *vh, const struct lws_http_mount *m)
+{
+	const struct lws_protocol_vhost_options *pvo;
+	struct lws_fcgi_pool *pool;
+	int n = 1;
+
+	for (pvo = m->upstreams; pvo; pvo = pvo->next)
+		n++;
+
+	pool = lws_zalloc(sizeof(*pool) + n * sizeof(pool->w[0]), "fcgi pool");
+	if (!pool)
+		return 1;
+
+	pool->w = (struct lws_fcgi_worker *)(pool + 1);
+	pool->count_w = n;
+	pool->mount = m;
+	pool->vhost = vh;
+	pool->max_conns = lws_fcgi_def(m->fastcgi_conns, 8);
+	pool->mpxs = lws_fcgi_def(m->fastcgi_mpxs, 1);
+	pool->timeout = lws_fcgi_def(m->cgi_timeout,
+				     (int)vh->context->timeout_secs);
+
+	pool->next = vh->fcgi_pools;
+	vh->fcgi_pools = pool;
+
+	n = 0;
+	pool->w[n].pool = pool;
+	if (lws_fcgi_worker_init(&pool->w[n++], m->origin))
+		return 1;
+	for (pvo = m->upstreams; pvo; pvo = pvo->next) {
+		pool->w[n].pool = pool;
+		if (lws_fcgi_worker_init(&pool->w[n++], pvo->name))
+			return 1;
+	}
+
+	lwsl_notice("%s: %s: %d fastcgi workers\n", __func__, m->mountpoint,
+		    pool->count_w);
+
+	return 0;
+}
+
+int
+lws_fcgi_vhost_init(struct lws_vhost *vh)
+{
+	const struct lws_http_mount *m;
+
+	for (m = vh->mount_list; m; m = m->mount_next)
+		if (m->origin_protocol == LWSMPRO_FASTCGI &&
+		    lws_fcgi_pool_create(vh, m))
+			return 1;
+
+	return 0;
+}
+
+void
+lws_fcgi_vhost_destroy(struct lws_vhost *vh)
+{
+	struct lws_fcgi_pool *pool;
+
+	/* by now the wsi using the pools are gone */
+	while (vh->fcgi_pools) {
+		pool = vh->fcgi_pools;
+		vh->fcgi_pools = pool->next;
+		lws_free(pool);
+	}
+}
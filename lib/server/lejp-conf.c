@@ -100,6 +100,19 @@ static const char * const paths_vhosts[] = {
 	"vhosts[].client-ssl-ciphers",
 	"vhosts[].onlyraw",
 	"vhosts[].ignore-missing-cert",
+	"vhosts[].mounts[].upstreams",
+	"vhosts[].mounts[].lb-policy",
+	"vhosts[].mounts[].health-check",
+	"vhosts[].mounts[].health-check-interval",
+	"vhosts[].mounts[].max-fails",
+	"vhosts[].mounts[].fail-timeout",
+	"vhosts[].mounts[].upstream-keepalive",
+	"vhosts[].mounts[].ws-passthrough",
+	"vhosts[].mounts[].proxy-cache",
+	"vhosts[].mounts[].proxy-cache-disk",
+	"vhosts[].mounts[].proxy-cache-dir",
+	"vhosts[].mounts[].fastcgi-conns",
+	"vhosts[].mounts[].fastcgi-mpxs",
 };
 
 enum lejp_vhost_paths {
@@ -148,6 +161,19 @@ enum lejp_vhost_paths {
 	LEJPVP_CLIENT_CIPHERS,
 	LEJPVP_FLAG_ONLYRAW,
 	LEJPVP_IGNORE_MISSING_CERT,
+	LEJPVP_MOUNT_UPSTREAMS,
+	LEJPVP_MOUNT_LB_POLICY,
+	LEJPVP_MOUNT_HEALTH_CHECK,
+	LEJPVP_MOUNT_HEALTH_CHECK_INTERVAL,
+	LEJPVP_MOUNT_MAX_FAILS,
+	LEJPVP_MOUNT_FAIL_TIMEOUT,
+	LEJPVP_MOUNT_UPSTREAM_KEEPALIVE,
+	LEJPVP_MOUNT_WS_PASSTHROUGH,
+	LEJPVP_MOUNT_PROXY_CACHE,
+	LEJPVP_MOUNT_PROXY_CACHE_DISK,
+	LEJPVP_MOUNT_PROXY_CACHE_DIR,
+	LEJPVP_MOUNT_FASTCGI_CONNS,
+	LEJPVP_MOUNT_FASTCGI_MPXS,
 };
 
 static const char * const parser_errs[] = {
@@ -459,6 +485,7 @@ lejp_vhosts_cb(struct lejp_ctx *ctx, char reason)
 			">http://",
 			">https://",
 			"callback://",
+			"fastcgi://",
 			"gzip://",
 		};
 
@@ -649,6 +676,63 @@ lejp_vhosts_cb(struct lejp_ctx *ctx, char reason)
 		a->pvo_int->options = NULL;
 		break;
 
+	case LEJPVP_MOUNT_UPSTREAMS:
+		pvo = lwsws_align(a);
+		a->p += sizeof(*pvo);
+
+		pvo->next = a->m.upstreams;
+		a->m.upstreams = pvo;
+		pvo->name = a->p;
+		pvo->value = "";
+		pvo->options = NULL;
+		goto dostring;
+
+	case LEJPVP_MOUNT_LB_POLICY:
+		if (!strcmp(ctx->buf, "least-conn"))
+			a->m.lb_policy = LWS_PROXY_LB_LEAST_CONN;
+		else if (!strcmp(ctx->buf, "hash"))
+			a->m.lb_policy = LWS_PROXY_LB_HASH;
+		else if (!strcmp(ctx->buf, "round-robin"))
+			a->m.lb_policy = LWS_PROXY_LB_ROUND_ROBIN;
+		else {
+			lwsl_err("unknown lb-policy %s\n", ctx->buf);
+			return 1;
+		}
+		return 0;
+	case LEJPVP_MOUNT_HEALTH_CHECK:
+		a->m.health_check_path = a->p;
+		break;
+	case LEJPVP_MOUNT_HEALTH_CHECK_INTERVAL:
+		a->m.health_check_interval = atoi(ctx->buf);
+		return 0;
+	case LEJPVP_MOUNT_MAX_FAILS:
+		a->m.max_fails = atoi(ctx->buf);
+		return 0;
+	case LEJPVP_MOUNT_FAIL_TIMEOUT:
+		a->m.fail_timeout = atoi(ctx->buf);
+		return 0;
+	case LEJPVP_MOUNT_UPSTREAM_KEEPALIVE:
+		a->m.upstream_keepalive = atoi(ctx->buf);
+		return 0;
+	case LEJPVP_MOUNT_WS_PASSTHROUGH:
+		a->m.ws_passthrough = arg_to_bool(ctx->buf);
+		return 0;
+	case LEJPVP_MOUNT_PROXY_CACHE:
+		a->m.proxy_cache_mem = strtoul(ctx->buf, NULL, 10);
+		return 0;
+	case LEJPVP_MOUNT_PROXY_CACHE_DISK:
+		a->m.proxy_cache_disk = strtoul(ctx->buf, NULL, 10);
+		return 0;
+	case LEJPVP_MOUNT_PROXY_CACHE_DIR:
+		a->m.proxy_cache_dir = a->p;
+		break;
+	case LEJPVP_MOUNT_FASTCGI_CONNS:
+		a->m.fastcgi_conns = atoi(ctx->buf);
+		return 0;
+	case LEJPVP_MOUNT_FASTCGI_MPXS:
+		a->m.fastcgi_mpxs = atoi(ctx->buf);
+		return 0;
+
 	case LEJPVP_ENABLE_CLIENT_SSL:
 		a->enable_client_ssl = arg_to_bool(ctx->buf);
 		return 0;
@@ -726,8 +810,8 @@ dostring:
  */
 
 static int
-lwsws_get_config(void *user, const char *f, const char * const *paths,
-		 int count_paths, lejp_callback cb)
+lwsws_get_config(void *user, const char *f, const struct lejp_paths *lp,
+		 lejp_callback cb)
 {
 	unsigned char buf[128];
 	struct lejp_ctx ctx;
@@ -739,7 +823,7 @@ lwsws_get_config(void *user, const char *f, const char * const *paths,
 		return 2;
 	}
 	lwsl_info("%s: %s\n", __func__, f);
-	lejp_construct(&ctx, cb, user, paths, count_paths);
+	lejp_construct_compiled(&ctx, cb, user, lp);
 
 	do {
 		n = read(fd, buf, sizeof(buf));
@@ -765,8 +849,8 @@ lwsws_get_config(void *user, const char *f, const char * const *paths,
 #if defined(LWS_WITH_LIBUV) && UV_VERSION_MAJOR > 0
 
 static int
-lwsws_get_config_d(void *user, const char *d, const char * const *paths,
-		   int count_paths, lejp_callback cb)
+lwsws_get_config_d(void *user, const char *d, const struct lejp_paths *lp,
+		   lejp_callback cb)
 {
 	uv_dirent_t dent;
 	uv_fs_t req;
@@ -786,7 +870,7 @@ lwsws_get_config_d(void *user, const char *d, const char * const *paths,
 
 	while (uv_fs_scandir_next(&req, &dent) != UV_EOF) {
 		lws_snprintf(path, sizeof(path) - 1, "%s/%s", d, dent.name);
-		ret = lwsws_get_config(user, path, paths, count_paths, cb);
+		ret = lwsws_get_config(user, path, lp, cb);
 		if (ret)
 			goto bail;
 	}
@@ -812,8 +896,8 @@ static int filter(const struct dirent *ent)
 #endif
 
 static int
-lwsws_get_config_d(void *user, const char *d, const char * const *paths,
-		   int count_paths, lejp_callback cb)
+lwsws_get_config_d(void *user, const char *d, const struct lejp_paths *lp,
+		   lejp_callback cb)
 {
 #ifndef _WIN32
 	struct dirent **namelist;
@@ -831,7 +915,7 @@ lwsws_get_config_d(void *user, const char *d, const char * const *paths,
 			goto skip;
 		lws_snprintf(path, sizeof(path) - 1, "%s/%s", d,
 			 namelist[i]->d_name);
-		ret = lwsws_get_config(user, path, paths, count_paths, cb);
+		ret = lwsws_get_config(user, path, lp, cb);
 		if (ret) {
 			while (i++ < n)
 				free(namelist[i]);
@@ -852,13 +936,48 @@ bail:
 
 #endif
 
+/*
+ * parse <d>/conf and then everything in <d>/conf.d, compiling the path list
+ * just once for all the files
+ */
+
+static int
+lwsws_get_config_dirs(void *user, const char *d, const char * const *paths,
+		      int count_paths, lejp_callback cb)
+{
+	struct lejp_path_node *nodes;
+	struct lejp_paths lp;
+	char dd[128];
+	int n, ret = 2;
+
+	n = lejp_paths_size(paths, count_paths);
+	nodes = lws_malloc(n * sizeof(*nodes), "lejp paths");
+	if (!nodes)
+		return 2;
+	if (lejp_paths_compile(&lp, nodes, n, paths, count_paths))
+		goto bail;
+
+	lws_snprintf(dd, sizeof(dd) - 1, "%s/conf", d);
+	if (lwsws_get_config(user, dd, &lp, cb) > 1)
+		goto bail;
+	lws_snprintf(dd, sizeof(dd) - 1, "%s/conf.d", d);
+	if (lwsws_get_config_d(user, dd, &lp, cb) > 1)
+		goto bail;
+
+	ret = 0;
+
+bail:
+	lws_free(nodes);
+
+	return ret;
+}
+
 int
 lwsws_get_config_globals(struct lws_context_creation_info *info, const char *d,
 			 char **cs, int *len)
 {
 	struct jpargs a;
 	const char * const *old = info->plugin_dirs;
-	char dd[128];
 
 	memset(&a, 0, sizeof(a));
 
@@ -879,13 +998,8 @@ lwsws_get_config_globals(struct lws_context_creation_info *info, const char *d,
 		old++;
 	}
 
-	lws_snprintf(dd, sizeof(dd) - 1, "%s/conf", d);
-	if (lwsws_get_config(&a, dd, paths_global,
-			     ARRAY_SIZE(paths_global), lejp_globals_cb) > 1)
-		return 1;
-	lws_snprintf(dd, sizeof(dd) - 1, "%s/conf.d", d);
-	if (lwsws_get_config_d(&a, dd, paths_global,
-			       ARRAY_SIZE(paths_global), lejp_globals_cb) > 1)
+	if (lwsws_get_config_dirs(&a, d, paths_global,
+				  ARRAY_SIZE(paths_global), lejp_globals_cb))
 		return 1;
 
 	a.plugin_dirs[a.count_plugin_dirs] = NULL;
@@ -902,7 +1016,6 @@ lwsws_get_config_vhosts(struct lws_context *context,
 			char **cs, int *len)
 {
 	struct jpargs a;
-	char dd[128];
 
 	memset(&a, 0, sizeof(a));
 
@@ -914,13 +1027,8 @@ lwsws_get_config_vhosts(struct lws_context *context,
 	a.protocols = info->protocols;
 	a.extensions = info->extensions;
 
-	lws_snprintf(dd, sizeof(dd) - 1, "%s/conf", d);
-	if (lwsws_get_config(&a, dd, paths_vhosts,
-			     ARRAY_SIZE(paths_vhosts), lejp_vhosts_cb) > 1)
-		return 1;
-	lws_snprintf(dd, sizeof(dd) - 1, "%s/conf.d", d);
-	if (lwsws_get_config_d(&a, dd, paths_vhosts,
-			       ARRAY_SIZE(paths_vhosts), lejp_vhosts_cb) > 1)
+	if (lwsws_get_config_dirs(&a, d, paths_vhosts,
+				  ARRAY_SIZE(paths_vhosts), lejp_vhosts_cb))
 		return 1;
 
 	*cs = a.p;
@@ -56,6 +56,7 @@ struct lws_urldecode_stateful {
 	char content_disp_filename[256];
 	char mime_boundary[128];
 	int out_len;
+	int boundary_len;
 	int pos;
 	int hdr_idx;
 	int mp;
@@ -65,6 +66,8 @@ struct lws_urldecode_stateful {
 	unsigned int inside_quote:1;
 	unsigned int subname:1;
 	unsigned int boundary_real_crlf:1;
+	unsigned int zero_copy:1;
+	unsigned int content_sent:1;
 
 	enum urldecode_stateful state;
 
@@ -113,6 +116,7 @@ lws_urldecode_s_create(struct lws *wsi, char *out, int out_len, void *data,
 					s->mime_boundary[m++] = *p++;
 
 				s->mime_boundary[m] = '\0';
+				s->boundary_len = m;
 
 				lwsl_notice("boundary '%s'\n", s->mime_boundary);
 			}
@@ -122,21 +126,144 @@ lws_urldecode_s_create(struct lws *wsi, char *out, int out_len, void *data,
 	return s;
 }
 
+/*
+ * Word-at-a-time test for a byte value in v, so the common case of a run of
+ * plain bytes is checked 8 at a time
+ */
+#define LWS_SPA_ONES (~(uint64_t)0 / 255)
+#define lws_spa_has_byte(v, c) \
+	((((v) ^ (LWS_SPA_ONES * (uint8_t)(c))) - LWS_SPA_ONES) & \
+	 ~((v) ^ (LWS_SPA_ONES * (uint8_t)(c))) & (LWS_SPA_ONES << 7))
+
+/*
+ * copy a run of urlencoded value bytes to out, translating '+', until '%' or
+ * '&' or the end of the input.  Returns the number of bytes copied.
+ */
+
+static int
+lws_urldecode_run(char *out, const char *in, int len)
+{
+	uint64_t v;
+	int n = 0, m;
+
+	while (1) {
+		while (n + 8 <= len) {
+			memcpy(&v, in + n, 8);
+			if (lws_spa_has_byte(v, '%') | lws_spa_has_byte(v, '&') |
+			    lws_spa_has_byte(v, '+'))
+				break;
+			memcpy(out + n, in + n, 8);
+			n += 8;
+		}
+
+		/* deal with the block containing something special */
+
+		m = n + 8 < len ? n + 8 : len;
+		for (; n < m; n++) {
+			if (in[n] == '%' || in[n] == '&')
+				return n;
+			out[n] = in[n] == '+' ? ' ' : in[n];
+		}
+		if (n == len)
+			return n;
+	}
+}
+
+/*
+ * Length of the run of multipart part data at in that can't contain the start
+ * of the boundary.  Every boundary starts with CR, so only CRs whose following
+ * bytes match the boundary as far as we can see end the run.
+ */
+
+static int
+lws_urldecode_mp_run(struct lws_urldecode_stateful *s, const char *in, int len)
+{
+	const char *p = in, *e = in + len, *c;
+	int n;
+
+	if (!s->mime_boundary[0])
+		return len;
+
+	while (p < e) {
+		c = memchr(p, '\x0d', lws_ptr_diff(e, p));
+		if (!c)
+			return len;
+		/* before the first boundary, any CR goes the slow way */
+		if (!s->boundary_real_crlf)
+			return lws_ptr_diff(c, in);
+		n = lws_ptr_diff(e, c);
+		if (n > s->boundary_len)
+			n = s->boundary_len;
+		if (!memcmp(c, s->mime_boundary, n))
+			return lws_ptr_diff(c, in);
+		p = c + 1;
+	}
+
+	return len;
+}
+
 static int
 lws_urldecode_s_process(struct lws_urldecode_stateful *s, const char *in,
 			int len)
 {
-	int n, m, hit = 0;
-	char c, was_end = 0;
+	int n, m, hit = 0, direct;
+	char c, *q;
 
 	while (len--) {
-		if (s->pos == s->out_len - s->mp - 1) {
+		if (s->pos >= s->out_len - s->mp - 1) {
 			if (s->output(s->data, s->name, &s->out, s->pos, 0))
 				return -1;
 
-			was_end = s->pos;
+			if (s->pos)
+				s->content_sent = 1;
 			s->pos = 0;
 		}
+
+		/*
+		 * Literal runs in a value or a multipart part are copied in
+		 * bulk, stopping at the next output flush point so the
+		 * output callback sees the same chunks as before.
+		 *
+		 * In zero-copy mode, runs of file content are instead passed
+		 * to the output callback directly from the input.
+		 */
+		m = s->out_len - s->mp - 1 - s->pos;
+		direct = s->zero_copy && s->state == MT_LOOK_BOUND_IN &&
+			 !s->mp && s->content_disp_filename[0];
+		if (direct)
+			m = len + 1;
+		if (len && m > 1 && (s->state == US_IDLE ||
+				     (s->state == MT_LOOK_BOUND_IN && !s->mp))) {
+			if (m > len + 1)
+				m = len + 1;
+			if (s->state == US_IDLE)
+				n = lws_urldecode_run(s->out + s->pos, in, m);
+			else {
+				n = lws_urldecode_mp_run(s, in, m);
+				if (n && direct) {
+					/* anything already buffered goes first */
+					if (s->pos && s->output(s->data, s->name,
+							&s->out, s->pos, 0))
+						return -1;
+					s->pos = 0;
+					q = (char *)in;
+					if (s->output(s->data, s->name, &q, n, 0))
+						return -1;
+					s->content_sent = 1;
+					in += n;
+					len -= n - 1;
+					continue;
+				}
+				memcpy(s->out + s->pos, in, n);
+			}
+			if (n) {
+				s->pos += n;
+				in += n;
+				len -= n - 1;
+				continue;
+			}
+		}
+
 		switch (s->state) {
 
 		/* states for url arg style */
@@ -222,12 +349,13 @@ retry_as_first:
 					s->mp = 0;
 					s->state = MT_IGNORE1;
 
-					if (s->pos || was_end)
+					if (s->pos || s->content_sent)
 						if (s->output(s->data, s->name,
 						      &s->out, s->pos, 1))
 							return -1;
 
 					s->pos = 0;
+					s->content_sent = 0;
 
 					s->content_disp[0] = '\0';
 					s->name[0] = '\0';
@@ -241,9 +369,11 @@ retry_as_first:
 				if (!s->boundary_real_crlf)
 					n = 2;
 
-				memcpy(s->out + s->pos, s->mime_boundary + n,
-				       s->mp - n);
-				s->pos += s->mp;
+				if (s->mp > n) {
+					memcpy(s->out + s->pos,
+					       s->mime_boundary + n, s->mp - n);
+					s->pos += s->mp - n;
+				}
 				s->mp = 0;
 				goto retry_as_first;
 			}
@@ -259,7 +389,8 @@ retry_as_first:
 			if (c >= 'A' && c <= 'Z')
 				c += 'a' - 'A';
 			for (n = 0; n < (int)ARRAY_SIZE(mp_hdr); n++)
-				if (c == mp_hdr[n][s->mp]) {
+				if (s->mp < (int)strlen(mp_hdr[n]) &&
+				    c == mp_hdr[n][s->mp]) {
 					m++;
 					hit = n;
 				}
@@ -406,6 +537,8 @@ struct lws_spa {
 	char *end;
 	int max_storage;
 
+	lws_fop_fd_t sink;
+
 	char finalized;
 };
 
@@ -422,6 +555,24 @@ lws_urldecode_spa_lookup(struct lws_spa *spa,
 	return -1;
 }
 
+static int
+lws_spa_sink_write(struct lws_spa *spa, char *buf, int len)
+{
+	lws_filepos_t amount;
+
+	while (len) {
+		if (lws_vfs_file_write(spa->sink, &amount, (uint8_t *)buf,
+				       len) || !amount) {
+			lwsl_notice("%s: file sink write failed\n", __func__);
+			return -1;
+		}
+		buf += amount;
+		len -= (int)amount;
+	}
+
+	return 0;
+}
+
 static int
 lws_urldecode_spa_cb(void *data, const char *name, char **buf, int len,
 		     int final)
@@ -431,6 +582,15 @@ lws_urldecode_spa_cb(void *data, const char *name, char **buf, int len,
 	int n;
 
 	if (spa->s->content_disp_filename[0]) {
+		if (spa->sink && final != LWS_UFS_OPEN) {
+			if (len && lws_spa_sink_write(spa, *buf, len))
+				return -1;
+			if (final != LWS_UFS_FINAL_CONTENT)
+				return 0;
+			/* the part ended: let the user know with no data */
+			spa->sink = NULL;
+			len = 0;
+		}
 		if (spa->opt_cb) {
 			n = spa->opt_cb(spa->opt_data, name,
 					spa->s->content_disp_filename,
@@ -466,36 +626,37 @@ lws_urldecode_spa_cb(void *data, const char *name, char **buf, int len,
 }
 
 LWS_VISIBLE LWS_EXTERN struct lws_spa *
-lws_spa_create(struct lws *wsi, const char * const *param_names,
-			 int count_params, int max_storage,
-			 lws_spa_fileupload_cb opt_cb, void *opt_data)
+lws_spa_create_via_info(struct lws *wsi, const struct lws_spa_create_info *i)
 {
 	struct lws_spa *spa = lws_zalloc(sizeof(*spa), "spa");
 
 	if (!spa)
 		return NULL;
 
-	spa->param_names = param_names;
-	spa->count_params = count_params;
-	spa->max_storage = max_storage;
-	spa->opt_cb = opt_cb;
-	spa->opt_data = opt_data;
+	spa->param_names = i->param_names;
+	spa->count_params = i->count_params;
+	spa->max_storage = i->max_storage;
+	spa->opt_cb = i->opt_cb;
+	spa->opt_data = i->opt_data;
 
-	spa->storage = lws_malloc(max_storage, "spa");
+	spa->storage = lws_malloc(spa->max_storage, "spa");
 	if (!spa->storage)
 		goto bail2;
-	spa->end = spa->storage + max_storage - 1;
+	spa->end = spa->storage + spa->max_storage - 1;
 
-	spa->params = lws_zalloc(sizeof(char *) * count_params, "spa params");
+	spa->params = lws_zalloc(sizeof(char *) * spa->count_params,
+				 "spa params");
 	if (!spa->params)
 		goto bail3;
 
-	spa->s = lws_urldecode_s_create(wsi, spa->storage, max_storage, spa,
-					lws_urldecode_spa_cb);
+	spa->s = lws_urldecode_s_create(wsi, spa->storage, spa->max_storage,
+					spa, lws_urldecode_spa_cb);
 	if (!spa->s)
 		goto bail4;
 
-	spa->param_length = lws_zalloc(sizeof(int) * count_params,
+	spa->s->zero_copy = !!(i->options & LWS_SPA_OPT_FILE_ZERO_COPY);
+
+	spa->param_length = lws_zalloc(sizeof(int) * spa->count_params,
 					"spa param len");
 	if (!spa->param_length)
 		goto bail5;
@@ -516,6 +677,34 @@ bail2:
 	return NULL;
 }
 
+LWS_VISIBLE LWS_EXTERN struct lws_spa *
+lws_spa_create(struct lws *wsi, const char * const *param_names,
+			 int count_params, int max_storage,
+			 lws_spa_fileupload_cb opt_cb, void *opt_data)
+{
+	struct lws_spa_create_info i;
+
+	memset(&i, 0, sizeof(i));
+	i.param_names = param_names;
+	i.count_params = count_params;
+	i.max_storage = max_storage;
+	i.opt_cb = opt_cb;
+	i.opt_data = opt_data;
+
+	return lws_spa_create_via_info(wsi, &i);
+}
+
+LWS_VISIBLE LWS_EXTERN int
+lws_spa_file_sink(struct lws_spa *spa, lws_fop_fd_t fop_fd)
+{
+	if (!spa->s || !spa->s->content_disp_filename[0])
+		return -1;
+
+	spa->sink = fop_fd;
+
+	return 0;
+}
+
 LWS_VISIBLE LWS_EXTERN int
 lws_spa_process(struct lws_spa *ludspa, const char *in, int len)
 {
@@ -0,0 +1,97 @@
+/*
+ * libwebsockets - small server side websockets and web server implementation
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+/*
+ * Extension to mimetype table used after the builtin types and the mount's
+ * extra_mimetypes, when built with LWS_WITH_FULL_MIMETYPES.
+ *
+ * Entries must stay sorted by extension (strcmp order) for the bsearch.
+ */
+
+static const struct lws_mimetype lws_mimetypes_full[] = {
+	{ ".7z", "application/x-7z-compressed" },
+	{ ".aac", "audio/aac" },
+	{ ".apng", "image/apng" },
+	{ ".avi", "video/x-msvideo" },
+	{ ".avif", "image/avif" },
+	{ ".bin", "application/octet-stream" },
+	{ ".bmp", "image/bmp" },
+	{ ".bz2", "application/x-bzip2" },
+	{ ".csv", "text/csv" },
+	{ ".doc", "application/msword" },
+	{ ".docx",
+	  "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+	{ ".eot", "application/vnd.ms-fontobject" },
+	{ ".epub", "application/epub+zip" },
+	{ ".flac", "audio/flac" },
+	{ ".htm", "text/html" },
+	{ ".ics", "text/calendar" },
+	{ ".jar", "application/java-archive" },
+	{ ".jpeg", "image/jpeg" },
+	{ ".json", "application/json" },
+	{ ".jsonld", "application/ld+json" },
+	{ ".m3u8", "application/vnd.apple.mpegurl" },
+	{ ".m4a", "audio/mp4" },
+	{ ".manifest", "text/cache-manifest" },
+	{ ".map", "application/json" },
+	{ ".md", "text/markdown" },
+	{ ".mid", "audio/midi" },
+	{ ".mjs", "text/javascript" },
+	{ ".mkv", "video/x-matroska" },
+	{ ".mov", "video/quicktime" },
+	{ ".mp3", "audio/mpeg" },
+	{ ".mp4", "video/mp4" },
+	{ ".mpeg", "video/mpeg" },
+	{ ".odp", "application/vnd.oasis.opendocument.presentation" },
+	{ ".ods", "application/vnd.oasis.opendocument.spreadsheet" },
+	{ ".odt", "application/vnd.oasis.opendocument.text" },
+	{ ".oga", "audio/ogg" },
+	{ ".ogg", "audio/ogg" },
+	{ ".ogv", "video/ogg" },
+	{ ".opus", "audio/opus" },
+	{ ".pdf", "application/pdf" },
+	{ ".ppt", "application/vnd.ms-powerpoint" },
+	{ ".pptx",
+	  "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+	{ ".rar", "application/vnd.rar" },
+	{ ".rtf", "application/rtf" },
+	{ ".sh", "application/x-sh" },
+	{ ".tar", "application/x-tar" },
+	{ ".tgz", "application/gzip" },
+	{ ".tif", "image/tiff" },
+	{ ".tiff", "image/tiff" },
+	{ ".ts", "video/mp2t" },
+	{ ".wasm", "application/wasm" },
+	{ ".wav", "audio/wav" },
+	{ ".weba", "audio/webm" },
+	{ ".webm", "video/webm" },
+	{ ".webmanifest", "application/manifest+json" },
+	{ ".webp", "image/webp" },
+	{ ".woff2", "font/woff2" },
+	{ ".xhtml", "application/xhtml+xml" },
+	{ ".xls", "application/vnd.ms-excel" },
+	{ ".xlsx",
+	  "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+	{ ".xz", "application/x-xz" },
+	{ ".yaml", "application/yaml" },
+	{ ".yml", "application/yaml" },
+	{ ".zip", "application/zip" },
+};
@@ -0,0 +1,528 @@
+/*
+ * libwebsockets - OpenMetrics exposition of server stats
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+#include "private-libwebsockets.h"
+
+/*
+ * The exposition is a fixed list of metric families, each with one "item"
+ * per context, service thread or vhost.  An item (one sample, or all the
+ * lines of one histogram) is only ever emitted whole, so the caller can take
+ * it a buffer at a time and the state just records the next family / item.
+ */
+
+enum lws_om_type {
+	LWSOMT_COUNTER,
+	LWSOMT_GAUGE,
+	LWSOMT_HISTOGRAM,
+};
+
+enum lws_om_unit {
+	LWSOMU_NONE,
+	LWSOMU_BYTES,
+	LWSOMU_SECONDS, /* we hold us, expose seconds */
+};
+
+enum lws_om_scope {
+	LWSOMS_CONTEXT,
+	LWSOMS_STATS, /* what is the LWSSTATS_ index */
+	LWSOMS_PT,
+	LWSOMS_VHOST,
+};
+
+enum lws_om_what {
+	LWSOMW_WSI_ALIVE,
+	LWSOMW_FDS_MAX,
+	LWSOMW_AH_POOL_MAX,
+	LWSOMW_CGI_SPAWNED,
+	LWSOMW_PEERS,
+	LWSOMW_PEER_LIMIT_AH,
+	LWSOMW_PEER_LIMIT_WSI,
+
+	LWSOMW_PT_FDS,
+	LWSOMW_PT_AH_IN_USE,
+	LWSOMW_PT_AH_WAIT_LIST,
+
+	LWSOMW_VH_RX,
+	LWSOMW_VH_TX,
+	LWSOMW_VH_H1_CONN,
+	LWSOMW_VH_H1_TRANS,
+	LWSOMW_VH_H2_TRANS,
+	LWSOMW_VH_WS_UPG,
+	LWSOMW_VH_H2_UPG,
+	LWSOMW_VH_H2_ALPN,
+	LWSOMW_VH_H2_SUBS,
+	LWSOMW_VH_REJECTED,
+
+	/* histograms use the LWSSTATS_LAT_ index as what */
+};
+
+struct lws_om_family {
+	const char *name;
+	const char *help;
+	unsigned char type;
+	unsigned char unit;
+	unsigned char scope;
+	unsigned char what;
+};
+
+#define C LWSOMT_COUNTER
+#define G LWSOMT_GAUGE
+#define H LWSOMT_HISTOGRAM
+
+static const struct lws_om_family lws_om_families[] = {
+	{ "lws_wsi_alive", "Connections and other wsi currently allocated",
+	  G, LWSOMU_NONE, LWSOMS_CONTEXT, LWSOMW_WSI_ALIVE },
+	{ "lws_fds_per_thread_max", "Fds each service thread can handle",
+	  G, LWSOMU_NONE, LWSOMS_CONTEXT, LWSOMW_FDS_MAX },
+	{ "lws_ah_pool_max", "Http header allocations per service thread",
+	  G, LWSOMU_NONE, LWSOMS_CONTEXT, LWSOMW_AH_POOL_MAX },
+#if defined(LWS_WITH_CGI)
+	{ "lws_cgi_spawned", "CGI processes spawned",
+	  C, LWSOMU_NONE, LWSOMS_CONTEXT, LWSOMW_CGI_SPAWNED },
+#endif
+#if defined(LWS_WITH_PEER_LIMITS)
+	{ "lws_peers", "Peer IPs currently tracked",
+	  G, LWSOMU_NONE, LWSOMS_CONTEXT, LWSOMW_PEERS },
+	{ "lws_peer_limit_ah", "Max http header allocations per peer IP, 0 is unlimited",
+	  G, LWSOMU_NONE, LWSOMS_CONTEXT, LWSOMW_PEER_LIMIT_AH },
+	{ "lws_peer_limit_wsi", "Max connections per peer IP, 0 is unlimited",
+	  G, LWSOMU_NONE, LWSOMS_CONTEXT, LWSOMW_PEER_LIMIT_WSI },
+#endif
+
+	{ "lws_pt_fds", "Fds in use by the service thread",
+	  G, LWSOMU_NONE, LWSOMS_PT, LWSOMW_PT_FDS },
+	{ "lws_pt_ah_in_use", "Http header allocations in use by the service thread",
+	  G, LWSOMU_NONE, LWSOMS_PT, LWSOMW_PT_AH_IN_USE },
+	{ "lws_pt_ah_wait_list", "Connections waiting for an http header allocation",
+	  G, LWSOMU_NONE, LWSOMS_PT, LWSOMW_PT_AH_WAIT_LIST },
+
+#if defined(LWS_WITH_STATS)
+	{ "lws_pt_service_loop_seconds", "Time spent servicing fds after each poll wait",
+	  H, LWSOMU_SECONDS, LWSOMS_PT, LWSSTATS_LAT_SERVICE_LOOP },
+
+	{ "lws_connections", "Incoming connections",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_CONNECTIONS },
+	{ "lws_api_close", "Calls to the close api",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_API_CLOSE },
+	{ "lws_api_read", "Calls to read from a socket",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_API_READ },
+	{ "lws_api_lws_write", "Calls to lws_write()",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_API_LWS_WRITE },
+	{ "lws_api_write", "Calls to write to a socket",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_API_WRITE },
+	{ "lws_write_partials", "Socket writes that were partial",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_WRITE_PARTIALS },
+	{ "lws_writeable_cb_requests", "Requests for a writable callback",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_WRITEABLE_CB_REQ },
+	{ "lws_writeable_cb_effective_requests", "Requests for a writable callback not already pending",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_WRITEABLE_CB_EFF_REQ },
+	{ "lws_writeable_cb", "Writable callbacks",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_WRITEABLE_CB },
+	{ "lws_tls_connections_failed", "Failed tls accepts",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_SSL_CONNECTIONS_FAILED },
+	{ "lws_tls_connections_accepted", "Completed tls accepts",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_SSL_CONNECTIONS_ACCEPTED },
+	{ "lws_tls_accept_spins", "Tls accept attempts",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_SSL_CONNECTIONS_ACCEPT_SPIN },
+	{ "lws_tls_connections_had_rx", "Accepted tls connections that received data",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_SSL_CONNS_HAD_RX },
+	{ "lws_timeouts", "Connections closed by timeout",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_TIMEOUTS },
+	{ "lws_service_entries", "Entries to the service loop",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_SERVICE_ENTRY },
+	{ "lws_read_bytes", "Bytes read",
+	  C, LWSOMU_BYTES, LWSOMS_STATS, LWSSTATS_B_READ },
+	{ "lws_write_bytes", "Bytes written",
+	  C, LWSOMU_BYTES, LWSOMS_STATS, LWSSTATS_B_WRITE },
+	{ "lws_partials_accepted_bytes", "Bytes buffered from partial writes",
+	  C, LWSOMU_BYTES, LWSOMS_STATS, LWSSTATS_B_PARTIALS_ACCEPTED_PARTS },
+	{ "lws_tls_accept_delay_seconds", "Total time from accept to tls accepted",
+	  C, LWSOMU_SECONDS, LWSOMS_STATS, LWSSTATS_MS_SSL_CONNECTIONS_ACCEPTED_DELAY },
+	{ "lws_writable_delay_seconds", "Total time from asking for writable to the callback",
+	  C, LWSOMU_SECONDS, LWSOMS_STATS, LWSSTATS_MS_WRITABLE_DELAY },
+	{ "lws_writable_delay_worst_seconds", "Worst time from asking for writable to the callback",
+	  G, LWSOMU_SECONDS, LWSOMS_STATS, LWSSTATS_MS_WORST_WRITABLE_DELAY },
+	{ "lws_tls_rx_delay_seconds", "Total time from tls accepted to first rx",
+	  C, LWSOMU_SECONDS, LWSOMS_STATS, LWSSTATS_MS_SSL_RX_DELAY },
+	{ "lws_peer_limit_ah_denied", "Http header allocations refused by the peer limit",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_PEER_LIMIT_AH_DENIED },
+	{ "lws_peer_limit_wsi_denied", "Connections refused by the peer limit",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_PEER_LIMIT_WSI_DENIED },
+	{ "lws_access_log_dropped", "Access log lines dropped",
+	  C, LWSOMU_NONE, LWSOMS_STATS, LWSSTATS_C_ACCESS_LOG_DROPPED },
+#endif
+
+	{ "lws_vhost_rx_bytes", "Bytes received",
+	  C, LWSOMU_BYTES, LWSOMS_VHOST, LWSOMW_VH_RX },
+	{ "lws_vhost_tx_bytes", "Bytes sent",
+	  C, LWSOMU_BYTES, LWSOMS_VHOST, LWSOMW_VH_TX },
+	{ "lws_vhost_h1_connections", "HTTP/1.x connections",
+	  C, LWSOMU_NONE, LWSOMS_VHOST, LWSOMW_VH_H1_CONN },
+	{ "lws_vhost_h1_transactions", "HTTP/1.x transactions",
+	  C, LWSOMU_NONE, LWSOMS_VHOST, LWSOMW_VH_H1_TRANS },
+	{ "lws_vhost_h2_transactions", "HTTP/2 transactions",
+	  C, LWSOMU_NONE, LWSOMS_VHOST, LWSOMW_VH_H2_TRANS },
+	{ "lws_vhost_ws_upgrades", "Upgrades to websocket",
+	  C, LWSOMU_NONE, LWSOMS_VHOST, LWSOMW_VH_WS_UPG },
+	{ "lws_vhost_h2_upgrades", "Upgrades to h2c",
+	  C, LWSOMU_NONE, LWSOMS_VHOST, LWSOMW_VH_H2_UPG },
+	{ "lws_vhost_h2_alpn", "HTTP/2 connections by alpn",
+	  C, LWSOMU_NONE, LWSOMS_VHOST, LWSOMW_VH_H2_ALPN },
+	{ "lws_vhost_h2_substreams", "HTTP/2 streams",
+	  C, LWSOMU_NONE, LWSOMS_VHOST, LWSOMW_VH_H2_SUBS },
+	{ "lws_vhost_rejected", "Connections rejected",
+	  C, LWSOMU_NONE, LWSOMS_VHOST, LWSOMW_VH_REJECTED },
+
+#if defined(LWS_WITH_STATS)
+	{ "lws_vhost_accept_tls_seconds", "Time from tcp accept to tls handshake complete",
+	  H, LWSOMU_SECONDS, LWSOMS_VHOST, LWSSTATS_LAT_ACCEPT_TLS },
+	{ "lws_vhost_first_byte_seconds", "Time from http headers complete to first response write",
+	  H, LWSOMU_SECONDS, LWSOMS_VHOST, LWSSTATS_LAT_FIRST_BYTE },
+	{ "lws_vhost_writable_seconds", "Time from asking for writable to the callback",
+	  H, LWSOMU_SECONDS, LWSOMS_VHOST, LWSSTATS_LAT_WRITABLE },
+#endif
+};
+
+#undef C
+#undef G
+#undef H
+
+static const char * const lws_om_types[] = { "counter", "gauge", "histogram" };
+static const char * const lws_om_units[] = { NULL, "bytes", "seconds" };
+
+/* returns nonzero without advancing *p if it didn't fit */
+
+static int
+lws_om_printf(char **p, char *end, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(*p, end - *p, format, ap);
+	va_end(ap);
+
+	if (n < 0 || n >= end - *p)
+		return 1;
+
+	*p += n;
+
+	return 0;
+}
+
+/* label values may contain anything, OpenMetrics wants \\, \" and \n escaped */
+
+static void
+lws_om_escape(char *d, size_t len, const char *s)
+{
+	char *end = d + len - 1;
+
+	while (*s && d < end) {
+		if (*s == '\\' || *s == '"' || *s == '\n') {
+			if (d + 2 > end)
+				break;
+			*d++ = '\\';
+			*d++ = *s == '\n' ? 'n' : *s;
+		} else
+			*d++ = *s;
+		s++;
+	}
+
+	*d = '\0';
+}
+
+static int
+lws_om_value(char **p, char *end, const struct lws_om_family *f, uint64_t v)
+{
+	if (f->unit == LWSOMU_SECONDS)
+		return lws_om_printf(p, end, "%llu.%06llu\n",
+				     (unsigned long long)(v / 1000000),
+				     (unsigned long long)(v % 1000000));
+
+	return lws_om_printf(p, end, "%llu\n", (unsigned long long)v);
+}
+
+static uint64_t
+lws_om_get(struct lws_context *context, const struct lws_om_family *f,
+	   struct lws_context_per_thread *pt, struct lws_vhost *vh)
+{
+	switch (f->what) {
+	case LWSOMW_WSI_ALIVE:
+		return context->count_wsi_allocated;
+	case LWSOMW_FDS_MAX:
+		return context->fd_limit_per_thread;
+	case LWSOMW_AH_POOL_MAX:
+		return context->max_http_header_pool;
+#if defined(LWS_WITH_CGI)
+	case LWSOMW_CGI_SPAWNED:
+		return context->count_cgi_spawned;
+#endif
+#if defined(LWS_WITH_PEER_LIMITS)
+	case LWSOMW_PEERS:
+		return context->count_peers;
+	case LWSOMW_PEER_LIMIT_AH:
+		return context->ip_limit_ah;
+	case LWSOMW_PEER_LIMIT_WSI:
+		return context->ip_limit_wsi;
+#endif
+
+	case LWSOMW_PT_FDS:
+		return pt->fds_count;
+	case LWSOMW_PT_AH_IN_USE:
+		return pt->ah_count_in_use;
+	case LWSOMW_PT_AH_WAIT_LIST:
+		return pt->ah_wait_list_length;
+
+	case LWSOMW_VH_RX:
+		return vh->conn_stats.rx;
+	case LWSOMW_VH_TX:
+		return vh->conn_stats.tx;
+	case LWSOMW_VH_H1_CONN:
+		return vh->conn_stats.h1_conn;
+	case LWSOMW_VH_H1_TRANS:
+		return vh->conn_stats.h1_trans;
+	case LWSOMW_VH_H2_TRANS:
+		return vh->conn_stats.h2_trans;
+	case LWSOMW_VH_WS_UPG:
+		return vh->conn_stats.ws_upg;
+	case LWSOMW_VH_H2_UPG:
+		return vh->conn_stats.h2_upg;
+	case LWSOMW_VH_H2_ALPN:
+		return vh->conn_stats.h2_alpn;
+	case LWSOMW_VH_H2_SUBS:
+		return vh->conn_stats.h2_subs;
+	case LWSOMW_VH_REJECTED:
+		return vh->conn_stats.rejected;
+	}
+
+	return 0;
+}
+
+static int
+lws_om_header(char **p, char *end, const struct lws_om_family *f)
+{
+	if (lws_om_printf(p, end, "# TYPE %s %s\n", f->name,
+			  lws_om_types[f->type]))
+		return 1;
+	if (lws_om_units[f->unit] &&
+	    lws_om_printf(p, end, "# UNIT %s %s\n", f->name,
+			  lws_om_units[f->unit]))
+		return 1;
+
+	return lws_om_printf(p, end, "# HELP %s %s\n", f->name, f->help);
+}
+
+#if defined(LWS_WITH_STATS)
+/*
+ * The histograms have 8 buckets per power of two, that's too many to scrape
+ * for every vhost, so expose one "le" per power of two.  Those boundaries
+ * are exact bucket edges, so the cumulative counts are exact too.  Anything
+ * from 2^31us (~36 minutes) up only shows in +Inf.
+ */
+static int
+lws_om_histogram(char **p, char *end, const struct lws_om_family *f,
+		 const char *lab, const struct lws_stats_hist *h)
+{
+	uint64_t c = 0, le;
+	int n, k = LWS_STATS_HIST_SUB_BITS;
+
+	for (n = 0; n < LWS_STATS_HIST_BUCKETS; n++) {
+		c += lws_stats_load(&h->bucket[n]);
+		/* the last bucket of each power of two, from 2^3 - 1 */
+		if (k < 32 && n == ((k - LWS_STATS_HIST_SUB_BITS) <<
+				    LWS_STATS_HIST_SUB_BITS) +
+				   (1 << LWS_STATS_HIST_SUB_BITS) - 1) {
+			le = (1ull << k) - 1;
+			if (lws_om_printf(p, end, "%s_bucket{%s%sle=\"%llu.%06llu\"} %llu\n",
+					  f->name, lab, *lab ? "," : "",
+					  (unsigned long long)(le / 1000000),
+					  (unsigned long long)(le % 1000000),
+					  (unsigned long long)c))
+				return 1;
+			k++;
+		}
+	}
+
+	if (lws_om_printf(p, end, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+			  f->name, lab, *lab ? "," : "",
+			  (unsigned long long)c) ||
+	    lws_om_printf(p, end, "%s_count%s%s%s %llu\n", f->name,
+			  *lab ? "{" : "", lab, *lab ? "}" : "",
+			  (unsigned long long)c) ||
+	    lws_om_printf(p, end, "%s_sum%s%s%s ", f->name,
+			  *lab ? "{" : "", lab, *lab ? "}" : ""))
+		return 1;
+
+	return lws_om_value(p, end, f, lws_stats_load(&h->sum_us));
+}
+#endif
+
+static int
+lws_om_item(struct lws_context *context, const struct lws_om_family *f,
+	    int item, struct lws_vhost *vh, char **p, char *end)
+{
+	struct lws_context_per_thread *pt = NULL;
+	char lab[192], esc[128];
+
+	lab[0] = '\0';
+
+	switch (f->scope) {
+	case LWSOMS_PT:
+		pt = &context->pt[item];
+		lws_snprintf(lab, sizeof(lab), "pt=\"%d\"", item);
+		break;
+	case LWSOMS_VHOST:
+		lws_om_escape(esc, sizeof(esc), vh->name);
+		lws_snprintf(lab, sizeof(lab), "vhost=\"%s\",port=\"%d\"",
+			     esc, vh->listen_port);
+		break;
+	}
+
+#if defined(LWS_WITH_STATS)
+	if (f->type == LWSOMT_HISTOGRAM) {
+		struct lws_stats_hist *h;
+		int n;
+
+		if (pt)
+			return lws_om_histogram(p, end, f, lab,
+						&pt->service_hist);
+
+		/* the vhost's are kept per pt */
+		h = lws_zalloc(sizeof(*h), "om hist");
+		if (!h)
+			return 1;
+		lws_stats_vh_hist_sum(h, vh, (enum lws_stats_latency)f->what);
+		n = lws_om_histogram(p, end, f, lab, h);
+		lws_free(h);
+
+		return n;
+	}
+#endif
+
+	if (lws_om_printf(p, end, "%s%s%s%s%s ", f->name,
+			  f->type == LWSOMT_COUNTER ? "_total" : "",
+			  *lab ? "{" : "", lab, *lab ? "}" : ""))
+		return 1;
+
+#if defined(LWS_WITH_STATS)
+	if (f->scope == LWSOMS_STATS)
+		return lws_om_value(p, end, f, lws_stats_get(context, f->what));
+#endif
+
+	return lws_om_value(p, end, f, lws_om_get(context, f, pt, vh));
+}
+
+LWS_VISIBLE LWS_EXTERN int
+lws_openmetrics_dump(struct lws_context *context,
+		     struct lws_openmetrics_state *st, char *buf, size_t len)
+{
+	char *p = buf, *end = buf + len, *rewind;
+	const struct lws_om_family *f;
+	struct lws_vhost *vh = NULL;
+	int vh_item = -1, n;
+
+	if (st->finished)
+		return 0;
+
+	while (st->family < (int)ARRAY_SIZE(lws_om_families)) {
+		f = &lws_om_families[st->family];
+
+		if (f->scope == LWSOMS_VHOST && st->hide_vhosts) {
+			st->family++;
+			continue;
+		}
+
+		if (!st->header_done) {
+			rewind = p;
+			if (lws_om_header(&p, end, f)) {
+				p = rewind;
+				goto full;
+			}
+			st->header_done = 1;
+		}
+
+		/* is there an item st->item in this family? */
+
+		switch (f->scope) {
+		case LWSOMS_PT:
+			n = st->item < context->count_threads;
+			break;
+		case LWSOMS_VHOST:
+			/* the list may change between calls, so go by index */
+			if (!vh || vh_item != st->item - 1) {
+				vh = context->vhost_list;
+				for (n = 0; vh && n < st->item; n++)
+					vh = vh->vhost_next;
+			} else
+				vh = vh->vhost_next;
+			vh_item = st->item;
+			n = !!vh;
+			break;
+		default:
+			n = !st->item;
+			break;
+		}
+
+		if (!n) {
+			st->family++;
+			st->item = 0;
+			st->header_done = 0;
+			vh = NULL;
+			continue;
+		}
+
+		rewind = p;
+		if (lws_om_item(context, f, st->item, vh, &p, end)) {
+			p = rewind;
+			goto full;
+		}
+		st->item++;
+	}
+
+	if (lws_om_printf(&p, end, "# EOF\n"))
+		goto full;
+
+	st->finished = 1;
+
+	return lws_ptr_diff(p, buf);
+
+full:
+	if (p == buf) {
+		lwsl_err("%s: buffer too small\n", __func__);
+		return -1;
+	}
+
+	return lws_ptr_diff(p, buf);
+}
+
+/*
+ * The lws-openmetrics protocol is built in too, so a vhost can have it
+ * without plugin support: lws_create_vhost() adds it to any vhost one of
+ * whose pvos names it, unless the vhost already has a protocol of that name.
+ */
+
+#if !defined(LWS_PLUGIN_STATIC)
+#define LWS_PLUGIN_STATIC
+#endif
+#include "../../plugins/protocol_lws_openmetrics.c"
+
+const struct lws_protocols lws_openmetrics_protocol =
+	LWS_PLUGIN_PROTOCOL_LWS_OPENMETRICS;
@@ -60,23 +60,64 @@ lextable_decode(int pos, char c)
 	}
 }
 
+/*
+ * ah structs come from per-pt slabs of LWS_AH_SLAB_COUNT and go back on a
+ * per-pt free list when detached, so attach / detach churn does not hit the
+ * allocator.  The header data starts small and is only grown towards
+ * max_http_header_data when a request actually needs it, so most ah cost a
+ * fraction of a full size one.
+ */
+
+static int
+_lws_ah_slab_add(struct lws_context_per_thread *pt)
+{
+	struct lws_ah_slab *slab = lws_zalloc(sizeof(*slab), "ah slab");
+	int n;
+
+	if (!slab)
+		return 1;
+
+	slab->next = pt->ah_slab_list;
+	pt->ah_slab_list = slab;
+
+	for (n = 0; n < LWS_AH_SLAB_COUNT; n++) {
+		slab->ah[n].next = pt->ah_free_list;
+		pt->ah_free_list = &slab->ah[n];
+	}
+
+	return 0;
+}
+
 static struct allocated_headers *
 _lws_create_ah(struct lws_context_per_thread *pt, ah_data_idx_t data_size)
 {
-	struct allocated_headers *ah = lws_zalloc(sizeof(*ah), "ah struct");
+	struct allocated_headers *ah;
+	ah_data_idx_t data_length;
+	char *data;
 
-	if (!ah)
+	if (!pt->ah_free_list && _lws_ah_slab_add(pt))
 		return NULL;
 
-	ah->data = lws_malloc(data_size, "ah data");
-	if (!ah->data) {
-		lws_free(ah);
+	ah = pt->ah_free_list;
 
-		return NULL;
+	if (!ah->data) {
+		ah->data = lws_malloc(data_size, "ah data");
+		if (!ah->data)
+			return NULL;
+		ah->data_length = data_size;
 	}
+
+	pt->ah_free_list = ah->next;
+
+	/* the data (and its size) is all we keep from any last use */
+	data = ah->data;
+	data_length = ah->data_length;
+	memset(ah, 0, sizeof(*ah));
+	ah->data = data;
+	ah->data_length = data_length;
+
 	ah->next = pt->ah_list;
 	pt->ah_list = ah;
-	ah->data_length = data_size;
 	pt->ah_pool_length++;
 
 	lwsl_info("%s: created ah %p (size %d): pool length %d\n", __func__,
@@ -88,15 +129,28 @@ _lws_create_ah(struct lws_context_per_thread *pt, ah_data_idx_t data_size)
 int
 _lws_destroy_ah(struct lws_context_per_thread *pt, struct allocated_headers *ah)
 {
+	char *p;
+
 	lws_start_foreach_llp(struct allocated_headers **, a, pt->ah_list) {
 		if ((*a) == ah) {
 			*a = ah->next;
 			pt->ah_pool_length--;
 			lwsl_info("%s: freed ah %p : pool length %d\n",
 				    __func__, ah, pt->ah_pool_length);
-			if (ah->data)
-				lws_free(ah->data);
-			lws_free(ah);
+
+			/* if it had to grow, give the excess back */
+			if (ah->data && ah->data_length > LWS_AH_DATA_INITIAL) {
+				p = lws_realloc(ah->data, LWS_AH_DATA_INITIAL,
+						"ah data shrink");
+				if (p) {
+					ah->data = p;
+					ah->data_length = LWS_AH_DATA_INITIAL;
+				}
+			}
+
+			ah->wsi = NULL;
+			ah->next = pt->ah_free_list;
+			pt->ah_free_list = ah;
 
 			return 0;
 		}
@@ -105,6 +159,52 @@ _lws_destroy_ah(struct lws_context_per_thread *pt, struct allocated_headers *ah)
 	return 1;
 }
 
+void
+_lws_ah_slabs_destroy(struct lws_context_per_thread *pt)
+{
+	struct lws_ah_slab *slab;
+	int n;
+
+	while (pt->ah_list)
+		_lws_destroy_ah(pt, pt->ah_list);
+
+	while (pt->ah_slab_list) {
+		slab = pt->ah_slab_list;
+		pt->ah_slab_list = slab->next;
+		for (n = 0; n < LWS_AH_SLAB_COUNT; n++)
+			if (slab->ah[n].data)
+				lws_free(slab->ah[n].data);
+		lws_free(slab);
+	}
+	pt->ah_free_list = NULL;
+}
+
+int
+_lws_ah_data_grow(struct lws_context *context, struct allocated_headers *ah)
+{
+	unsigned int n = ah->data_length * 2;
+	char *p;
+
+	if (ah->data_length >= (unsigned int)context->max_http_header_data)
+		return 1;
+
+	if (n > (unsigned int)context->max_http_header_data)
+		n = context->max_http_header_data;
+
+	p = lws_realloc(ah->data, n, "ah data grow");
+	if (!p) {
+		lwsl_err("%s: OOM growing ah to %u\n", __func__, n);
+		return 1;
+	}
+
+	lwsl_debug("%s: ah %p data %u -> %u\n", __func__, ah,
+		   (unsigned int)ah->data_length, n);
+	ah->data = p;
+	ah->data_length = n;
+
+	return 0;
+}
+
 void
 _lws_header_table_reset(struct allocated_headers *ah)
 {
@@ -260,7 +360,10 @@ lws_header_table_attach(struct lws *wsi, int autoservice)
 
 	__lws_remove_from_ah_waiting_list(wsi);
 
-	wsi->u.hdr.ah = _lws_create_ah(pt, context->max_http_header_data);
+	n = context->max_http_header_data;
+	if (n > LWS_AH_DATA_INITIAL)
+		n = LWS_AH_DATA_INITIAL;
+	wsi->u.hdr.ah = _lws_create_ah(pt, n);
 	if (!wsi->u.hdr.ah) { /* we could not create an ah */
 		_lws_header_ensure_we_are_on_waiting_list(wsi);
 
@@ -597,10 +700,15 @@ char *lws_hdr_simple_ptr(struct lws *wsi, enum lws_token_indexes h)
 int LWS_WARN_UNUSED_RESULT
 lws_pos_in_bounds(struct lws *wsi)
 {
-	if (wsi->u.hdr.ah->pos <
-	    (unsigned int)wsi->context->max_http_header_data)
+	struct allocated_headers *ah = wsi->u.hdr.ah;
+
+	if (ah->pos < ah->data_length)
 		return 0;
 
+	/* out of data we have, but we may be allowed more */
+	if (ah->pos < (unsigned int)wsi->context->max_http_header_data)
+		return _lws_ah_data_grow(wsi->context, ah);
+
 	if ((int)wsi->u.hdr.ah->pos == wsi->context->max_http_header_data) {
 		lwsl_err("Ran out of header data space\n");
 		return 1;
@@ -892,6 +1000,24 @@ static const unsigned char methods[] = {
 	WSI_TOKEN_HEAD_URI,
 };
 
+static int
+lws_parse_state_is_method(int state)
+{
+	switch (state) {
+	case WSI_TOKEN_GET_URI:
+	case WSI_TOKEN_POST_URI:
+	case WSI_TOKEN_OPTIONS_URI:
+	case WSI_TOKEN_PUT_URI:
+	case WSI_TOKEN_PATCH_URI:
+	case WSI_TOKEN_DELETE_URI:
+	case WSI_TOKEN_CONNECT:
+	case WSI_TOKEN_HEAD_URI:
+		return 1;
+	}
+
+	return 0;
+}
+
 int LWS_WARN_UNUSED_RESULT
 lws_parse(struct lws *wsi, unsigned char c)
 {
@@ -909,15 +1035,10 @@ lws_parse(struct lws *wsi, unsigned char c)
 
 		/* collect into malloc'd buffers */
 		/* optional initial space swallow */
-		if (!ah->frags[ah->frag_index[wsi->u.hdr.parser_state]].len &&
-		    c == ' ')
+		if (!ah->frags[ah->nfrag].len && c == ' ')
 			break;
 
-		for (m = 0; m < ARRAY_SIZE(methods); m++)
-			if (wsi->u.hdr.parser_state == methods[m])
-				break;
-		if (m == ARRAY_SIZE(methods))
-			/* it was not any of the methods */
+		if (!lws_parse_state_is_method(wsi->u.hdr.parser_state))
 			goto check_eol;
 
 		/* special URI processing... end at space */
@@ -1153,6 +1274,69 @@ forbid:
 	return -1;
 }
 
+/*
+ * lws_parse() has to look at every byte, but most of a request is header
+ * values and headers we skip, where all it does is copy or drop bytes until
+ * the CR.  When the parser is in one of those states, find the CR with
+ * memchr() (vectorized by the libc) and deal with the run in one go.
+ *
+ * Returns how many bytes at buf were consumed, which may be 0.  It never
+ * consumes the CR or anything after it, nor anything that would need
+ * lws_parse()'s special handling (leading space, NUL, hitting a limit), so
+ * the caller just feeds the next byte to lws_parse() as usual.
+ */
+
+int
+lws_parse_span(struct lws *wsi, const unsigned char *buf, size_t len)
+{
+	struct allocated_headers *ah = wsi->u.hdr.ah;
+	int state = wsi->u.hdr.parser_state;
+	const unsigned char *cr;
+	struct lws_fragments *f;
+	size_t n, room;
+
+	if (len < 2)
+		return 0;
+
+	cr = memchr(buf, '\x0d', len);
+	n = cr ? (size_t)(cr - buf) : len;
+	if (!n)
+		return 0;
+
+	if (state == WSI_TOKEN_SKIPPING)
+		return (int)n;
+
+	if (state >= WSI_TOKEN_COUNT || state == WSI_TOKEN_CHALLENGE ||
+	    lws_parse_state_is_method(state))
+		return 0;
+
+	/* lws_parse() swallows a space starting the header */
+	if (buf[0] == ' ' && !ah->frags[ah->nfrag].len)
+		return 0;
+
+	/* stored but not counted by lws_parse(), leave it to that */
+	if (memchr(buf, '\0', n))
+		return 0;
+
+	f = &ah->frags[ah->nfrag];
+	room = 0;
+	if (f->len < wsi->u.hdr.current_token_limit)
+		room = wsi->u.hdr.current_token_limit - f->len;
+	/* lws_parse() will grow the ah data if the run needs more */
+	if (ah->pos + room > ah->data_length)
+		room = ah->data_length - ah->pos;
+	if (n > room)
+		n = room;
+	if (!n)
+		return 0;
+
+	memcpy(ah->data + ah->pos, buf, n);
+	ah->pos += (uint32_t)n;
+	f->len += (uint16_t)n;
+
+	return (int)n;
+}
+
 LWS_VISIBLE int lws_frame_is_binary(struct lws *wsi)
 {
 	return wsi->u.ws.frame_is_binary;
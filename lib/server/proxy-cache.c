@@ -0,0 +1,1493 @@
+/*
+ * libwebsockets - response cache for reverse proxy mounts
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+#include "private-libwebsockets.h"
+
+/*
+ * A proxy mount with proxy_cache_mem set keeps GET responses the upstream
+ * says can be shared, keyed by the upstream path and the values of the
+ * request headers named in the response's Vary.  Bodies are kept in memory
+ * up to proxy_cache_mem bytes, and beyond that, if there is a
+ * proxy_cache_dir, in files there up to proxy_cache_disk bytes; the least
+ * recently used entries are pushed out to disk, and then dropped, to stay
+ * inside those.
+ *
+ * The first request to miss creates the entry and fills it from the
+ * upstream response as that is passed on to its client.  Requests for the
+ * same path meanwhile wait on their pt's list and look it up again when
+ * the filling finishes.  Stale entries with an ETag are revalidated the
+ * same way, with If-None-Match.  A response that can't be stored leaves a
+ * "pass" entry for a while, so later requests go straight to the upstream
+ * instead of queueing behind each other.
+ *
+ * A request with Authorization only ever gets, or stores, a response that
+ * said public, s-maxage or must-revalidate (RFC 7234 3.2); other entries
+ * are left alone and it goes to the upstream.
+ *
+ * Hits are sent by the static file path: memory entries through a small
+ * fops reading the body in place, spilled ones as an ordinary file.
+ *
+ * Entries are shared between pts, under the cache lock.  Once filled, the
+ * body, headers and vary values of an entry don't change, so they are read
+ * without the lock by whoever holds a reference on it.
+ */
+
+#define LWS_PXC_HASH 256
+#define LWS_PXC_MAX_VARY 8
+#define LWS_PXC_VARY_LEN 1024
+#define LWS_PXC_HDRS_LEN 2048
+/* one response may use up to this fraction of the memory or disk limit */
+#define LWS_PXC_OBJ_DIV 4
+#define LWS_PXC_DEF_DISK (256ul * 1024 * 1024)
+/* how long an uncacheable response stops us trying to cache the path */
+#define LWS_PXC_PASS_SECS 10
+
+#if LWS_MAX_SMP > 1
+#define lws_pxc_lock(c) pthread_mutex_lock(&(c)->lock)
+#define lws_pxc_unlock(c) pthread_mutex_unlock(&(c)->lock)
+#else
+#define lws_pxc_lock(c) (void)(c)
+#define lws_pxc_unlock(c) (void)(c)
+#endif
+
+struct lws_pxc_entry {
+	struct lws_pxc_entry *hash_next;
+	struct lws_pxc_entry *lru_prev, *lru_next; /* most recent first */
+	struct lws_proxy_cache *cache;
+	unsigned char *body; /* in memory... */
+	char *file; /* ...or in this file */
+	char *vary; /* the request's values for vary_tok, NUL after each */
+	unsigned char *hdrs; /* response headers to send: token, len, value */
+	size_t len; /* of the body */
+	size_t alloc; /* of body, while filling it */
+	size_t mem; /* what we count against the memory limit */
+	time_t stored; /* when we got or last revalidated it */
+	time_t expires; /* fresh until */
+	uint32_t hash;
+	int refs;
+	int fd; /* filling the file */
+	unsigned short vary_len;
+	unsigned short hdrs_len;
+	unsigned char vary_tok[LWS_PXC_MAX_VARY];
+	unsigned char count_vary;
+	char fill_tsi;
+	char waiting[LWS_MAX_SMP]; /* pts with requests waiting for it */
+	unsigned int filling:1; /* a request is fetching or revalidating it */
+	unsigned int pass:1; /* not cacheable, fetch it directly */
+	unsigned int linked:1; /* in the hash table */
+	unsigned int in_lru:1; /* filled and counted against the limits */
+	unsigned int shared:1; /* may be used for requests with Authorization */
+	char key[1]; /* the upstream path, overallocated */
+};
+
+struct lws_proxy_cache {
+	struct lws_pxc_entry *hash[LWS_PXC_HASH];
+	struct lws_pxc_entry *lru_head, *lru_tail;
+	const char *dir;
+	size_t mem_limit, mem_used;
+	unsigned long long disk_limit, disk_used;
+#if LWS_MAX_SMP > 1
+	pthread_mutex_t lock;
+#endif
+};
+
+/* what a Cache-Control header said */
+struct lws_pxc_cc {
+	long max_age; /* -1 if not given */
+	long s_maxage;
+	unsigned int no_store:1;
+	unsigned int no_cache:1;
+	unsigned int priv:1;
+	unsigned int pub:1;
+	unsigned int must_reval:1;
+};
+
+/* stored from the response, and sent with hits */
+static const unsigned char lws_pxc_hdr_toks[] = {
+	WSI_TOKEN_HTTP_CONTENT_TYPE,
+	WSI_TOKEN_HTTP_CACHE_CONTROL,
+	WSI_TOKEN_HTTP_ETAG,
+	WSI_TOKEN_HTTP_LAST_MODIFIED,
+	WSI_TOKEN_HTTP_EXPIRES,
+	WSI_TOKEN_HTTP_VARY,
+};
+
+/*
+ * Next item of a comma-separated header value at *p, NUL-terminated in
+ * place.  If val is given, name=value items are split there too.
+ */
+
+static char *
+lws_pxc_item(char **p, char **val)
+{
+	char *s = *p, *e, *q;
+	size_t n;
+
+	while (*s == ' ' || *s == '\t' || *s == ',')
+		s++;
+	if (!*s)
+		return NULL;
+
+	e = s;
+	while (*e && *e != ',')
+		e++;
+	*p = *e ? e + 1 : e;
+	*e = '\0';
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+		*--e = '\0';
+
+	if (!val)
+		return s;
+
+	*val = NULL;
+	q = strchr(s, '=');
+	if (q) {
+		*q++ = '\0';
+		if (*q == '"') {
+			q++;
+			n = strlen(q);
+			if (n && q[n - 1] == '"')
+				q[n - 1] = '\0';
+		}
+		*val = q;
+	}
+
+	return s;
+}
+
+static void
+lws_pxc_parse_cc(struct lws *wsi, struct lws_pxc_cc *cc)
+{
+	char buf[256], *p, *t, *v;
+	int f = 0;
+
+	memset(cc, 0, sizeof(*cc));
+	cc->max_age = -1;
+	cc->s_maxage = -1;
+
+	while (lws_hdr_copy_fragment(wsi, buf, sizeof(buf),
+				     WSI_TOKEN_HTTP_CACHE_CONTROL, f++) >= 0) {
+		p = buf;
+		while ((t = lws_pxc_item(&p, &v))) {
+			/* the field-list forms only ever make us more careful */
+			if (!strcasecmp(t, "no-store"))
+				cc->no_store = 1;
+			else if (!strcasecmp(t, "no-cache"))
+				cc->no_cache = 1;
+			else if (!strcasecmp(t, "private"))
+				cc->priv = 1;
+			else if (!strcasecmp(t, "public"))
+				cc->pub = 1;
+			else if (!strcasecmp(t, "must-revalidate"))
+				cc->must_reval = 1;
+			else if (v && !strcasecmp(t, "max-age"))
+				cc->max_age = atol(v);
+			else if (v && !strcasecmp(t, "s-maxage"))
+				cc->s_maxage = atol(v);
+		}
+	}
+}
+
+/* IMF-fixdate, eg, "Sun, 06 Nov 1994 08:49:37 GMT", or 0 if it isn't one */
+
+static time_t
+lws_pxc_http_date(const char *s)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	int d, m, y, hh, mm, ss, era, yoe, doy, doe;
+	char mon[4];
+	const char *p;
+
+	if (sscanf(s, "%*3s, %2d %3s %4d %2d:%2d:%2d", &d, mon, &y, &hh, &mm,
+		   &ss) != 6)
+		return 0;
+
+	p = strstr(months, mon);
+	if (!p || (p - months) % 3 || y < 1970)
+		return 0;
+	m = (int)(p - months) / 3 + 1;
+
+	/* days since 1970-01-01 in the proleptic gregorian calendar */
+	y -= m <= 2;
+	era = y / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return (time_t)(era * 146097 + doe - 719468) * 86400 +
+	       hh * 3600 + mm * 60 + ss;
+}
+
+/* seconds the response is fresh for, or -1 if it didn't say */
+
+static long
+lws_pxc_freshness(struct lws *wsi, const struct lws_pxc_cc *cc, time_t now)
+{
+	time_t expires, date = now, t;
+	char buf[64];
+
+	if (cc->no_cache)
+		return 0;
+	if (cc->s_maxage >= 0)
+		return cc->s_maxage;
+	if (cc->max_age >= 0)
+		return cc->max_age;
+
+	if (lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_EXPIRES) <= 0)
+		return -1;
+	/* an invalid one means it already expired */
+	expires = lws_pxc_http_date(buf);
+
+	if (lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_DATE) > 0) {
+		t = lws_pxc_http_date(buf);
+		if (t)
+			date = t;
+	}
+
+	return expires > date ? (long)(expires - date) : 0;
+}
+
+static int
+lws_pxc_name_to_token(const char *name)
+{
+	size_t len = strlen(name);
+	const unsigned char *s;
+	int n;
+
+	for (n = 0; n < WSI_TOKEN_COUNT; n++) {
+		s = lws_token_to_string((enum lws_token_indexes)n);
+		if (s && !strncasecmp((const char *)s, name, len) &&
+		    s[len] == ':')
+			return n;
+	}
+
+	return -1;
+}
+
+/* the request headers a response varies on, or -1 if we can't store it */
+
+static int
+lws_pxc_parse_vary(struct lws *wsi, unsigned char *tok)
+{
+	char buf[256], *p, *t;
+	int f = 0, count = 0, n;
+
+	if (lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_VARY) >= (int)sizeof(buf))
+		return -1;
+
+	while (lws_hdr_copy_fragment(wsi, buf, sizeof(buf),
+				     WSI_TOKEN_HTTP_VARY, f++) >= 0) {
+		p = buf;
+		while ((t = lws_pxc_item(&p, NULL))) {
+			if (!strcmp(t, "*"))
+				return -1;
+			/* we can only tell apart headers we parse */
+			n = lws_pxc_name_to_token(t);
+			if (n < 0 || count == LWS_PXC_MAX_VARY)
+				return -1;
+			tok[count++] = (unsigned char)n;
+		}
+	}
+
+	return count;
+}
+
+static int
+lws_pxc_vary_values(struct lws *wsi, const unsigned char *tok, int count,
+		    char *buf, int len)
+{
+	int n, m, used = 0;
+
+	for (n = 0; n < count; n++) {
+		m = lws_hdr_total_length(wsi, (enum lws_token_indexes)tok[n]);
+		if (used + m + 1 > len)
+			return -1;
+		buf[used] = '\0';
+		if (m && lws_hdr_copy(wsi, buf + used, len - used,
+				      (enum lws_token_indexes)tok[n]) < 0)
+			return -1;
+		used += m + 1;
+	}
+
+	return used;
+}
+
+static int
+lws_pxc_vary_match(struct lws *wsi, const struct lws_pxc_entry *e)
+{
+	char buf[LWS_PXC_VARY_LEN];
+	int n;
+
+	if (!e->count_vary)
+		return 1;
+
+	n = lws_pxc_vary_values(wsi, e->vary_tok, e->count_vary, buf,
+				sizeof(buf));
+
+	return n == e->vary_len && !memcmp(buf, e->vary, n);
+}
+
+static const char *
+lws_pxc_hdr(const struct lws_pxc_entry *e, int tok, int *len)
+{
+	const unsigned char *p = e->hdrs, *end = p + e->hdrs_len;
+	int n;
+
+	while (p + 3 <= end) {
+		n = (p[1] << 8) | p[2];
+		if (p[0] == tok) {
+			*len = n;
+			return (const char *)p + 3;
+		}
+		p += 3 + n;
+	}
+
+	return NULL;
+}
+
+static int
+lws_pxc_hdrs_build(struct lws *wsi, unsigned char *buf, int len)
+{
+	int n, m, f, used = 0;
+	char v[512];
+
+	for (n = 0; n < (int)ARRAY_SIZE(lws_pxc_hdr_toks); n++)
+		for (f = 0; (m = lws_hdr_copy_fragment(wsi, v, sizeof(v),
+				(enum lws_token_indexes)lws_pxc_hdr_toks[n],
+				f)) >= 0; f++) {
+			if (used + 3 + m > len)
+				return -1;
+			buf[used++] = lws_pxc_hdr_toks[n];
+			buf[used++] = (unsigned char)(m >> 8);
+			buf[used++] = (unsigned char)m;
+			memcpy(buf + used, v, m);
+			used += m;
+		}
+
+	return used;
+}
+
+/*
+ * Memory entries are served through these fops by the static file path,
+ * which holds a reference on the entry until it closes the fop_fd
+ */
+
+static void
+lws_pxc_free(struct lws_pxc_entry *e)
+{
+	if (e->fd >= 0)
+		close(e->fd);
+	lws_free(e->body);
+	lws_free(e->file);
+	lws_free(e->vary);
+	lws_free(e->hdrs);
+	lws_free(e);
+}
+
+static void
+lws_pxc_unref(struct lws_pxc_entry *e)
+{
+	if (!--e->refs && !e->linked)
+		lws_pxc_free(e);
+}
+
+static lws_fop_fd_t
+lws_pxc_fops_open(const struct lws_plat_file_ops *fops, const char *filename,
+		  const char *vpath, lws_fop_flags_t *flags)
+{
+	/* only ever opened by lws_pxc_open() */
+	return NULL;
+}
+
+static int
+lws_pxc_fops_close(lws_fop_fd_t *fop_fd)
+{
+	struct lws_pxc_entry *e = (*fop_fd)->filesystem_priv;
+	struct lws_proxy_cache *c = e->cache;
+
+	lws_pxc_lock(c);
+	lws_pxc_unref(e);
+	lws_pxc_unlock(c);
+
+	lws_free_set_NULL(*fop_fd);
+
+	return 0;
+}
+
+static lws_fileofs_t
+lws_pxc_fops_seek_cur(lws_fop_fd_t fop_fd, lws_fileofs_t offset_from_cur_pos)
+{
+	lws_fileofs_t pos = (lws_fileofs_t)fop_fd->pos + offset_from_cur_pos;
+
+	if (pos < 0)
+		pos = 0;
+	if (pos > (lws_fileofs_t)fop_fd->len)
+		pos = fop_fd->len;
+	fop_fd->pos = pos;
+
+	return pos;
+}
+
+static int
+lws_pxc_fops_read(lws_fop_fd_t fop_fd, lws_filepos_t *amount, uint8_t *buf,
+		  lws_filepos_t len)
+{
+	struct lws_pxc_entry *e = fop_fd->filesystem_priv;
+
+	if (len > fop_fd->len - fop_fd->pos)
+		len = fop_fd->len - fop_fd->pos;
+	memcpy(buf, e->body + fop_fd->pos, (size_t)len);
+	fop_fd->pos += len;
+	*amount = len;
+
+	return 0;
+}
+
+static const struct lws_plat_file_ops fops_pxc = {
+	lws_pxc_fops_open,
+	lws_pxc_fops_close,
+	lws_pxc_fops_seek_cur,
+	lws_pxc_fops_read,
+	NULL,
+	{ { NULL, 0 } },
+	NULL
+};
+
+/* call with the cache locked */
+
+static lws_fop_fd_t
+lws_pxc_open(struct lws *wsi, struct lws_pxc_entry *e)
+{
+	lws_fop_flags_t flags = LWS_O_RDONLY;
+	lws_fop_fd_t fop;
+
+	if (e->file)
+		return lws_vfs_file_open(wsi->context->fops, e->file, &flags);
+
+	fop = lws_zalloc(sizeof(*fop), "proxy cache fop");
+	if (!fop)
+		return NULL;
+
+	fop->fops = &fops_pxc;
+	fop->filesystem_priv = e;
+	fop->len = e->len;
+	e->refs++;
+
+	return fop;
+}
+
+static void
+lws_pxc_lru_remove(struct lws_proxy_cache *c, struct lws_pxc_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		c->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		c->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void
+lws_pxc_lru_add(struct lws_proxy_cache *c, struct lws_pxc_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = c->lru_head;
+	if (c->lru_head)
+		c->lru_head->lru_prev = e;
+	else
+		c->lru_tail = e;
+	c->lru_head = e;
+}
+
+/* count a filled entry against the limits */
+
+static void
+lws_pxc_account(struct lws_proxy_cache *c, struct lws_pxc_entry *e)
+{
+	e->mem = sizeof(*e) + strlen(e->key) + e->vary_len + e->hdrs_len;
+	if (e->body)
+		e->mem += e->len;
+	c->mem_used += e->mem;
+	if (e->file)
+		c->disk_used += e->len;
+
+	lws_pxc_lru_add(c, e);
+	e->in_lru = 1;
+}
+
+static void
+lws_pxc_unaccount(struct lws_proxy_cache *c, struct lws_pxc_entry *e)
+{
+	if (!e->in_lru)
+		return;
+
+	c->mem_used -= e->mem;
+	if (e->file)
+		c->disk_used -= e->len;
+
+	lws_pxc_lru_remove(c, e);
+	e->in_lru = 0;
+}
+
+/* take it out of the cache, it goes when the last reference does */
+
+static void
+lws_pxc_drop(struct lws_proxy_cache *c, struct lws_pxc_entry *e)
+{
+	struct lws_pxc_entry **pe = &c->hash[e->hash % LWS_PXC_HASH];
+
+	if (!e->linked)
+		return;
+
+	while (*pe != e)
+		pe = &(*pe)->hash_next;
+	*pe = e->hash_next;
+
+	lws_pxc_unaccount(c, e);
+	if (e->file)
+		unlink(e->file);
+
+	/* anyone waiting on it must look again */
+	e->filling = 0;
+	e->linked = 0;
+
+	if (!e->refs)
+		lws_pxc_free(e);
+}
+
+static struct lws_pxc_entry *
+lws_pxc_create(struct lws_proxy_cache *c, const char *key, uint32_t hash,
+	       int tsi)
+{
+	struct lws_pxc_entry *e;
+	size_t n = strlen(key);
+
+	e = lws_zalloc(sizeof(*e) + n, "proxy cache entry");
+	if (!e)
+		return NULL;
+
+	memcpy(e->key, key, n + 1);
+	e->cache = c;
+	e->hash = hash;
+	e->fd = -1;
+	e->fill_tsi = (char)tsi;
+	e->filling = 1;
+	e->refs = 1;
+
+	e->hash_next = c->hash[hash % LWS_PXC_HASH];
+	c->hash[hash % LWS_PXC_HASH] = e;
+	e->linked = 1;
+
+	return e;
+}
+
+static int
+lws_pxc_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+lws_pxc_file_create(struct lws_proxy_cache *c, struct lws_pxc_entry *e)
+{
+	char path[256];
+	int n;
+
+	n = lws_snprintf(path, sizeof(path), "%s/lws-pxc-%d-%p", c->dir,
+			 (int)getpid(), e);
+
+	e->fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (e->fd < 0) {
+		lwsl_err("%s: can't create %s\n", __func__, path);
+		return 1;
+	}
+
+	e->file = lws_malloc(n + 1, "proxy cache file");
+	if (!e->file) {
+		close(e->fd);
+		e->fd = -1;
+		unlink(path);
+		return 1;
+	}
+	memcpy(e->file, path, n + 1);
+
+	return 0;
+}
+
+/* move a memory entry's body out to a file, to make room */
+
+static int
+lws_pxc_spill(struct lws_proxy_cache *c, struct lws_pxc_entry *e)
+{
+	if (!c->dir || e->len > c->disk_limit / LWS_PXC_OBJ_DIV)
+		return 1;
+
+	if (lws_pxc_file_create(c, e))
+		return 1;
+
+	if (lws_pxc_write(e->fd, e->body, e->len)) {
+		close(e->fd);
+		e->fd = -1;
+		unlink(e->file);
+		lws_free_set_NULL(e->file);
+
+		return 1;
+	}
+	close(e->fd);
+	e->fd = -1;
+
+	lws_free_set_NULL(e->body);
+	c->mem_used -= e->len;
+	e->mem -= e->len;
+	c->disk_used += e->len;
+
+	return 0;
+}
+
+static void
+lws_pxc_evict(struct lws_proxy_cache *c)
+{
+	struct lws_pxc_entry *e, *e1;
+
+	/* entries in use stay until they're not */
+
+	for (e = c->lru_tail; e && c->mem_used > c->mem_limit; e = e1) {
+		e1 = e->lru_prev;
+		if (e->refs || e->filling || e->file)
+			continue;
+		if (!e->body || lws_pxc_spill(c, e))
+			lws_pxc_drop(c, e);
+	}
+
+	/* spilled entries only cost memory for what we know about them */
+
+	for (e = c->lru_tail; e && (c->disk_used > c->disk_limit ||
+				    c->mem_used > c->mem_limit); e = e1) {
+		e1 = e->lru_prev;
+		if (e->file && !e->filling)
+			lws_pxc_drop(c, e);
+	}
+}
+
+/* remember for a while it's not cacheable, so requests don't queue on it */
+
+static void
+lws_pxc_pass(struct lws_proxy_cache *c, struct lws_pxc_entry *e)
+{
+	lws_pxc_unaccount(c, e);
+
+	if (e->fd >= 0) {
+		close(e->fd);
+		e->fd = -1;
+	}
+	if (e->file) {
+		unlink(e->file);
+		lws_free_set_NULL(e->file);
+	}
+	lws_free_set_NULL(e->body);
+	lws_free_set_NULL(e->vary);
+	lws_free_set_NULL(e->hdrs);
+	e->len = 0;
+	e->alloc = 0;
+	e->vary_len = 0;
+	e->hdrs_len = 0;
+	e->count_vary = 0;
+
+	e->pass = 1;
+	e->filling = 0;
+	e->expires = time(NULL) + LWS_PXC_PASS_SECS;
+
+	lws_pxc_account(c, e);
+	lws_pxc_evict(c);
+}
+
+static size_t
+lws_pxc_max_object(struct lws_proxy_cache *c)
+{
+	unsigned long long n = c->dir ? c->disk_limit / LWS_PXC_OBJ_DIV : 0;
+
+	if (n < c->mem_limit / LWS_PXC_OBJ_DIV)
+		n = c->mem_limit / LWS_PXC_OBJ_DIV;
+
+	return n > (size_t)-1 ? (size_t)-1 : (size_t)n;
+}
+
+/*
+ * Waiters are listed on their own pt, and each entry notes which pts have
+ * any.  When it stops filling, the pt that filled it wakes its own waiters
+ * and posts to the other pts to wake theirs.
+ */
+
+static void
+lws_pxc_take_waiting(struct lws_pxc_entry *e, char *pts)
+{
+	int n;
+
+	for (n = 0; n < LWS_MAX_SMP; n++) {
+		pts[n] |= e->waiting[n];
+		e->waiting[n] = 0;
+	}
+}
+
+static void
+lws_pxc_wake_pt(struct lws_context_per_thread *pt)
+{
+	struct lws **pw = &pt->pxc_waiters, *w;
+	struct lws_proxy_cache *c;
+	struct lws_proxy_req *req;
+	struct lws_pxc_entry *e;
+	int filling;
+
+	while (*pw) {
+		w = *pw;
+		req = w->pxy_req;
+		e = req->cent;
+		c = e->cache;
+
+		lws_pxc_lock(c);
+		filling = e->filling;
+		if (!filling)
+			lws_pxc_unref(e);
+		lws_pxc_unlock(c);
+
+		if (filling) {
+			pw = &req->cache_wait_next;
+			continue;
+		}
+
+		*pw = req->cache_wait_next;
+		req->cache_wait_next = NULL;
+		req->cent = NULL;
+		req->cache_wait = 0;
+		req->cache_again = 1;
+
+		lws_set_timeout(w, NO_PENDING_TIMEOUT, 0);
+		lws_callback_on_writable(w);
+	}
+}
+
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS)
+static void
+lws_pxc_wake_work(struct lws_context *context, int tsi,
+		  struct lws_pt_work *work)
+{
+	struct lws_context_per_thread *pt = &context->pt[tsi];
+
+	__atomic_store_n(&pt->pxc_wake_pending, 0, __ATOMIC_RELEASE);
+	lws_pxc_wake_pt(pt);
+}
+#endif
+
+static void
+lws_pxc_wake(struct lws *wsi, const char *pts)
+{
+	struct lws_context *context = wsi->context;
+	struct lws_context_per_thread *pt;
+	int n;
+
+	for (n = 0; n < context->count_threads; n++) {
+		if (!pts[n])
+			continue;
+		pt = &context->pt[n];
+
+		if (n == wsi->tsi) {
+			lws_pxc_wake_pt(pt);
+			continue;
+		}
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS)
+		/* one wake in flight to a pt covers everything it waits on */
+		if (__atomic_exchange_n(&pt->pxc_wake_pending, 1,
+					__ATOMIC_ACQ_REL))
+			continue;
+		pt->pxc_wake.cb = lws_pxc_wake_work;
+		if (lws_pt_work_post(context, n, &pt->pxc_wake))
+			__atomic_store_n(&pt->pxc_wake_pending, 0,
+					 __ATOMIC_RELEASE);
+#endif
+	}
+}
+
+/* the owner can't fill it after all */
+
+static void
+lws_pxc_abandon(struct lws *wsi, struct lws_proxy_req *req, int pass)
+{
+	struct lws_pxc_entry *e = req->cent;
+	struct lws_proxy_cache *c = e->cache;
+	char pts[LWS_MAX_SMP];
+
+	memset(pts, 0, sizeof(pts));
+
+	lws_pxc_lock(c);
+	lws_pxc_take_waiting(e, pts);
+	if (req->cache_reval)
+		/* the stale copy is no worse than it was */
+		e->filling = 0;
+	else
+		if (pass)
+			lws_pxc_pass(c, e);
+		else
+			lws_pxc_drop(c, e);
+	lws_pxc_unref(e);
+	lws_pxc_unlock(c);
+
+	req->cent = NULL;
+	req->cache_owner = 0;
+	req->cache_reval = 0;
+	req->cache_fill = 0;
+
+	lws_pxc_wake(wsi, pts);
+}
+
+static void
+lws_pxc_invalidate(struct lws_proxy_cache *c, const char *key, uint32_t hash)
+{
+	struct lws_pxc_entry *e, *e1;
+
+	lws_pxc_lock(c);
+	for (e = c->hash[hash % LWS_PXC_HASH]; e; e = e1) {
+		e1 = e->hash_next;
+		if (e->hash == hash && !e->filling && !strcmp(e->key, key))
+			lws_pxc_drop(c, e);
+	}
+	lws_pxc_unlock(c);
+}
+
+struct lws_proxy_cache *
+lws_proxy_cache_create(const struct lws_http_mount *m)
+{
+	struct lws_proxy_cache *c;
+
+	c = lws_zalloc(sizeof(*c), "proxy cache");
+	if (!c)
+		return NULL;
+
+	c->mem_limit = m->proxy_cache_mem;
+	c->dir = m->proxy_cache_dir;
+	c->disk_limit = m->proxy_cache_disk ? m->proxy_cache_disk :
+					      LWS_PXC_DEF_DISK;
+#if LWS_MAX_SMP > 1
+	pthread_mutex_init(&c->lock, NULL);
+#endif
+
+	return c;
+}
+
+void
+lws_proxy_cache_destroy(struct lws_proxy_cache *c)
+{
+	struct lws_pxc_entry *e;
+	int n;
+
+	if (!c)
+		return;
+
+	/* the requests using it are all gone by now */
+	for (n = 0; n < LWS_PXC_HASH; n++)
+		while ((e = c->hash[n])) {
+			e->refs = 0;
+			lws_pxc_drop(c, e);
+		}
+
+#if LWS_MAX_SMP > 1
+	pthread_mutex_destroy(&c->lock);
+#endif
+	lws_free(c);
+}
+
+int
+lws_proxy_cache_lookup(struct lws *wsi, struct lws_proxy_req *req)
+{
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+	struct lws_proxy_cache *c = req->pool->cache;
+	struct lws_pxc_entry *e;
+	time_t now = time(NULL);
+	struct lws_pxc_cc cc;
+	char pragma[32];
+	uint32_t hash;
+	int head, reval, n;
+
+	if (!c)
+		return LWS_PXC_FETCH;
+
+	hash = lws_proxy_hash(req->path, strlen(req->path));
+
+	head = !strcmp(req->method, "HEAD");
+	if (!head && strcmp(req->method, "GET")) {
+		/* whatever these do, we mustn't serve the old version after */
+		if (!strcmp(req->method, "POST") ||
+		    !strcmp(req->method, "PUT") ||
+		    !strcmp(req->method, "PATCH") ||
+		    !strcmp(req->method, "DELETE"))
+			lws_pxc_invalidate(c, req->path, hash);
+
+		return LWS_PXC_FETCH;
+	}
+
+	/* we couldn't tell where a request body ended */
+	if (req->body_length)
+		return LWS_PXC_FETCH;
+
+	lws_pxc_parse_cc(wsi, &cc);
+	if (cc.no_store)
+		return LWS_PXC_FETCH;
+	req->cache_auth = !!lws_hdr_total_length(wsi,
+						 WSI_TOKEN_HTTP_AUTHORIZATION);
+	reval = cc.no_cache || !cc.max_age;
+	if (lws_hdr_copy(wsi, pragma, sizeof(pragma),
+			 WSI_TOKEN_HTTP_PRAGMA) > 0 && strstr(pragma, "no-cache"))
+		reval = 1;
+
+	lws_pxc_lock(c);
+
+	for (e = c->hash[hash % LWS_PXC_HASH]; e; e = e->hash_next) {
+		if (e->hash != hash || strcmp(e->key, req->path))
+			continue;
+
+		if (e->filling) {
+			if (head)
+				break;
+#if LWS_MAX_SMP > 1 && !defined(LWS_HAVE_ATOMIC_BUILTINS)
+			/* nothing could wake us from another pt */
+			if (e->fill_tsi != wsi->tsi)
+				break;
+#endif
+			/* it's on its way, wait for it */
+			e->refs++;
+			e->waiting[(int)wsi->tsi] = 1;
+			req->cent = e;
+			req->cache_wait = 1;
+			req->cache_wait_next = pt->pxc_waiters;
+			pt->pxc_waiters = wsi;
+			lws_pxc_unlock(c);
+
+			lws_set_timeout(wsi, PENDING_TIMEOUT_AWAITING_PROXY_RESPONSE,
+					wsi->context->timeout_secs);
+
+			return LWS_PXC_WAIT;
+		}
+
+		if (!lws_pxc_vary_match(wsi, e))
+			continue;
+
+		if (e->pass) {
+			if (now < e->expires) {
+				lws_pxc_unlock(c);
+				return LWS_PXC_FETCH;
+			}
+			lws_pxc_drop(c, e);
+			e = NULL;
+			break;
+		}
+
+		if (req->cache_auth && !e->shared) {
+			/* not ours to give out, nor to replace */
+			lws_pxc_unlock(c);
+			return LWS_PXC_FETCH;
+		}
+
+		if (now < e->expires && !reval) {
+			if (!head) {
+				req->cache_fop = lws_pxc_open(wsi, e);
+				if (!req->cache_fop) {
+					lws_pxc_drop(c, e);
+					e = NULL;
+					break;
+				}
+			}
+			e->refs++;
+			req->cent = e;
+			req->cache_hit = 1;
+			lws_pxc_lru_remove(c, e);
+			lws_pxc_lru_add(c, e);
+			lws_pxc_unlock(c);
+
+			return LWS_PXC_HIT;
+		}
+
+		if (!head && lws_pxc_hdr(e, WSI_TOKEN_HTTP_ETAG, &n)) {
+			/* ask the upstream if what we have is still good */
+			e->filling = 1;
+			e->fill_tsi = (char)wsi->tsi;
+			e->refs++;
+			req->cent = e;
+			req->cache_owner = 1;
+			req->cache_reval = 1;
+			lws_pxc_unlock(c);
+
+			return LWS_PXC_FETCH;
+		}
+
+		lws_pxc_drop(c, e);
+		e = NULL;
+		break;
+	}
+
+	if (!e && !head) {
+		/* others wanting it can wait for us to fill it */
+		e = lws_pxc_create(c, req->path, hash, wsi->tsi);
+		if (e) {
+			req->cent = e;
+			req->cache_owner = 1;
+		}
+	}
+
+	lws_pxc_unlock(c);
+
+	return LWS_PXC_FETCH;
+}
+
+int
+lws_proxy_cache_append(struct lws_proxy_req *req, char **p, size_t len)
+{
+	const char *etag;
+	int n;
+
+	if (!req->cache_reval)
+		return 0;
+
+	etag = lws_pxc_hdr(req->cent, WSI_TOKEN_HTTP_ETAG, &n);
+	if (!etag)
+		return 0;
+	if (len < (size_t)n + 20)
+		return -1;
+
+	n = lws_snprintf(*p, len, "If-None-Match: %.*s\x0d\x0a", n, etag);
+	*p += n;
+
+	return n;
+}
+
+/* call with the cache locked */
+
+static int
+lws_pxc_fill_start(struct lws_pxc_entry *e, struct lws *cwsi, struct lws *wsi,
+		   const unsigned char *tok, int count_vary, long long cl,
+		   time_t now, long fresh)
+{
+	struct lws_proxy_cache *c = e->cache;
+	unsigned char hdrs[LWS_PXC_HDRS_LEN];
+	char vals[LWS_PXC_VARY_LEN];
+	int n;
+
+	n = lws_pxc_vary_values(wsi, tok, count_vary, vals, sizeof(vals));
+	if (n < 0)
+		return 1;
+	if (n) {
+		e->vary = lws_malloc(n, "proxy cache vary");
+		if (!e->vary)
+			return 1;
+		memcpy(e->vary, vals, n);
+	}
+	e->vary_len = (unsigned short)n;
+	memcpy(e->vary_tok, tok, count_vary);
+	e->count_vary = (unsigned char)count_vary;
+
+	n = lws_pxc_hdrs_build(cwsi, hdrs, sizeof(hdrs));
+	if (n < 0)
+		return 1;
+	if (n) {
+		e->hdrs = lws_malloc(n, "proxy cache hdrs");
+		if (!e->hdrs)
+			return 1;
+		memcpy(e->hdrs, hdrs, n);
+	}
+	e->hdrs_len = (unsigned short)n;
+
+	e->stored = now;
+	e->expires = now + (fresh > 0 ? fresh : 0);
+
+	if (cl > (long long)(c->mem_limit / LWS_PXC_OBJ_DIV))
+		/* we know it won't fit in memory */
+		return lws_pxc_file_create(c, e);
+
+	e->alloc = cl >= 0 ? (size_t)cl : 4096;
+	if (e->alloc > c->mem_limit / LWS_PXC_OBJ_DIV)
+		e->alloc = c->mem_limit / LWS_PXC_OBJ_DIV;
+	e->body = lws_malloc(e->alloc + 1, "proxy cache body");
+
+	return !e->body;
+}
+
+int
+lws_proxy_cache_response(struct lws *cwsi, struct lws *wsi,
+			 struct lws_proxy_req *req, unsigned int status)
+{
+	unsigned char tok[LWS_PXC_MAX_VARY];
+	struct lws_pxc_entry *e = req->cent;
+	time_t now = time(NULL);
+	struct lws_proxy_cache *c;
+	char pts[LWS_MAX_SMP], v[32];
+	struct lws_pxc_cc cc;
+	long long cl = -1;
+	int count_vary, storable, shared, ret = 0;
+	uint32_t hash;
+	long fresh;
+
+	if (!req->cache_owner)
+		return 0;
+
+	c = e->cache;
+	memset(pts, 0, sizeof(pts));
+
+	lws_pxc_parse_cc(cwsi, &cc);
+	fresh = lws_pxc_freshness(cwsi, &cc, now);
+	if (!cwsi->perform_rewrite &&
+	    lws_hdr_copy(cwsi, v, sizeof(v), WSI_TOKEN_HTTP_CONTENT_LENGTH) > 0)
+		cl = atoll(v);
+	count_vary = lws_pxc_parse_vary(cwsi, tok);
+	shared = cc.pub || cc.s_maxage >= 0 || cc.must_reval;
+
+	storable = status == HTTP_STATUS_OK && !cc.no_store && !cc.priv &&
+		   (!req->cache_auth || shared) && count_vary >= 0 &&
+		   !lws_hdr_total_length(cwsi, WSI_TOKEN_HTTP_SET_COOKIE) &&
+		   (fresh >= 0 ||
+		    lws_hdr_total_length(cwsi, WSI_TOKEN_HTTP_ETAG)) &&
+		   (cl < 0 || (unsigned long long)cl <= lws_pxc_max_object(c));
+
+	lws_pxc_lock(c);
+
+	if (req->cache_reval) {
+		req->cache_reval = 0;
+		e->filling = 0;
+		lws_pxc_take_waiting(e, pts);
+
+		if (status == HTTP_STATUS_NOT_MODIFIED) {
+			/* what we have is still good, serve that */
+			e->stored = now;
+			e->expires = now + (fresh > 0 ? fresh : 0);
+			req->cache_owner = 0;
+			req->cache_fop = lws_pxc_open(wsi, e);
+			if (req->cache_fop) {
+				req->cache_hit = 1;
+				if (e->in_lru) {
+					lws_pxc_lru_remove(c, e);
+					lws_pxc_lru_add(c, e);
+				}
+				ret = 1;
+			} else {
+				lws_pxc_drop(c, e);
+				ret = -1;
+			}
+			goto bail;
+		}
+
+		/* it sent something else, which replaces it */
+		hash = e->hash;
+		lws_pxc_drop(c, e);
+		lws_pxc_unref(e);
+		req->cent = NULL;
+		req->cache_owner = 0;
+
+		e = NULL;
+		if (storable) {
+			e = lws_pxc_create(c, req->path, hash, wsi->tsi);
+			if (e) {
+				req->cent = e;
+				req->cache_owner = 1;
+			}
+		}
+	} else
+		if (!storable) {
+			lws_pxc_take_waiting(e, pts);
+			if (req->cache_auth)
+				/* it may be cacheable without the credentials */
+				lws_pxc_drop(c, e);
+			else
+				lws_pxc_pass(c, e);
+			lws_pxc_unref(e);
+			req->cent = NULL;
+			req->cache_owner = 0;
+			e = NULL;
+		}
+
+	if (e) {
+		e->shared = shared;
+		if (lws_pxc_fill_start(e, cwsi, wsi, tok, count_vary, cl, now,
+				       fresh)) {
+			lws_pxc_take_waiting(e, pts);
+			lws_pxc_pass(c, e);
+			lws_pxc_unref(e);
+			req->cent = NULL;
+			req->cache_owner = 0;
+		} else
+			req->cache_fill = 1;
+	}
+
+bail:
+	lws_pxc_unlock(c);
+	lws_pxc_wake(wsi, pts);
+
+	return ret;
+}
+
+void
+lws_proxy_cache_fill(struct lws *wsi, struct lws_proxy_req *req,
+		     const void *buf, size_t len)
+{
+	struct lws_pxc_entry *e = req->cent;
+	struct lws_proxy_cache *c = e->cache;
+	size_t lim = c->mem_limit / LWS_PXC_OBJ_DIV, n;
+	unsigned char *p;
+
+	/* nobody else looks at it until it's filled */
+
+	if (e->fd < 0 && e->len + len > e->alloc) {
+		if (e->len + len > lim) {
+			/* too big for memory after all, carry on in a file */
+			if (!c->dir || lws_pxc_file_create(c, e) ||
+			    lws_pxc_write(e->fd, e->body, e->len))
+				goto bail;
+			lws_free_set_NULL(e->body);
+			e->alloc = 0;
+		} else {
+			n = e->alloc * 2;
+			if (n < e->len + len)
+				n = e->len + len;
+			if (n > lim)
+				n = lim;
+			p = lws_realloc(e->body, n + 1, "proxy cache body");
+			if (!p)
+				goto bail;
+			e->body = p;
+			e->alloc = n;
+		}
+	}
+
+	if (e->fd >= 0) {
+		if (e->len + len > c->disk_limit / LWS_PXC_OBJ_DIV ||
+		    lws_pxc_write(e->fd, buf, len))
+			goto bail;
+	} else
+		memcpy(e->body + e->len, buf, len);
+	e->len += len;
+
+	return;
+
+bail:
+	lws_pxc_abandon(wsi, req, 1);
+}
+
+void
+lws_proxy_cache_commit(struct lws *wsi, struct lws_proxy_req *req)
+{
+	struct lws_pxc_entry *e = req->cent;
+	struct lws_proxy_cache *c = e->cache;
+	char pts[LWS_MAX_SMP];
+	unsigned char *p;
+
+	memset(pts, 0, sizeof(pts));
+
+	if (e->fd >= 0) {
+		close(e->fd);
+		e->fd = -1;
+	} else
+		if (e->alloc > e->len) {
+			p = lws_realloc(e->body, e->len + 1, "proxy cache body");
+			if (p)
+				e->body = p;
+			e->alloc = e->len;
+		}
+
+	lws_pxc_lock(c);
+	e->filling = 0;
+	lws_pxc_take_waiting(e, pts);
+	lws_pxc_account(c, e);
+	lws_pxc_unref(e);
+	lws_pxc_evict(c);
+	lws_pxc_unlock(c);
+
+	req->cent = NULL;
+	req->cache_owner = 0;
+	req->cache_fill = 0;
+
+	lwsl_info("%s: cached %s\n", __func__, e->key);
+
+	lws_pxc_wake(wsi, pts);
+}
+
+static int
+lws_pxc_not_modified(struct lws *wsi, const struct lws_pxc_entry *e)
+{
+	const char *etag;
+	char inm[256], *p, *t;
+	int len;
+
+	etag = lws_pxc_hdr(e, WSI_TOKEN_HTTP_ETAG, &len);
+	if (!etag || lws_hdr_copy(wsi, inm, sizeof(inm),
+				  WSI_TOKEN_HTTP_IF_NONE_MATCH) <= 0)
+		return 0;
+
+	/* If-None-Match compares weakly */
+	if (len > 2 && !strncmp(etag, "W/", 2)) {
+		etag += 2;
+		len -= 2;
+	}
+
+	p = inm;
+	while ((t = lws_pxc_item(&p, NULL))) {
+		if (!strcmp(t, "*"))
+			return 1;
+		if (!strncmp(t, "W/", 2))
+			t += 2;
+		if ((int)strlen(t) == len && !memcmp(t, etag, len))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Send req->cent to the client.  Returns 1 if the headers were all of it,
+ * 0 if the body is going out by the static file path, or -1 on error.
+ */
+
+int
+lws_proxy_cache_serve(struct lws *wsi, struct lws_proxy_req *req)
+{
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+	unsigned char *start = pt->serv_buf + LWS_PRE, *p = start,
+		      *end = pt->serv_buf + wsi->context->pt_serv_buf_size - 1;
+	const struct lws_pxc_entry *e = req->cent;
+	lws_fop_fd_t fop = req->cache_fop;
+	const unsigned char *h, *he;
+	int status = HTTP_STATUS_OK, n;
+	char age[24];
+
+	req->cache_fop = NULL;
+
+	if (fop && lws_pxc_not_modified(wsi, e)) {
+		status = HTTP_STATUS_NOT_MODIFIED;
+		lws_vfs_file_close(&fop);
+	}
+
+	if (lws_add_http_header_status(wsi, status, &p, end))
+		goto bail;
+	if (status == HTTP_STATUS_OK &&
+	    lws_add_http_header_content_length(wsi, e->len, &p, end))
+		goto bail;
+
+	h = e->hdrs;
+	he = h + e->hdrs_len;
+	while (h + 3 <= he) {
+		n = (h[1] << 8) | h[2];
+		if (status == HTTP_STATUS_OK ||
+		    h[0] != WSI_TOKEN_HTTP_CONTENT_TYPE)
+			if (lws_add_http_header_by_token(wsi,
+					(enum lws_token_indexes)h[0], h + 3, n,
+					&p, end))
+				goto bail;
+		h += 3 + n;
+	}
+
+	n = lws_snprintf(age, sizeof(age), "%ld", (long)(time(NULL) - e->stored));
+	if (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_AGE,
+					 (unsigned char *)age, n, &p, end))
+		goto bail;
+
+	if (lws_finalize_http_header(wsi, &p, end))
+		goto bail;
+
+	if (lws_write(wsi, start, p - start, LWS_WRITE_HTTP_HEADERS) < 0)
+		goto bail;
+
+	if (!fop || !e->len) {
+		if (fop)
+			lws_vfs_file_close(&fop);
+
+		return 1;
+	}
+
+	wsi->u.http.fop_fd = fop;
+	wsi->u.http.filelen = e->len;
+	wsi->u.http.filepos = 0;
+#if defined(LWS_WITH_RANGES)
+	wsi->u.http.range.count_ranges = 0;
+	wsi->u.http.range.inside = 0;
+#endif
+	wsi->state = LWSS_HTTP_ISSUING_FILE;
+	lws_callback_on_writable(wsi);
+
+	return 0;
+
+bail:
+	if (fop)
+		lws_vfs_file_close(&fop);
+
+	return -1;
+}
+
+void
+lws_proxy_cache_req_destroy(struct lws *wsi, struct lws_proxy_req *req)
+{
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+	struct lws_pxc_entry *e = req->cent;
+	struct lws_proxy_cache *c;
+	struct lws **pw;
+
+	if (req->cache_fop)
+		lws_vfs_file_close(&req->cache_fop);
+
+	if (!e)
+		return;
+
+	if (req->cache_wait) {
+		pw = &pt->pxc_waiters;
+		while (*pw) {
+			if (*pw == wsi) {
+				*pw = req->cache_wait_next;
+				break;
+			}
+			pw = &(*pw)->pxy_req->cache_wait_next;
+		}
+		req->cache_wait = 0;
+	}
+
+	if (req->cache_owner) {
+		/* if the upstream failed, others shouldn't queue on it too */
+		lws_pxc_abandon(wsi, req, req->failed);
+
+		return;
+	}
+
+	c = e->cache;
+	lws_pxc_lock(c);
+	lws_pxc_unref(e);
+	lws_pxc_unlock(c);
+
+	req->cent = NULL;
+}
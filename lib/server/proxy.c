@@ -0,0 +1,1367 @@
+/*
+ * libwebsockets - reverse proxy mounts with upstream pools
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+#include "private-libwebsockets.h"
+
+/*
+ * Each http:// or https:// mount gets a pool of upstreams when the vhost is
+ * created: the origin's host, then any in the mount's upstreams list.  Every
+ * request picks one by the mount's lb_policy, skipping upstreams that failed
+ * max_fails times in a row (for fail_timeout seconds) or failed their last
+ * active health check, unless every upstream is in that state.
+ *
+ * The incoming wsi owns a struct lws_proxy_req for the transaction, and the
+ * upstream client connection is its child.  When the response completes and
+ * the mount allows it, the child goes on its upstream's idle list for the
+ * pt instead of closing, and the next request on that pt to that upstream
+ * sends its request on it directly.
+ *
+ * The idle lists are only touched by their own pt; the counters used to make
+ * the choice are shared between pts and use relaxed atomics.  Active health
+ * checks all run from pt 0.
+ */
+
+#if LWS_MAX_SMP > 1 && defined(LWS_HAVE_ATOMIC_BUILTINS_64)
+#define lws_pxy_load(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define lws_pxy_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define lws_pxy_add(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#else
+#define lws_pxy_load(p) (*(p))
+#define lws_pxy_store(p, v) (*(p) = (v))
+#define lws_pxy_add(p, v) ((*(p) += (v)) - (v))
+#endif
+
+#define lws_pxy_def(v, d) ((v) ? (v) : (d))
+
+uint32_t
+lws_proxy_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	/* FNV-1a */
+	while (len--) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619;
+	}
+
+	/* ...which spreads similar short strings badly round the ring */
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static int
+lws_proxy_hash_point_cmp(const void *a, const void *b)
+{
+	const struct lws_proxy_hash_point *pa = a, *pb = b;
+
+	if (pa->hash == pb->hash)
+		return pa->index - pb->index;
+
+	return pa->hash < pb->hash ? -1 : 1;
+}
+
+static int
+lws_proxy_upstream_init(struct lws_proxy_upstream *up, const char *name,
+			size_t len, int port)
+{
+	const char *p;
+
+	if (len > 8 && !strncmp(name, "https://", 8)) {
+		name += 8;
+		len -= 8;
+	} else
+		if (len > 7 && !strncmp(name, "http://", 7)) {
+			name += 7;
+			len -= 7;
+		}
+
+	p = memchr(name, ':', len);
+	if (p) {
+		port = atoi(p + 1);
+		len = p - name;
+	}
+
+	if (!len || len >= sizeof(up->address) || port <= 0 || port > 65535) {
+		lwsl_err("%s: bad upstream '%.*s'\n", __func__, (int)len, name);
+		return 1;
+	}
+
+	memcpy(up->address, name, len);
+	up->address[len] = '\0';
+	up->port = port;
+
+	return 0;
+}
+
+static int
+lws_proxy_pool_create(struct lws_vhost *vh, const struct lws_http_mount *m)
+{
+	const struct lws_protocol_vhost_options *pvo;
+	struct lws_proxy_pool *pool;
+	int n = 1, def = 80, k;
+	const char *pslash;
+	char s[80];
+
+	pslash = strchr(m->origin, '/');
+	if (!pslash) {
+		lwsl_err("Proxy mount origin '%s' must have /\n", m->origin);
+		return 1;
+	}
+
+	for (pvo = m->upstreams; pvo; pvo = pvo->next)
+		n++;
+
+	pool = lws_zalloc(sizeof(*pool), "proxy pool");
+	if (!pool)
+		return 1;
+	pool->up = lws_zalloc(n * sizeof(*pool->up), "proxy upstreams");
+	if (!pool->up)
+		goto bail;
+
+	pool->mount = m;
+	pool->vhost = vh;
+	pool->path = pslash + 1;
+	pool->ssl = m->origin_protocol == LWSMPRO_HTTPS;
+	if (pool->ssl)
+		def = 443;
+
+	if (lws_proxy_upstream_init(&pool->up[0], m->origin,
+				    pslash - m->origin, def))
+		goto bail;
+	n = 1;
+	for (pvo = m->upstreams; pvo; pvo = pvo->next)
+		if (lws_proxy_upstream_init(&pool->up[n++], pvo->name,
+					    strlen(pvo->name), def))
+			goto bail;
+	pool->count_up = n;
+	for (n = 0; n < pool->count_up; n++)
+		pool->up[n].pool = pool;
+
+	if (m->lb_policy == LWS_PROXY_LB_HASH) {
+		/*
+		 * Each upstream owns the arcs of the ring ending at its
+		 * points, so adding or removing one only moves the paths on
+		 * its own arcs
+		 */
+		pool->count_ring = pool->count_up * LWS_PROXY_HASH_POINTS;
+		pool->ring = lws_malloc(pool->count_ring * sizeof(*pool->ring),
+					"proxy hash ring");
+		if (!pool->ring)
+			goto bail;
+
+		for (n = 0; n < pool->count_up; n++)
+			for (k = 0; k < LWS_PROXY_HASH_POINTS; k++) {
+				int l = lws_snprintf(s, sizeof(s), "%s:%d#%d",
+						     pool->up[n].address,
+						     pool->up[n].port, k);
+				struct lws_proxy_hash_point *hp =
+				  &pool->ring[n * LWS_PROXY_HASH_POINTS + k];
+
+				hp->hash = lws_proxy_hash(s, l);
+				hp->index = n;
+			}
+
+		qsort(pool->ring, pool->count_ring, sizeof(*pool->ring),
+		      lws_proxy_hash_point_cmp);
+	}
+
+	if (m->proxy_cache_mem) {
+		pool->cache = lws_proxy_cache_create(m);
+		if (!pool->cache)
+			goto bail;
+	}
+
+	pool->next = vh->proxy_pools;
+	vh->proxy_pools = pool;
+
+	lwsl_info("   proxy %s: %d upstreams, lb %d\n", m->mountpoint,
+		  pool->count_up, m->lb_policy);
+
+	return 0;
+
+bail:
+	lws_free(pool->ring);
+	lws_free(pool->up);
+	lws_free(pool);
+
+	return 1;
+}
+
+int
+lws_proxy_vhost_init(struct lws_vhost *vh)
+{
+	const struct lws_http_mount *m;
+
+	for (m = vh->mount_list; m; m = m->mount_next)
+		if ((m->origin_protocol == LWSMPRO_HTTP ||
+		     m->origin_protocol == LWSMPRO_HTTPS) &&
+		    lws_proxy_pool_create(vh, m))
+			return 1;
+
+	return 0;
+}
+
+void
+lws_proxy_vhost_destroy(struct lws_vhost *vh)
+{
+	struct lws_proxy_pool *pool = vh->proxy_pools, *pool1;
+
+	while (pool) {
+		pool1 = pool->next;
+		lws_proxy_cache_destroy(pool->cache);
+		lws_free(pool->ring);
+		lws_free(pool->up);
+		lws_free(pool);
+		pool = pool1;
+	}
+
+	vh->proxy_pools = NULL;
+}
+
+static int
+lws_proxy_usable(struct lws_proxy_upstream *up, time_t now)
+{
+	return !lws_pxy_load(&up->hc_down) &&
+	       lws_pxy_load(&up->down_until) <= now;
+}
+
+static struct lws_proxy_upstream *
+lws_proxy_choose(struct lws_proxy_pool *pool, uint32_t hash)
+{
+	int n, m, start, best = -1, lo, hi, any;
+	time_t now = time(NULL);
+	int a, besta = 0;
+
+	if (pool->count_up == 1)
+		return &pool->up[0];
+
+	/* first time around, only consider healthy upstreams */
+
+	for (any = 0; any < 2; any++) {
+		switch (pool->mount->lb_policy) {
+		case LWS_PROXY_LB_HASH:
+			/* first point at or after the hash, wrapping */
+			lo = 0;
+			hi = pool->count_ring;
+			while (lo < hi) {
+				m = (lo + hi) / 2;
+				if (pool->ring[m].hash < hash)
+					lo = m + 1;
+				else
+					hi = m;
+			}
+			for (n = 0; n < pool->count_ring; n++) {
+				m = pool->ring[(lo + n) % pool->count_ring].index;
+				if (any || lws_proxy_usable(&pool->up[m], now))
+					return &pool->up[m];
+			}
+			break;
+
+		case LWS_PROXY_LB_LEAST_CONN:
+			/* rotate the start so ties are shared out */
+			start = (int)(lws_pxy_add(&pool->rr, 1) %
+				      (unsigned int)pool->count_up);
+			for (n = 0; n < pool->count_up; n++) {
+				m = (start + n) % pool->count_up;
+				if (!any && !lws_proxy_usable(&pool->up[m], now))
+					continue;
+				a = lws_pxy_load(&pool->up[m].active);
+				if (best < 0 || a < besta) {
+					best = m;
+					besta = a;
+				}
+			}
+			if (best >= 0)
+				return &pool->up[best];
+			break;
+
+		default:
+			start = (int)(lws_pxy_add(&pool->rr, 1) %
+				      (unsigned int)pool->count_up);
+			for (n = 0; n < pool->count_up; n++) {
+				m = (start + n) % pool->count_up;
+				if (any || lws_proxy_usable(&pool->up[m], now))
+					return &pool->up[m];
+			}
+			break;
+		}
+	}
+
+	return &pool->up[0];
+}
+
+/* passive health: how did a transaction with the upstream go */
+
+static void
+lws_proxy_result(struct lws_proxy_upstream *up, int ok)
+{
+	const struct lws_http_mount *m = up->pool->mount;
+
+	if (ok) {
+		if (lws_pxy_load(&up->fails))
+			lws_pxy_store(&up->fails, 0);
+		return;
+	}
+
+	if (lws_pxy_add(&up->fails, 1) + 1 < lws_pxy_def(m->max_fails, 1))
+		return;
+
+	lws_pxy_store(&up->fails, 0);
+	lws_pxy_store(&up->down_until,
+		      time(NULL) + lws_pxy_def(m->fail_timeout, 10));
+	lwsl_notice("%s: proxy %s upstream %s:%d failing, skipped for %ds\n",
+		    __func__, m->mountpoint, up->address, up->port,
+		    lws_pxy_def(m->fail_timeout, 10));
+}
+
+/* active health: what did the health check say */
+
+static void
+lws_proxy_hc_result(struct lws_proxy_upstream *up, int ok)
+{
+	/* a passing check also ends any passive fail_timeout early */
+	if (ok && lws_pxy_load(&up->down_until)) {
+		lws_pxy_store(&up->fails, 0);
+		lws_pxy_store(&up->down_until, 0);
+	}
+
+	if (lws_pxy_load(&up->hc_down) == !ok)
+		return;
+
+	lws_pxy_store(&up->hc_down, !ok);
+
+	lwsl_notice("%s: proxy %s upstream %s:%d health check %s\n", __func__,
+		    up->pool->mount->mountpoint, up->address, up->port,
+		    ok ? "passing" : "failing");
+}
+
+static void
+lws_proxy_uncount(struct lws_proxy_req *req)
+{
+	if (!req->counted)
+		return;
+
+	(void)lws_pxy_add(&req->up->active, -1);
+	req->counted = 0;
+}
+
+static void
+lws_proxy_req_destroy(struct lws *wsi)
+{
+	struct lws_proxy_req *req = wsi->pxy_req;
+
+	lws_proxy_cache_req_destroy(wsi, req);
+	lws_proxy_uncount(req);
+	lws_free(req->body);
+	lws_free_set_NULL(wsi->pxy_req);
+}
+
+/*
+ * The upstream connection failed before it got us a response.  If nothing
+ * irrevocable happened yet, the parent's next WRITEABLE tries again.
+ */
+
+static void
+lws_proxy_conn_failed(struct lws *wsi, struct lws_proxy_req *req, int stale)
+{
+	lws_proxy_uncount(req);
+	if (!stale)
+		lws_proxy_result(req->up, 0);
+
+	if (!req->hdrs_sent && !req->body_sent &&
+	    (stale || ++req->tries < req->pool->count_up)) {
+		req->retry = 1;
+		req->stale = stale;
+	} else
+		req->failed = 1;
+
+	lws_callback_on_writable(wsi);
+}
+
+/*
+ * Send the request on a kept-alive connection: it goes back to being an
+ * unconnected client wsi with a socket, and lws_client_connect_via_info2()
+ * skips the connect when it gets the ah
+ */
+
+static int
+lws_proxy_reuse(struct lws *wsi, struct lws *cwsi, struct lws_proxy_req *req)
+{
+	struct client_info_stash *stash;
+
+	stash = lws_zalloc(sizeof(*stash), "client stash");
+	if (!stash)
+		return 1;
+
+	strncpy(stash->address, req->up->address, sizeof(stash->address) - 1);
+	strncpy(stash->path, req->path, sizeof(stash->path) - 1);
+	strncpy(stash->host, req->pool->up[0].address,
+		sizeof(stash->host) - 1);
+	strncpy(stash->method, req->method, sizeof(stash->method) - 1);
+
+	lws_set_timeout(cwsi, NO_PENDING_TIMEOUT, 0);
+	lws_union_transition(cwsi, LWSCM_HTTP_CLIENT);
+	cwsi->u.hdr.stash = stash;
+	cwsi->state = LWSS_CLIENT_UNCONNECTED;
+	cwsi->pxy_reused = 1;
+
+	cwsi->parent = wsi;
+	cwsi->sibling_list = wsi->child_list;
+	wsi->child_list = cwsi;
+
+	lwsl_info("%s: wsi %p reusing %p to %s:%d\n", __func__, wsi, cwsi,
+		  req->up->address, req->up->port);
+
+	/*
+	 * < 0 means it already failed and was closed, which the parent
+	 * hears about via LWS_CALLBACK_CHILD_CLOSING
+	 */
+	if (lws_header_table_attach(cwsi, 0) < 0)
+		lwsl_info("%s: ah attach failed\n", __func__);
+
+	return 0;
+}
+
+static int
+lws_proxy_connect(struct lws *wsi, struct lws_proxy_req *req, int reuse)
+{
+	struct lws_context_per_thread *pt = &wsi->context->pt[(int)wsi->tsi];
+	struct lws_proxy_upstream *up = req->up;
+	struct lws_client_connect_info i;
+	struct lws *cwsi;
+	int tsi = wsi->tsi;
+
+	req->retry = 0;
+	req->failed = 0;
+	(void)lws_pxy_add(&up->active, 1);
+	req->counted = 1;
+
+	if (reuse && up->idle[tsi] &&
+	    pt->ah_count_in_use < wsi->context->max_http_header_pool) {
+		cwsi = up->idle[tsi];
+		up->idle[tsi] = cwsi->pxy_idle_next;
+		up->count_idle[tsi]--;
+		cwsi->pxy_idle_next = NULL;
+		cwsi->pxy_up = NULL;
+
+		if (!lws_proxy_reuse(wsi, cwsi, req))
+			return 0;
+
+		lws_close_free_wsi(cwsi, LWS_CLOSE_STATUS_NOSTATUS);
+	}
+
+	memset(&i, 0, sizeof(i));
+	i.context = wsi->context;
+	i.vhost = wsi->vhost;
+	i.address = up->address;
+	i.port = up->port;
+	i.ssl_connection = req->pool->ssl;
+	i.path = req->path;
+	/* the upstreams all serve the origin's site */
+	i.host = req->pool->up[0].address;
+	i.origin = NULL;
+	i.method = req->method;
+	i.parent_wsi = wsi;
+	if (req->ws)
+		/* we send the client's own handshake on it */
+		i.method = "RAW";
+	else {
+		i.uri_replace_from = req->pool->mount->origin;
+		i.uri_replace_to = req->pool->mount->mountpoint;
+	}
+
+	lwsl_info("proxying to %s port %d url %s, ssl %d, from %s, to %s\n",
+		  i.address, i.port, i.path, i.ssl_connection,
+		  i.uri_replace_from, i.uri_replace_to);
+
+	cwsi = lws_client_connect_via_info(&i);
+	/* it may have failed and told us about it already */
+	if (!cwsi && !req->retry && !req->failed)
+		lws_proxy_conn_failed(wsi, req, 0);
+
+	return 0;
+}
+
+/* serve it from the cache, wait for it to be, or go to the upstream for it */
+
+static int
+lws_proxy_start(struct lws *wsi, struct lws_proxy_req *req)
+{
+	switch (lws_proxy_cache_lookup(wsi, req)) {
+	case LWS_PXC_FETCH:
+		req->up = lws_proxy_choose(req->pool, req->hash);
+		return lws_proxy_connect(wsi, req, 1);
+	case LWS_PXC_WAIT:
+		return 0;
+	case LWS_PXC_HIT:
+		lws_callback_on_writable(wsi);
+		return 0;
+	}
+
+	return -1;
+}
+
+static struct lws_proxy_req *
+lws_proxy_req_create(struct lws *wsi, const struct lws_http_mount *hit,
+		     const char *uri_ptr)
+{
+	struct lws_proxy_pool *pool = wsi->vhost->proxy_pools;
+	struct lws_proxy_req *req;
+	char *p;
+	int na;
+
+	while (pool && pool->mount != hit)
+		pool = pool->next;
+	if (!pool) {
+		lwsl_err("%s: no upstreams for %s\n", __func__, hit->mountpoint);
+		return NULL;
+	}
+
+	if (wsi->pxy_req)
+		lws_proxy_req_destroy(wsi);
+
+	req = lws_zalloc(sizeof(*req), "proxy req");
+	if (!req)
+		return NULL;
+	req->pool = pool;
+	wsi->pxy_req = req;
+
+	req->hash = lws_proxy_hash(uri_ptr + hit->mountpoint_len,
+				   strlen(uri_ptr + hit->mountpoint_len));
+
+	lws_snprintf(req->path, sizeof(req->path) - 1, "/%s/%s", pool->path,
+		     uri_ptr + hit->mountpoint_len);
+	lws_clean_url(req->path);
+	na = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_URI_ARGS);
+	if (na) {
+		p = req->path + strlen(req->path);
+		*p++ = '?';
+		lws_hdr_copy(wsi, p, &req->path[sizeof(req->path) - 1] - p,
+			     WSI_TOKEN_HTTP_URI_ARGS);
+		while (--na) {
+			if (*p == '\0')
+				*p = '&';
+			p++;
+		}
+	}
+
+	return req;
+}
+
+int
+lws_proxy_http_action(struct lws *wsi, const struct lws_http_mount *hit,
+		      const char *uri_ptr, const char *method)
+{
+	struct lws_proxy_req *req;
+	char cl[32];
+
+	/*
+	 * We don't decode chunked http/1 request bodies, and not knowing
+	 * where one ends, we'd take the rest of it for the next request.
+	 * Ask for a content-length and drop the connection.
+	 */
+	if (!wsi->http2_substream &&
+	    lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_TRANSFER_ENCODING)) {
+		lwsl_notice("%s: %p: chunked request body refused\n",
+			    __func__, wsi);
+		lws_return_http_status(wsi, HTTP_STATUS_LENGTH_REQUIRED, NULL);
+
+		return 1;
+	}
+
+	req = lws_proxy_req_create(wsi, hit, uri_ptr);
+	if (!req)
+		return -1;
+
+	/* h2 gives us the method separately */
+	if (method[0] == ':')
+		lws_hdr_copy(wsi, req->method, sizeof(req->method),
+			     WSI_TOKEN_HTTP_COLON_METHOD);
+	else
+		strncpy(req->method, method, sizeof(req->method) - 1);
+
+	/*
+	 * We can only pass on a request body we know the length of, don't
+	 * let lws_http_action() wait for one otherwise
+	 */
+	wsi->u.http.rx_content_length = 0;
+	if (lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_CONTENT_LENGTH)) {
+		lws_hdr_copy(wsi, cl, sizeof(cl), WSI_TOKEN_HTTP_CONTENT_LENGTH);
+		req->body_length = atoll(cl);
+		wsi->u.http.rx_content_length = req->body_length;
+		lws_hdr_copy(wsi, req->ctype, sizeof(req->ctype),
+			     WSI_TOKEN_HTTP_CONTENT_TYPE);
+	}
+
+	return lws_proxy_start(wsi, req);
+}
+
+int
+lws_proxy_req_body(struct lws *wsi, unsigned char *buf, size_t len)
+{
+	struct lws_proxy_req *req = wsi->pxy_req;
+	struct lws *cwsi = lws_get_child(wsi);
+	unsigned char *p;
+	size_t n;
+
+	if (req->body_len + len > LWS_PROXY_BODY_MAX) {
+		/*
+		 * http/1 reads pause below until the upstream took what we
+		 * have, but we don't withhold window from h2 streams, so they
+		 * can get this far ahead of it.  Fail the stream.
+		 */
+		lwsl_notice("%s: %p: body too far ahead of upstream\n",
+			    __func__, wsi);
+#ifdef LWS_WITH_HTTP2
+		if (wsi->http2_substream)
+			lws_h2_rst_stream(wsi, H2_ERR_ENHANCE_YOUR_CALM,
+					  "proxy body backlog");
+#endif
+		lws_set_timeout(wsi, PENDING_TIMEOUT_CLOSE_SEND,
+				LWS_TO_KILL_ASYNC);
+
+		return -1;
+	}
+
+	if (req->body_len + len > req->body_alloc) {
+		/* h2 gives it to us a byte at a time */
+		n = req->body_alloc * 2;
+		if (n < req->body_len + len)
+			n = req->body_len + len;
+		if (n > LWS_PROXY_BODY_MAX)
+			n = LWS_PROXY_BODY_MAX;
+		p = lws_realloc(req->body, LWS_PRE + n, "proxy body");
+		if (!p)
+			return -1;
+		req->body = p;
+		req->body_alloc = n;
+	}
+
+	memcpy(req->body + LWS_PRE + req->body_len, buf, len);
+	req->body_len += len;
+
+	/* hold off reading more until the upstream took it */
+	if (!wsi->http2_substream)
+		lws_rx_flow_control(wsi, 0);
+
+	if (cwsi && (cwsi->mode == LWSCM_WSCL_ISSUE_HTTP_BODY ||
+		     cwsi->mode == LWSCM_RAW))
+		lws_callback_on_writable(cwsi);
+
+	return 0;
+}
+
+/*
+ * Websocket pass-through: the upstream connection is a RAW client connection,
+ * we send it the client's upgrade request with the path mapped, and from then
+ * on both connections are RAW and each relays what it reads to the other
+ * as it is.  The client's frames are masked by the client and the upstream's
+ * are unmasked as the client expects, so neither direction needs reframing.
+ * The extensions are negotiated end to end too.
+ */
+
+int
+lws_proxy_ws_action(struct lws *wsi, const struct lws_http_mount *hit,
+		    const char *uri_ptr, unsigned char *buf, size_t len)
+{
+	static const unsigned char pass[] = {
+		WSI_TOKEN_UPGRADE,
+		WSI_TOKEN_CONNECTION,
+		WSI_TOKEN_KEY,
+		WSI_TOKEN_VERSION,
+		WSI_TOKEN_PROTOCOL,
+		WSI_TOKEN_EXTENSIONS,
+		WSI_TOKEN_ORIGIN,
+		WSI_TOKEN_HTTP_COOKIE,
+		WSI_TOKEN_HTTP_AUTHORIZATION,
+		WSI_TOKEN_HTTP_USER_AGENT,
+	};
+	struct lws_proxy_req *req;
+	size_t size = LWS_PRE + 4096 + len;
+	char v[1024], *p, *end;
+	int n, f;
+
+	req = lws_proxy_req_create(wsi, hit, uri_ptr);
+	if (!req)
+		return -1;
+	req->ws = 1;
+
+	req->body = lws_malloc(size, "proxy ws handshake");
+	if (!req->body)
+		return -1;
+	req->body_alloc = size - LWS_PRE;
+
+	p = (char *)req->body + LWS_PRE;
+	end = (char *)req->body + size - len;
+	p += lws_snprintf(p, end - p, "GET %s HTTP/1.1\x0d\x0aHost: %s\x0d\x0a",
+			  req->path, req->pool->up[0].address);
+
+	for (n = 0; n < (int)ARRAY_SIZE(pass); n++)
+		for (f = 0; lws_hdr_copy_fragment(wsi, v, sizeof(v),
+				(enum lws_token_indexes)pass[n], f) > 0; f++)
+			p += lws_snprintf(p, end - p, "%s %s\x0d\x0a",
+				lws_token_to_string(
+					(enum lws_token_indexes)pass[n]), v);
+
+	if (end - p < 3) {
+		lwsl_err("%s: upgrade request too large\n", __func__);
+		return -1;
+	}
+	*p++ = '\x0d';
+	*p++ = '\x0a';
+
+	/* anything the client sent after its request goes on after ours */
+	memcpy(p, buf, len);
+	req->body_len = (unsigned char *)p + len - (req->body + LWS_PRE);
+
+	/* from now we only relay what we read from the client */
+	lws_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
+	lws_header_table_force_to_detachable_state(wsi);
+	lws_header_table_detach(wsi, 0);
+	lws_union_transition(wsi, LWSCM_RAW);
+
+	lwsl_info("%s: wsi %p: ws %s passed through\n", __func__, wsi,
+		  req->path);
+
+	req->up = lws_proxy_choose(req->pool, req->hash);
+
+	return lws_proxy_connect(wsi, req, 0);
+}
+
+static int
+lws_proxy_ws_relay(struct lws *from, struct lws *to, void *in, size_t len)
+{
+	if (lws_issue_raw(to, in, len) < 0)
+		return -1;
+
+	/* until the other side sent it all, read no more from this one */
+	if (lws_tx_pending(to))
+		lws_rx_flow_control(from, 0);
+
+	return 0;
+}
+
+/* the client connection has some data for the upstream */
+
+static int
+lws_proxy_ws_client_rx(struct lws *wsi, void *in, size_t len)
+{
+	struct lws_proxy_req *req = wsi->pxy_req;
+	struct lws *cwsi = lws_get_child(wsi);
+
+	if (cwsi && cwsi->mode == LWSCM_RAW && !req->body_len)
+		return lws_proxy_ws_relay(wsi, cwsi, in, len);
+
+	/* it goes after the handshake, when the upstream is connected */
+	return lws_proxy_req_body(wsi, in, len);
+}
+
+/* the upstream connection can take more */
+
+static int
+lws_proxy_ws_upstream_writeable(struct lws *wsi, struct lws *parent,
+				struct lws_proxy_req *req)
+{
+	if (req->body_len) {
+		if (lws_issue_raw(wsi, req->body + LWS_PRE, req->body_len) < 0)
+			return -1;
+		req->body_sent += req->body_len;
+		req->body_len = 0;
+	}
+
+	if (!lws_tx_pending(wsi))
+		lws_rx_flow_control(parent, 1);
+
+	return 0;
+}
+
+/* the client connection can take more */
+
+static int
+lws_proxy_ws_client_writeable(struct lws *wsi)
+{
+	static const char bad_gw[] = "HTTP/1.1 502 Bad Gateway\x0d\x0a"
+				     "content-length: 0\x0d\x0a"
+				     "connection: close\x0d\x0a\x0d\x0a";
+	struct lws_proxy_req *req = wsi->pxy_req;
+	struct lws *cwsi = lws_get_child(wsi);
+
+	if (req->retry) {
+		if (!req->stale)
+			req->up = lws_proxy_choose(req->pool, req->hash);
+		req->stale = 0;
+
+		return lws_proxy_connect(wsi, req, 0);
+	}
+
+	if (req->failed) {
+		/* everything from the upstream was sent on, we can close */
+		if (req->hdrs_sent)
+			return -1;
+
+		/* we could not get the upgrade to any upstream */
+		if (lws_issue_raw(wsi, (unsigned char *)bad_gw,
+				  sizeof(bad_gw) - 1) < 0)
+			return -1;
+		req->hdrs_sent = 1;
+		lws_callback_on_writable(wsi);
+
+		return 0;
+	}
+
+	if (cwsi)
+		lws_rx_flow_control(cwsi, 1);
+
+	return 0;
+}
+
+/* upstream connection may take more of the request body */
+
+static int
+lws_proxy_client_writeable(struct lws *wsi, struct lws *parent,
+			   struct lws_proxy_req *req)
+{
+	if (req->body_len) {
+		if (lws_write(wsi, req->body + LWS_PRE, req->body_len,
+			      LWS_WRITE_HTTP) < 0)
+			return -1;
+		req->body_sent += req->body_len;
+		req->body_len = 0;
+		if (!parent->http2_substream)
+			lws_rx_flow_control(parent, 1);
+	}
+
+	/* lws_client_socket_service() moves on to wait for the reply */
+	if (req->body_sent >= req->body_length)
+		lws_client_http_body_pending(wsi, 0);
+
+	return 0;
+}
+
+static int
+lws_proxy_established(struct lws *wsi, struct lws *parent,
+		      struct lws_proxy_req *req)
+{
+	static const unsigned char pass[] = {
+		WSI_TOKEN_HTTP_CONTENT_TYPE,
+		WSI_TOKEN_HTTP_LOCATION,
+		WSI_TOKEN_HTTP_CACHE_CONTROL,
+		WSI_TOKEN_HTTP_ETAG,
+		WSI_TOKEN_HTTP_LAST_MODIFIED,
+		WSI_TOKEN_HTTP_EXPIRES,
+		WSI_TOKEN_HTTP_VARY,
+		WSI_TOKEN_HTTP_SET_COOKIE,
+	};
+	unsigned char buf[LWS_PRE + 2048], *start = buf + LWS_PRE, *p = start,
+		      *end = &buf[sizeof(buf) - 1];
+	unsigned int status = lws_http_client_http_response(wsi);
+	char v[256];
+	int n, m, f;
+
+	lws_proxy_result(req->up, 1);
+
+	if (!status)
+		status = HTTP_STATUS_OK;
+
+	n = lws_proxy_cache_response(wsi, parent, req, status);
+	if (n < 0)
+		return -1;
+	if (n) {
+		/* we revalidated it, the client gets what we had */
+		req->no_body = 1;
+		req->framed = 1;
+		req->done = 1;
+		lws_callback_on_writable(parent);
+
+		return 0;
+	}
+
+	if (lws_add_http_header_status(parent, status, &p, end))
+		return 1;
+
+	/* each set-cookie, eg, is a separate fragment */
+	for (n = 0; n < (int)ARRAY_SIZE(pass); n++)
+		for (f = 0; (m = lws_hdr_copy_fragment(wsi, v, sizeof(v),
+				(enum lws_token_indexes)pass[n], f)) > 0; f++)
+			if (lws_add_http_header_by_token(parent,
+					(enum lws_token_indexes)pass[n],
+					(unsigned char *)v, m, &p, end))
+				return 1;
+
+	/* a rewritten body has a different length */
+	m = 0;
+	if (!wsi->perform_rewrite) {
+		m = lws_hdr_copy(wsi, v, sizeof(v),
+				 WSI_TOKEN_HTTP_CONTENT_LENGTH);
+		if (m > 0) {
+			if (lws_add_http_header_by_token(parent,
+					WSI_TOKEN_HTTP_CONTENT_LENGTH,
+					(unsigned char *)v, m, &p, end))
+				return 1;
+			req->framed = 1;
+		}
+	}
+
+	if (status < 200 || status == HTTP_STATUS_NO_CONTENT ||
+	    status == HTTP_STATUS_NOT_MODIFIED ||
+	    !strcmp(req->method, "HEAD") || (m > 0 && !atoll(v))) {
+		/* there won't be any more from the upstream */
+		req->no_body = 1;
+		req->framed = 1;
+		req->done = 1;
+	}
+
+	if (lws_finalize_http_header(parent, &p, end))
+		return 1;
+
+	n = lws_write(parent, start, p - start, LWS_WRITE_HTTP_HEADERS);
+	if (n < 0)
+		return -1;
+	req->hdrs_sent = 1;
+
+	if (req->no_body)
+		lws_callback_on_writable(parent);
+
+	return 0;
+}
+
+static int
+lws_proxy_finish(struct lws *wsi)
+{
+	struct lws_proxy_req *req = wsi->pxy_req;
+	unsigned char fin[LWS_PRE + 1];
+	struct lws *cwsi;
+	int framed = req->framed, n = 1;
+
+	if (req->cache_fill && req->done)
+		lws_proxy_cache_commit(wsi, req);
+
+	if (req->cache_hit) {
+		/* the response comes from the cache instead */
+		n = lws_proxy_cache_serve(wsi, req);
+		framed = 1;
+	}
+
+	wsi->reason_bf &= ~LWS_CB_REASON_AUX_BF__PROXY;
+	lws_proxy_req_destroy(wsi);
+
+	/* if it's still with us, it's not going back in the idle list */
+	cwsi = lws_get_child(wsi);
+	if (cwsi)
+		lws_close_free_wsi(cwsi, LWS_CLOSE_STATUS_NOSTATUS);
+
+	/* the body is going out by the static file path */
+	if (n <= 0)
+		return n;
+
+	if (wsi->http2_substream) {
+		if (lws_write(wsi, fin + LWS_PRE, 0, LWS_WRITE_HTTP_FINAL) < 0)
+			return -1;
+	} else
+		if (!framed)
+			/* the close is what ends the response */
+			return -1;
+
+	/* he didn't wait for all of the request body */
+	if (wsi->u.http.rx_content_remain)
+		return -1;
+
+	if (lws_http_transaction_completed(wsi))
+		return -1;
+
+	return 0;
+}
+
+static int
+lws_proxy_parent_writeable(struct lws *wsi)
+{
+	struct lws_proxy_req *req = wsi->pxy_req;
+	struct lws *cwsi = lws_get_child(wsi);
+	char buf[LWS_PRE + 2048], *px = buf + LWS_PRE;
+	int lenx = sizeof(buf) - LWS_PRE, n;
+
+	if (req->cache_wait)
+		return 0;
+
+	if (req->cache_again) {
+		/* what we waited for is in the cache now, or isn't coming */
+		req->cache_again = 0;
+
+		return lws_proxy_start(wsi, req);
+	}
+
+	if (req->cache_hit && !cwsi)
+		return lws_proxy_finish(wsi);
+
+	if (req->retry) {
+		if (!req->stale)
+			req->up = lws_proxy_choose(req->pool, req->hash);
+		req->stale = 0;
+
+		return lws_proxy_connect(wsi, req, 0);
+	}
+
+	if (req->failed) {
+		if (req->hdrs_sent || wsi->u.http.rx_content_remain)
+			return -1;
+
+		/* we could not get a response from any upstream */
+		lws_proxy_req_destroy(wsi);
+		if (lws_return_http_status(wsi, HTTP_STATUS_BAD_GATEWAY, NULL))
+			return -1;
+
+		return lws_http_transaction_completed(wsi) ? -1 : 0;
+	}
+
+	if (req->no_body && cwsi) {
+		if (lws_http_transaction_completed_client(cwsi))
+			lws_close_free_wsi(cwsi, LWS_CLOSE_STATUS_NOSTATUS);
+		cwsi = NULL;
+	}
+
+	if (!req->done) {
+		/*
+		 * our sink is writeable and our source has something
+		 * to read.  So read a lump of source material of
+		 * suitable size to send or what's available, whichever
+		 * is the smaller.
+		 */
+		if (!cwsi || !(wsi->reason_bf & LWS_CB_REASON_AUX_BF__PROXY))
+			return 0;
+		wsi->reason_bf &= ~LWS_CB_REASON_AUX_BF__PROXY;
+
+		n = lws_http_client_read(cwsi, &px, &lenx);
+		if (!req->done) {
+			if (n >= 0)
+				return 0;
+			if (req->failed)
+				/* we couldn't write it on */
+				return -1;
+			if (req->framed) {
+				/* the upstream closed before the end */
+				lws_proxy_result(req->up, 0);
+				return -1;
+			}
+			/* the upstream closing ended the response */
+		}
+	}
+
+	return lws_proxy_finish(wsi);
+}
+
+static void
+lws_proxy_hc_start(struct lws_proxy_pool *pool, struct lws_proxy_upstream *up)
+{
+	struct lws_client_connect_info i;
+	struct lws *wsi;
+
+	memset(&i, 0, sizeof(i));
+	i.context = pool->vhost->context;
+	i.vhost = pool->vhost;
+	i.address = up->address;
+	i.port = up->port;
+	i.ssl_connection = pool->ssl;
+	i.path = pool->mount->health_check_path;
+	i.host = pool->up[0].address;
+	i.method = "GET";
+
+	wsi = lws_client_connect_via_info(&i);
+	if (!wsi) {
+		lws_proxy_hc_result(up, 0);
+		return;
+	}
+
+	wsi->pxy_hc = 1;
+	wsi->pxy_up = up;
+	up->hc_wsi = wsi;
+}
+
+void
+lws_proxy_periodic(struct lws_context *context, time_t now)
+{
+	struct lws_vhost *vh = context->vhost_list;
+	struct lws_proxy_pool *pool;
+	int n;
+
+	context->proxy_hc_last = now;
+
+	for (; vh; vh = vh->vhost_next)
+		for (pool = vh->proxy_pools; pool; pool = pool->next) {
+			if (!pool->mount->health_check_path ||
+			    now < pool->next_health_check)
+				continue;
+
+			pool->next_health_check = now +
+			    lws_pxy_def(pool->mount->health_check_interval, 10);
+
+			for (n = 0; n < pool->count_up; n++)
+				if (!pool->up[n].hc_wsi)
+					lws_proxy_hc_start(pool, &pool->up[n]);
+		}
+}
+
+int
+lws_proxy_park(struct lws *wsi)
+{
+	struct lws *parent = lws_get_parent(wsi), **pw;
+	struct lws_proxy_upstream *up;
+	struct lws_proxy_req *req;
+	int tsi = wsi->tsi;
+
+	if (!parent || !parent->pxy_req)
+		return 1;
+
+	req = parent->pxy_req;
+	up = req->up;
+	if (up->count_idle[tsi] >= req->pool->mount->upstream_keepalive)
+		return 1;
+
+	if (wsi->rw && lws_rewrite_reset(wsi->rw))
+		return 1;
+
+	/* the response is complete, we don't belong to him any more */
+	pw = &parent->child_list;
+	while (*pw) {
+		if (*pw == wsi) {
+			*pw = wsi->sibling_list;
+			break;
+		}
+		pw = &(*pw)->sibling_list;
+	}
+	wsi->parent = NULL;
+	wsi->sibling_list = NULL;
+	wsi->pxy_reused = 0;
+
+	wsi->u.http.rx_content_length = 0;
+	wsi->u.http.rx_content_remain = 0;
+	wsi->chunked = 0;
+
+	wsi->pxy_up = up;
+	wsi->pxy_idle_next = up->idle[tsi];
+	up->idle[tsi] = wsi;
+	up->count_idle[tsi]++;
+
+	/* anything arriving now means he closed it, or is confused */
+	lws_change_pollfd(wsi, 0, LWS_POLLIN);
+	lws_set_timeout(wsi, PENDING_TIMEOUT_HTTP_KEEPALIVE_IDLE,
+			wsi->vhost->keepalive_timeout);
+
+	lwsl_info("%s: %p idle to %s:%d\n", __func__, wsi, up->address,
+		  up->port);
+
+	return 0;
+}
+
+void
+lws_proxy_wsi_destroy(struct lws *wsi)
+{
+	struct lws_proxy_upstream *up = wsi->pxy_up;
+	struct lws **pw;
+
+	if (wsi->pxy_req)
+		lws_proxy_req_destroy(wsi);
+
+	if (!up)
+		return;
+
+	if (up->hc_wsi == wsi) {
+		/* closed before it had an answer */
+		if (wsi->pxy_hc)
+			lws_proxy_hc_result(up, 0);
+		up->hc_wsi = NULL;
+	}
+
+	pw = &up->idle[(int)wsi->tsi];
+	while (*pw) {
+		if (*pw == wsi) {
+			*pw = wsi->pxy_idle_next;
+			up->count_idle[(int)wsi->tsi]--;
+			break;
+		}
+		pw = &(*pw)->pxy_idle_next;
+	}
+
+	wsi->pxy_up = NULL;
+}
+
+int
+lws_proxy_callback(struct lws *wsi, enum lws_callback_reasons reason,
+		   void *in, size_t len)
+{
+	struct lws *parent = lws_get_parent(wsi);
+	struct lws_proxy_req *req = NULL;
+	char **p = (char **)in;
+	int n;
+
+	if (parent)
+		req = parent->pxy_req;
+
+	switch (reason) {
+	case LWS_CALLBACK_HTTP_WRITEABLE:
+		if (!wsi->pxy_req)
+			break;
+
+		return lws_proxy_parent_writeable(wsi);
+
+	case LWS_CALLBACK_RAW_ADOPT:
+		if (!req)
+			break;
+
+		/* connected to the upstream, the handshake can go */
+		lws_proxy_result(req->up, 1);
+		lws_callback_on_writable(wsi);
+		break;
+
+	case LWS_CALLBACK_RAW_RX:
+		if (wsi->pxy_req)
+			return lws_proxy_ws_client_rx(wsi, in, len);
+		if (!req)
+			break;
+
+		req->hdrs_sent = 1;
+
+		return lws_proxy_ws_relay(wsi, parent, in, len);
+
+	case LWS_CALLBACK_RAW_WRITEABLE:
+		if (wsi->pxy_req)
+			return lws_proxy_ws_client_writeable(wsi);
+		if (!req)
+			break;
+
+		return lws_proxy_ws_upstream_writeable(wsi, parent, req);
+
+	case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER:
+		if (!req)
+			break;
+		n = lws_proxy_cache_append(req, p, len);
+		if (n < 0)
+			return -1;
+		len -= n;
+		if (!req->body_length)
+			break;
+		if (len < sizeof(req->ctype) + 64)
+			return -1;
+
+		*p += lws_snprintf(*p, len, "Content-Length: %llu\x0d\x0a",
+				   (unsigned long long)req->body_length);
+		if (req->ctype[0])
+			*p += lws_snprintf(*p, len - 64,
+					   "Content-Type: %s\x0d\x0a",
+					   req->ctype);
+
+		lws_client_http_body_pending(wsi, 1);
+		lws_callback_on_writable(wsi);
+		break;
+
+	case LWS_CALLBACK_CLIENT_HTTP_WRITEABLE:
+		if (!req)
+			break;
+
+		return lws_proxy_client_writeable(wsi, parent, req);
+
+	case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+		if (wsi->pxy_hc) {
+			wsi->pxy_hc = 0;
+			lws_proxy_hc_result(wsi->pxy_up, 0);
+			break;
+		}
+		if (!req)
+			break;
+
+		lwsl_info("%s: upstream %s:%d: %s\n", __func__,
+			  req->up->address, req->up->port,
+			  in ? (const char *)in : "");
+		lws_proxy_conn_failed(parent, req, wsi->pxy_reused);
+		break;
+
+	case LWS_CALLBACK_CHILD_CLOSING:
+		/*
+		 * the upstream connection is going before the response
+		 * completed, without a CLIENT_CONNECTION_ERROR, eg, it timed
+		 * out, or failed sending the request
+		 */
+		if (!req || req->done || req->retry || req->failed)
+			break;
+
+		if (!req->hdrs_sent) {
+			lws_proxy_conn_failed(parent, req, wsi->pxy_reused);
+			break;
+		}
+
+		req->failed = 1;
+		lws_callback_on_writable(parent);
+		break;
+
+	case LWS_CALLBACK_ESTABLISHED_CLIENT_HTTP:
+		if (wsi->pxy_hc) {
+			n = lws_http_client_http_response(wsi);
+			wsi->pxy_hc = 0;
+			lws_proxy_hc_result(wsi->pxy_up, n >= 200 && n < 400);
+
+			/* we don't need the body */
+			return -1;
+		}
+		if (!req)
+			break;
+
+		return lws_proxy_established(wsi, parent, req);
+
+	case LWS_CALLBACK_RECEIVE_CLIENT_HTTP:
+		if (!req)
+			/* idle, he hung up, or is sending junk */
+			return !!wsi->pxy_up;
+
+		parent->reason_bf |= LWS_CB_REASON_AUX_BF__PROXY;
+		lws_callback_on_writable(parent);
+		break;
+
+	case LWS_CALLBACK_RECEIVE_CLIENT_HTTP_READ:
+		if (!req)
+			break;
+
+		n = lws_write(parent, (unsigned char *)in, len,
+			      LWS_WRITE_HTTP);
+		if (n < 0) {
+			req->failed = 1;
+			return -1;
+		}
+		if (req->cache_fill)
+			lws_proxy_cache_fill(parent, req, in, len);
+		break;
+
+	case LWS_CALLBACK_COMPLETED_CLIENT_HTTP:
+		if (!req)
+			break;
+
+		req->done = 1;
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,464 @@
+/*
+ * libwebsockets - topic publish / subscribe
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+#include "private-libwebsockets.h"
+
+/*
+ * Each topic has a part per service thread, which only that thread touches.
+ * It holds a ring of the most recent messages for the topic, and two lists of
+ * the pt's subscribers: the idle ones, who have sent everything, and the busy
+ * ones, who are behind and already have a WRITEABLE callback coming.
+ *
+ * Publishers on any thread post each message to the pts with subscribers
+ * using the pt work queue.  When the message arrives, it goes in the ring and
+ * only the idle subscribers need waking.  A subscriber is just a position in
+ * the ring, so a slow one costs nothing until it writes again, when it skips
+ * to within its max_lag of the head.
+ *
+ * The context hash of topics only ever grows, lock-free, so topic handles
+ * stay valid until the context goes.
+ */
+
+#define LWS_PUBSUB_DEF_LAG 32
+#define LWS_PUBSUB_MAX_LAG 1024
+/* most messages sent per lws_pubsub_write_pending() */
+#define LWS_PUBSUB_WRITE_BATCH 32
+
+struct lws_pubsub_delivery {
+	struct lws_pt_work work; /* must be first */
+	struct lws_pubsub_topic *topic;
+	struct lws_shared_msg *sm; /* the delivery owns one reference */
+};
+
+#if defined(LWS_HAVE_ATOMIC_BUILTINS)
+#define lws_pubsub_count_subs(tp, d) \
+	__atomic_store_n(&(tp)->count_subs, (tp)->count_subs + (d), \
+			 __ATOMIC_RELAXED)
+#else
+#define lws_pubsub_count_subs(tp, d) (tp)->count_subs += (d)
+#endif
+
+static const char *
+lws_pubsub_topic_name(struct lws_pubsub_topic *t)
+{
+	return (const char *)&t->pt[t->context->count_threads];
+}
+
+static uint32_t
+lws_pubsub_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+
+	return h;
+}
+
+static void
+lws_pubsub_link(struct lws_pubsub_sub **list, struct lws_pubsub_sub *sub)
+{
+	sub->next = *list;
+	if (*list)
+		(*list)->prev = &sub->next;
+	*list = sub;
+	sub->prev = list;
+}
+
+static void
+lws_pubsub_unlink(struct lws_pubsub_sub *sub)
+{
+	*sub->prev = sub->next;
+	if (sub->next)
+		sub->next->prev = sub->prev;
+}
+
+/*
+ * Nobody on this pt is behind any more, so nobody can need the messages
+ * still in the ring.  Let them go now instead of when they are overwritten.
+ */
+static void
+lws_pubsub_ring_release(struct lws_pubsub_topic_pt *tp)
+{
+	struct lws_shared_msg **slot;
+
+	while (tp->held != tp->head) {
+		slot = &tp->ring[tp->held++ & (tp->ring_size - 1)];
+		if (*slot) {
+			lws_shared_msg_unref(*slot);
+			*slot = NULL;
+		}
+	}
+}
+
+/* make sure the ring can hold max_lag messages, keeping what it has */
+static int
+lws_pubsub_ring_fit(struct lws_pubsub_topic_pt *tp, uint32_t max_lag)
+{
+	uint32_t size = tp->ring_size ? tp->ring_size : 8, s;
+	struct lws_shared_msg **r;
+
+	while (size < max_lag)
+		size <<= 1;
+	if (size == tp->ring_size)
+		return 0;
+
+	r = lws_zalloc(size * sizeof(*r), "pubsub ring");
+	if (!r)
+		return 1;
+
+	if (tp->ring) {
+		for (s = tp->held; s != tp->head; s++)
+			r[s & (size - 1)] = tp->ring[s & (tp->ring_size - 1)];
+		lws_free(tp->ring);
+	}
+
+	tp->ring = r;
+	tp->ring_size = size;
+
+	return 0;
+}
+
+static struct lws_pubsub_sub *
+lws_pubsub_find(struct lws *wsi, struct lws_pubsub_topic *topic)
+{
+	struct lws_pubsub_sub *sub = wsi->pubsub_subs;
+
+	while (sub && sub->topic != topic)
+		sub = sub->wsi_next;
+
+	return sub;
+}
+
+/* the caller has already taken it off the wsi's list */
+static void
+lws_pubsub_sub_destroy(struct lws_pubsub_sub *sub)
+{
+	struct lws_pubsub_topic_pt *tp = &sub->topic->pt[(int)sub->wsi->tsi];
+
+	lws_pubsub_unlink(sub);
+	lws_pubsub_count_subs(tp, -1);
+	if (!tp->busy)
+		lws_pubsub_ring_release(tp);
+
+	lws_free(sub);
+}
+
+LWS_VISIBLE struct lws_pubsub_topic *
+lws_pubsub_topic_get(struct lws_context *context, const char *name)
+{
+#if defined(LWS_HAVE_ATOMIC_BUILTINS)
+	struct lws_pubsub_topic **bucket, *head, *seen = NULL, *nt = NULL, *t;
+	uint32_t h = lws_pubsub_hash(name);
+	size_t len = strlen(name) + 1;
+
+	bucket = &context->pubsub_hash[h & (LWS_PUBSUB_HASH_SIZE - 1)];
+	head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+
+	do {
+		/* topics are only added at the head, check the new ones */
+		for (t = head; t != seen; t = t->next)
+			if (t->hash == h &&
+			    !strcmp(lws_pubsub_topic_name(t), name)) {
+				/* somebody else created it first */
+				lws_free(nt);
+
+				return t;
+			}
+		seen = head;
+
+		if (!nt) {
+			nt = lws_zalloc(sizeof(*nt) + context->count_threads *
+					sizeof(struct lws_pubsub_topic_pt) + len,
+					"pubsub topic");
+			if (!nt)
+				return NULL;
+
+			nt->context = context;
+			nt->hash = h;
+			nt->pt = (struct lws_pubsub_topic_pt *)(nt + 1);
+			memcpy((char *)lws_pubsub_topic_name(nt), name, len);
+		}
+		nt->next = head;
+	} while (!__atomic_compare_exchange_n(bucket, &head, nt, 0,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+
+	return nt;
+#else
+	lwsl_err("%s: needs atomic builtins\n", __func__);
+
+	return NULL;
+#endif
+}
+
+LWS_VISIBLE int
+lws_pubsub_subscribe(struct lws *wsi, struct lws_pubsub_topic *topic,
+		     unsigned int max_lag, enum lws_pubsub_lag_policy policy)
+{
+	struct lws_pubsub_topic_pt *tp = &topic->pt[(int)wsi->tsi];
+	struct lws_pubsub_sub *sub;
+
+	if (wsi->mode != LWSCM_WS_SERVING) {
+		lwsl_err("%s: %p is not a ws server connection\n", __func__,
+			 wsi);
+		return 1;
+	}
+
+	if (!max_lag)
+		max_lag = LWS_PUBSUB_DEF_LAG;
+	if (max_lag > LWS_PUBSUB_MAX_LAG)
+		max_lag = LWS_PUBSUB_MAX_LAG;
+
+	if (lws_pubsub_ring_fit(tp, max_lag))
+		return 1;
+
+	sub = lws_pubsub_find(wsi, topic);
+	if (!sub) {
+		sub = lws_zalloc(sizeof(*sub), "pubsub sub");
+		if (!sub)
+			return 1;
+
+		sub->topic = topic;
+		sub->wsi = wsi;
+		sub->seq = tp->head;
+		sub->wsi_next = wsi->pubsub_subs;
+		wsi->pubsub_subs = sub;
+		lws_pubsub_link(&tp->idle, sub);
+		lws_pubsub_count_subs(tp, 1);
+	}
+
+	sub->max_lag = max_lag;
+	sub->policy = (unsigned char)policy;
+
+	return 0;
+}
+
+LWS_VISIBLE int
+lws_pubsub_unsubscribe(struct lws *wsi, struct lws_pubsub_topic *topic)
+{
+	lws_start_foreach_llp(struct lws_pubsub_sub **, p, wsi->pubsub_subs) {
+		if ((*p)->topic == topic) {
+			struct lws_pubsub_sub *sub = *p;
+
+			*p = sub->wsi_next;
+			lws_pubsub_sub_destroy(sub);
+
+			return 0;
+		}
+	} lws_end_foreach_llp(p, wsi_next);
+
+	return 1;
+}
+
+LWS_VISIBLE unsigned int
+lws_pubsub_dropped(struct lws *wsi, struct lws_pubsub_topic *topic)
+{
+	struct lws_pubsub_sub *sub = lws_pubsub_find(wsi, topic);
+
+	return sub ? sub->dropped : 0;
+}
+
+void
+lws_pubsub_wsi_destroy(struct lws *wsi)
+{
+	struct lws_pubsub_sub *sub;
+
+	while (wsi->pubsub_subs) {
+		sub = wsi->pubsub_subs;
+		wsi->pubsub_subs = sub->wsi_next;
+		lws_pubsub_sub_destroy(sub);
+	}
+}
+
+/* runs on the service thread tsi, from its work queue */
+static void
+lws_pubsub_deliver(struct lws_context *context, int tsi,
+		   struct lws_pt_work *work)
+{
+	struct lws_pubsub_delivery *d = (struct lws_pubsub_delivery *)work;
+	struct lws_pubsub_topic_pt *tp = &d->topic->pt[tsi];
+	struct lws_shared_msg **slot;
+	struct lws_pubsub_sub *sub;
+
+	if (!tp->count_subs) {
+		/* they all went since it was published */
+		lws_shared_msg_unref(d->sm);
+		lws_free(d);
+
+		return;
+	}
+
+	slot = &tp->ring[tp->head & (tp->ring_size - 1)];
+	if (tp->head - tp->held == tp->ring_size) {
+		/* the oldest message falls out of the ring */
+		if (*slot)
+			lws_shared_msg_unref(*slot);
+		tp->held++;
+	}
+	*slot = d->sm;
+	tp->head++;
+	lws_free(d);
+
+	/* the busy ones will see it when they get to it */
+	while (tp->idle) {
+		sub = tp->idle;
+		lws_pubsub_unlink(sub);
+		lws_pubsub_link(&tp->busy, sub);
+		sub->busy = 1;
+		lws_callback_on_writable(sub->wsi);
+	}
+}
+
+LWS_VISIBLE int
+lws_pubsub_publish(struct lws_pubsub_topic *topic, const void *payload,
+		   size_t len, enum lws_write_protocol wp)
+{
+#if defined(LWS_HAVE_ATOMIC_BUILTINS)
+	struct lws_pubsub_delivery *d[LWS_MAX_SMP];
+	struct lws_context *context = topic->context;
+	int tsi[LWS_MAX_SMP];
+	struct lws_shared_msg *sm;
+	int n, count = 0;
+
+	for (n = 0; n < context->count_threads; n++) {
+		if (!__atomic_load_n(&topic->pt[n].count_subs,
+				     __ATOMIC_RELAXED))
+			continue;
+
+		d[count] = lws_malloc(sizeof(*d[0]), "pubsub delivery");
+		if (!d[count])
+			goto bail;
+
+		d[count]->work.cb = lws_pubsub_deliver;
+		d[count]->work.opaque = NULL;
+		d[count]->topic = topic;
+		tsi[count++] = n;
+	}
+
+	if (!count)
+		return 0;
+
+	sm = lws_shared_msg_create(payload, len, wp);
+	if (!sm)
+		goto bail;
+
+	/*
+	 * Take all the references before posting any, since once a pt has
+	 * its delivery it may drop its reference at any time
+	 */
+	for (n = 1; n < count; n++)
+		lws_shared_msg_ref(sm);
+
+	for (n = 0; n < count; n++) {
+		d[n]->sm = sm;
+		if (lws_pt_work_post(context, tsi[n], &d[n]->work)) {
+			lws_shared_msg_unref(sm);
+			lws_free(d[n]);
+		}
+	}
+
+	return count;
+
+bail:
+	while (count--)
+		lws_free(d[count]);
+
+	return -1;
+#else
+	lwsl_err("%s: needs atomic builtins\n", __func__);
+
+	return -1;
+#endif
+}
+
+LWS_VISIBLE int
+lws_pubsub_write_pending(struct lws *wsi)
+{
+	struct lws_pubsub_topic_pt *tp;
+	struct lws_pubsub_sub *sub;
+	uint32_t lag, keep;
+	int sent = 0;
+
+	for (sub = wsi->pubsub_subs; sub; sub = sub->wsi_next) {
+		if (!sub->busy)
+			continue;
+
+		tp = &sub->topic->pt[(int)wsi->tsi];
+		while (sub->seq != tp->head) {
+			if (sent == LWS_PUBSUB_WRITE_BATCH ||
+			    lws_tx_queue_choked(wsi)) {
+				/* still behind, come back for the rest */
+				lws_callback_on_writable(wsi);
+
+				return sent;
+			}
+
+			lag = tp->head - sub->seq;
+			if (lag > sub->max_lag) {
+				keep = sub->max_lag;
+				if (sub->policy == LWS_PUBSUB_LAG_COALESCE)
+					keep = 1;
+				sub->dropped += lag - keep;
+				sub->seq = tp->head - keep;
+			}
+
+			if (lws_write_shared(wsi, tp->ring[sub->seq++ &
+						   (tp->ring_size - 1)]) < 0)
+				return -1;
+			sent++;
+		}
+
+		/* caught up, wait for the next message */
+		lws_pubsub_unlink(sub);
+		lws_pubsub_link(&tp->idle, sub);
+		sub->busy = 0;
+		if (!tp->busy)
+			lws_pubsub_ring_release(tp);
+	}
+
+	return sent;
+}
+
+void
+lws_pubsub_context_destroy(struct lws_context *context)
+{
+	struct lws_pubsub_topic *t, *t1;
+	int n, m;
+
+	/* clean up anything still on its way to a pt */
+	for (n = 0; n < context->count_threads; n++)
+		lws_pt_work_run(context, n);
+
+	for (n = 0; n < LWS_PUBSUB_HASH_SIZE; n++) {
+		t = context->pubsub_hash[n];
+		while (t) {
+			t1 = t->next;
+			for (m = 0; m < context->count_threads; m++) {
+				lws_pubsub_ring_release(&t->pt[m]);
+				lws_free(t->pt[m].ring);
+			}
+			lws_free(t);
+			t = t1;
+		}
+		context->pubsub_hash[n] = NULL;
+	}
+}
@@ -1,34 +1,204 @@
 #include "private-libwebsockets.h"
 
+/*
+ * Proxied html is scanned as it streams through, just far enough to find
+ * the values of href, src and action attributes in tags.  Everything else
+ * is passed on exactly as it came, mostly in the same spans it arrived in;
+ * only the start of the url values we rewrite is held back until we can
+ * tell if it names the origin, which may be across a chunk boundary.
+ *
+ *  - absolute urls to the origin, "http[s]://" or "//" followed by it, and
+ *    root-relative urls, have the origin part replaced by the mountpoint
+ *
+ *  - relative urls already resolve under the mountpoint and are left alone
+ *
+ * Comments, <!...> declarations and the raw text in script and style
+ * elements are skipped.
+ */
+
+enum lws_rewrite_states {
+	LWSRW_DATA,
+	LWSRW_TAG_OPEN,
+	LWSRW_TAG_NAME,
+	LWSRW_BEFORE_ATTR,
+	LWSRW_ATTR_NAME,
+	LWSRW_AFTER_ATTR,
+	LWSRW_BEFORE_VAL,
+	LWSRW_VAL,
+	LWSRW_MARKUP,
+	LWSRW_COMMENT,
+	LWSRW_BOGUS,
+	LWSRW_RAWTEXT,
+	LWSRW_RAWTEXT_END,
+};
+
+/* spans at least this long are passed on as they are, rather than copied */
+#define LWS_REWRITE_DIRECT (LWS_REWRITE_OUT / 4)
+
+static const char * const url_attrs[] = { "href", "src", "action" };
+static const char * const rawtext_tags[] = { "script", "style" };
+
+static int
+lws_rewrite_flush(struct lws_rewrite *r)
+{
+	int n = r->out_len;
+
+	if (!n)
+		return 0;
+	r->out_len = 0;
+
+	return user_callback_handle_rxflow(r->wsi->protocol->callback,
+			r->wsi, LWS_CALLBACK_RECEIVE_CLIENT_HTTP_READ,
+			r->wsi->user_space, r->out + LWS_PRE, n);
+}
+
+static int
+lws_rewrite_emit(struct lws_rewrite *r, const void *p, int len)
+{
+	if (!len)
+		return 0;
+
+	if (r->out_len + len > LWS_REWRITE_OUT && lws_rewrite_flush(r))
+		return -1;
+
+	/*
+	 * Long spans are always from the input, which like all http rx has
+	 * LWS_PRE of space before it
+	 */
+	if (!r->out_len && len >= LWS_REWRITE_DIRECT)
+		return user_callback_handle_rxflow(r->wsi->protocol->callback,
+				r->wsi, LWS_CALLBACK_RECEIVE_CLIENT_HTTP_READ,
+				r->wsi->user_space, (void *)p, len);
+
+	memcpy(r->out + LWS_PRE + r->out_len, p, len);
+	r->out_len += len;
+
+	return 0;
+}
+
+/* s starts with prefix, ending at a url path boundary */
+
+static int
+lws_rewrite_prefix(const char *s, int len, const char *prefix, int plen)
+{
+	return len >= plen && !strncmp(s, prefix, plen) &&
+	       (len == plen || s[plen] == '/' || s[plen] == '?' ||
+		s[plen] == '#');
+}
+
+/* emit the start of a url value we captured, rewritten if it needs it */
+
+static int
+lws_rewrite_url(struct lws_rewrite *r)
+{
+	const char *v = r->val, *rest = NULL;
+	int len = r->val_len, n = 0;
+
+	r->capture = 0;
+
+	if (len >= 7 && !strncasecmp(v, "http://", 7))
+		n = 7;
+	else if (len >= 8 && !strncasecmp(v, "https://", 8))
+		n = 8;
+	else if (len >= 2 && v[0] == '/' && v[1] == '/')
+		n = 2;
+
+	if (n) {
+		if (lws_rewrite_prefix(v + n, len - n, r->from, r->from_len))
+			rest = v + n + r->from_len;
+	} else
+		if (len && v[0] == '/') {
+			/* outside the origin path, it can only go under us */
+			rest = v;
+			if (lws_rewrite_prefix(v, len, r->from_path,
+					       r->from_path_len))
+				rest = v + r->from_path_len;
+		}
+
+	if (!rest)
+		return lws_rewrite_emit(r, v, len);
+
+	len -= rest - v;
+	n = r->to_len;
+	if (n && r->to[n - 1] == '/' && len && *rest == '/')
+		n--;
+	if (lws_rewrite_emit(r, r->to, n))
+		return -1;
+
+	return lws_rewrite_emit(r, rest, len);
+}
+
+/* which of names the tag or attribute name is, from 1, or 0 */
+
+static int
+lws_rewrite_is(const char *name, int len, const char * const *names,
+	       int count)
+{
+	int n;
+
+	for (n = 0; n < count; n++)
+		if (len == (int)strlen(names[n]) &&
+		    !strncmp(name, names[n], len))
+			return n + 1;
+
+	return 0;
+}
+
+static void
+lws_rewrite_name(char *name, unsigned char *len, unsigned char c)
+{
+	if (*len < LWS_REWRITE_NAME)
+		name[*len] = (char)tolower(c);
+	/* too long to be one we care about either way */
+	if (*len <= LWS_REWRITE_NAME)
+		(*len)++;
+}
+
+static void
+lws_rewrite_tag_end(struct lws_rewrite *r)
+{
+	int n;
+
+	r->state = LWSRW_DATA;
+	if (r->end_tag)
+		return;
+
+	n = lws_rewrite_is(r->name, r->name_len, rawtext_tags,
+			   ARRAY_SIZE(rawtext_tags));
+	if (n) {
+		r->rawtext = rawtext_tags[n - 1];
+		r->state = LWSRW_RAWTEXT;
+	}
+}
+
+#define lws_rewrite_space(c) (c == ' ' || c == '\t' || c == '\n' || \
+			      c == '\r' || c == '\f')
 
 LWS_EXTERN struct lws_rewrite *
-lws_rewrite_create(struct lws *wsi, hubbub_callback_t cb, const char *from, const char *to)
+lws_rewrite_create(struct lws *wsi, const char *from, const char *to)
 {
-	struct lws_rewrite *r = lws_malloc(sizeof(*r), "rewrite");
+	struct lws_rewrite *r;
+	const char *p;
+	int n = strlen(from);
 
+	/* room to see whether a url value starts with the origin */
+	r = lws_zalloc(sizeof(*r) + n + 10, "rewrite");
 	if (!r) {
 		lwsl_err("OOM\n");
 		return NULL;
 	}
 
-	if (hubbub_parser_create("UTF-8", false, &r->parser) != HUBBUB_OK) {
-		lws_free(r);
-
-		return NULL;
-	}
+	r->wsi = wsi;
 	r->from = from;
-	r->from_len = strlen(from);
+	r->from_len = n;
+	if (n && from[n - 1] == '/')
+		r->from_len--;
+	p = strchr(from, '/');
+	r->from_path = p ? p : "";
+	r->from_path_len = p ? r->from_len - (p - from) : 0;
 	r->to = to;
 	r->to_len = strlen(to);
-	r->params.token_handler.handler = cb;
-	r->wsi = wsi;
-	r->params.token_handler.pw = (void *)r;
-	if (hubbub_parser_setopt(r->parser, HUBBUB_PARSER_TOKEN_HANDLER,
-				 &r->params) != HUBBUB_OK) {
-		lws_free(r);
-
-		return NULL;
-	}
+	r->val_max = n + 10;
 
 	return r;
 }
@@ -37,16 +207,217 @@ LWS_EXTERN int
 lws_rewrite_parse(struct lws_rewrite *r,
 		  const unsigned char *in, int in_len)
 {
-	if (hubbub_parser_parse_chunk(r->parser, in, in_len) != HUBBUB_OK)
+	const unsigned char *p = in, *end = in + in_len, *span = in, *q;
+	unsigned char c;
+
+	while (p < end) {
+		c = *p;
+
+		switch (r->state) {
+		case LWSRW_DATA:
+			q = memchr(p, '<', end - p);
+			if (!q) {
+				p = end;
+				continue;
+			}
+			p = q;
+			r->state = LWSRW_TAG_OPEN;
+			break;
+
+		case LWSRW_TAG_OPEN:
+			r->name_len = 0;
+			r->end_tag = 0;
+			if (c == '!') {
+				r->match = 0;
+				r->state = LWSRW_MARKUP;
+				break;
+			}
+			if (c == '/') {
+				r->end_tag = 1;
+				r->state = LWSRW_TAG_NAME;
+				break;
+			}
+			r->state = isalpha(c) ? LWSRW_TAG_NAME : LWSRW_DATA;
+			continue;
+
+		case LWSRW_TAG_NAME:
+			if (lws_rewrite_space(c) || c == '/') {
+				r->state = LWSRW_BEFORE_ATTR;
+				break;
+			}
+			if (c == '>') {
+				lws_rewrite_tag_end(r);
+				break;
+			}
+			lws_rewrite_name(r->name, &r->name_len, c);
+			break;
+
+		case LWSRW_BEFORE_ATTR:
+			if (lws_rewrite_space(c) || c == '/')
+				break;
+			if (c == '>') {
+				lws_rewrite_tag_end(r);
+				break;
+			}
+			r->attr_len = 0;
+			r->state = LWSRW_ATTR_NAME;
+			continue;
+
+		case LWSRW_ATTR_NAME:
+		case LWSRW_AFTER_ATTR:
+			if (lws_rewrite_space(c)) {
+				r->state = LWSRW_AFTER_ATTR;
+				break;
+			}
+			if (c == '=') {
+				r->state = LWSRW_BEFORE_VAL;
+				break;
+			}
+			if (c == '>' || c == '/') {
+				r->state = LWSRW_BEFORE_ATTR;
+				continue;
+			}
+			if (r->state == LWSRW_AFTER_ATTR) {
+				/* a new attribute without a value */
+				r->attr_len = 0;
+				r->state = LWSRW_ATTR_NAME;
+			}
+			lws_rewrite_name(r->attr, &r->attr_len, c);
+			break;
+
+		case LWSRW_BEFORE_VAL:
+			if (lws_rewrite_space(c))
+				break;
+			if (c == '>') {
+				lws_rewrite_tag_end(r);
+				break;
+			}
+			r->quote = 0;
+			if (c == '"' || c == '\'') {
+				r->quote = (char)c;
+				p++;
+			}
+			r->state = LWSRW_VAL;
+			r->capture = !r->end_tag &&
+				     lws_rewrite_is(r->attr, r->attr_len, url_attrs,
+						    ARRAY_SIZE(url_attrs));
+			if (r->capture) {
+				/* hold the value back until we know */
+				if (lws_rewrite_emit(r, span, p - span))
+					return -1;
+				r->val_len = 0;
+			}
+			continue;
+
+		case LWSRW_VAL:
+			if (r->quote ? c == r->quote :
+				       (lws_rewrite_space(c) || c == '>')) {
+				if (r->capture) {
+					if (lws_rewrite_url(r))
+						return -1;
+					span = p;
+				}
+				r->state = LWSRW_BEFORE_ATTR;
+				if (r->quote)
+					break;
+				continue;
+			}
+			if (!r->capture)
+				break;
+			r->val[r->val_len++] = (char)c;
+			if (r->val_len == r->val_max) {
+				/* we've seen enough, the rest goes as it is */
+				if (lws_rewrite_url(r))
+					return -1;
+				span = p + 1;
+			}
+			break;
+
+		case LWSRW_MARKUP:
+			if (c == '-') {
+				if (++r->match == 2) {
+					r->match = 0;
+					r->state = LWSRW_COMMENT;
+				}
+				break;
+			}
+			r->state = LWSRW_BOGUS;
+			continue;
+
+		case LWSRW_COMMENT:
+			if (c == '>' && r->match >= 2)
+				r->state = LWSRW_DATA;
+			else
+				if (c == '-') {
+					if (r->match < 2)
+						r->match++;
+				} else
+					r->match = 0;
+			break;
+
+		case LWSRW_BOGUS:
+			q = memchr(p, '>', end - p);
+			if (!q) {
+				p = end;
+				continue;
+			}
+			p = q;
+			r->state = LWSRW_DATA;
+			break;
+
+		case LWSRW_RAWTEXT:
+			q = memchr(p, '<', end - p);
+			if (!q) {
+				p = end;
+				continue;
+			}
+			p = q;
+			r->match = 0;
+			r->state = LWSRW_RAWTEXT_END;
+			break;
+
+		case LWSRW_RAWTEXT_END:
+			/* looking for "/script" etc after the '<' */
+			if (r->match && !r->rawtext[r->match - 1]) {
+				/* ...and the end of the name, not "</scriptx" */
+				if (lws_rewrite_space(c) || c == '/' || c == '>') {
+					/* the element's end tag */
+					r->end_tag = 1;
+					r->state = LWSRW_BEFORE_ATTR;
+				} else
+					r->state = LWSRW_RAWTEXT;
+				continue;
+			}
+			if (r->match ? tolower(c) != r->rawtext[r->match - 1] :
+				       c != '/') {
+				r->state = LWSRW_RAWTEXT;
+				continue;
+			}
+			r->match++;
+			break;
+		}
+
+		p++;
+	}
+
+	if (!r->capture && lws_rewrite_emit(r, span, end - span))
 		return -1;
 
+	return lws_rewrite_flush(r);
+}
+
+LWS_EXTERN int
+lws_rewrite_reset(struct lws_rewrite *r)
+{
+	r->state = LWSRW_DATA;
+	r->capture = 0;
+	r->out_len = 0;
+
 	return 0;
 }
 
 LWS_EXTERN void
 lws_rewrite_destroy(struct lws_rewrite *r)
 {
-	hubbub_parser_destroy(r->parser);
 	lws_free(r);
 }
-
@@ -233,12 +233,139 @@ bail:
 #define strchr ets_strchr
 #endif
 
+/*
+ * vhosts are indexed by (listen_port, name) so SNI and Host: lookups don't
+ * have to walk the whole vhost list.  Only the first vhost in list order for
+ * each (port, name) goes in the hash table, since that is the one a linear
+ * scan would find; likewise vhost_port_list holds the first vhost on each
+ * port for the fallback match.
+ */
+
+static uint32_t
+lws_vhost_name_hash(int port, const char *name, int len)
+{
+	uint32_t h = 2166136261u ^ (uint32_t)port;
+
+	while (len--) {
+		h ^= (uint8_t)*name++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static struct lws_vhost *
+lws_vhost_hash_find(struct lws_context *context, int port, const char *name,
+		    int len, uint32_t hash)
+{
+	struct lws_vhost *vh;
+
+	if (!context->vhost_hash_table)
+		return NULL;
+
+	vh = context->vhost_hash_table[hash & (context->vhost_hash_elements - 1)];
+	while (vh) {
+		if (vh->name_hash == hash && vh->listen_port == port &&
+		    vh->name_len == len && !strncmp(vh->name, name, len))
+			return vh;
+		vh = vh->vhost_hash_next;
+	}
+
+	return NULL;
+}
+
+static int
+lws_vhost_hash_resize(struct lws_context *context, uint32_t elements)
+{
+	struct lws_vhost **t = lws_zalloc(elements * sizeof(*t), "vhost hash"),
+			 *vh, *vh1;
+	uint32_t n;
+
+	if (!t)
+		return 1;
+
+	for (n = 0; n < context->vhost_hash_elements; n++) {
+		vh = context->vhost_hash_table[n];
+		while (vh) {
+			vh1 = vh->vhost_hash_next;
+			vh->vhost_hash_next = t[vh->name_hash & (elements - 1)];
+			t[vh->name_hash & (elements - 1)] = vh;
+			vh = vh1;
+		}
+	}
+
+	lws_free(context->vhost_hash_table);
+	context->vhost_hash_table = t;
+	context->vhost_hash_elements = elements;
+
+	return 0;
+}
+
+/* the vhost must already be at the end of context->vhost_list */
+
+int
+lws_vhost_index_add(struct lws_vhost *vh)
+{
+	struct lws_context *context = vh->context;
+	struct lws_vhost **pv;
+	uint32_t n;
+
+	vh->ordinal = context->vhost_ordinal++;
+	vh->name_len = (int)strlen(vh->name);
+	vh->name_hash = lws_vhost_name_hash(vh->listen_port, vh->name,
+					    vh->name_len);
+	vh->vhost_hash_next = NULL;
+	vh->vhost_port_next = NULL;
+
+	if (context->vhost_hash_count >= context->vhost_hash_elements &&
+	    lws_vhost_hash_resize(context, context->vhost_hash_elements ?
+				  context->vhost_hash_elements * 2 : 64))
+		return 1;
+
+	if (!lws_vhost_hash_find(context, vh->listen_port, vh->name,
+				 vh->name_len, vh->name_hash)) {
+		n = vh->name_hash & (context->vhost_hash_elements - 1);
+		vh->vhost_hash_next = context->vhost_hash_table[n];
+		context->vhost_hash_table[n] = vh;
+		context->vhost_hash_count++;
+	}
+
+	pv = &context->vhost_port_list;
+	while (*pv) {
+		if ((*pv)->listen_port == vh->listen_port)
+			return 0;
+		pv = &(*pv)->vhost_port_next;
+	}
+	*pv = vh;
+
+	return 0;
+}
+
+void
+lws_vhost_index_rebuild(struct lws_context *context)
+{
+	struct lws_vhost *vh = context->vhost_list;
+
+	lws_free_set_NULL(context->vhost_hash_table);
+	context->vhost_hash_elements = 0;
+	context->vhost_hash_count = 0;
+	context->vhost_ordinal = 0;
+	context->vhost_port_list = NULL;
+
+	while (vh) {
+		if (lws_vhost_index_add(vh))
+			lwsl_err("%s: OOM indexing vhost %s\n", __func__,
+				 vh->name);
+		vh = vh->vhost_next;
+	}
+}
+
 struct lws_vhost *
 lws_select_vhost(struct lws_context *context, int port, const char *servername)
 {
-	struct lws_vhost *vhost = context->vhost_list;
+	struct lws_vhost *vhost, *vh;
 	const char *p;
-	int n, m, colon;
+	int n, colon;
 
 	n = (int)strlen(servername);
 	colon = n;
@@ -248,13 +375,11 @@ lws_select_vhost(struct lws_context *context, int port, const char *servername)
 
 	/* Priotity 1: first try exact matches */
 
-	while (vhost) {
-		if (port == vhost->listen_port &&
-		    !strncmp(vhost->name, servername, colon)) {
-			lwsl_info("SNI: Found: %s\n", servername);
-			return vhost;
-		}
-		vhost = vhost->vhost_next;
+	vhost = lws_vhost_hash_find(context, port, servername, colon,
+				    lws_vhost_name_hash(port, servername, colon));
+	if (vhost) {
+		lwsl_info("SNI: Found: %s\n", servername);
+		return vhost;
 	}
 
 	/*
@@ -263,31 +388,37 @@ lws_select_vhost(struct lws_context *context, int port, const char *servername)
 	 * which is reasonable.  If exact match exists we already chose it and
 	 * never reach here.  SSL will still fail it if the cert doesn't allow
 	 * *.x.com.
+	 *
+	 * Each suffix following a '.' is looked up in the hash; where several
+	 * suffixes have a vhost, the one earliest in the vhost list wins.
 	 */
-	vhost = context->vhost_list;
-	while (vhost) {
-		m = (int)strlen(vhost->name);
-		if (port == vhost->listen_port &&
-		    m <= (colon - 2) &&
-		    servername[colon - m - 1] == '.' &&
-		    !strncmp(vhost->name, servername + colon - m, m)) {
-			lwsl_info("SNI: Found %s on wildcard: %s\n",
-				    servername, vhost->name);
-			return vhost;
-		}
-		vhost = vhost->vhost_next;
+	for (n = 1; n < colon; n++) {
+		if (servername[n] != '.')
+			continue;
+		vh = lws_vhost_hash_find(context, port, servername + n + 1,
+					 colon - n - 1,
+					 lws_vhost_name_hash(port,
+						servername + n + 1,
+						colon - n - 1));
+		if (vh && (!vhost || vh->ordinal < vhost->ordinal))
+			vhost = vh;
+	}
+	if (vhost) {
+		lwsl_info("SNI: Found %s on wildcard: %s\n",
+			    servername, vhost->name);
+		return vhost;
 	}
 
 	/* Priority 3: match the first vhost on our port */
 
-	vhost = context->vhost_list;
+	vhost = context->vhost_port_list;
 	while (vhost) {
 		if (port == vhost->listen_port) {
 			lwsl_info("vhost match to %s based on port %d\n",
 					vhost->name, port);
 			return vhost;
 		}
-		vhost = vhost->vhost_next;
+		vhost = vhost->vhost_port_next;
 	}
 
 	/* no match */
@@ -295,75 +426,156 @@ lws_select_vhost(struct lws_context *context, int port, const char *servername)
 	return NULL;
 }
 
-LWS_VISIBLE LWS_EXTERN const char *
-lws_get_mimetype(const char *file, const struct lws_http_mount *m)
-{
-	int n = (int)strlen(file);
-	const struct lws_protocol_vhost_options *pvo = NULL;
-
-	if (m)
-		pvo = m->extra_mimetypes;
+struct lws_mimetype {
+	const char *ext;
+	const char *mimetype;
+};
 
-	if (n < 5)
-		return NULL;
+/* sorted by extension (strcmp order) for the bsearch */
+
+static const struct lws_mimetype lws_mimetypes_builtin[] = {
+	{ ".JPG",	"image/jpeg" },
+	{ ".css",	"text/css" },
+	{ ".gif",	"image/gif" },
+	{ ".gz",	"application/gzip" },
+	{ ".html",	"text/html" },
+	{ ".ico",	"image/x-icon" },
+	{ ".jpg",	"image/jpeg" },
+	{ ".js",	"text/javascript" },
+	{ ".otf",	"application/font-woff" },
+	{ ".png",	"image/png" },
+	{ ".svg",	"image/svg+xml" },
+	{ ".ttf",	"application/x-font-ttf" },
+	{ ".txt",	"text/plain" },
+	{ ".woff",	"application/font-woff" },
+	{ ".xml",	"application/xml" },
+};
 
-	if (!strcmp(&file[n - 4], ".ico"))
-		return "image/x-icon";
+#if defined(LWS_WITH_FULL_MIMETYPES)
+#include "mimetypes.h"
+#endif
 
-	if (!strcmp(&file[n - 4], ".gif"))
-		return "image/gif";
+/* no table extension is longer than this, including the '.' */
+#define LWS_MIMETYPE_EXT_MAX 16
 
-	if (!strcmp(&file[n - 3], ".js"))
-		return "text/javascript";
+static const char *
+lws_mimetype_table(const struct lws_mimetype *t, int count, const char *ext)
+{
+	int lo = 0, hi = count - 1, mid, n;
 
-	if (!strcmp(&file[n - 4], ".png"))
-		return "image/png";
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		n = strcmp(ext, t[mid].ext);
+		if (!n)
+			return t[mid].mimetype;
+		if (n < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
 
-	if (!strcmp(&file[n - 4], ".jpg"))
-		return "image/jpeg";
+	return NULL;
+}
 
-	if (!strcmp(&file[n - 3], ".gz"))
-		return "application/gzip";
+/* returns the trailing ".ext" of the filename, or NULL */
 
-	if (!strcmp(&file[n - 4], ".JPG"))
-		return "image/jpeg";
+static const char *
+lws_mimetype_ext(const char *file, int n)
+{
+	const char *p = file + n;
 
-	if (!strcmp(&file[n - 5], ".html"))
-		return "text/html";
+	while (p > file && file + n - p < LWS_MIMETYPE_EXT_MAX) {
+		p--;
+		if (*p == '.')
+			return p;
+		if (*p == '/')
+			break;
+	}
 
-	if (!strcmp(&file[n - 4], ".css"))
-		return "text/css";
+	return NULL;
+}
 
-	if (!strcmp(&file[n - 4], ".txt"))
-		return "text/plain";
+static const char *
+lws_mimetype_extra_compiled(const struct lws_mount_trie_hit *mh,
+			    const char *file, int n)
+{
+	const struct lws_suffix_node *node = mh->mimetypes, *best = NULL;
 
-	if (!strcmp(&file[n - 4], ".svg"))
-		return "image/svg+xml";
+	/*
+	 * walk back along the filename; the deepest node is not necessarily
+	 * the one to use, the entry listed first in extra_mimetypes wins
+	 */
 
-	if (!strcmp(&file[n - 4], ".ttf"))
-		return "application/x-font-ttf";
+	while (node) {
+		if (node->value && (!best || node->ordinal < best->ordinal))
+			best = node;
+		if (!n)
+			break;
+		n--;
+		node = node->child;
+		while (node && node->c != file[n])
+			node = node->sibling;
+	}
 
-	if (!strcmp(&file[n - 4], ".otf"))
-		return "application/font-woff";
+	if (mh->mimetype_any &&
+	    (!best || mh->mimetype_any_ordinal < best->ordinal))
+		return mh->mimetype_any;
 
-	if (!strcmp(&file[n - 5], ".woff"))
-		return "application/font-woff";
+	return best ? best->value : NULL;
+}
 
-	if (!strcmp(&file[n - 4], ".xml"))
-		return "application/xml";
+static const char *
+lws_mimetype_lookup(const char *file, const struct lws_http_mount *m,
+		    const struct lws_mount_trie_hit *mh)
+{
+	const struct lws_protocol_vhost_options *pvo = NULL;
+	int n = (int)strlen(file), l;
+	const char *ext, *mt;
 
-	while (pvo) {
-		if (pvo->name[0] == '*') /* ie, match anything */
-			return pvo->value;
+	if (m)
+		pvo = m->extra_mimetypes;
 
-		if (!strcmp(&file[n - strlen(pvo->name)], pvo->name))
-			return pvo->value;
+	if (n < 5)
+		return NULL;
 
-		pvo = pvo->next;
+	ext = lws_mimetype_ext(file, n);
+	if (ext) {
+		mt = lws_mimetype_table(lws_mimetypes_builtin,
+				(int)ARRAY_SIZE(lws_mimetypes_builtin), ext);
+		if (mt)
+			return mt;
 	}
 
+	if (mh) {
+		mt = lws_mimetype_extra_compiled(mh, file, n);
+		if (mt)
+			return mt;
+	} else
+		while (pvo) {
+			if (pvo->name[0] == '*') /* ie, match anything */
+				return pvo->value;
+
+			l = (int)strlen(pvo->name);
+			if (l <= n && !strcmp(&file[n - l], pvo->name))
+				return pvo->value;
+
+			pvo = pvo->next;
+		}
+
+#if defined(LWS_WITH_FULL_MIMETYPES)
+	if (ext)
+		return lws_mimetype_table(lws_mimetypes_full,
+				(int)ARRAY_SIZE(lws_mimetypes_full), ext);
+#endif
+
 	return NULL;
 }
+
+LWS_VISIBLE LWS_EXTERN const char *
+lws_get_mimetype(const char *file, const struct lws_http_mount *m)
+{
+	return lws_mimetype_lookup(file, m, NULL);
+}
 static lws_fop_flags_t
 lws_vfs_prepare_flags(struct lws *wsi)
 {
@@ -383,8 +595,9 @@ lws_vfs_prepare_flags(struct lws *wsi)
 
 static int
 lws_http_serve(struct lws *wsi, char *uri, const char *origin,
-	       const struct lws_http_mount *m)
+	       const struct lws_mount_trie_hit *mh)
 {
+	const struct lws_http_mount *m = mh->hm;
 	const struct lws_protocol_vhost_options *pvo = m->interpret;
 	struct lws_process_html_args args;
 	const char *mimetype;
@@ -534,7 +747,7 @@ lws_http_serve(struct lws *wsi, char *uri, const char *origin,
 		return -1;
 #endif
 
-	mimetype = lws_get_mimetype(path, m);
+	mimetype = lws_mimetype_lookup(path, m, mh);
 	if (!mimetype) {
 		lwsl_err("unknown mimetype for %s\n", path);
                goto bail;
@@ -593,13 +806,300 @@ bail:
 	return -1;
 }
 
-const struct lws_http_mount *
-lws_find_mount(struct lws *wsi, const char *uri_ptr, int uri_len)
+static struct lws_mount_trie_node *
+lws_mount_trie_child(struct lws_mount_trie_node *node, char c)
+{
+	node = node->child;
+	while (node && node->edge[0] != c)
+		node = node->sibling;
+
+	return node;
+}
+
+static int
+lws_mount_trie_insert(struct lws_mount_trie_node *node, const char *key,
+		      int len, struct lws_mount_trie_hit *hit)
+{
+	struct lws_mount_trie_node *c, *mid, **pc;
+	struct lws_mount_trie_hit **ph;
+	int n;
+
+	while (len) {
+		c = lws_mount_trie_child(node, *key);
+		if (!c) {
+			c = lws_zalloc(sizeof(*c), "mount trie");
+			if (!c)
+				return 1;
+			c->edge = key;
+			c->edge_len = len;
+			c->sibling = node->child;
+			node->child = c;
+			node = c;
+			break;
+		}
+
+		n = 0;
+		while (n < c->edge_len && n < len && c->edge[n] == key[n])
+			n++;
+
+		if (n < c->edge_len) {
+			/* split the edge at the divergence point */
+			mid = lws_zalloc(sizeof(*mid), "mount trie");
+			if (!mid)
+				return 1;
+			mid->edge = c->edge;
+			mid->edge_len = n;
+			c->edge += n;
+			c->edge_len -= n;
+
+			pc = &node->child;
+			while (*pc != c)
+				pc = &(*pc)->sibling;
+			*pc = mid;
+			mid->sibling = c->sibling;
+			c->sibling = NULL;
+			mid->child = c;
+			c = mid;
+		}
+
+		node = c;
+		key += n;
+		len -= n;
+	}
+
+	/* keep hits in mount_list order */
+
+	ph = &node->hits;
+	while (*ph)
+		ph = &(*ph)->next;
+	*ph = hit;
+
+	return 0;
+}
+
+static void
+lws_mount_trie_free(struct lws_mount_trie_node *node)
+{
+	struct lws_mount_trie_node *n;
+
+	while (node) {
+		n = node->sibling;
+		lws_mount_trie_free(node->child);
+		lws_free(node);
+		node = n;
+	}
+}
+
+static void
+lws_suffix_trie_free(struct lws_suffix_node *node)
+{
+	struct lws_suffix_node *n;
+
+	while (node) {
+		n = node->sibling;
+		lws_suffix_trie_free(node->child);
+		lws_free(node);
+		node = n;
+	}
+}
+
+static int
+lws_mount_compile_mimetypes(struct lws_mount_trie_hit *mh)
 {
-	const struct lws_http_mount *hm, *hit = NULL;
-	int best = 0;
+	const struct lws_protocol_vhost_options *pvo = mh->hm->extra_mimetypes;
+	struct lws_suffix_node *node, *c;
+	int ord = 0, n;
+
+	for (; pvo; pvo = pvo->next, ord++) {
+		if (pvo->name[0] == '*') {
+			if (!mh->mimetype_any) {
+				mh->mimetype_any = pvo->value;
+				mh->mimetype_any_ordinal = ord;
+			}
+			continue;
+		}
 
+		if (!mh->mimetypes) {
+			mh->mimetypes = lws_zalloc(sizeof(*node), "mimetypes");
+			if (!mh->mimetypes)
+				return 1;
+		}
+
+		/* insert the suffix reversed */
+
+		node = mh->mimetypes;
+		n = (int)strlen(pvo->name);
+		while (n--) {
+			c = node->child;
+			while (c && c->c != pvo->name[n])
+				c = c->sibling;
+			if (!c) {
+				c = lws_zalloc(sizeof(*c), "mimetypes");
+				if (!c)
+					return 1;
+				c->c = pvo->name[n];
+				c->sibling = node->child;
+				node->child = c;
+			}
+			node = c;
+		}
+		if (!node->value) {
+			node->value = pvo->value;
+			node->ordinal = ord;
+		}
+	}
+
+	return 0;
+}
+
+void
+lws_vhost_mount_trie_destroy(struct lws_vhost *vh)
+{
+	const struct lws_http_mount *hm = vh->mount_list;
+	int n = 0;
+
+	lws_mount_trie_free(vh->mount_trie);
+	vh->mount_trie = NULL;
+
+	if (vh->mount_hits)
+		for (; hm; hm = hm->mount_next, n++)
+			lws_suffix_trie_free(vh->mount_hits[n].mimetypes);
+
+	lws_free_set_NULL(vh->mount_hits);
+}
+
+/*
+ * Returns nonzero if any part of the index could not be allocated, in which
+ * case nothing is left behind and the vhost must not be used: there is no
+ * unindexed fallback for mount matching.
+ */
+
+int
+lws_vhost_mount_trie_build(struct lws_vhost *vh)
+{
+	const struct lws_http_mount *hm = vh->mount_list;
+	int n = 0;
+
+	lws_vhost_mount_trie_destroy(vh);
+
+	if (!hm)
+		return 0;
+
+	while (hm) {
+		n++;
+		hm = hm->mount_next;
+	}
+
+	vh->mount_hits = lws_zalloc(n * sizeof(*vh->mount_hits), "mount hits");
+	vh->mount_trie = lws_zalloc(sizeof(*vh->mount_trie), "mount trie");
+	if (!vh->mount_hits || !vh->mount_trie)
+		goto bail;
+
+	for (n = 0, hm = vh->mount_list; hm; hm = hm->mount_next, n++) {
+		vh->mount_hits[n].hm = hm;
+		vh->mount_hits[n].ordinal = n;
+		if (lws_mount_compile_mimetypes(&vh->mount_hits[n]))
+			goto bail;
+		/* a mountpoint shorter than its mountpoint_len never matches */
+		if ((int)strlen(hm->mountpoint) < hm->mountpoint_len)
+			continue;
+		if (lws_mount_trie_insert(vh->mount_trie, hm->mountpoint,
+					  hm->mountpoint_len,
+					  &vh->mount_hits[n]))
+			goto bail;
+	}
+
+	return 0;
+
+bail:
+	lws_vhost_mount_trie_destroy(vh);
+
+	return 1;
+}
+
+#define LWS_MOUNT_MAX_CANDIDATES 32
+
+/* mounts that pass the request body on can take any method */
+
+static int
+lws_mount_any_method(const struct lws_http_mount *hm)
+{
+	return hm->origin_protocol == LWSMPRO_CGI ||
+	       hm->origin_protocol == LWSMPRO_FASTCGI
+#if defined(LWS_WITH_HTTP_PROXY)
+	       || hm->origin_protocol == LWSMPRO_HTTP ||
+	       hm->origin_protocol == LWSMPRO_HTTPS
+#endif
+	       ;
+}
+
+static const struct lws_mount_trie_hit *
+lws_find_mount_hit(struct lws *wsi, const char *uri_ptr, int uri_len)
+{
+	struct lws_mount_trie_hit *cand[LWS_MOUNT_MAX_CANDIDATES], *h;
+	struct lws_mount_trie_node *node = wsi->vhost->mount_trie, *c;
+	const struct lws_mount_trie_hit *hit = NULL;
+	const struct lws_http_mount *hm;
+	int best = 0, count = 0, pos = 0, n, m, any;
+
+	/*
+	 * lws_create_vhost() fails if the mounts can't be indexed, so a vhost
+	 * without a trie is one without any mounts.  Both the trie walk and
+	 * the linear scan below hand out mount_hits[] entries.
+	 */
+	if (!node || !wsi->vhost->mount_hits)
+		return NULL;
+
+	/*
+	 * Collect every mount whose mountpoint is a prefix of the uri ending
+	 * on a valid boundary, in mount_list order...
+	 */
+
+	while (1) {
+		if (node->hits && (uri_ptr[pos] == '\0' || uri_ptr[pos] == '/' ||
+				   pos == 1)) {
+			for (h = node->hits; h; h = h->next) {
+				if (count == LWS_MOUNT_MAX_CANDIDATES)
+					goto linear;
+				n = count++;
+				while (n && cand[n - 1]->ordinal > h->ordinal) {
+					cand[n] = cand[n - 1];
+					n--;
+				}
+				cand[n] = h;
+			}
+		}
+		if (pos == uri_len)
+			break;
+		c = lws_mount_trie_child(node, uri_ptr[pos]);
+		if (!c || c->edge_len > uri_len - pos ||
+		    memcmp(c->edge, uri_ptr + pos, c->edge_len))
+			break;
+		pos += c->edge_len;
+		node = c;
+	}
+
+	/* ... and choose among them exactly as the linear scan does */
+
+	any = lws_hdr_total_length(wsi, WSI_TOKEN_GET_URI) ||
+	      (wsi->http2_substream &&
+	       lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_COLON_PATH));
+
+	for (m = 0; m < count; m++) {
+		hm = cand[m]->hm;
+		if (hm->origin_protocol == LWSMPRO_CALLBACK ||
+		    ((lws_mount_any_method(hm) || any ||
+		      hm->protocol) && hm->mountpoint_len > best)) {
+			best = hm->mountpoint_len;
+			hit = cand[m];
+		}
+	}
+
+	return hit;
+
+linear:
 	hm = wsi->vhost->mount_list;
+	n = 0;
 	while (hm) {
 		if (uri_len >= hm->mountpoint_len &&
 		    !strncmp(uri_ptr, hm->mountpoint, hm->mountpoint_len) &&
@@ -608,7 +1108,7 @@ lws_find_mount(struct lws *wsi, const char *uri_ptr, int uri_len)
 		     hm->mountpoint_len == 1)
 		    ) {
 			if (hm->origin_protocol == LWSMPRO_CALLBACK ||
-			    ((hm->origin_protocol == LWSMPRO_CGI ||
+			    ((lws_mount_any_method(hm) ||
 			     lws_hdr_total_length(wsi, WSI_TOKEN_GET_URI) ||
 			     (wsi->http2_substream &&
 				lws_hdr_total_length(wsi,
@@ -616,15 +1116,26 @@ lws_find_mount(struct lws *wsi, const char *uri_ptr, int uri_len)
 			     hm->protocol) &&
 			    hm->mountpoint_len > best)) {
 				best = hm->mountpoint_len;
-				hit = hm;
+				hit = &wsi->vhost->mount_hits[n];
 			}
 		}
 		hm = hm->mount_next;
+		n++;
 	}
 
 	return hit;
 }
 
+const struct lws_http_mount *
+lws_find_mount(struct lws *wsi, const char *uri_ptr, int uri_len)
+{
+	const struct lws_mount_trie_hit *hit;
+
+	hit = lws_find_mount_hit(wsi, uri_ptr, uri_len);
+
+	return hit ? hit->hm : NULL;
+}
+
 #if LWS_POSIX
 
 static int
@@ -786,6 +1297,7 @@ lws_http_action(struct lws *wsi)
 	enum http_version request_version;
 	char content_length_str[32];
 	struct lws_process_html_args args;
+	const struct lws_mount_trie_hit *mh;
 	const struct lws_http_mount *hit = NULL;
 	unsigned int n;
 	char http_version_str[10];
@@ -797,6 +1309,11 @@ lws_http_action(struct lws *wsi)
 		"http://", "https://"
 	};
 
+#if defined(LWS_WITH_STATS)
+	/* headers are complete, the response has not started yet */
+	wsi->http_hdr_done_us = time_in_microseconds();
+#endif
+
 	meth = lws_http_get_uri_and_method(wsi, &uri_ptr, &uri_len);
 	if (meth < 0 || meth >= (int)ARRAY_SIZE(method_names))
 		goto bail_nuke_ah;
@@ -913,7 +1430,8 @@ lws_http_action(struct lws *wsi)
 
 	/* can we serve it from the mount list? */
 
-	hit = lws_find_mount(wsi, uri_ptr, uri_len);
+	mh = lws_find_mount_hit(wsi, uri_ptr, uri_len);
+	hit = mh ? mh->hm : NULL;
 	if (!hit) {
 		/* deferred cleanup and reset to protocols[0] */
 
@@ -952,6 +1470,7 @@ lws_http_action(struct lws *wsi)
 	     (hit->origin_protocol == LWSMPRO_REDIR_HTTP ||
 	      hit->origin_protocol == LWSMPRO_REDIR_HTTPS)) &&
 	    (hit->origin_protocol != LWSMPRO_CGI &&
+	     hit->origin_protocol != LWSMPRO_FASTCGI &&
 	     hit->origin_protocol != LWSMPRO_CALLBACK)) {
 		unsigned char *start = pt->serv_buf + LWS_PRE,
 			      *p = start, *end = p + 512;
@@ -1043,78 +1562,16 @@ lws_http_action(struct lws *wsi)
 
 	if (hit->origin_protocol == LWSMPRO_HTTPS ||
 	    hit->origin_protocol == LWSMPRO_HTTP)  {
-		struct lws_client_connect_info i;
-		char ads[96], rpath[256], *pcolon, *pslash, *p;
-		int n, na;
-
-		memset(&i, 0, sizeof(i));
-		i.context = lws_get_context(wsi);
-
-		pcolon = strchr(hit->origin, ':');
-		pslash = strchr(hit->origin, '/');
-		if (!pslash) {
-			lwsl_err("Proxy mount origin '%s' must have /\n",
-				 hit->origin);
-			return -1;
-		}
-		if (pcolon > pslash)
-			pcolon = NULL;
-		
-		if (pcolon)
-			n = pcolon - hit->origin;
-		else
-			n = pslash - hit->origin;
-
-		if (n >= (int)sizeof(ads) - 2)
-			n = sizeof(ads) - 2;
-
-		memcpy(ads, hit->origin, n);
-		ads[n] = '\0';
-
-		i.address = ads;
-		i.port = 80;
-		if (hit->origin_protocol == LWSMPRO_HTTPS) { 
-			i.port = 443;
-			i.ssl_connection = 1;
-		}
-		if (pcolon)
-			i.port = atoi(pcolon + 1);
-		
-		lws_snprintf(rpath, sizeof(rpath) - 1, "/%s/%s", pslash + 1,
-			     uri_ptr + hit->mountpoint_len);
-		lws_clean_url(rpath);
-		na = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_URI_ARGS);
-		if (na) {
-			p = rpath + strlen(rpath);
-			*p++ = '?';
-			lws_hdr_copy(wsi, p, &rpath[sizeof(rpath) - 1] - p,
-				     WSI_TOKEN_HTTP_URI_ARGS);
-			while (--na) {
-				if (*p == '\0')
-					*p = '&';
-				p++;
-			}
-		}
-				
-
-		i.path = rpath;
-		i.host = i.address;
-		i.origin = NULL;
-		i.method = "GET";
-		i.parent_wsi = wsi;
-		i.uri_replace_from = hit->origin;
-		i.uri_replace_to = hit->mountpoint;
-
-		lwsl_notice("proxying to %s port %d url %s, ssl %d, from %s, to %s\n",
-				i.address, i.port, i.path, i.ssl_connection,
-				i.uri_replace_from, i.uri_replace_to);
-	
-		if (!lws_client_connect_via_info(&i)) {
-			lwsl_err("proxy connect fail\n");
+		/* > 0 means it already answered with an error */
+		n = lws_proxy_http_action(wsi, hit, uri_ptr,
+					  method_names[meth]);
+		if (n) {
+			if ((int)n < 0)
+				lwsl_err("proxy connect fail\n");
 			return 1;
 		}
 
-		return 0;
+		goto deal_body;
 	}
 #endif
 
@@ -1196,6 +1653,19 @@ lws_http_action(struct lws *wsi)
 	}
 #endif
 
+#ifdef LWS_WITH_FASTCGI
+	/* did we hit something with a fastcgi:// origin? */
+	if (hit->origin_protocol == LWSMPRO_FASTCGI) {
+		if (lws_fcgi_http_action(wsi, hit, uri_ptr,
+					 method_names[meth])) {
+			lwsl_err("%s: fastcgi failed\n", __func__);
+			return -1;
+		}
+
+		goto deal_body;
+	}
+#endif
+
 	n = (int)strlen(s);
 	if (s[0] == '\0' || (n == 1 && s[n - 1] == '/'))
 		s = (char *)hit->def;
@@ -1207,7 +1677,7 @@ lws_http_action(struct lws *wsi)
 	wsi->cache_revalidate = hit->cache_revalidate;
 	wsi->cache_intermediaries = hit->cache_intermediaries;
 
-	n = lws_http_serve(wsi, s, hit->origin, hit);
+	n = lws_http_serve(wsi, s, hit->origin, mh);
 	if (n) {
 		/*
 		 * 	lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
@@ -1235,7 +1705,8 @@ after:
 		return 1;
 	}
 
-#ifdef LWS_WITH_CGI
+#if defined(LWS_WITH_CGI) || defined(LWS_WITH_HTTP_PROXY) || \
+    defined(LWS_WITH_FASTCGI)
 deal_body:
 #endif
 	/*
@@ -1328,6 +1799,38 @@ lws_server_init_wsi_for_ws(struct lws *wsi)
 	return 0;
 }
 
+#if defined(LWS_WITH_HTTP_PROXY)
+/*
+ * Returns 1 if a proxy mount took the ws upgrade to pass it through, 0 if
+ * we should handle it ourselves, or -1 if it failed
+ */
+static int
+lws_http_proxy_ws(struct lws *wsi, unsigned char *buf, size_t len)
+{
+	const struct lws_mount_trie_hit *mh;
+	const struct lws_http_mount *hit;
+	char *uri_ptr = NULL;
+	int uri_len;
+
+	if (lws_http_get_uri_and_method(wsi, &uri_ptr, &uri_len) < 0)
+		return 0;
+
+	mh = lws_find_mount_hit(wsi, uri_ptr, uri_len);
+	if (!mh)
+		return 0;
+	hit = mh->hm;
+	if (!hit->ws_passthrough ||
+	    (hit->origin_protocol != LWSMPRO_HTTP &&
+	     hit->origin_protocol != LWSMPRO_HTTPS))
+		return 0;
+
+	if (lws_proxy_ws_action(wsi, hit, uri_ptr, buf, len))
+		return -1;
+
+	return 1;
+}
+#endif
+
 int
 lws_handshake_server(struct lws *wsi, unsigned char **buf, size_t len)
 {
@@ -1354,9 +1857,7 @@ lws_handshake_server(struct lws *wsi, unsigned char **buf, size_t len)
 
 	lwsl_hexdump(*buf, len);
 
-	while (len--) {
-		wsi->more_rx_waiting = !!len;
-
+	while (len) {
 		if (wsi->mode != LWSCM_HTTP_SERVING &&
 		    wsi->mode != LWSCM_HTTP2_SERVING &&
 		    wsi->mode != LWSCM_HTTP_SERVING_ACCEPTED) {
@@ -1364,6 +1865,16 @@ lws_handshake_server(struct lws *wsi, unsigned char **buf, size_t len)
 			goto bail_nuke_ah;
 		}
 
+		/* take any run of header value bytes in one go */
+		m = lws_parse_span(wsi, *buf, len);
+		*buf += m;
+		len -= m;
+		if (!len) {
+			wsi->more_rx_waiting = 0;
+			break;
+		}
+
+		wsi->more_rx_waiting = !!--len;
 		m = lws_parse(wsi, *(*buf)++);
 		if (m) {
 			if (m == 2) {
@@ -1385,9 +1896,10 @@ raw_transition:
 						wsi->user_space, NULL, 0))
 					goto bail_nuke_ah;
 
+				/* the ah is gone from u.hdr after the transition */
 				lws_header_table_force_to_detachable_state(wsi);
-				lws_union_transition(wsi, LWSCM_RAW);
 				lws_header_table_detach(wsi, 1);
+				lws_union_transition(wsi, LWSCM_RAW);
 
 				if (m == 2 && (wsi->protocol->callback)(wsi,
 						LWS_CALLBACK_RAW_RX,
@@ -1488,6 +2000,16 @@ raw_transition:
 			if (!strcasecmp(lws_hdr_simple_ptr(wsi, WSI_TOKEN_UPGRADE),
 					"websocket")) {
 				wsi->vhost->conn_stats.ws_upg++;
+#if defined(LWS_WITH_HTTP_PROXY)
+				n = lws_http_proxy_ws(wsi, *buf, len);
+				if (n < 0)
+					goto bail_nuke_ah;
+				if (n) {
+					/* it has all the rx we had */
+					*buf += len;
+					return 0;
+				}
+#endif
 				lwsl_info("Upgrade to ws\n");
 				goto upgrade_ws;
 			}
@@ -1754,17 +2276,289 @@ bail_nuke_ah:
 }
 
 
+#if LWS_MAX_SMP > 1
+
+/*
+ * How loaded a pt is, in units of one idle connection: its fd count plus the
+ * recent service time, traffic and queued tx scaled into the same units.  A
+ * pt that has not ticked for a while has been idle, so its averages are stale.
+ */
+
+static unsigned int
+lws_pt_load_score(const struct lws_context_per_thread *pt, time_t now)
+{
+	unsigned int score = pt->fds_count;
+
+	if (now - pt->load.last_s <= 2)
+		score += pt->load.busy_us_avg / LWS_PT_LOAD_US_PER_CONN +
+			 pt->load.bytes_avg / LWS_PT_LOAD_BYTES_PER_CONN;
+	if (pt->load.txq_bytes > 0)
+		score += (unsigned int)(pt->load.txq_bytes /
+					LWS_PT_LOAD_TXQ_PER_CONN);
+
+	return score;
+}
+
+#if defined(LWS_HAVE_ATOMIC_BUILTINS)
+
+struct lws_pt_migration {
+	struct lws_pt_work work; /* must be first */
+	struct lws *wsi;
+	enum pending_timeout reason;
+	int secs;
+	int vh_prot; /* index in vhost same protocol lists, or -1 */
+	int from; /* tsi it left */
+};
+
+/* index of the wsi's protocol in its vhost's list, or -1 */
+
+static int
+lws_wsi_vh_protocol_index(struct lws *wsi)
+{
+	const struct lws_protocols *vp = wsi->vhost->protocols;
+
+	if (!wsi->protocol || wsi->protocol < vp ||
+	    wsi->protocol >= &vp[wsi->vhost->count_protocols])
+		return -1;
+
+	return (int)(wsi->protocol - vp);
+}
+
+/*
+ * Only a wsi sitting idle between http/1 transactions can change pt: it has
+ * no ah, nothing buffered anywhere, no pending tx or POLLOUT interest, and is
+ * not on any per-pt list besides fds and timeouts.  It must also have been
+ * idle for a while, so we don't bounce a busy keepalive connection around
+ * just because we looked at it between two of its transactions.
+ */
+
+static int
+lws_wsi_migratable(struct lws_context_per_thread *pt, struct lws *wsi,
+		   time_t now)
+{
+	struct lws *w;
+
+	if (wsi->pending_timeout != PENDING_TIMEOUT_HTTP_KEEPALIVE_IDLE ||
+	    now - (wsi->pending_timeout_limit -
+		   wsi->vhost->keepalive_timeout) < LWS_PT_MIGRATE_IDLE_SECS)
+		return 0;
+
+	if (wsi->mode != LWSCM_HTTP_SERVING || wsi->state != LWSS_HTTP ||
+	    wsi->u.hdr.ah || wsi->u.hdr.preamble_rx ||
+	    wsi->parent || wsi->child_list || wsi->http2_substream ||
+	    wsi->socket_is_permanently_unusable ||
+	    (wsi->same_vh_protocol_prev && lws_wsi_vh_protocol_index(wsi) < 0) ||
+	    wsi->rxflow_buffer || wsi->rxflow_change_to != LWS_RXFLOW_ALLOW ||
+	    lws_tx_pending(wsi) || wsi->position_in_fds_table < 0 ||
+	    pt->fds[wsi->position_in_fds_table].events & LWS_POLLOUT)
+		return 0;
+#ifdef LWS_WITH_CGI
+	if (wsi->cgi)
+		return 0;
+#endif
+#ifdef LWS_OPENSSL_SUPPORT
+	if (wsi->pending_read_list_prev || pt->pending_read_list == wsi ||
+	    (wsi->ssl && lws_ssl_pending(wsi)))
+		return 0;
+#endif
+	for (w = pt->ah_wait_list; w; w = w->u.hdr.ah_wait_list)
+		if (w == wsi)
+			return 0;
+
+	return 1;
+}
+
+/* runs on the destination service thread, which now owns the wsi */
+
+static void
+lws_pt_migration_arrive(struct lws_context *context, int tsi,
+			struct lws_pt_work *work)
+{
+	struct lws_pt_migration *mig = (struct lws_pt_migration *)work;
+	enum pending_timeout reason = mig->reason;
+	int secs = mig->secs, vh_prot = mig->vh_prot, from = mig->from;
+	struct lws *wsi = mig->wsi;
+
+	lws_free(mig);
+
+	if (insert_wsi_socket_into_fds(context, wsi)) {
+		lwsl_err("%s: %p: unable to join pt %d\n", __func__, wsi, tsi);
+		lws_close_free_wsi(wsi, LWS_CLOSE_STATUS_NOSTATUS);
+		return;
+	}
+	if (from != tsi)
+		context->pt[tsi].load.migrated_in++;
+
+	/* leaving the old pt's fds took us off the vhost protocol list */
+	if (vh_prot >= 0)
+		lws_same_vh_protocol_insert(wsi, vh_prot);
+
+	if (reason)
+		lws_set_timeout(wsi, reason, secs);
+}
+
+/*
+ * Runs on the overloaded pt's own service thread, since only it may touch
+ * its fds table: idle connections are taken out of our fds and timeout list
+ * and posted to the destination pt, which inserts them from its own thread.
+ */
+
+static void
+lws_pt_migrate_idle(struct lws_context *context, int tsi, int dest, int max,
+		    time_t now)
+{
+	struct lws_context_per_thread *pt = &context->pt[tsi];
+	struct lws_pt_migration *mig;
+	struct lws *wsi;
+	int n;
+
+	for (n = (int)pt->fds_count - 1; n >= 0 && max; n--) {
+		wsi = wsi_from_fd(context, pt->fds[n].fd);
+		if (!wsi || !lws_wsi_migratable(pt, wsi, now))
+			continue;
+
+		mig = lws_malloc(sizeof(*mig), "pt migration");
+		if (!mig)
+			return;
+
+		memset(&mig->work, 0, sizeof(mig->work));
+		mig->work.cb = lws_pt_migration_arrive;
+		mig->wsi = wsi;
+		mig->reason = wsi->pending_timeout;
+		mig->secs = 0;
+		mig->vh_prot = -1;
+		mig->from = tsi;
+		if (wsi->same_vh_protocol_prev)
+			mig->vh_prot = lws_wsi_vh_protocol_index(wsi);
+		if (mig->reason) {
+			if (wsi->pending_timeout_limit > now)
+				mig->secs = (int)(wsi->pending_timeout_limit -
+						  now);
+			lws_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
+		}
+
+		if (remove_wsi_socket_from_fds(wsi)) {
+			lwsl_err("%s: %p: unable to leave pt %d\n", __func__,
+				 wsi, tsi);
+			if (wsi->position_in_fds_table >= 0 && mig->reason)
+				/* still ours, just leave it be */
+				lws_set_timeout(wsi, mig->reason, mig->secs);
+			lws_free(mig);
+			if (wsi->position_in_fds_table < 0)
+				lws_close_free_wsi(wsi,
+						   LWS_CLOSE_STATUS_NOSTATUS);
+			return;
+		}
+
+		wsi->tsi = (char)dest;
+		if (lws_pt_work_post(context, dest, &mig->work)) {
+			/* put it back where it was */
+			wsi->tsi = (char)tsi;
+			lws_pt_migration_arrive(context, tsi, &mig->work);
+			return;
+		}
+
+		lwsl_info("%s: %p: idle wsi from pt %d to %d\n", __func__,
+			  wsi, tsi, dest);
+		pt->load.migrated_out++;
+		max--;
+	}
+}
+#endif
+
+/*
+ * Once a second on each pt's own service thread: fold the last second's
+ * signals into the averages, and if we are clearly busier than the least
+ * loaded pt, hand it some of our idle keepalive connections, so their next
+ * transactions are served where there is capacity.
+ */
+
+void
+lws_pt_load_tick(struct lws_context *context, int tsi, time_t now)
+{
+	struct lws_context_per_thread *pt = &context->pt[tsi];
+	time_t gap = now - pt->load.last_s;
+#if defined(LWS_HAVE_ATOMIC_BUILTINS)
+	unsigned int us, lowest = ~0, s;
+	int n, dest = -1;
+#endif
+
+	pt->load.busy_us_avg = (unsigned int)
+		((pt->load.busy_us_avg + pt->load.busy_us) / 2);
+	pt->load.bytes_avg = (unsigned int)
+		((pt->load.bytes_avg + pt->load.bytes) / 2);
+	if (gap > 1) {
+		/* we were idle for the seconds we did not tick */
+		gap = gap > 32 ? 32 : gap;
+		pt->load.busy_us_avg >>= gap - 1;
+		pt->load.bytes_avg >>= gap - 1;
+	}
+	pt->load.busy_us = 0;
+	pt->load.bytes = 0;
+	pt->load.last_s = now;
+
+#if defined(LWS_HAVE_ATOMIC_BUILTINS)
+	if (context->count_threads < 2 || context->being_destroyed ||
+	    lws_check_opt(context->options, LWS_SERVER_OPTION_NO_PT_MIGRATION) ||
+	    LWS_LIBEV_ENABLED(context) || LWS_LIBUV_ENABLED(context) ||
+	    LWS_LIBEVENT_ENABLED(context))
+		return;
+
+	for (n = 0; n < context->count_threads; n++) {
+		if (n == tsi || (unsigned int)context->pt[n].fds_count >=
+					context->fd_limit_per_thread - 1)
+			continue;
+		s = lws_pt_load_score(&context->pt[n], now);
+		if (s < lowest) {
+			lowest = s;
+			dest = n;
+		}
+	}
+	if (dest < 0)
+		return;
+
+	us = lws_pt_load_score(pt, now);
+	if (us < lowest + LWS_PT_MIGRATE_MIN_DIFF || us < lowest + lowest / 4)
+		return;
+
+	n = (int)(us - lowest) / 2;
+	if (n > LWS_PT_MIGRATE_MAX)
+		n = LWS_PT_MIGRATE_MAX;
+
+	lws_pt_migrate_idle(context, tsi, dest, n, now);
+#endif
+}
+#endif
+
 static int
 lws_get_idlest_tsi(struct lws_context *context)
 {
-	unsigned int lowest = ~0;
+	unsigned int lowest = ~0, s;
 	int n = 0, hit = -1;
+#if LWS_MAX_SMP > 1
+	time_t now = 0;
+
+	/*
+	 * This is on the accept path, so rather than ask the OS the time, use
+	 * the newest second any service thread last ticked its load in
+	 */
+	for (; n < context->count_threads; n++)
+		if (context->pt[n].load.last_s > now)
+			now = context->pt[n].load.last_s;
+	n = 0;
+#endif
 
 	for (; n < context->count_threads; n++) {
-		if ((unsigned int)context->pt[n].fds_count !=
-		    context->fd_limit_per_thread - 1 &&
-		    (unsigned int)context->pt[n].fds_count < lowest) {
-			lowest = context->pt[n].fds_count;
+		if ((unsigned int)context->pt[n].fds_count ==
+		    context->fd_limit_per_thread - 1)
+			continue;
+#if LWS_MAX_SMP > 1
+		s = lws_pt_load_score(&context->pt[n], now);
+#else
+		s = context->pt[n].fds_count;
+#endif
+		if (s < lowest) {
+			lowest = s;
 			hit = n;
 		}
 	}
@@ -1840,6 +2634,10 @@ lws_http_transaction_completed(struct lws *wsi)
 	lwsl_info("%s: wsi %p\n", __func__, wsi);
 
 	lws_access_log(wsi);
+#if defined(LWS_WITH_STATS)
+	/* don't let a response-less transaction time the next one */
+	wsi->http_hdr_done_us = 0;
+#endif
 
 	if (!wsi->hdr_parsing_completed) {
 		lwsl_notice("%s: ignoring, ah parsing incomplete\n", __func__);
@@ -2071,6 +2869,10 @@ lws_adopt_descriptor_vhost(struct lws_vhost *vh, lws_adoption_type type,
 			new_wsi->mode = LWSCM_SSL_INIT;
 
 		ssl = 1;
+#if defined(LWS_WITH_STATS) && defined(LWS_OPENSSL_SUPPORT)
+		/* LWSSTATS_LAT_ACCEPT_TLS is timed from here */
+		new_wsi->accept_start_us = time_in_microseconds();
+#endif
 	}
 
 	lws_libev_accept(new_wsi, new_wsi->desc);
@@ -2258,13 +3060,11 @@ lws_server_socket_service(struct lws_context *context, struct lws *wsi,
 
 		/* pending truncated sends have uber priority */
 
-		if (wsi->trunc_len) {
+		if (lws_tx_pending(wsi)) {
 			if (!(pollfd->revents & LWS_POLLOUT))
 				break;
 
-			if (lws_issue_raw(wsi, wsi->trunc_alloc +
-					       wsi->trunc_offset,
-					  wsi->trunc_len) < 0)
+			if (lws_tx_queue_drain(wsi) < 0)
 				goto fail;
 			/*
 			 * we can't afford to allow input processing to send
@@ -2316,6 +3116,15 @@ lws_server_socket_service(struct lws_context *context, struct lws *wsi,
 				switch (ah->rxlen) {
 				case 0:
 					lwsl_info("%s: read 0 len a\n", __func__);
+					/*
+					 * between transactions there's nothing
+					 * to finish, don't sit on the ah until
+					 * it times out
+					 */
+					if (wsi->state == LWSS_HTTP &&
+					    !wsi->hdr_parsing_completed &&
+					    !ah->pos)
+						goto fail;
 					wsi->seen_zero_length_recv = 1;
 					lws_change_pollfd(wsi, LWS_POLLIN, 0);
 					goto try_pollout;
@@ -2453,6 +3262,8 @@ try_pollout:
 						LWSSTATS_MS_WRITABLE_DELAY, ul);
 				lws_stats_atomic_max(wsi->context, pt,
 					  LWSSTATS_MS_WORST_WRITABLE_DELAY, ul);
+				lws_stats_vh_latency(wsi->vhost, pt,
+						     LWSSTATS_LAT_WRITABLE, ul);
 				wsi->active_writable_req_us = 0;
 			}
 #endif
@@ -2482,6 +3293,8 @@ try_pollout:
 						LWSSTATS_MS_WRITABLE_DELAY, ul);
 				lws_stats_atomic_max(wsi->context, pt,
 					  LWSSTATS_MS_WORST_WRITABLE_DELAY, ul);
+				lws_stats_vh_latency(wsi->vhost, pt,
+						     LWSSTATS_LAT_WRITABLE, ul);
 				wsi->active_writable_req_us = 0;
 			}
 #endif
@@ -109,6 +109,9 @@ lws_server_socket_service_ssl(struct lws *wsi, lws_sockfd_type accept_fd)
 	struct lws_context *context = wsi->context;
 	struct lws_vhost *vh;
 	struct lws_context_per_thread *pt = &context->pt[(int)wsi->tsi];
+#if defined(LWS_WITH_STATS)
+	uint64_t accept_us = 0;
+#endif
 	int n;
         char buf[256];
 
@@ -262,9 +265,10 @@ lws_server_socket_service_ssl(struct lws *wsi, lws_sockfd_type accept_fd)
 		lws_stats_atomic_bump(wsi->context, pt,
 				      LWSSTATS_C_SSL_CONNECTIONS_ACCEPTED, 1);
 #if defined(LWS_WITH_STATS)
+		accept_us = time_in_microseconds() - wsi->accept_start_us;
 		lws_stats_atomic_bump(wsi->context, pt,
 				      LWSSTATS_MS_SSL_CONNECTIONS_ACCEPTED_DELAY,
-				      time_in_microseconds() - wsi->accept_start_us);
+				      accept_us);
 		wsi->accept_start_us = time_in_microseconds();
 #endif
 
@@ -282,6 +286,13 @@ accepted:
 			vh = vh->vhost_next;
 		}
 
+#if defined(LWS_WITH_STATS)
+		/* after the SNI switch, so it counts against the right vhost */
+		if (wsi->ssl)
+			lws_stats_vh_latency(wsi->vhost, pt,
+					     LWSSTATS_LAT_ACCEPT_TLS, accept_us);
+#endif
+
 		/* OK, we are accepted... give him some time to negotiate */
 		lws_set_timeout(wsi, PENDING_TIMEOUT_ESTABLISH_WITH_SERVER,
 				context->timeout_secs);
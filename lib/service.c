@@ -37,6 +37,7 @@ lws_calllback_as_writeable(struct lws *wsi)
 				      LWSSTATS_MS_WRITABLE_DELAY, ul);
 		lws_stats_atomic_max(wsi->context, pt,
 				     LWSSTATS_MS_WORST_WRITABLE_DELAY, ul);
+		lws_stats_vh_latency(wsi->vhost, pt, LWSSTATS_LAT_WRITABLE, ul);
 		wsi->active_writable_req_us = 0;
 	}
 #endif
@@ -94,10 +95,9 @@ lws_handle_POLLOUT_event(struct lws *wsi, struct lws_pollfd *pollfd)
 	 *	       If anything else sent first the protocol would be
 	 *	       corrupted.
 	 */
-	if (wsi->trunc_len) {
+	if (lws_tx_pending(wsi)) {
 		//lwsl_notice("%s: completing partial\n", __func__);
-		if (lws_issue_raw(wsi, wsi->trunc_alloc + wsi->trunc_offset,
-				  wsi->trunc_len) < 0) {
+		if (lws_tx_queue_drain(wsi) < 0) {
 			lwsl_info("%s signalling to close\n", __func__);
 			goto bail_die;
 		}
@@ -889,10 +889,11 @@ spin_chunks:
 		n = wsi->chunk_remaining;
 
 #ifdef LWS_WITH_HTTP_PROXY
-	/* hubbub */
-	if (wsi->perform_rewrite)
-		lws_rewrite_parse(wsi->rw, (unsigned char *)*buf, n);
-	else
+	if (wsi->perform_rewrite) {
+		/* it passes on the rewritten html as RECEIVE_CLIENT_HTTP_READ */
+		if (lws_rewrite_parse(wsi->rw, (unsigned char *)*buf, n))
+			return -1;
+	} else
 #endif
 		if (user_callback_handle_rxflow(wsi->protocol->callback,
 				wsi, LWS_CALLBACK_RECEIVE_CLIENT_HTTP_READ,
@@ -981,6 +982,11 @@ lws_service_fd_tsi(struct lws_context *context, struct lws_pollfd *pollfd,
 	if (context->time_up < 1464083026 && now > 1464083026)
 		context->time_up = now;
 
+#if LWS_MAX_SMP > 1 && !defined(LWS_NO_SERVER)
+	if (pt->load.last_s != now)
+		lws_pt_load_tick(context, tsi, now);
+#endif
+
 	/* TODO: if using libev, we should probably use timeout watchers... */
 	if (context->last_timeout_check_s != now) {
 		context->last_timeout_check_s = now;
@@ -995,6 +1001,7 @@ lws_service_fd_tsi(struct lws_context *context, struct lws_pollfd *pollfd,
 		lws_plat_service_periodic(context);
 
 		lws_check_deferred_free(context, 0);
+		lws_access_log_periodic(context);
 
 #if defined(LWS_WITH_PEER_LIMITS)
 		lws_peer_cull_peer_wait_list(context);
@@ -1121,43 +1128,19 @@ lws_service_fd_tsi(struct lws_context *context, struct lws_pollfd *pollfd,
 	}
 
 	/*
-	 * at intervals, check for ws connections needing ping-pong checks
+	 * start the ws ping-pong checks that are due on this service thread
 	 */
 
-	if (context->ws_ping_pong_interval &&
-	    context->last_ws_ping_pong_check_s < now + 10) {
-		struct lws_vhost *vh = context->vhost_list;
-		context->last_ws_ping_pong_check_s = now;
-
-		while (vh) {
-			for (n = 0; n < vh->count_protocols; n++) {
-				wsi = vh->same_vh_protocol_list[n];
-
-				while (wsi) {
-					if (wsi->state == LWSS_ESTABLISHED &&
-					    !wsi->socket_is_permanently_unusable &&
-					    !wsi->u.ws.send_check_ping &&
-					    wsi->u.ws.time_next_ping_check &&
-					    wsi->u.ws.time_next_ping_check < now) {
-
-						lwsl_info("req pp on wsi %p\n",
-							  wsi);
-						wsi->u.ws.send_check_ping = 1;
-						lws_set_timeout(wsi,
-					PENDING_TIMEOUT_WS_PONG_CHECK_SEND_PING,
-							context->timeout_secs);
-						lws_callback_on_writable(wsi);
-						wsi->u.ws.time_next_ping_check =
-							now +
-							wsi->context->
-							  ws_ping_pong_interval;
-					}
-					wsi = wsi->same_vh_protocol_next;
-				}
-			}
-			vh = vh->vhost_next;
-		}
-	}
+	if (pt->ping_wheel_ran != now)
+		lws_ping_wheel_service(pt, now);
+
+#if defined(LWS_WITH_HTTP_PROXY)
+	/*
+	 * proxy upstream health checks all go from the first service thread
+	 */
+	if (!tsi && context->proxy_hc_last != now)
+		lws_proxy_periodic(context, now);
+#endif
 
 	/*
 	 * check the remaining cert lifetime daily
@@ -1239,9 +1222,17 @@ lws_service_fd_tsi(struct lws_context *context, struct lws_pollfd *pollfd,
 		char s[10];
 
 		/* discard the byte(s) that signaled us */
-		if (read(wsi->desc.sockfd, s, sizeof(s)) < 0)
+		if (read(wsi->desc.sockfd, s, sizeof(s)) < 0 &&
+		    LWS_ERRNO != LWS_EAGAIN)
 			goto close_and_handled;
 #endif
+		/* other threads may have posted work for us */
+		lws_pt_work_run(context, tsi);
+
+		if (!pt->cancel_pending)
+			goto handled;
+		pt->cancel_pending = 0;
+
 		/*
 		 * the poll() wait, or the event loop for libuv etc is a
 		 * process-wide resource that we interrupted.  So let every
@@ -1362,7 +1353,7 @@ lws_service_fd_tsi(struct lws_context *context, struct lws_pollfd *pollfd,
 
 #if defined(LWS_WITH_HTTP2)
 		wsi1 = lws_get_network_wsi(wsi);
-		if (wsi1 && wsi1->trunc_len)
+		if (wsi1 && lws_tx_pending(wsi1))
 			/* We cannot deal with any kind of new RX
 			 * because we are dealing with a partial send
 			 * (new RX may trigger new http_action() that expect
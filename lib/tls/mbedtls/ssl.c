@@ -117,6 +117,7 @@ lws_ssl_capable_read(struct lws *wsi, unsigned char *buf, int len)
 	}
 
 	lws_stats_atomic_bump(context, pt, LWSSTATS_B_READ, n);
+	lws_pt_load_bytes(pt, n);
 
 	if (wsi->vhost)
 		wsi->vhost->conn_stats.rx += n;
@@ -46,7 +46,7 @@ struct per_session_data__lws_mirror {
 
 /* this is the element in the ring */
 struct a_message {
-	void *payload;
+	struct lws_shared_msg *sm; /* framed once, shared by all pss */
 	size_t len;
 };
 
@@ -173,8 +173,9 @@ mirror_destroy_message(void *_msg)
 {
 	struct a_message *msg = _msg;
 
-	free(msg->payload);
-	msg->payload = NULL;
+	if (msg->sm)
+		lws_shared_msg_unref(msg->sm);
+	msg->sm = NULL;
 	msg->len = 0;
 }
 
@@ -327,7 +328,7 @@ callback_lws_mirror(struct lws *wsi, enum lws_callback_reasons reason,
 			if (!msg)
 				break;
 
-			if (!msg->payload) {
+			if (!msg->sm) {
 				lwsl_err("%s: NULL payload: worst = %d,"
 					 " pss->tail = %d\n", __func__,
 					 oldest_tail, pss->tail);
@@ -337,8 +338,7 @@ callback_lws_mirror(struct lws *wsi, enum lws_callback_reasons reason,
 				break;
 			}
 
-			n = lws_write(wsi, (unsigned char *)msg->payload +
-				      LWS_PRE, msg->len, LWS_WRITE_TEXT);
+			n = lws_write_shared(wsi, msg->sm);
 			if (n < 0) {
 				lwsl_info("%s: WRITEABLE: %d\n", __func__, n);
 
@@ -380,14 +380,13 @@ callback_lws_mirror(struct lws *wsi, enum lws_callback_reasons reason,
 			goto req_writable;
 		}
 
-		amsg.payload = malloc(LWS_PRE + len);
+		amsg.sm = lws_shared_msg_create(in, len, LWS_WRITE_TEXT);
 		amsg.len = len;
-		if (!amsg.payload) {
+		if (!amsg.sm) {
 			lwsl_notice("OOM: dropping\n");
 			break;
 		}
 
-		memcpy((char *)amsg.payload + LWS_PRE, in, len);
 		if (!lws_ring_insert(pss->mi->ring, &amsg, 1)) {
 			mirror_destroy_message(&amsg);
 			lwsl_notice("dropping!\n");
@@ -420,7 +419,8 @@ req_writable:
 		callback_lws_mirror, \
 		sizeof(struct per_session_data__lws_mirror), \
 		128, /* rx buf size must be >= permessage-deflate rx size */ \
-		0, NULL, 0 \
+		0, NULL, 0, \
+		16384, 0, 32, 0 /* queue up to 16KiB / 32 msgs per peer */ \
 	}
 
 #if !defined (LWS_PLUGIN_STATIC)
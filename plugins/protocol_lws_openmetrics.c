@@ -0,0 +1,208 @@
+/*
+ * http protocol handler plugin serving OpenMetrics
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * These test plugins are intended to be adapted for use in your code, which
+ * may be proprietary.  So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * Bind it to a mount with origin "callback://lws-openmetrics" and point your
+ * Prometheus scraper at it.  The exposition is produced a chunk at a time from
+ * the writable callback, so a scrape doesn't stall the service thread however
+ * many vhosts there are, and it works with any event loop.
+ *
+ * We don't know the length until we have produced it all, so the body is
+ * chunked for HTTP/1.1, and for HTTP/1.0, which has no chunked encoding,
+ * ended by closing the connection.
+ */
+
+#if !defined (LWS_PLUGIN_STATIC)
+#define LWS_DLL
+#define LWS_INTERNAL
+#include "../lib/libwebsockets.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+/* exposition bytes produced per writable callback */
+#define LWS_OPENMETRICS_CHUNK 4096
+
+static const char openmetrics_ct[] =
+	"application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+struct per_vhost_data__lws_openmetrics {
+	int hide_vhosts;
+};
+
+struct per_session_data__lws_openmetrics {
+	struct lws_openmetrics_state st;
+	char h2; /* frame with END_STREAM rather than chunked encoding */
+	char close; /* HTTP/1.0: the body ends when the connection closes */
+};
+
+static int
+callback_lws_openmetrics(struct lws *wsi, enum lws_callback_reasons reason,
+			 void *user, void *in, size_t len)
+{
+	struct per_session_data__lws_openmetrics *pss =
+			(struct per_session_data__lws_openmetrics *)user;
+	struct per_vhost_data__lws_openmetrics *v =
+			(struct per_vhost_data__lws_openmetrics *)
+			lws_protocol_vh_priv_get(lws_get_vhost(wsi),
+					lws_get_protocol(wsi));
+	const struct lws_protocol_vhost_options *pvo;
+	unsigned char buf[LWS_PRE + LWS_OPENMETRICS_CHUNK],
+		      *start = &buf[LWS_PRE], *p = start,
+		      *end = &buf[sizeof(buf) - 1];
+	char ver[10];
+	int n, m;
+
+	switch (reason) {
+
+	case LWS_CALLBACK_PROTOCOL_INIT: /* per vhost */
+		if (v)
+			break;
+
+		v = lws_protocol_vh_priv_zalloc(lws_get_vhost(wsi),
+				lws_get_protocol(wsi),
+				sizeof(struct per_vhost_data__lws_openmetrics));
+		if (!v)
+			return 1;
+
+		pvo = (const struct lws_protocol_vhost_options *)in;
+		while (pvo) {
+			if (!strcmp(pvo->name, "hide-vhosts"))
+				v->hide_vhosts = atoi(pvo->value);
+			pvo = pvo->next;
+		}
+		break;
+
+	case LWS_CALLBACK_HTTP:
+		memset(&pss->st, 0, sizeof(pss->st));
+		pss->st.hide_vhosts = v && v->hide_vhosts;
+		/* only h2 requests have the :path pseudoheader */
+		pss->h2 = !!lws_hdr_total_length(wsi,
+						 WSI_TOKEN_HTTP_COLON_PATH);
+		/* "HTTP/1.1", the same test the server makes */
+		pss->close = !pss->h2 &&
+			     (lws_hdr_copy(wsi, ver, sizeof(ver),
+					   WSI_TOKEN_HTTP) < 8 ||
+			      ver[5] != '1' || ver[7] != '1');
+
+		if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end))
+			return 1;
+		if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_CONTENT_TYPE,
+				(unsigned char *)openmetrics_ct,
+				sizeof(openmetrics_ct) - 1, &p, end))
+			return 1;
+		if (pss->close) {
+			/* even if it asked for keep-alive */
+			if (lws_add_http_header_by_token(wsi,
+					WSI_TOKEN_CONNECTION,
+					(unsigned char *)"close", 5, &p, end))
+				return 1;
+		} else
+			if (!pss->h2 &&
+			    lws_add_http_header_by_token(wsi,
+					WSI_TOKEN_HTTP_TRANSFER_ENCODING,
+					(unsigned char *)"chunked", 7, &p, end))
+				return 1;
+		if (lws_finalize_http_header(wsi, &p, end))
+			return 1;
+
+		n = lws_write(wsi, start, lws_ptr_diff(p, start),
+			      LWS_WRITE_HTTP_HEADERS);
+		if (n < 0)
+			return 1;
+
+		lws_callback_on_writable(wsi);
+		break;
+
+	case LWS_CALLBACK_HTTP_WRITEABLE:
+		n = lws_openmetrics_dump(lws_get_context(wsi), &pss->st,
+					 (char *)start, LWS_OPENMETRICS_CHUNK);
+		if (n < 0)
+			return -1;
+
+		/* lws frames the chunks for 1.1, h2 ignores the flag */
+		m = pss->close ? 0 : LWS_WRITE_HTTP_CHUNK;
+
+		if (!n) {
+			/* all sent, end the body */
+			if (pss->close)
+				return -1;
+			if (lws_write(wsi, start, 0,
+				      LWS_WRITE_HTTP_FINAL | m) < 0)
+				return -1;
+
+			if (lws_http_transaction_completed(wsi))
+				return -1;
+			break;
+		}
+
+		if (lws_write(wsi, start, n, LWS_WRITE_HTTP | m) < 0)
+			return -1;
+
+		lws_callback_on_writable(wsi);
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+#define LWS_PLUGIN_PROTOCOL_LWS_OPENMETRICS \
+	{ \
+		"lws-openmetrics", \
+		callback_lws_openmetrics, \
+		sizeof(struct per_session_data__lws_openmetrics), \
+		0, \
+		0, NULL, 0 \
+	}
+
+#if !defined (LWS_PLUGIN_STATIC)
+
+static const struct lws_protocols protocols[] = {
+	LWS_PLUGIN_PROTOCOL_LWS_OPENMETRICS
+};
+
+LWS_EXTERN LWS_VISIBLE int
+init_protocol_lws_openmetrics(struct lws_context *context,
+			      struct lws_plugin_capability *c)
+{
+	if (c->api_magic != LWS_PLUGIN_API_MAGIC) {
+		lwsl_err("Plugin API %d, library API %d", LWS_PLUGIN_API_MAGIC,
+			 c->api_magic);
+		return 1;
+	}
+
+	c->protocols = protocols;
+	c->count_protocols = ARRAY_SIZE(protocols);
+	c->extensions = NULL;
+	c->count_extensions = 0;
+
+	return 0;
+}
+
+LWS_EXTERN LWS_VISIBLE int
+destroy_protocol_lws_openmetrics(struct lws_context *context)
+{
+	return 0;
+}
+
+#endif
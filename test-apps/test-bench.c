@@ -0,0 +1,164 @@
+/*
+ * libwebsockets-test-*-bench - helpers shared by the benchmarks
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ */
+
+#include "test-bench.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+struct bench_client {
+	struct lws_context *context;
+	int (*client)(void *);
+	void *arg;
+	volatile int done;
+	int result;
+};
+
+unsigned long long
+bench_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((unsigned long long)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+unsigned long long
+bench_time_us(void)
+{
+	return bench_time_ns() / 1000;
+}
+
+int
+bench_connect(int port)
+{
+	struct sockaddr_in sa;
+	struct timeval tv;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int
+bench_read_oks(int fd, int count, char *last)
+{
+	char rx[16384];
+	int n, k, got = 0, len = 0;
+
+	/* each response ends with the two byte body */
+	while (got < count) {
+		k = read(fd, rx, sizeof(rx));
+		if (k <= 0)
+			return -1;
+		len += k;
+		for (n = 0; n < k; *last = rx[n++])
+			if (*last == 'o' && rx[n] == 'k')
+				got++;
+	}
+
+	return len;
+}
+
+int
+callback_bench_ok(struct lws *wsi, enum lws_callback_reasons reason,
+		  void *user, void *in, size_t len)
+{
+	unsigned char buf[LWS_PRE + 256], *start = buf + LWS_PRE, *p = start,
+		      *end = buf + sizeof(buf) - 1;
+
+	switch (reason) {
+	case LWS_CALLBACK_HTTP:
+		if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+		    lws_add_http_header_content_length(wsi, 2, &p, end) ||
+		    lws_finalize_http_header(wsi, &p, end))
+			return 1;
+		memcpy(p, "ok", 2);
+		if (lws_write(wsi, start, p - start + 2, LWS_WRITE_HTTP) < 0)
+			return 1;
+		if (lws_http_transaction_completed(wsi))
+			return -1;
+		return 0;
+
+	default:
+		break;
+	}
+
+	return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+static void *
+bench_client_thread(void *d)
+{
+	struct bench_client *c = (struct bench_client *)d;
+
+	c->result = c->client(c->arg);
+	c->done = 1;
+	lws_cancel_service(c->context);
+
+	return NULL;
+}
+
+int
+bench_serve(struct lws_context *context, int (*client)(void *), void *arg)
+{
+	struct bench_client c;
+	pthread_t thread;
+
+	memset(&c, 0, sizeof(c));
+	c.context = context;
+	c.client = client;
+	c.arg = arg;
+
+	if (pthread_create(&thread, NULL, bench_client_thread, &c))
+		return 1;
+
+	while (!c.done)
+		lws_service(context, 50);
+
+	pthread_join(thread, NULL);
+
+	return c.result;
+}
@@ -0,0 +1,54 @@
+/*
+ * libwebsockets-test-*-bench - helpers shared by the benchmarks
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ */
+
+#include <libwebsockets.h>
+
+/* monotonic clock */
+extern unsigned long long
+bench_time_us(void);
+extern unsigned long long
+bench_time_ns(void);
+
+/*
+ * A blocking client socket connected to us on 127.0.0.1:port, with Nagle
+ * off and reads timing out after 5s, or -1
+ */
+extern int
+bench_connect(int port);
+
+/*
+ * Reads from fd until count responses from callback_bench_ok() have come,
+ * *last carrying the last byte seen from one call to the next.  Returns how
+ * many bytes that took, or -1 if the connection failed first.
+ */
+extern int
+bench_read_oks(int fd, int count, char *last);
+
+/* answers every http request with a two byte body, "ok", in one write */
+extern int
+callback_bench_ok(struct lws *wsi, enum lws_callback_reasons reason,
+		  void *user, void *in, size_t len);
+
+/*
+ * Runs client(arg) on its own thread while this one services context, and
+ * returns what it returned, or 1 if it couldn't be started
+ */
+extern int
+bench_serve(struct lws_context *context, int (*client)(void *), void *arg);
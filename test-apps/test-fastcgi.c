@@ -0,0 +1,637 @@
+/*
+ * libwebsockets-test-fastcgi - fastcgi:// mount checks against a responder
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * A thread runs a minimal multiplexing FastCGI responder on --port + 1, and
+ * we serve a vhost on --port with a fastcgi:// mount onto it, allowing one
+ * connection carrying up to four requests.  Another thread makes requests
+ * to the vhost and checks what comes back:
+ *
+ *  - /chunked: no content-length, so we chunk it to the client; the
+ *    responder sends it in records of every size from 1 byte, with padding,
+ *    dribbled out a few bytes per write, with FCGI_STDERR records mixed in
+ *  - /len: a response with a content-length
+ *  - /echo: a POST body comes back as the response
+ *  - /mpx: three at once, which the responder only answers once it has all
+ *    three in flight on the same connection with different ids
+ *  - /hang: the client resets the connection before the responder answers,
+ *    which must send it FCGI_ABORT_REQUEST
+ *  - /retry: the responder closes the kept-alive connection on it without
+ *    answering, as workers restarting do, and it must be sent again on a
+ *    new connection
+ *
+ * It exits nonzero if anything was wrong.
+ */
+
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define FCGI_BEGIN_REQUEST	1
+#define FCGI_ABORT_REQUEST	2
+#define FCGI_END_REQUEST	3
+#define FCGI_PARAMS		4
+#define FCGI_STDIN		5
+#define FCGI_STDOUT		6
+#define FCGI_STDERR		7
+
+#define MAX_CONNS 8
+#define MAX_IDS 8
+
+struct fcgi_id {
+	char uri[64];
+	unsigned char params[2048];
+	char body[4096];
+	int params_len;
+	int body_len;
+	unsigned int active:1;
+	unsigned int params_done:1;
+	unsigned int stdin_done:1;
+	unsigned int deferred:1;
+};
+
+struct fcgi_conn {
+	struct fcgi_id id[MAX_IDS + 1];
+	unsigned char rx[70000];
+	int fd;
+	int rx_len;
+	int served;
+};
+
+static struct lws_context *context;
+static struct fcgi_conn conns[MAX_CONNS];
+static volatile int done, aborts, retries, mpx_ids, stderr_lines;
+static int port = 7794, failed;
+static char chunked_body[3000];
+
+/* responder */
+
+static void
+fcgi_write(int fd, const void *buf, size_t len, int dribble)
+{
+	const char *p = buf;
+	size_t n;
+
+	while (len) {
+		n = dribble && len > 3 ? 3 : len;
+		if (write(fd, p, n) < 0)
+			return;
+		p += n;
+		len -= n;
+		if (dribble)
+			usleep(50);
+	}
+}
+
+static void
+fcgi_rec(int fd, int type, int id, const void *buf, int len, int pad,
+	 int dribble)
+{
+	unsigned char h[8] = { 1, (unsigned char)type, (unsigned char)(id >> 8),
+			       (unsigned char)id, (unsigned char)(len >> 8),
+			       (unsigned char)len, (unsigned char)pad, 0 },
+		      padding[255];
+
+	memset(padding, 0, sizeof(padding));
+	fcgi_write(fd, h, sizeof(h), dribble);
+	fcgi_write(fd, buf, len, dribble);
+	fcgi_write(fd, padding, pad, dribble);
+}
+
+static void
+fcgi_end(struct fcgi_conn *c, int id)
+{
+	unsigned char end[8];
+
+	memset(end, 0, sizeof(end));
+	fcgi_rec(c->fd, FCGI_STDOUT, id, NULL, 0, 0, 0);
+	fcgi_rec(c->fd, FCGI_END_REQUEST, id, end, sizeof(end), 0, 0);
+	c->id[id].active = 0;
+	c->served++;
+}
+
+static void
+fcgi_stdout(struct fcgi_conn *c, int id, const char *s, int len)
+{
+	fcgi_rec(c->fd, FCGI_STDOUT, id, s, len, 0, 0);
+}
+
+static void
+fcgi_close(struct fcgi_conn *c)
+{
+	close(c->fd);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+/* a name / value pair from FCGI_PARAMS, we only look at REQUEST_URI */
+
+static void
+fcgi_params(struct fcgi_id *r)
+{
+	unsigned char *p = r->params, *end = p + r->params_len;
+	int nl, vl;
+
+	while (p < end) {
+		nl = *p & 0x80 ? (int)(((p[0] & 0x7f) << 24) | (p[1] << 16) |
+				       (p[2] << 8) | p[3]) : *p;
+		p += *p & 0x80 ? 4 : 1;
+		vl = *p & 0x80 ? (int)(((p[0] & 0x7f) << 24) | (p[1] << 16) |
+				       (p[2] << 8) | p[3]) : *p;
+		p += *p & 0x80 ? 4 : 1;
+		if (nl == 11 && !memcmp(p, "REQUEST_URI", 11) &&
+		    vl < (int)sizeof(r->uri)) {
+			memcpy(r->uri, p + nl, vl);
+			r->uri[vl] = '\0';
+		}
+		p += nl + vl;
+	}
+}
+
+/* returns nonzero if it closed the connection */
+
+static int
+fcgi_respond(struct fcgi_conn *c, int id)
+{
+	static const char hdrs[] = "Content-Type: text/plain\r\n\r\n";
+	int len = (int)strlen(chunked_body), n, m, size, pad;
+	struct fcgi_id *r = &c->id[id];
+	char buf[256];
+
+	if (!strcmp(r->uri, "/retry") && c->served) {
+		retries++;
+		fcgi_close(c);
+
+		return 1;
+	}
+
+	if (!strcmp(r->uri, "/hang"))
+		return 0;
+
+	if (!strcmp(r->uri, "/mpx")) {
+		r->deferred = 1;
+		for (n = 1, m = 0; n <= MAX_IDS; n++)
+			m += c->id[n].active && c->id[n].deferred;
+		if (m < 3)
+			return 0;
+		mpx_ids = m;
+		for (n = 1; n <= MAX_IDS; n++)
+			if (c->id[n].active && c->id[n].deferred) {
+				fcgi_stdout(c, n, hdrs, sizeof(hdrs) - 1);
+				fcgi_stdout(c, n, "mpx", 3);
+				fcgi_end(c, n);
+			}
+
+		return 0;
+	}
+
+	if (!strcmp(r->uri, "/chunked")) {
+		fcgi_rec(c->fd, FCGI_STDOUT, id, hdrs, sizeof(hdrs) - 1, 3, 1);
+		for (n = 0, size = 1; n < len; n += m, size++) {
+			m = size;
+			if (m > len - n)
+				m = len - n;
+			pad = (8 - (m & 7)) & 7;
+			fcgi_rec(c->fd, FCGI_STDOUT, id, chunked_body + n, m,
+				 pad, size < 8);
+			if (!(size % 16))
+				fcgi_rec(c->fd, FCGI_STDERR, id, "warning\n",
+					 8, 0, 0);
+		}
+		fcgi_end(c, id);
+
+		return 0;
+	}
+
+	if (!strcmp(r->uri, "/echo")) {
+		n = lws_snprintf(buf, sizeof(buf), "Content-Length: %d\r\n%s",
+				 r->body_len, hdrs);
+		fcgi_stdout(c, id, buf, n);
+		fcgi_stdout(c, id, r->body, r->body_len);
+		fcgi_end(c, id);
+
+		return 0;
+	}
+
+	n = lws_snprintf(buf, sizeof(buf), "Status: 200 OK\r\n"
+			 "Content-Length: 5\r\n%shello", hdrs);
+	fcgi_stdout(c, id, buf, n);
+	fcgi_end(c, id);
+
+	return 0;
+}
+
+/* returns nonzero if it closed the connection */
+
+static int
+fcgi_record(struct fcgi_conn *c, const unsigned char *h,
+	    const unsigned char *p, int len)
+{
+	int id = (h[2] << 8) | h[3];
+	struct fcgi_id *r;
+
+	if (!id || id > MAX_IDS) {
+		lwsl_err("responder: bad request id %d\n", id);
+		failed = 1;
+		return 0;
+	}
+	r = &c->id[id];
+
+	switch (h[1]) {
+	case FCGI_BEGIN_REQUEST:
+		if (r->active) {
+			lwsl_err("responder: id %d already in use\n", id);
+			failed = 1;
+		}
+		memset(r, 0, sizeof(*r));
+		r->active = 1;
+		break;
+
+	case FCGI_PARAMS:
+		if (!len) {
+			r->params_done = 1;
+			fcgi_params(r);
+			break;
+		}
+		if (r->params_len + len <= (int)sizeof(r->params)) {
+			memcpy(r->params + r->params_len, p, len);
+			r->params_len += len;
+		}
+		break;
+
+	case FCGI_STDIN:
+		if (!len) {
+			r->stdin_done = 1;
+			return fcgi_respond(c, id);
+		}
+		if (r->body_len + len <= (int)sizeof(r->body)) {
+			memcpy(r->body + r->body_len, p, len);
+			r->body_len += len;
+		}
+		break;
+
+	case FCGI_ABORT_REQUEST:
+		if (!r->active)
+			break;
+		aborts++;
+		fcgi_end(c, id);
+		break;
+	}
+
+	return 0;
+}
+
+static void
+fcgi_conn_rx(struct fcgi_conn *c)
+{
+	int n, len, used = 0;
+
+	n = read(c->fd, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len);
+	if (n <= 0) {
+		fcgi_close(c);
+		return;
+	}
+	c->rx_len += n;
+
+	while (c->rx_len - used >= 8) {
+		len = (c->rx[used + 4] << 8) | c->rx[used + 5];
+		if (c->rx_len - used < 8 + len + c->rx[used + 6])
+			break;
+		if (fcgi_record(c, c->rx + used, c->rx + used + 8, len))
+			return;
+		used += 8 + len + c->rx[used + 6];
+	}
+
+	memmove(c->rx, c->rx + used, c->rx_len - used);
+	c->rx_len -= used;
+}
+
+static void *
+thread_responder(void *d)
+{
+	struct pollfd pfd[MAX_CONNS + 1];
+	int fd = *(int *)d, n, m;
+
+	for (n = 0; n < MAX_CONNS; n++)
+		conns[n].fd = -1;
+
+	while (!done) {
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		for (n = 0; n < MAX_CONNS; n++) {
+			pfd[n + 1].fd = conns[n].fd;
+			pfd[n + 1].events = POLLIN;
+		}
+		if (poll(pfd, MAX_CONNS + 1, 50) <= 0)
+			continue;
+
+		if (pfd[0].revents & POLLIN) {
+			m = accept(fd, NULL, NULL);
+			for (n = 0; n < MAX_CONNS; n++)
+				if (conns[n].fd < 0)
+					break;
+			if (n == MAX_CONNS)
+				close(m);
+			else
+				conns[n].fd = m;
+		}
+
+		for (n = 0; n < MAX_CONNS; n++)
+			if (conns[n].fd >= 0 && pfd[n + 1].fd == conns[n].fd &&
+			    pfd[n + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				fcgi_conn_rx(&conns[n]);
+	}
+
+	for (n = 0; n < MAX_CONNS; n++)
+		if (conns[n].fd >= 0)
+			close(conns[n].fd);
+	close(fd);
+
+	return NULL;
+}
+
+/* client */
+
+static int
+client_connect(void)
+{
+	struct sockaddr_in sa;
+	struct timeval tv;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* the http status, with the body (dechunked) in out, or -1 */
+
+static int
+get(const char *method, const char *path, const char *body, char *out,
+    int out_len)
+{
+	char buf[16384], *p, *e;
+	int fd, n, m = 0, chunked;
+
+	fd = client_connect();
+	if (fd < 0)
+		return -1;
+
+	n = lws_snprintf(buf, sizeof(buf), "%s %s HTTP/1.1\r\n"
+			 "Host: localhost\r\nConnection: close\r\n", method,
+			 path);
+	if (body)
+		n += lws_snprintf(buf + n, sizeof(buf) - n,
+				  "Content-Length: %d\r\n", (int)strlen(body));
+	n += lws_snprintf(buf + n, sizeof(buf) - n, "\r\n%s", body ? body : "");
+	if (write(fd, buf, n) != n) {
+		close(fd);
+		return -1;
+	}
+
+	while (m < (int)sizeof(buf) - 1) {
+		n = read(fd, buf + m, sizeof(buf) - 1 - m);
+		if (n <= 0)
+			break;
+		m += n;
+	}
+	close(fd);
+	buf[m] = '\0';
+
+	p = strstr(buf, "\r\n\r\n");
+	if (strncmp(buf, "HTTP/1.1 ", 9) || !p)
+		return -1;
+	*p = '\0';
+	p += 4;
+	chunked = !!strstr(buf, "chunked");
+
+	m = 0;
+	while (*p) {
+		n = chunked ? (int)strtol(p, &e, 16) : (int)strlen(p);
+		if (chunked) {
+			if (e[0] != '\r' || e[1] != '\n')
+				return -1;
+			p = e + 2;
+		}
+		if (!n || m + n >= out_len)
+			break;
+		memcpy(out + m, p, n);
+		m += n;
+		p += n + (chunked ? 2 : 0);
+	}
+	out[m] = '\0';
+
+	return atoi(buf + 9);
+}
+
+static void
+check(const char *what, int ok)
+{
+	if (ok)
+		return;
+
+	lwsl_err("FAILED: %s\n", what);
+	failed = 1;
+}
+
+static void *
+thread_mpx(void *d)
+{
+	char out[64];
+
+	*(int *)d = get("GET", "/mpx", NULL, out, sizeof(out)) == 200 &&
+		    !strcmp(out, "mpx");
+
+	return NULL;
+}
+
+static void *
+thread_client(void *d)
+{
+	static char out[sizeof(chunked_body) + 1];
+	struct linger lin;
+	pthread_t t[3];
+	int n, ok[3], fd;
+
+	(void)d;
+
+	check("chunked", get("GET", "/chunked", NULL, out, sizeof(out)) ==
+			 200 && !strcmp(out, chunked_body));
+	check("stderr", stderr_lines > 0);
+	check("len", get("GET", "/len", NULL, out, sizeof(out)) == 200 &&
+		     !strcmp(out, "hello"));
+	check("echo", get("POST", "/echo", "some body", out, sizeof(out)) ==
+		      200 && !strcmp(out, "some body"));
+
+	for (n = 0; n < 3; n++)
+		pthread_create(&t[n], NULL, thread_mpx, &ok[n]);
+	for (n = 0; n < 3; n++) {
+		pthread_join(t[n], NULL);
+		check("mpx", ok[n]);
+	}
+	check("mpx ids", mpx_ids == 3);
+
+	fd = client_connect();
+	if (fd >= 0) {
+		n = write(fd, "GET /hang HTTP/1.1\r\nHost: localhost\r\n\r\n",
+			  39);
+		usleep(200000);
+		/* a plain close is taken as a half-close, reset it instead */
+		lin.l_onoff = 1;
+		lin.l_linger = 0;
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+		close(fd);
+	}
+	for (n = 0; n < 40 && !aborts; n++)
+		usleep(50000);
+	check("abort", aborts == 1);
+
+	check("retry", get("GET", "/retry", NULL, out, sizeof(out)) == 200 &&
+		       !strcmp(out, "hello") && retries == 1);
+
+	/* and the connection we were given after that one is usable */
+	check("after retry", get("GET", "/len", NULL, out, sizeof(out)) == 200);
+
+	done = 1;
+	lws_cancel_service(context);
+
+	return NULL;
+}
+
+static void
+emit(int level, const char *line)
+{
+	if (strstr(line, "FastCGI-stderr: warning"))
+		stderr_lines++;
+
+	if (getenv("DBG") || level & (LLL_ERR | LLL_WARN))
+		fprintf(stderr, "%s", line);
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ NULL, 0, 0, 0 }
+};
+
+static const struct lws_protocols protocols[] = {
+	{ "http-only", lws_callback_http_dummy, 0, 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	pthread_t responder, client;
+	struct lws_http_mount mount;
+	struct sockaddr_in sa;
+	char origin[32];
+	int n = 0, fd;
+
+	lws_set_log_level(getenv("DBG") ? 1023 : (LLL_ERR | LLL_WARN | LLL_NOTICE), emit);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hp:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-fastcgi [--port=<p>]\n");
+			return 1;
+		}
+	}
+
+	for (n = 0; n < (int)sizeof(chunked_body) - 1; n++)
+		chunked_body[n] = 'a' + (n * 7) % 26;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	n = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port + 1);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || listen(fd, 8)) {
+		lwsl_err("unable to listen on %d: %d\n", port + 1, errno);
+		return 1;
+	}
+
+	lws_snprintf(origin, sizeof(origin), "127.0.0.1:%d", port + 1);
+	memset(&mount, 0, sizeof(mount));
+	mount.mountpoint = "/";
+	mount.mountpoint_len = 1;
+	mount.origin = origin;
+	mount.origin_protocol = LWSMPRO_FASTCGI;
+	mount.fastcgi_conns = 1;
+	mount.fastcgi_mpxs = 4;
+
+	memset(&info, 0, sizeof(info));
+	info.port = port;
+	info.protocols = protocols;
+	info.mounts = &mount;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		return 1;
+	}
+
+	if (pthread_create(&responder, NULL, thread_responder, &fd) ||
+	    pthread_create(&client, NULL, thread_client, NULL)) {
+		lws_context_destroy(context);
+		return 1;
+	}
+
+	while (!done)
+		lws_service(context, 50);
+
+	pthread_join(client, NULL);
+	pthread_join(responder, NULL);
+	lws_context_destroy(context);
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed;
+}
@@ -0,0 +1,244 @@
+/*
+ * libwebsockets-test-lejp-bench - LEJP path matching benchmark
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * This builds a JSON document of about --size bytes, an array of messages
+ * each with a few of --paths possible members, and parses it --count times
+ * with the paths given to lejp_construct() and then compiled for
+ * lejp_construct_compiled().  It checks both saw the same matches and
+ * reports how long each took.  --pretty indents the document, so about a
+ * third of it is whitespace between tokens.  --nest puts the array that
+ * deep in objects named "o", so every path starts with that many "o.".
+ */
+
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+static int count_paths = 200, size = 10 * 1024 * 1024, count = 5,
+	   chunk = 4096, pretty, nest;
+static unsigned long trace;
+
+static unsigned long long
+time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((unsigned long long)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static signed char
+cb(struct lejp_ctx *ctx, char reason)
+{
+	/* a cheap summary of what matched, to compare the two ways */
+	if (reason & LEJP_FLAG_CB_IS_VALUE)
+		trace = (trace * 31) + ((unsigned long)ctx->path_match << 8) +
+			(unsigned char)reason;
+
+	return 0;
+}
+
+static char *
+make_doc(int *len)
+{
+	const char *nl = pretty ? "\n" : "", *sp = pretty ? " " : "",
+		   *in1 = pretty ? "  " : "", *in2 = pretty ? "    " : "",
+		   *in3 = pretty ? "      " : "";
+	char *doc = malloc(size + 1024), *p = doc, *end = doc + size;
+	int n, m;
+
+	if (!doc)
+		return NULL;
+
+	for (n = 0; n < nest; n++)
+		p += sprintf(p, "{\"o\":");
+	p += sprintf(p, "{%s%s\"m\":%s[", nl, in1, sp);
+	while (p < end) {
+		p += sprintf(p, "%s%s%s{", p[-1] == '[' ? "" : ",", nl, in2);
+		for (n = 0; n < 8; n++) {
+			/* some members aren't in the path list */
+			m = rand() % (count_paths + 8);
+			p += sprintf(p, "%s%s%s\"f%d\":%s", n ? "," : "", nl,
+				     in3, m, sp);
+			if (m & 1)
+				p += sprintf(p, "%d", rand());
+			else
+				p += sprintf(p, "\"v%d\"", rand());
+		}
+		p += sprintf(p, "%s%s}", nl, in2);
+	}
+	p += sprintf(p, "%s%s]%s}", nl, in1, nl);
+	for (n = 0; n < nest; n++)
+		*p++ = '}';
+
+	*len = (int)(p - doc);
+
+	return doc;
+}
+
+/* returns the time taken, or 0 if the parse failed */
+
+static unsigned long long
+parse(const char *doc, int len, const char * const *paths,
+      const struct lejp_paths *lp)
+{
+	unsigned long long start = time_ns();
+	struct lejp_ctx ctx;
+	int n, m, r = LEJP_CONTINUE;
+
+	if (lp)
+		lejp_construct_compiled(&ctx, cb, NULL, lp);
+	else
+		lejp_construct(&ctx, cb, NULL, paths,
+			       (unsigned char)count_paths);
+
+	for (n = 0; n < len && r == LEJP_CONTINUE; n += m) {
+		m = len - n > chunk ? chunk : len - n;
+		r = lejp_parse(&ctx, (const unsigned char *)doc + n, m);
+	}
+	lejp_destruct(&ctx);
+
+	/* the document must have ended, and not before its last byte */
+	if (r < 0 || n < len) {
+		fprintf(stderr, "parse failed: %d\n", r);
+		return 0;
+	}
+
+	return time_ns() - start;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "paths",	required_argument,	NULL, 'n' },
+	{ "size",	required_argument,	NULL, 's' },
+	{ "count",	required_argument,	NULL, 'c' },
+	{ "chunk",	required_argument,	NULL, 'k' },
+	{ "pretty",	no_argument,		NULL, 'P' },
+	{ "nest",	required_argument,	NULL, 'N' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	unsigned long long t, best[2] = { ~0ull, ~0ull };
+	unsigned long traces[2] = { 0, 0 };
+	struct lejp_path_node *nodes;
+	struct lejp_paths lp;
+	char **paths, *doc;
+	int n = 0, m, len, ret = 1;
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hn:s:c:k:PN:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'n':
+			count_paths = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'c':
+			count = atoi(optarg);
+			break;
+		case 'k':
+			chunk = atoi(optarg);
+			break;
+		case 'P':
+			pretty = 1;
+			break;
+		case 'N':
+			nest = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-lejp-bench "
+				"[--paths <n, max 255>] [--size <bytes>] "
+				"[--count <n>] [--chunk <bytes>] [--pretty] "
+				"[--nest <n>]\n");
+			return 1;
+		}
+	}
+
+	if (count_paths < 1 || count_paths > 255 || count < 1 || chunk < 1 ||
+	    size < 1 || nest < 0 || nest > LEJP_MAX_DEPTH - 4)
+		return 1;
+
+	paths = malloc(count_paths * sizeof(*paths));
+	if (!paths)
+		return 1;
+	for (n = 0; n < count_paths; n++) {
+		paths[n] = malloc(nest * 2 + 16);
+		if (!paths[n])
+			return 1;
+		for (m = 0; m < nest; m++)
+			memcpy(paths[n] + m * 2, "o.", 2);
+		lws_snprintf(paths[n] + nest * 2, 16, "m[].f%d", n);
+	}
+
+	m = lejp_paths_size((const char * const *)paths,
+			    (unsigned char)count_paths);
+	nodes = malloc(m * sizeof(*nodes));
+	doc = make_doc(&len);
+	if (!nodes || !doc ||
+	    lejp_paths_compile(&lp, nodes, m, (const char * const *)paths,
+			       (unsigned char)count_paths))
+		goto bail;
+
+	printf("%d paths, %d trie nodes, %d byte document%s, nested %d\n",
+	       count_paths, lp.count_nodes, len, pretty ? " (pretty)" : "",
+	       nest);
+
+	/* alternate them, and keep the best of each */
+	for (n = 0; n < count; n++)
+		for (m = 0; m < 2; m++) {
+			trace = 0;
+			t = parse(doc, len, (const char * const *)paths,
+				  m ? &lp : NULL);
+			if (!t)
+				goto bail;
+			if (t < best[m])
+				best[m] = t;
+			traces[m] = trace;
+		}
+
+	if (traces[0] != traces[1]) {
+		fprintf(stderr, "FAILED: the matches differ\n");
+		goto bail;
+	}
+
+	for (m = 0; m < 2; m++)
+		printf("%s: %llums, %.0f MB/s\n", m ? "compiled" : "linear",
+		       best[m] / 1000000,
+		       ((double)len / (1024 * 1024)) /
+		       ((double)best[m] / 1000000000));
+	ret = 0;
+
+bail:
+	for (n = 0; n < count_paths; n++)
+		free(paths[n]);
+	free(paths);
+	free(nodes);
+	free(doc);
+
+	return ret;
+}
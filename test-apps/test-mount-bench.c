@@ -0,0 +1,202 @@
+/*
+ * libwebsockets-test-mount-bench - mount matching benchmark
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * Mount matching isn't reachable from outside without a connection, so
+ * this measures it the long way round: one vhost on --port has a single
+ * callback mount, another on --port + 1 has --mounts of them, "/m0/x",
+ * "/m1/x"... and a thread makes --requests keep-alive GETs to each, for
+ * paths under random mounts, --pipeline at a time.  Everything else about
+ * the requests is the same, so the difference in time per request is
+ * what matching among that many mounts costs.
+ */
+
+
+#include "test-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+static int port = 7796, count_mounts = 3000, requests = 50000, pipeline = 8;
+static double us_per_req[2];
+
+static const struct lws_protocols protocols[] = {
+	{ "mount-bench", callback_bench_ok, 0, 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+/* returns nonzero if the responses didn't all come */
+
+static int
+run(int p, int spread)
+{
+	unsigned long long start;
+	char req[4096], last = 0;
+	int fd, n, m, len;
+
+	fd = bench_connect(p);
+	if (fd < 0)
+		return 1;
+
+	start = bench_time_us();
+
+	for (n = 0; n < requests; n += pipeline) {
+		len = 0;
+		for (m = 0; m < pipeline; m++)
+			len += lws_snprintf(req + len, sizeof(req) - len,
+					    "GET /m%d/x/index.html HTTP/1.1\r\n"
+					    "Host: localhost\r\n\r\n",
+					    spread ? rand() % count_mounts : 0);
+		if (write(fd, req, len) != len ||
+		    bench_read_oks(fd, pipeline, &last) < 0)
+			break;
+	}
+
+	us_per_req[spread] = (double)(bench_time_us() - start) / n;
+	close(fd);
+
+	return n < requests;
+}
+
+static int
+client(void *d)
+{
+	(void)d;
+
+	/* warm up, then time both */
+	if (run(port, 0) || run(port, 0) || run(port + 1, 1)) {
+		fprintf(stderr, "requests failed\n");
+		return 1;
+	}
+
+	printf("1 mount: %.2fus/req, %d mounts: %.2fus/req, "
+	       "difference %.0fns/req\n", us_per_req[0], count_mounts,
+	       us_per_req[1], (us_per_req[1] - us_per_req[0]) * 1000);
+
+	return 0;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ "mounts",	required_argument,	NULL, 'm' },
+	{ "requests",	required_argument,	NULL, 'r' },
+	{ "pipeline",	required_argument,	NULL, 'P' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	struct lws_http_mount *mounts, one;
+	struct lws_context *context;
+	int n = 0, ret = 1;
+	char *names;
+
+	/*
+	 * a callback mount first tries its origin as a directory, and only
+	 * calls the protocol when that fails, logging an error for each one
+	 */
+	lws_set_log_level(LLL_USER, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:m:r:P:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'm':
+			count_mounts = atoi(optarg);
+			break;
+		case 'r':
+			requests = atoi(optarg);
+			break;
+		case 'P':
+			pipeline = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-mount-bench "
+				"[--mounts <n>] [--requests <n>] "
+				"[--pipeline <n>] [--port <p>] "
+				"[-d <log bitfield>]\n");
+			return 1;
+		}
+	}
+
+	if (count_mounts < 1 || pipeline < 1 || pipeline > 64)
+		return 1;
+
+	mounts = calloc(count_mounts, sizeof(*mounts));
+	names = malloc(count_mounts * 16);
+	if (!mounts || !names)
+		return 1;
+
+	for (n = 0; n < count_mounts; n++) {
+		mounts[n].mount_next = n + 1 < count_mounts ? &mounts[n + 1] :
+							      NULL;
+		mounts[n].mountpoint = names + n * 16;
+		mounts[n].mountpoint_len = (unsigned char)
+				lws_snprintf(names + n * 16, 16, "/m%d/x", n);
+		mounts[n].origin = "mount-bench";
+		mounts[n].origin_protocol = LWSMPRO_CALLBACK;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		return 1;
+	}
+
+	one = mounts[0];
+	one.mount_next = NULL;
+
+	info.protocols = protocols;
+	info.vhost_name = "one";
+	info.port = port;
+	info.mounts = &one;
+	if (!lws_create_vhost(context, &info))
+		goto bail;
+	info.vhost_name = "many";
+	info.port = port + 1;
+	info.mounts = mounts;
+	if (!lws_create_vhost(context, &info))
+		goto bail;
+
+	printf("%d requests, %d pipelined\n", requests, pipeline);
+
+	ret = bench_serve(context, client, NULL);
+
+bail:
+	lws_context_destroy(context);
+	free(mounts);
+	free(names);
+
+	return ret;
+}
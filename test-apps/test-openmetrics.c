@@ -0,0 +1,232 @@
+/*
+ * libwebsockets-test-openmetrics - built in lws-openmetrics protocol checks
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * No plugins are loaded.  The vhost on --port names lws-openmetrics in its
+ * pvo and mounts it on /metrics, the one on --port + 1 has the same mount
+ * but doesn't ask for the protocol.  A thread scrapes both, and checks only
+ * the first serves the exposition.  It scrapes the first again as HTTP/1.0,
+ * asking for keep-alive, and checks that comes unchunked and the server
+ * closes the connection to end it.  It exits nonzero if anything is wrong.
+ */
+
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static struct lws_context *context;
+static volatile int done;
+static int port = 7802, failed;
+
+static const struct lws_protocols protocols[] = {
+	{ "http-only", lws_callback_http_dummy, 0, 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+static const struct lws_protocol_vhost_options pvo_hide = {
+	NULL, NULL, "hide-vhosts", "0"
+};
+
+static const struct lws_protocol_vhost_options pvo = {
+	NULL, &pvo_hide, "lws-openmetrics", ""
+};
+
+static const struct lws_http_mount mount = {
+	.mountpoint		= "/metrics",
+	.origin			= "lws-openmetrics",
+	.origin_protocol	= LWSMPRO_CALLBACK,
+	.mountpoint_len		= 8,
+};
+
+/* the whole response, up to the server closing the connection, or -1 */
+
+static int
+get(int p, const char *req, char *buf, int len)
+{
+	struct sockaddr_in sa;
+	struct timeval tv;
+	int fd, n, m = 0;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(p);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		goto bail;
+
+	n = (int)strlen(req);
+	if (write(fd, req, n) != n)
+		goto bail;
+
+	while (m < len - 1) {
+		n = read(fd, buf + m, len - 1 - m);
+		if (n <= 0)
+			break;
+		m += n;
+	}
+	close(fd);
+	buf[m] = '\0';
+
+	/* a timeout rather than the close */
+	if (n < 0)
+		return -1;
+
+	return m;
+
+bail:
+	close(fd);
+
+	return -1;
+}
+
+static void *
+thread_client(void *d)
+{
+	static const char req11[] = "GET /metrics HTTP/1.1\r\n"
+				    "Host: localhost\r\n"
+				    "Connection: close\r\n\r\n",
+			  req10[] = "GET /metrics HTTP/1.0\r\n"
+				    "Connection: keep-alive\r\n\r\n";
+	static char buf[256 * 1024];
+	char *b;
+	int n;
+
+	(void)d;
+
+	n = get(port, req11, buf, sizeof(buf));
+	if (n < 0 || strncmp(buf, "HTTP/1.1 200", 12) ||
+	    !strstr(buf, "application/openmetrics-text") ||
+	    !strstr(buf, "vhost=\"om\"") || !strstr(buf, "# EOF\n")) {
+		fprintf(stderr, "scrape of the vhost with the protocol "
+			"failed:\n%.*s\n", n > 1024 ? 1024 : n, buf);
+		failed = 1;
+	}
+
+	n = get(port + 1, req11, buf, sizeof(buf));
+	if (n > 0 && strstr(buf, "# EOF\n")) {
+		fprintf(stderr, "the vhost without the protocol served it\n");
+		failed = 1;
+	}
+
+	n = get(port, req10, buf, sizeof(buf));
+	b = n < 0 ? NULL : strstr(buf, "\r\n\r\n");
+	if (!b || strncmp(buf, "HTTP/1.0 200", 12) ||
+	    strstr(buf, "chunked") || b[4] != '#' ||
+	    n < 6 || strcmp(buf + n - 6, "# EOF\n")) {
+		fprintf(stderr, "HTTP/1.0 scrape failed:\n%.*s\n",
+			n > 1024 ? 1024 : n, buf);
+		failed = 1;
+	}
+
+	done = 1;
+	lws_cancel_service(context);
+
+	return NULL;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	pthread_t thread;
+	int n = 0;
+
+	/* the vhost without the protocol logs an error, as it should */
+	lws_set_log_level(LLL_WARN, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-openmetrics "
+				"[-d <log level>] [--port=<p>]\n");
+			return 1;
+		}
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		return 1;
+	}
+
+	info.protocols = protocols;
+	info.mounts = &mount;
+	info.vhost_name = "om";
+	info.port = port;
+	info.pvo = &pvo;
+	if (!lws_create_vhost(context, &info))
+		goto bail;
+
+	info.vhost_name = "plain";
+	info.port = port + 1;
+	info.pvo = NULL;
+	if (!lws_create_vhost(context, &info))
+		goto bail;
+
+	if (pthread_create(&thread, NULL, thread_client, NULL))
+		goto bail;
+
+	while (!done)
+		lws_service(context, 50);
+
+	pthread_join(thread, NULL);
+	lws_context_destroy(context);
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed;
+
+bail:
+	lws_context_destroy(context);
+
+	return 1;
+}
@@ -0,0 +1,360 @@
+/*
+ * libwebsockets-test-proxy-cache - proxy mount response cache checks
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * This serves an "upstream" vhost on --port + 1 that answers every GET with
+ * the count of requests it has seen so far, and a Cache-Control chosen by
+ * the first letter of the path.  Paths starting with 'e' also get an ETag,
+ * and a 304 when the request already has it.  A second vhost on --port has
+ * a caching proxy mount onto it.  A thread makes requests to the proxy,
+ * with and without Authorization, and checks from the count both which ones
+ * the cache answered and that each body is the one it should have been.
+ * Last it POSTs a chunked body, which the proxy can't relay, and checks it
+ * gets a 411 without the upstream seeing it.  It exits nonzero if any were
+ * wrong.
+ */
+
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static struct lws_context *context;
+static volatile int done, served;
+static int port = 7792, failed;
+
+/* the upstream's answers, by the first letter of the path */
+static const char * const cc[] = {
+	"p", "max-age=60",
+	"u", "public, max-age=60",
+	"s", "s-maxage=60",
+	"m", "max-age=60, must-revalidate",
+	"e", "no-cache",
+};
+
+#define ETAG "\"v1\""
+
+static const struct step {
+	const char *path;
+	char auth;
+	char fetched; /* the upstream should see it */
+	int body; /* the upstream's count when it sent what we should get */
+} steps[] = {
+	/* credentials neither get a private entry, nor replace it */
+	{ "/p1", 0, 1, 1 },
+	{ "/p1", 0, 0, 1 },
+	{ "/p1", 1, 1, 2 },
+	{ "/p1", 0, 0, 1 },
+	/* what they fetch isn't stored, and doesn't stop it being stored */
+	{ "/p2", 1, 1, 3 },
+	{ "/p2", 1, 1, 4 },
+	{ "/p2", 0, 1, 5 },
+	{ "/p2", 0, 0, 5 },
+	/* unless it said it may be shared */
+	{ "/u1", 1, 1, 6 },
+	{ "/u1", 1, 0, 6 },
+	{ "/u1", 0, 0, 6 },
+	{ "/s1", 1, 1, 7 },
+	{ "/s1", 1, 0, 7 },
+	{ "/m1", 1, 1, 8 },
+	{ "/m1", 1, 0, 8 },
+	{ "/m1", 0, 0, 8 },
+	/* revalidated every time, the 304 getting what we stored first */
+	{ "/e1", 0, 1, 9 },
+	{ "/e1", 0, 1, 9 },
+	{ "/e1", 0, 1, 9 },
+};
+
+struct per_session_data__upstream {
+	char body[16];
+	int len;
+};
+
+static int
+callback_upstream(struct lws *wsi, enum lws_callback_reasons reason,
+		  void *user, void *in, size_t len)
+{
+	struct per_session_data__upstream *pss =
+			(struct per_session_data__upstream *)user;
+	unsigned char buf[LWS_PRE + 512], *start = buf + LWS_PRE, *p = start,
+		      *end = buf + sizeof(buf) - 1;
+	const char *c = "no-store";
+	char inm[32];
+	int n, nm;
+
+	switch (reason) {
+	case LWS_CALLBACK_HTTP:
+		for (n = 0; n < (int)(sizeof(cc) / sizeof(cc[0])); n += 2)
+			if (((const char *)in)[1] == cc[n][0])
+				c = cc[n + 1];
+
+		pss->len = lws_snprintf(pss->body, sizeof(pss->body), "%d",
+					++served);
+
+		nm = ((const char *)in)[1] == 'e' &&
+		     lws_hdr_copy(wsi, inm, sizeof(inm),
+				  WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0 &&
+		     !strcmp(inm, ETAG);
+		if (nm)
+			pss->len = 0;
+
+		if (lws_add_http_header_status(wsi, nm ? HTTP_STATUS_NOT_MODIFIED :
+						HTTP_STATUS_OK, &p, end))
+			return 1;
+		if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_CONTENT_TYPE,
+				(unsigned char *)"text/plain", 10, &p, end))
+			return 1;
+		if (lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_CACHE_CONTROL,
+				(unsigned char *)c, (int)strlen(c), &p, end))
+			return 1;
+		if (c[0] == 'n' && lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_ETAG, (unsigned char *)ETAG,
+				(int)strlen(ETAG), &p, end))
+			return 1;
+		if (lws_add_http_header_content_length(wsi, pss->len, &p, end))
+			return 1;
+		if (lws_finalize_http_header(wsi, &p, end))
+			return 1;
+		if (lws_write(wsi, start, p - start, LWS_WRITE_HTTP_HEADERS) < 0)
+			return 1;
+		if (nm) {
+			/* no body */
+			if (lws_http_transaction_completed(wsi))
+				return -1;
+			return 0;
+		}
+		lws_callback_on_writable(wsi);
+		return 0;
+
+	case LWS_CALLBACK_HTTP_WRITEABLE:
+		memcpy(start, pss->body, pss->len);
+		if (lws_write(wsi, start, pss->len, LWS_WRITE_HTTP_FINAL) < 0)
+			return 1;
+		if (lws_http_transaction_completed(wsi))
+			return -1;
+		return 0;
+
+	default:
+		break;
+	}
+
+	return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+static const struct lws_protocols protocols[] = {
+	{ "upstream", callback_upstream,
+	  sizeof(struct per_session_data__upstream), 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+static const struct lws_protocols front_protocols[] = {
+	{ "http-only", lws_callback_http_dummy, 0, 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+/*
+ * the http status of the response, or -1, with its body in body.  chunked
+ * makes it a POST with a chunked body instead of a GET.
+ */
+
+static int
+get(const char *path, int auth, int chunked, char *body, int max)
+{
+	struct sockaddr_in sa;
+	struct timeval tv;
+	char buf[2048], *p;
+	int fd, n, m = 0;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		goto bail;
+
+	n = lws_snprintf(buf, sizeof(buf), "%s %s HTTP/1.1\r\n"
+			 "Host: localhost\r\n%s%s"
+			 "Connection: close\r\n\r\n%s",
+			 chunked ? "POST" : "GET", path,
+			 auth ? "Authorization: Basic dXNlcjpwYXNz\r\n" : "",
+			 chunked ? "Transfer-Encoding: chunked\r\n" : "",
+			 chunked ? "5\r\nhello\r\n0\r\n\r\n" : "");
+	if (write(fd, buf, n) != n)
+		goto bail;
+
+	/* the proxy closes after the response */
+	while (m < (int)sizeof(buf) - 1) {
+		n = read(fd, buf + m, sizeof(buf) - 1 - m);
+		if (n <= 0)
+			break;
+		m += n;
+	}
+	close(fd);
+	buf[m] = '\0';
+
+	p = strstr(buf, "\r\n\r\n");
+	if (strncmp(buf, "HTTP/1.1 ", 9) || !p)
+		return -1;
+	lws_snprintf(body, max, "%s", p + 4);
+
+	return atoi(buf + 9);
+
+bail:
+	close(fd);
+
+	return -1;
+}
+
+static void *
+thread_client(void *d)
+{
+	char body[64], want[16];
+	int n, status, before;
+
+	(void)d;
+
+	for (n = 0; n < (int)(sizeof(steps) / sizeof(steps[0])); n++) {
+		lws_snprintf(want, sizeof(want), "%d", steps[n].body);
+		before = served;
+		body[0] = '\0';
+		status = get(steps[n].path, steps[n].auth, 0, body,
+			     sizeof(body));
+		if (status != 200 || served - before != steps[n].fetched ||
+		    strcmp(body, want)) {
+			lwsl_err("step %d: %s%s: status %d, upstream saw %d, "
+				 "body '%s'\n", n, steps[n].path,
+				 steps[n].auth ? " (auth)" : "", status,
+				 served - before, body);
+			failed = 1;
+		}
+	}
+
+	before = served;
+	status = get("/p3", 0, 1, body, sizeof(body));
+	if (status != HTTP_STATUS_LENGTH_REQUIRED || served != before) {
+		lwsl_err("chunked POST: status %d, upstream saw %d\n", status,
+			 served - before);
+		failed = 1;
+	}
+
+	done = 1;
+	lws_cancel_service(context);
+
+	return NULL;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	struct lws_http_mount mount;
+	char origin[64];
+	pthread_t thread;
+	int n = 0;
+
+	lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-proxy-cache "
+				"[-d <log level>] [--port=<p>]\n");
+			return 1;
+		}
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		return 1;
+	}
+
+	info.vhost_name = "upstream";
+	info.port = port + 1;
+	info.protocols = protocols;
+	if (!lws_create_vhost(context, &info))
+		goto bail;
+
+	lws_snprintf(origin, sizeof(origin), "127.0.0.1:%d/", port + 1);
+	memset(&mount, 0, sizeof(mount));
+	mount.mountpoint = "/";
+	mount.mountpoint_len = 1;
+	mount.origin = origin;
+	mount.origin_protocol = LWSMPRO_HTTP;
+	mount.proxy_cache_mem = 1024 * 1024;
+
+	info.vhost_name = "proxy";
+	info.port = port;
+	info.protocols = front_protocols;
+	info.mounts = &mount;
+	if (!lws_create_vhost(context, &info))
+		goto bail;
+
+	if (pthread_create(&thread, NULL, thread_client, NULL))
+		goto bail;
+
+	while (!done)
+		lws_service(context, 50);
+
+	pthread_join(thread, NULL);
+	lws_context_destroy(context);
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed;
+
+bail:
+	lws_context_destroy(context);
+
+	return 1;
+}
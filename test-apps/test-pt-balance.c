@@ -0,0 +1,294 @@
+/*
+ * libwebsockets-test-pt-balance - idle connection migration between pts
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * This runs two service threads, and opens --idle keep-alive connections
+ * that make one request each and then sit idle, so they are spread over
+ * both pts.  Then one hot connection makes pipelined requests as fast as
+ * it can for --secs seconds, pinning load on whichever pt it landed on.
+ *
+ * It reports each pt's connections and load before and after, and how many
+ * connections each handed off, once normally and once with
+ * LWS_SERVER_OPTION_NO_PT_MIGRATION.  Finally every idle connection makes
+ * another request, to check the ones that moved still work.
+ *
+ * It fails if the hot pt handed nothing off with migration, or anything
+ * moved without it.
+ */
+
+#include "test-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MAX_IDLE 512
+#define THREADS 2
+
+static struct lws_context *context;
+static volatile int done;
+static int port = 7804, count_idle = 40, secs = 6;
+
+struct pt_info {
+	int fds;
+	unsigned int busy_us;
+	unsigned long in, out;
+};
+
+static const struct lws_protocols protocols[] = {
+	{ "pt-balance", callback_bench_ok, 0, 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+static const char req[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static void *
+thread_service(void *d)
+{
+	while (!done)
+		if (lws_service_tsi(context, 50, (int)(lws_intptr_t)d) < 0)
+			break;
+
+	return NULL;
+}
+
+/* the value after "name":" in the json at *p, moving *p past it */
+
+static unsigned long
+json_ul(const char **p, const char *name)
+{
+	char match[32];
+	const char *q;
+
+	lws_snprintf(match, sizeof(match), "\"%s\":\"", name);
+	q = strstr(*p, match);
+	if (!q)
+		return 0;
+	*p = q + strlen(match);
+
+	return strtoul(*p, NULL, 10);
+}
+
+static int
+get_pts(struct pt_info *pi)
+{
+	static char buf[32768];
+	const char *p = buf;
+	int n;
+
+	if (lws_json_dump_context(context, buf, sizeof(buf), 1) <= 0)
+		return 1;
+
+	for (n = 0; n < THREADS; n++) {
+		pi[n].fds = (int)json_ul(&p, "fds_count");
+		pi[n].busy_us = (unsigned int)json_ul(&p, "busy_us");
+		pi[n].in = json_ul(&p, "migrated_in");
+		pi[n].out = json_ul(&p, "migrated_out");
+	}
+
+	return 0;
+}
+
+static void
+show(const char *when, struct pt_info *pi)
+{
+	int n;
+
+	printf("  %-6s", when);
+	for (n = 0; n < THREADS; n++)
+		printf("  pt%d: %3d fds, %7uus/s busy, %3lu in, %3lu out", n,
+		       pi[n].fds, pi[n].busy_us, pi[n].in, pi[n].out);
+	printf("\n");
+}
+
+/* hammers the server with pipelined requests until time is up */
+
+static int
+hot(int fd)
+{
+	unsigned long long end = bench_time_us() + (unsigned long long)secs *
+							1000000;
+	char burst[sizeof(req) * 8], last = 0;
+	int n, len = (int)(sizeof(req) - 1) * 8;
+
+	for (n = 0; n < 8; n++)
+		memcpy(burst + n * (sizeof(req) - 1), req, sizeof(req) - 1);
+
+	while (bench_time_us() < end)
+		if (write(fd, burst, len) != len ||
+		    bench_read_oks(fd, 8, &last) < 0)
+			return 1;
+
+	return 0;
+}
+
+/* returns 0 if it behaved as it should with or without migration */
+
+static int
+run(int migrate)
+{
+	struct lws_context_creation_info info;
+	struct pt_info before[THREADS], after[THREADS];
+	pthread_t service[THREADS];
+	int fds[MAX_IDLE], hot_fd = -1, idle = 0, n, started, failed = 1, h;
+	char last = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.port = port;
+	info.protocols = protocols;
+	info.count_threads = THREADS;
+	info.keepalive_timeout = 60;
+	if (!migrate)
+		info.options = LWS_SERVER_OPTION_NO_PT_MIGRATION;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		return 1;
+	}
+	if (lws_get_count_threads(context) != THREADS) {
+		fprintf(stderr, "needs LWS_MAX_SMP >= %d\n", THREADS);
+		lws_context_destroy(context);
+		return 1;
+	}
+
+	done = 0;
+	for (started = 0; started < THREADS; started++)
+		if (pthread_create(&service[started], NULL, thread_service,
+				   (void *)(lws_intptr_t)started))
+			goto bail;
+
+	for (idle = 0; idle < count_idle; idle++) {
+		fds[idle] = bench_connect(port);
+		if (fds[idle] < 0)
+			break;
+		if (write(fds[idle], req, sizeof(req) - 1) != sizeof(req) - 1 ||
+		    bench_read_oks(fds[idle], 1, &last) < 0) {
+			close(fds[idle]);
+			break;
+		}
+	}
+	if (idle < count_idle) {
+		fprintf(stderr, "idle connection %d failed\n", idle);
+		goto bail;
+	}
+
+	/* let the idle ones become idle enough to be moved */
+	sleep(2);
+	if (get_pts(before))
+		goto bail;
+
+	hot_fd = bench_connect(port);
+	if (hot_fd < 0 || hot(hot_fd)) {
+		fprintf(stderr, "hot connection failed\n");
+		goto bail;
+	}
+	if (get_pts(after))
+		goto bail;
+
+	printf("%s migration:\n", migrate ? "with" : "without");
+	show("before", before);
+	show("after", after);
+
+	/* the hot pt is the one that did the most work */
+	h = after[1].busy_us > after[0].busy_us;
+
+	failed = 0;
+	if (migrate && !after[h].out) {
+		fprintf(stderr, "hot pt %d handed nothing off\n", h);
+		failed = 1;
+	}
+	if (after[!h].out || (!migrate && after[h].out)) {
+		fprintf(stderr, "unexpected migrations\n");
+		failed = 1;
+	}
+
+	for (n = 0; n < idle; n++)
+		if (write(fds[n], req, sizeof(req) - 1) != sizeof(req) - 1 ||
+		    bench_read_oks(fds[n], 1, &last) < 0) {
+			fprintf(stderr, "idle connection %d failed after\n", n);
+			failed = 1;
+		}
+
+bail:
+	if (hot_fd >= 0)
+		close(hot_fd);
+	for (n = 0; n < idle; n++)
+		close(fds[n]);
+
+	done = 1;
+	lws_cancel_service(context);
+	for (n = 0; n < started; n++)
+		pthread_join(service[n], NULL);
+	lws_context_destroy(context);
+
+	return failed;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ "idle",	required_argument,	NULL, 'i' },
+	{ "secs",	required_argument,	NULL, 's' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	int n = 0, failed;
+
+	lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:i:s:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'i':
+			count_idle = atoi(optarg);
+			break;
+		case 's':
+			secs = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-pt-balance "
+				"[--idle <n>] [--secs <n>] [--port <p>] "
+				"[-d <log bitfield>]\n");
+			return 1;
+		}
+	}
+
+	if (count_idle < 1 || count_idle > MAX_IDLE || secs < 1)
+		return 1;
+
+	failed = run(1);
+	failed |= run(0);
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed;
+}
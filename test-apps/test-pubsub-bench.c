@@ -0,0 +1,425 @@
+/*
+ * libwebsockets-test-pubsub-bench - topic fan-out benchmark
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * This forks a child that opens --subscribers ws connections to us and then
+ * just reads and discards whatever arrives, as cheaply as it can.  Each
+ * connection subscribes to one of --topics topics, and once they are all up,
+ * a separate thread publishes --length byte messages to the topics in turn
+ * every --interval us for --time seconds.
+ *
+ * It reports how many messages per second the service threads got onto the
+ * subscriber sockets, and how many were skipped for slow subscribers.  The
+ * child needs one fd per subscriber and so do we, so for 100k subscribers
+ * you need to raise the fd limit (ulimit -n) above that first.
+ */
+
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_TOPICS 256
+
+static struct lws_context *context;
+static struct lws_pubsub_topic *topics[MAX_TOPICS];
+static volatile int force_exit;
+static int subscribers = 1000, count_topics = 1, seconds = 5, msg_len = 64,
+	   interval_us = 1000, port = 7682, max_lag = 32;
+static enum lws_pubsub_lag_policy policy = LWS_PUBSUB_LAG_DROP;
+
+/* updated from every service thread */
+static unsigned long established, next_topic, delivered, dropped;
+
+struct per_session_data__pubsub_bench {
+	struct lws_pubsub_topic *topic;
+};
+
+static const char handshake[] =
+	"GET / HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"Sec-WebSocket-Protocol: lws-pubsub-bench\r\n\r\n";
+
+static unsigned long long
+time_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return ((unsigned long long)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+/*
+ * The subscribers, in the forked child.  They don't parse anything, they just
+ * keep the socket drained so the server is the bottleneck.
+ */
+static int
+run_subscribers(void)
+{
+	struct epoll_event ev, events[256];
+	struct sockaddr_in sa;
+	static char buf[65536];
+	int epfd, fd, n, m, live = 0, tries;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (n = 0; n < subscribers; n++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			fprintf(stderr, "subscriber %d: socket: %s\n", n,
+				strerror(errno));
+			break;
+		}
+		tries = 0;
+		while (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+			if (errno != ECONNREFUSED || ++tries == 500) {
+				fprintf(stderr, "subscriber %d: connect: %s\n",
+					n, strerror(errno));
+				close(fd);
+				goto up;
+			}
+			/* the server may not be listening yet */
+			usleep(10000);
+		}
+		if (write(fd, handshake, sizeof(handshake) - 1) !=
+		    (int)sizeof(handshake) - 1) {
+			close(fd);
+			break;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		live++;
+	}
+
+up:
+	while (live) {
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), 1000);
+		if (n < 0 && errno != EINTR)
+			break;
+		while (n-- > 0) {
+			do {
+				m = read(events[n].data.fd, buf, sizeof(buf));
+			} while (m == sizeof(buf));
+			if (!m || (m < 0 && errno != EAGAIN)) {
+				close(events[n].data.fd);
+				live--;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int
+callback_pubsub_bench(struct lws *wsi, enum lws_callback_reasons reason,
+		      void *user, void *in, size_t len)
+{
+	struct per_session_data__pubsub_bench *pss =
+			(struct per_session_data__pubsub_bench *)user;
+	int n;
+
+	switch (reason) {
+	case LWS_CALLBACK_ESTABLISHED:
+		pss->topic = topics[__sync_fetch_and_add(&next_topic, 1) %
+				    count_topics];
+		if (lws_pubsub_subscribe(wsi, pss->topic, max_lag, policy))
+			return -1;
+		__sync_fetch_and_add(&established, 1);
+		break;
+
+	case LWS_CALLBACK_SERVER_WRITEABLE:
+		n = lws_pubsub_write_pending(wsi);
+		if (n < 0)
+			return -1;
+		__sync_fetch_and_add(&delivered, n);
+		break;
+
+	case LWS_CALLBACK_CLOSED:
+		__sync_fetch_and_add(&dropped,
+				     lws_pubsub_dropped(wsi, pss->topic));
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static struct lws_protocols protocols[] = {
+	{ "http-only", lws_callback_http_dummy, 0, 0 },
+	{
+		"lws-pubsub-bench",
+		callback_pubsub_bench,
+		sizeof(struct per_session_data__pubsub_bench),
+		0,
+	},
+	{ NULL, NULL, 0, 0 } /* terminator */
+};
+
+static void *
+thread_publish(void *unused)
+{
+	unsigned long long start, end, now;
+	unsigned long seq = 0, d0;
+	char *payload;
+
+	payload = malloc(msg_len);
+	if (!payload)
+		goto bail;
+	memset(payload, 'x', msg_len);
+
+	/* wait for everyone to subscribe */
+	start = time_us();
+	while (!force_exit && established < (unsigned long)subscribers) {
+		if (time_us() - start > 60000000ull) {
+			fprintf(stderr, "only %lu of %d subscribed\n",
+				established, subscribers);
+			break;
+		}
+		usleep(10000);
+	}
+	printf("%lu subscribers up, publishing for %ds\n", established,
+	       seconds);
+
+	d0 = delivered;
+	start = now = time_us();
+	end = start + (unsigned long long)seconds * 1000000;
+	while (!force_exit && now < end) {
+		if (msg_len >= (int)sizeof(seq))
+			memcpy(payload, &seq, sizeof(seq));
+		if (lws_pubsub_publish(topics[seq % count_topics], payload,
+				       msg_len, LWS_WRITE_BINARY) < 0) {
+			fprintf(stderr, "publish failed\n");
+			break;
+		}
+		seq++;
+		if (interval_us)
+			usleep(interval_us);
+		now = time_us();
+	}
+
+	d0 = delivered - d0;
+	printf("published %lu messages in %.2fs\n", seq,
+	       (now - start) / 1000000.0);
+	printf("delivered %lu messages, %.0f msgs/s, %.1f MB/s payload\n", d0,
+	       d0 * 1000000.0 / (now - start),
+	       (double)d0 * msg_len / (now - start));
+
+	free(payload);
+bail:
+	force_exit = 1;
+	lws_cancel_service(context);
+
+	pthread_exit(NULL);
+}
+
+static void *
+thread_service(void *threadid)
+{
+	while (lws_service_tsi(context, 50, (int)(lws_intptr_t)threadid) >= 0 &&
+	       !force_exit)
+		;
+
+	pthread_exit(NULL);
+}
+
+static void
+sighandler(int sig)
+{
+	force_exit = 1;
+	lws_cancel_service(context);
+}
+
+static struct option options[] = {
+	{ "help",	  no_argument,		NULL, 'h' },
+	{ "debug",	  required_argument,	NULL, 'd' },
+	{ "port",	  required_argument,	NULL, 'p' },
+	{ "threads",	  required_argument,	NULL, 'j' },
+	{ "subscribers",  required_argument,	NULL, 's' },
+	{ "topics",	  required_argument,	NULL, 'n' },
+	{ "time",	  required_argument,	NULL, 't' },
+	{ "length",	  required_argument,	NULL, 'l' },
+	{ "interval",	  required_argument,	NULL, 'i' },
+	{ "max-lag",	  required_argument,	NULL, 'm' },
+	{ "coalesce",	  no_argument,		NULL, 'c' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	pthread_t pthread_publish, pthread_service[32];
+	int debug_level = 3, threads = 1, n = 0;
+	struct rlimit rl;
+	char name[32];
+	void *retval;
+	pid_t child;
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:j:s:n:t:l:i:m:c", options,
+				NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			debug_level = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads > (int)ARRAY_SIZE(pthread_service)) {
+				fprintf(stderr, "Max threads %lu\n",
+					(unsigned long)ARRAY_SIZE(pthread_service));
+				return 1;
+			}
+			break;
+		case 's':
+			subscribers = atoi(optarg);
+			break;
+		case 'n':
+			count_topics = atoi(optarg);
+			if (count_topics < 1 || count_topics > MAX_TOPICS) {
+				fprintf(stderr, "topics 1 .. %d\n", MAX_TOPICS);
+				return 1;
+			}
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			msg_len = atoi(optarg);
+			break;
+		case 'i':
+			interval_us = atoi(optarg);
+			break;
+		case 'm':
+			max_lag = atoi(optarg);
+			break;
+		case 'c':
+			policy = LWS_PUBSUB_LAG_COALESCE;
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-pubsub-bench "
+				"[--subscribers <n>] [--topics <n>] "
+				"[--threads <n>] [--time <s>] [--length <b>] "
+				"[--interval <us>] [--max-lag <n>] "
+				"[--coalesce] [--port <p>] [-d <log bitfield>]\n");
+			return 1;
+		}
+	}
+
+	/* we and the child each need an fd per subscriber */
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur < (rlim_t)subscribers + 64) {
+			fprintf(stderr, "fd limit %lu is too low for %d "
+				"subscribers\n", (unsigned long)rl.rlim_cur,
+				subscribers);
+			return 1;
+		}
+	}
+
+	child = fork();
+	if (child < 0)
+		return 1;
+	if (!child)
+		return run_subscribers();
+
+	signal(SIGINT, sighandler);
+	lws_set_log_level(debug_level, NULL);
+
+	memset(&info, 0, sizeof info);
+	info.port = port;
+	info.protocols = protocols;
+	info.gid = -1;
+	info.uid = -1;
+	info.count_threads = threads;
+	info.max_http_header_pool = 16;
+
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("libwebsocket init failed\n");
+		goto bail;
+	}
+
+	for (n = 0; n < count_topics; n++) {
+		lws_snprintf(name, sizeof(name), "bench-%d", n);
+		topics[n] = lws_pubsub_topic_get(context, name);
+		if (!topics[n])
+			goto bail;
+	}
+
+	printf("%d subscribers, %d topics, %d service threads, "
+	       "%d byte messages every %dus, max lag %d%s\n", subscribers,
+	       count_topics, lws_get_count_threads(context), msg_len,
+	       interval_us, max_lag,
+	       policy == LWS_PUBSUB_LAG_COALESCE ? " (coalesce)" : "");
+
+	if (pthread_create(&pthread_publish, NULL, thread_publish, NULL))
+		goto bail;
+
+	for (n = 0; n < lws_get_count_threads(context); n++)
+		if (pthread_create(&pthread_service[n], NULL, thread_service,
+				   (void *)(lws_intptr_t)n))
+			lwsl_err("Failed to start service thread\n");
+
+	while ((--n) >= 0)
+		pthread_join(pthread_service[n], &retval);
+
+	pthread_join(pthread_publish, &retval);
+
+bail:
+	lws_context_destroy(context);
+	printf("skipped %lu messages for slow subscribers\n", dropped);
+
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+
+	return 0;
+}
@@ -0,0 +1,362 @@
+/*
+ * libwebsockets-test-rewrite - proxied html url rewriting checks
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * An "upstream" thread on --port + 1 answers GET /<n> with an html
+ * document, written n bytes at a time with a pause between, so the proxy
+ * mount on --port sees it arrive in pieces that size.  A second thread
+ * fetches it through the proxy for every n from 1 to 63, and checks the
+ * rewritten document is exactly what it should be each time.  It exits
+ * nonzero if any differ.
+ */
+
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_CHUNK 63
+
+static struct lws_context *context;
+static volatile int done;
+static int port = 7800, failed, listen_fd = -1;
+static char doc[8192], expected[8192];
+static int doc_len, expected_len;
+
+/*
+ * What the upstream sends, and what should come out of the proxy.  '@' in
+ * either stands for the upstream's host:port.
+ */
+static const struct piece {
+	const char *in, *out;
+} pieces[] = {
+	{ "<!DOCTYPE html>\n<html><head>", NULL },
+	/* absolute and root-relative urls to the origin go under the mount */
+	{ "<link rel=stylesheet href=\"http://@/s.css\">",
+	  "<link rel=stylesheet href=\"/px/s.css\">" },
+	{ "<a HREF='https://@/a?b=c'>", "<a HREF='/px/a?b=c'>" },
+	{ "<img alt=x src=//@/i.png>", "<img alt=x src=/px/i.png>" },
+	{ "<form method=post action=/post>", "<form method=post action=/px/post>" },
+	{ "<a href=\"http://@\">", "<a href=\"/px\">" },
+	{ "<a href=\"/a-root-relative-url-longer-than-we-hold-back/x\">",
+	  "<a href=\"/px/a-root-relative-url-longer-than-we-hold-back/x\">" },
+	/* everything else is left alone */
+	{ "<a href=\"rel/x\"><a href=\"http://example.com/\">", NULL },
+	{ "<a href=\"http://@x/\"><a title=\"/t\" data-src=\"/d\">", NULL },
+	{ "<!-- <a href=\"/c\"> -- > --> <!x <a href=/b>", NULL },
+	{ "<a href=\"/c\">", "<a href=\"/px/c\">" },
+	{ "</a href=\"/e\"><br/><input disabled src=\"/v\">",
+	  "</a href=\"/e\"><br/><input disabled src=\"/px/v\">" },
+	/* nor is the raw text in script and style */
+	{ "<script>if (a<b) x = '<a href=\"/s\">'; y = '</scriptx>"
+	  "<a href=/s2>'; </SCRIPT ><a href=/after>",
+	  "<script>if (a<b) x = '<a href=\"/s\">'; y = '</scriptx>"
+	  "<a href=/s2>'; </SCRIPT ><a href=/px/after>" },
+	{ "<style>a { b: url(/u) } </style/><img src=/after2>",
+	  "<style>a { b: url(/u) } </style/><img src=/px/after2>" },
+	{ "</head><body>", NULL },
+	/* a long span with nothing in it */
+	{ "~", NULL },
+	{ "<a href=/end>end</a></body></html>\n",
+	  "<a href=/px/end>end</a></body></html>\n" },
+};
+
+static int
+append(char *buf, int len, const char *s, const char *origin)
+{
+	int n;
+
+	if (*s == '~') {
+		/* longer than the rewriter will copy rather than pass on */
+		for (n = 0; n < 1500; n++)
+			buf[len++] = 'a' + (n % 26);
+
+		return len;
+	}
+
+	while (*s) {
+		if (*s == '@')
+			len += lws_snprintf(buf + len, sizeof(doc) - len, "%s",
+					    origin);
+		else
+			buf[len++] = *s;
+		s++;
+	}
+
+	return len;
+}
+
+static void *
+thread_upstream(void *d)
+{
+	char buf[2048], hdr[256];
+	int fd, n, m, k, one = 1;
+
+	(void)d;
+
+	for (n = 1; n <= MAX_CHUNK && !done; n++) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			break;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		/* the request, up to the end of its headers */
+		m = 0;
+		while (m < (int)sizeof(buf) - 1) {
+			k = read(fd, buf + m, sizeof(buf) - 1 - m);
+			if (k <= 0)
+				break;
+			m += k;
+			buf[m] = '\0';
+			if (strstr(buf, "\r\n\r\n"))
+				break;
+		}
+		k = strncmp(buf, "GET /", 5) ? 0 : atoi(buf + 5);
+		if (k < 1 || k > MAX_CHUNK)
+			k = 1;
+
+		m = lws_snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+				 "Content-Type: text/html\r\n"
+				 "Content-Length: %d\r\n"
+				 "Connection: close\r\n\r\n", doc_len);
+		if (write(fd, hdr, m) != m)
+			goto next;
+
+		for (m = 0; m < doc_len; m += k) {
+			if (k > doc_len - m)
+				k = doc_len - m;
+			if (write(fd, doc + m, k) != k)
+				break;
+			usleep(100);
+		}
+next:
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* the body of the response, or -1 */
+
+static int
+get(int chunk, char *body, int max)
+{
+	struct sockaddr_in sa;
+	struct timeval tv;
+	char buf[16384], *p;
+	int fd, n, m = 0;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		goto bail;
+
+	n = lws_snprintf(buf, sizeof(buf), "GET /px/%d HTTP/1.1\r\n"
+			 "Host: localhost\r\n"
+			 "Connection: close\r\n\r\n", chunk);
+	if (write(fd, buf, n) != n)
+		goto bail;
+
+	/* the proxy closes after the response */
+	while (m < (int)sizeof(buf) - 1) {
+		n = read(fd, buf + m, sizeof(buf) - 1 - m);
+		if (n <= 0)
+			break;
+		m += n;
+	}
+	close(fd);
+	buf[m] = '\0';
+
+	p = strstr(buf, "\r\n\r\n");
+	if (strncmp(buf, "HTTP/1.1 200", 12) || !p)
+		return -1;
+	p += 4;
+	n = m - (int)(p - buf);
+	if (n > max)
+		return -1;
+	memcpy(body, p, n);
+
+	return n;
+
+bail:
+	close(fd);
+
+	return -1;
+}
+
+static void *
+thread_client(void *d)
+{
+	char body[8192];
+	int n, m;
+
+	(void)d;
+
+	for (n = 1; n <= MAX_CHUNK; n++) {
+		m = get(n, body, sizeof(body));
+		if (m != expected_len || memcmp(body, expected, m)) {
+			lwsl_err("%d byte pieces: got %d bytes, expected %d\n",
+				 n, m, expected_len);
+			if (m > 0)
+				lwsl_err("%.*s\n", m, body);
+			failed = 1;
+		}
+	}
+
+	done = 1;
+	lws_cancel_service(context);
+
+	return NULL;
+}
+
+static const struct lws_protocols protocols[] = {
+	{ "http-only", lws_callback_http_dummy, 0, 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	pthread_t upstream, client;
+	struct lws_http_mount mount;
+	struct sockaddr_in sa;
+	struct timeval tv;
+	char origin[64];
+	int n = 0, one = 1;
+
+	lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-rewrite "
+				"[-d <log level>] [--port=<p>]\n");
+			return 1;
+		}
+	}
+
+	lws_snprintf(origin, sizeof(origin), "127.0.0.1:%d", port + 1);
+	for (n = 0; n < (int)(sizeof(pieces) / sizeof(pieces[0])); n++) {
+		doc_len = append(doc, doc_len, pieces[n].in, origin);
+		expected_len = append(expected, expected_len, pieces[n].out ?
+				      pieces[n].out : pieces[n].in, origin);
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+		return 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* so the upstream thread gives up if the proxy never comes */
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port + 1);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(listen_fd, 8) < 0) {
+		lwsl_err("unable to listen on %d\n", port + 1);
+		close(listen_fd);
+		return 1;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		close(listen_fd);
+		return 1;
+	}
+
+	lws_snprintf(origin, sizeof(origin), "127.0.0.1:%d/", port + 1);
+	memset(&mount, 0, sizeof(mount));
+	mount.mountpoint = "/px";
+	mount.mountpoint_len = 3;
+	mount.origin = origin;
+	mount.origin_protocol = LWSMPRO_HTTP;
+
+	info.vhost_name = "proxy";
+	info.port = port;
+	info.protocols = protocols;
+	info.mounts = &mount;
+	if (!lws_create_vhost(context, &info))
+		goto bail;
+
+	if (pthread_create(&upstream, NULL, thread_upstream, NULL))
+		goto bail;
+	if (pthread_create(&client, NULL, thread_client, NULL)) {
+		done = 1;
+		pthread_join(upstream, NULL);
+		goto bail;
+	}
+
+	while (!done)
+		lws_service(context, 50);
+
+	pthread_join(client, NULL);
+	pthread_join(upstream, NULL);
+	lws_context_destroy(context);
+	close(listen_fd);
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed;
+
+bail:
+	lws_context_destroy(context);
+	close(listen_fd);
+
+	return 1;
+}
@@ -122,18 +122,42 @@ static struct lws_protocols protocols[] = {
 	{ NULL, NULL, 0, 0 } /* terminator */
 };
 
+/*
+ * Instead of reaching into the wsi lists from this thread, the dumb
+ * increment thread posts a work item to a service thread, and the callback
+ * runs there, serialized with the rest of its service.
+ */
+
+static struct lws_pt_work dumb_work;
+static volatile int dumb_work_posted;
+
+static void
+dumb_increment_work(struct lws_context *context, int tsi,
+		    struct lws_pt_work *work)
+{
+	/* we own the work item again, it may be posted again */
+	dumb_work_posted = 0;
+
+	/*
+	 * this lock means wsi in the active list cannot disappear underneath
+	 * us, since other service threads may be adding or removing them
+	 */
+	pthread_mutex_lock(&lock_established_conns);
+	lws_callback_on_writable_all_protocol(context,
+			&protocols[PROTOCOL_DUMB_INCREMENT]);
+	pthread_mutex_unlock(&lock_established_conns);
+}
+
 void *thread_dumb_increment(void *threadid)
 {
+	dumb_work.cb = dumb_increment_work;
+
 	while (!force_exit) {
-		/*
-		 * this lock means wsi in the active list cannot
-		 * disappear underneath us, because the code to add and remove
-		 * them is protected by the same lock
-		 */
-		pthread_mutex_lock(&lock_established_conns);
-		lws_callback_on_writable_all_protocol(context,
-				&protocols[PROTOCOL_DUMB_INCREMENT]);
-		pthread_mutex_unlock(&lock_established_conns);
+		if (!dumb_work_posted) {
+			dumb_work_posted = 1;
+			if (lws_pt_work_post(context, 0, &dumb_work))
+				dumb_work_posted = 0;
+		}
 		usleep(100000);
 	}
 
@@ -226,7 +250,7 @@ int main(int argc, char **argv)
 		switch (n) {
 		case 'j':
 			threads = atoi(optarg);
-			if (threads > ARRAY_SIZE(pthread_service)) {
+			if (threads > (int)ARRAY_SIZE(pthread_service)) {
 				lwsl_err("Max threads %lu\n",
 					 (unsigned long)ARRAY_SIZE(pthread_service));
 				return 1;
@@ -0,0 +1,351 @@
+/*
+ * libwebsockets-test-spa-bench - POST body decoder benchmark
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * lws_spa needs a live wsi, so a thread POSTs --count bodies of --size
+ * bytes to the server here, first urlencoded (one long value with some
+ * '+' and %xx in it) and then multipart/form-data (one file part of random
+ * bytes).  The server parses them with lws_spa, timing only the
+ * lws_spa_process() calls, and answers with how much it decoded, which the
+ * thread checks.  It reports the decoder's MB/s for each.
+ */
+
+#include "test-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#define BOUNDARY "----lwsSpaBenchBoundary"
+
+static int port = 7798, size = 4 * 1024 * 1024, count = 8, zero_copy;
+static volatile unsigned long long spa_ns;
+
+static const char * const param_names[] = { "v" };
+
+struct per_session_data__spa_bench {
+	struct lws_spa *spa;
+	long file_length;
+};
+
+static int
+file_upload_cb(void *data, const char *name, const char *filename,
+	       char *buf, int len, enum lws_spa_fileupload_states state)
+{
+	struct per_session_data__spa_bench *pss =
+			(struct per_session_data__spa_bench *)data;
+
+	if (state != LWS_UFS_OPEN)
+		pss->file_length += len;
+
+	return 0;
+}
+
+static int
+callback_spa_bench(struct lws *wsi, enum lws_callback_reasons reason,
+		   void *user, void *in, size_t len)
+{
+	struct per_session_data__spa_bench *pss =
+			(struct per_session_data__spa_bench *)user;
+	unsigned char buf[LWS_PRE + 256], *start = buf + LWS_PRE, *p = start,
+		      *end = buf + sizeof(buf) - 1;
+	struct lws_spa_create_info i;
+	unsigned long long t;
+	char result[32];
+	int n;
+
+	switch (reason) {
+	case LWS_CALLBACK_HTTP:
+		/* the body follows */
+		pss->file_length = 0;
+		return 0;
+
+	case LWS_CALLBACK_HTTP_BODY:
+		if (!pss->spa) {
+			memset(&i, 0, sizeof(i));
+			i.param_names = param_names;
+			i.count_params = 1;
+			i.max_storage = size + 1024;
+			i.opt_cb = file_upload_cb;
+			i.opt_data = pss;
+			if (zero_copy)
+				i.options = LWS_SPA_OPT_FILE_ZERO_COPY;
+			pss->spa = lws_spa_create_via_info(wsi, &i);
+			if (!pss->spa)
+				return -1;
+		}
+
+		t = bench_time_ns();
+		n = lws_spa_process(pss->spa, in, (int)len);
+		spa_ns += bench_time_ns() - t;
+		if (n)
+			return -1;
+		break;
+
+	case LWS_CALLBACK_HTTP_BODY_COMPLETION:
+		if (!pss->spa)
+			return -1;
+		lws_spa_finalize(pss->spa);
+
+		/* the decoded size of whichever it was */
+		n = lws_snprintf(result, sizeof(result), "%ld",
+				 pss->file_length ? pss->file_length :
+				 (long)lws_spa_get_length(pss->spa, 0));
+		lws_spa_destroy(pss->spa);
+		pss->spa = NULL;
+
+		if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+		    lws_add_http_header_content_length(wsi, n, &p, end) ||
+		    lws_finalize_http_header(wsi, &p, end))
+			return 1;
+		memcpy(p, result, n);
+		if (lws_write(wsi, start, p - start + n, LWS_WRITE_HTTP) < 0)
+			return 1;
+		if (lws_http_transaction_completed(wsi))
+			return -1;
+		break;
+
+	case LWS_CALLBACK_CLOSED_HTTP:
+		if (pss->spa) {
+			lws_spa_destroy(pss->spa);
+			pss->spa = NULL;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+static const struct lws_protocols protocols[] = {
+	{ "spa-bench", callback_spa_bench,
+	  sizeof(struct per_session_data__spa_bench), 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+/*
+ * Fills body with a urlencoded "v=..." of len bytes, returning how long it
+ * decodes to
+ */
+
+static long
+make_urlencoded(char *body, int len)
+{
+	long decoded = 0;
+	int n = 2, r;
+
+	memcpy(body, "v=", 2);
+	while (n < len) {
+		r = rand() % 64;
+		if (!r && n + 3 <= len) {
+			memcpy(body + n, "%41", 3);
+			n += 3;
+		} else
+			body[n++] = r == 1 ? '+' : 'a' + (r % 26);
+		decoded++;
+	}
+
+	return decoded;
+}
+
+/* the body, len bytes, and the length of the file part in it */
+
+static long
+make_multipart(char *body, int len)
+{
+	static const char head[] = "--" BOUNDARY "\r\n"
+		"Content-Disposition: form-data; name=\"file\"; "
+			"filename=\"bench.bin\"\r\n"
+		"Content-Type: application/octet-stream\r\n\r\n",
+			  tail[] = "\r\n--" BOUNDARY "--\r\n";
+	long file = len - (sizeof(head) - 1) - (sizeof(tail) - 1);
+	int n;
+
+	memcpy(body, head, sizeof(head) - 1);
+	for (n = 0; n < file; n++)
+		body[sizeof(head) - 1 + n] = (char)rand();
+	memcpy(body + len - (sizeof(tail) - 1), tail, sizeof(tail) - 1);
+
+	return file;
+}
+
+/* returns the server's decoded length, or -1 */
+
+static long
+post(const char *body, int len, const char *type)
+{
+	char buf[1024];
+	int fd, n, m = 0;
+	char *p;
+
+	fd = bench_connect(port);
+	if (fd < 0)
+		return -1;
+
+	n = lws_snprintf(buf, sizeof(buf), "POST /bench HTTP/1.1\r\n"
+			 "Host: localhost\r\n"
+			 "Content-Type: %s\r\n"
+			 "Content-Length: %d\r\n"
+			 "Connection: close\r\n\r\n", type, len);
+	if (write(fd, buf, n) != n)
+		goto bail;
+	while (m < len) {
+		n = write(fd, body + m, len - m);
+		if (n <= 0)
+			goto bail;
+		m += n;
+	}
+
+	m = 0;
+	while (m < (int)sizeof(buf) - 1) {
+		n = read(fd, buf + m, sizeof(buf) - 1 - m);
+		if (n <= 0)
+			break;
+		m += n;
+	}
+	close(fd);
+	buf[m] = '\0';
+
+	p = strstr(buf, "\r\n\r\n");
+	if (strncmp(buf, "HTTP/1.1 200", 12) || !p)
+		return -1;
+
+	return atol(p + 4);
+
+bail:
+	close(fd);
+
+	return -1;
+}
+
+static int
+client(void *d)
+{
+	static const char * const types[] = {
+		"application/x-www-form-urlencoded",
+		"multipart/form-data; boundary=" BOUNDARY
+	};
+	long expected, got;
+	int t, n, failed = 1;
+	char *body;
+
+	(void)d;
+
+	body = malloc(size);
+	if (!body)
+		return 1;
+
+	for (t = 0; t < 2; t++) {
+		expected = t ? make_multipart(body, size) :
+			       make_urlencoded(body, size);
+
+		/* one to warm up, then time the rest */
+		for (n = 0; n <= count; n++) {
+			if (n == 1)
+				spa_ns = 0;
+			got = post(body, size, types[t]);
+			if (got != expected) {
+				lwsl_err("%s: decoded %ld, expected %ld\n",
+					 t ? "multipart" : "urlencoded", got,
+					 expected);
+				goto bail;
+			}
+		}
+
+		printf("%s: %.0f MB/s\n", t ? "multipart" : "urlencoded",
+		       ((double)size * count / (1024 * 1024)) /
+		       ((double)spa_ns / 1000000000));
+	}
+	failed = 0;
+
+bail:
+	free(body);
+
+	return failed;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ "size",	required_argument,	NULL, 's' },
+	{ "count",	required_argument,	NULL, 'c' },
+	{ "zero-copy",	no_argument,		NULL, 'z' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	struct lws_context *context;
+	int n = 0;
+
+	lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:s:c:z", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'c':
+			count = atoi(optarg);
+			break;
+		case 'z':
+			zero_copy = 1;
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-spa-bench "
+				"[--size <bytes>] [--count <n>] [--zero-copy] "
+				"[--port <p>] [-d <log bitfield>]\n");
+			return 1;
+		}
+	}
+
+	if (size < 1024 || count < 1)
+		return 1;
+
+	memset(&info, 0, sizeof(info));
+	info.port = port;
+	info.protocols = protocols;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		return 1;
+	}
+
+	printf("%d bodies of %d bytes%s\n", count, size,
+	       zero_copy ? ", zero copy" : "");
+
+	n = bench_serve(context, client, NULL);
+	lws_context_destroy(context);
+
+	return n;
+}
@@ -0,0 +1,338 @@
+/*
+ * libwebsockets-test-stats-bench - LWS_WITH_STATS multi-thread benchmark
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * This runs a service thread for each of --threads pts, and --clients
+ * threads that each make --connections keep-alive connections in turn,
+ * with --requests GETs on each.  It reports requests/s, and checks that
+ * lws_stats_get() afterwards agrees exactly with what the clients saw:
+ * connections, lws_write() calls (one per response) and bytes written.
+ *
+ * Then it times --bumps counter bumps on each of as many threads, done the
+ * way the library does them now, each thread adding to its own padded shard
+ * with relaxed atomics, and the way it did before, every thread taking one
+ * lock to add to one shared array.  From how many bumps the load made per
+ * request, it reports what each way costs per request, against how much
+ * service thread time a request took.
+ */
+
+#include "test-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
+
+static struct lws_context *context;
+static volatile int done;
+static int port = 7799, threads = LWS_MAX_SMP, clients = 8, connections = 10,
+	   requests = 1000, bumps = 10000000;
+
+struct client {
+	pthread_t thread;
+	unsigned long long conns, reqs, bytes;
+	int failed;
+};
+
+static const struct lws_protocols protocols[] = {
+	{ "stats-bench", callback_bench_ok, 0, 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+static void *
+thread_service(void *d)
+{
+	while (!done)
+		if (lws_service_tsi(context, 50, (int)(lws_intptr_t)d) < 0)
+			break;
+
+	return NULL;
+}
+
+static void *
+thread_client(void *d)
+{
+	static const char req[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	struct client *c = (struct client *)d;
+	int fd, n, m, k;
+	char last = 0;
+
+	for (n = 0; n < connections; n++) {
+		fd = bench_connect(port);
+		if (fd < 0)
+			goto bail;
+		c->conns++;
+
+		for (m = 0; m < requests; m++) {
+			if (write(fd, req, sizeof(req) - 1) != sizeof(req) - 1)
+				break;
+			k = bench_read_oks(fd, 1, &last);
+			if (k < 0)
+				break;
+			c->bytes += k;
+			c->reqs++;
+		}
+		close(fd);
+		if (m < requests)
+			goto bail;
+	}
+
+	return NULL;
+
+bail:
+	c->failed = 1;
+
+	return NULL;
+}
+
+struct bump_shard {
+	uint64_t stats[LWSSTATS_SIZE];
+	unsigned char updated;
+	char pad[64];
+};
+
+static struct bump_shard shards[MAX_THREADS];
+static uint64_t shared_stats[LWSSTATS_SIZE];
+static unsigned char shared_updated;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int bump_go, bump_locked;
+
+static void *
+thread_bump(void *d)
+{
+	struct bump_shard *s = &shards[(int)(lws_intptr_t)d];
+	int n, i;
+
+	while (!bump_go)
+		;
+
+	/* a write count and its byte count, in turn */
+	for (n = 0; n < bumps; n++) {
+		i = n & 1 ? LWSSTATS_B_WRITE : LWSSTATS_C_API_WRITE;
+		if (bump_locked) {
+			pthread_mutex_lock(&shared_lock);
+			shared_stats[i] += n & 1 ? 64 : 1;
+			shared_updated = 1;
+			pthread_mutex_unlock(&shared_lock);
+		} else {
+			__atomic_fetch_add(&s->stats[i], n & 1 ? 64 : 1,
+					   __ATOMIC_RELAXED);
+			if (!s->updated)
+				s->updated = 1;
+		}
+	}
+
+	return NULL;
+}
+
+/* ns per bump seen by each of count threads bumping at once, or 0 */
+
+static double
+bump_ns(int count, int locked)
+{
+	pthread_t t[MAX_THREADS];
+	unsigned long long start;
+	int n, m;
+
+	bump_go = 0;
+	bump_locked = locked;
+	for (n = 0; n < count; n++)
+		if (pthread_create(&t[n], NULL, thread_bump,
+				   (void *)(lws_intptr_t)n))
+			break;
+
+	start = bench_time_ns();
+	bump_go = 1;
+	for (m = 0; m < n; m++)
+		pthread_join(t[m], NULL);
+
+	if (n < count)
+		return 0;
+
+	return (double)(bench_time_ns() - start) / bumps;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ "threads",	required_argument,	NULL, 't' },
+	{ "clients",	required_argument,	NULL, 'c' },
+	{ "connections", required_argument,	NULL, 'n' },
+	{ "requests",	required_argument,	NULL, 'r' },
+	{ "bumps",	required_argument,	NULL, 'b' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	unsigned long long start, us, conns = 0, reqs = 0, bytes = 0,
+			   per_req = 0;
+	struct lws_context_creation_info info;
+	pthread_t service[MAX_THREADS];
+	double ns[2], req_us;
+	struct client *c;
+	int n = 0, count_threads, started = 0, failed = 0;
+
+	lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:t:c:n:r:b:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'n':
+			connections = atoi(optarg);
+			break;
+		case 'r':
+			requests = atoi(optarg);
+			break;
+		case 'b':
+			bumps = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-stats-bench "
+				"[--threads <n>] [--clients <n>] "
+				"[--connections <n>] [--requests <n>] "
+				"[--bumps <n>] [--port <p>] "
+				"[-d <log bitfield>]\n");
+			return 1;
+		}
+	}
+
+	if (threads < 1 || threads > MAX_THREADS || clients < 1 ||
+	    connections < 1 || requests < 1 || bumps < 1)
+		return 1;
+
+	c = calloc(clients, sizeof(*c));
+	if (!c)
+		return 1;
+
+	memset(&info, 0, sizeof(info));
+	info.port = port;
+	info.protocols = protocols;
+	info.count_threads = threads;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		free(c);
+		return 1;
+	}
+
+	/* it may have been limited by LWS_MAX_SMP */
+	count_threads = lws_get_count_threads(context);
+
+	for (started = 0; started < count_threads; started++)
+		if (pthread_create(&service[started], NULL, thread_service,
+				   (void *)(lws_intptr_t)started))
+			goto bail;
+
+	start = bench_time_us();
+	for (n = 0; n < clients; n++)
+		if (pthread_create(&c[n].thread, NULL, thread_client, &c[n]))
+			break;
+	if (n < clients) {
+		lwsl_err("unable to start the clients\n");
+		clients = n;
+		failed = 1;
+	}
+	for (n = 0; n < clients; n++) {
+		pthread_join(c[n].thread, NULL);
+		conns += c[n].conns;
+		reqs += c[n].reqs;
+		bytes += c[n].bytes;
+		failed |= c[n].failed;
+	}
+	us = bench_time_us() - start;
+
+	/* let the service threads see the last connections close */
+	usleep(200000);
+
+	printf("%d service threads, %d clients: %llu requests, %.0f req/s\n",
+	       count_threads, clients, reqs, (double)reqs * 1000000 / us);
+
+	if (failed)
+		lwsl_err("client requests failed\n");
+
+	if (lws_stats_get(context, LWSSTATS_C_CONNECTIONS) != conns ||
+	    lws_stats_get(context, LWSSTATS_C_API_LWS_WRITE) != reqs ||
+	    lws_stats_get(context, LWSSTATS_B_WRITE) != bytes) {
+		lwsl_err("stats: %llu connections, %llu writes, %llu bytes, "
+			 "clients saw %llu, %llu, %llu\n",
+			 (unsigned long long)lws_stats_get(context,
+						LWSSTATS_C_CONNECTIONS),
+			 (unsigned long long)lws_stats_get(context,
+						LWSSTATS_C_API_LWS_WRITE),
+			 (unsigned long long)lws_stats_get(context,
+						LWSSTATS_B_WRITE),
+			 conns, reqs, bytes);
+		failed = 1;
+	}
+
+	/*
+	 * Each read and write is bumped twice, once for the call and once
+	 * for its bytes; the rest are counts
+	 */
+	for (n = LWSSTATS_C_CONNECTIONS; n <= LWSSTATS_C_SERVICE_ENTRY; n++)
+		per_req += lws_stats_get(context, n);
+	per_req += lws_stats_get(context, LWSSTATS_C_API_READ) +
+		   lws_stats_get(context, LWSSTATS_C_API_WRITE);
+
+	ns[0] = bump_ns(count_threads, 1);
+	ns[1] = bump_ns(count_threads, 0);
+	if (!ns[0] || !ns[1] || !reqs) {
+		lwsl_err("unable to time the bumps\n");
+		failed = 1;
+	} else {
+		req_us = (double)us * count_threads / reqs;
+		printf("bumps on %d threads: locked %.1fns, sharded %.1fns\n",
+		       count_threads, ns[0], ns[1]);
+		printf("%.1f bumps/req: locked %.0fns/req, sharded %.0fns/req, "
+		       "saving %.0fns of %.2fus service thread time per req\n",
+		       (double)per_req / reqs, ns[0] * per_req / reqs,
+		       ns[1] * per_req / reqs, (ns[0] - ns[1]) * per_req / reqs,
+		       req_us);
+	}
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+bail:
+	done = 1;
+	for (n = 0; n < started; n++)
+		pthread_join(service[n], NULL);
+	lws_context_destroy(context);
+	free(c);
+
+	return failed || started < count_threads;
+}
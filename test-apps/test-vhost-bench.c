@@ -0,0 +1,250 @@
+/*
+ * libwebsockets-test-vhost-bench - vhost selection benchmark
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * This creates --vhosts vhosts, "vh0", "vh1"... all listening on --port,
+ * each answering every GET with its own name.  A thread makes --requests
+ * keep-alive requests, --pipeline at a time, first with every Host: naming
+ * the same vhost and then with each naming a random one, and checks each
+ * answer came from the vhost it asked for.  The difference in time per
+ * request is what picking among that many vhosts costs.
+ */
+
+#include "test-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+static int port = 7797, count_vhosts = 10000, requests = 50000, pipeline = 8,
+	   failed;
+static double us_per_req[2];
+
+static int
+callback_vhost_bench(struct lws *wsi, enum lws_callback_reasons reason,
+		     void *user, void *in, size_t len)
+{
+	unsigned char buf[LWS_PRE + 256], *start = buf + LWS_PRE, *p = start,
+		      *end = buf + sizeof(buf) - 1;
+	const char *name;
+	int n;
+
+	switch (reason) {
+	case LWS_CALLBACK_HTTP:
+		name = lws_get_vhost_name(lws_get_vhost(wsi));
+		n = (int)strlen(name);
+		if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+		    lws_add_http_header_content_length(wsi, n, &p, end) ||
+		    lws_finalize_http_header(wsi, &p, end))
+			return 1;
+		memcpy(p, name, n);
+		if (lws_write(wsi, start, p - start + n, LWS_WRITE_HTTP) < 0)
+			return 1;
+		if (lws_http_transaction_completed(wsi))
+			return -1;
+		return 0;
+
+	default:
+		break;
+	}
+
+	return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+static const struct lws_protocols protocols[] = {
+	{ "vhost-bench", callback_vhost_bench, 0, 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+/* returns nonzero if the responses didn't all come */
+
+static int
+run(int spread)
+{
+	char req[4096], rx[16384], *h, *b;
+	int fd, n, m, k, got, len, rxlen, cl, which[64];
+	unsigned long long start;
+
+	fd = bench_connect(port);
+	if (fd < 0)
+		return 1;
+
+	start = bench_time_us();
+
+	for (n = 0; n < requests; n += pipeline) {
+		len = 0;
+		for (m = 0; m < pipeline; m++) {
+			which[m] = spread ? rand() % count_vhosts : 0;
+			len += lws_snprintf(req + len, sizeof(req) - len,
+					    "GET / HTTP/1.1\r\n"
+					    "Host: vh%d\r\n\r\n", which[m]);
+		}
+		if (write(fd, req, len) != len)
+			break;
+
+		/* take the responses apart in order, checking who sent them */
+		got = 0;
+		rxlen = 0;
+		while (got < pipeline) {
+			k = read(fd, rx + rxlen, sizeof(rx) - 1 - rxlen);
+			if (k <= 0)
+				goto bail;
+			rxlen += k;
+			rx[rxlen] = '\0';
+
+			while (got < pipeline) {
+				h = strstr(rx, "\r\n\r\n");
+				if (!h)
+					break;
+				b = strstr(rx, "content-length: ");
+				if (!b || b > h)
+					goto bail;
+				cl = atoi(b + 16);
+				h += 4;
+				if (h + cl > rx + rxlen)
+					break;
+				lws_snprintf(req, sizeof(req), "vh%d", which[got]);
+				if (cl != (int)strlen(req) || memcmp(h, req, cl)) {
+					lwsl_err("asked %s, answered by %.*s\n",
+						 req, cl, h);
+					failed = 1;
+				}
+				got++;
+				rxlen -= (int)(h + cl - rx);
+				memmove(rx, h + cl, rxlen + 1);
+			}
+		}
+	}
+
+	us_per_req[spread] = (double)(bench_time_us() - start) / n;
+
+bail:
+	close(fd);
+
+	return n < requests;
+}
+
+static int
+client(void *d)
+{
+	(void)d;
+
+	/* warm up, then time both */
+	if (run(0) || run(0) || run(1)) {
+		fprintf(stderr, "requests failed\n");
+		return 1;
+	}
+
+	printf("1 vhost: %.2fus/req, %d vhosts: %.2fus/req, "
+	       "difference %.0fns/req\n", us_per_req[0], count_vhosts,
+	       us_per_req[1], (us_per_req[1] - us_per_req[0]) * 1000);
+
+	return failed;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ "vhosts",	required_argument,	NULL, 'v' },
+	{ "requests",	required_argument,	NULL, 'r' },
+	{ "pipeline",	required_argument,	NULL, 'P' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	struct lws_context *context;
+	char *names;
+	int n = 0;
+
+	lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:v:r:P:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'v':
+			count_vhosts = atoi(optarg);
+			break;
+		case 'r':
+			requests = atoi(optarg);
+			break;
+		case 'P':
+			pipeline = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-vhost-bench "
+				"[--vhosts <n>] [--requests <n>] "
+				"[--pipeline <n>] [--port <p>] "
+				"[-d <log bitfield>]\n");
+			return 1;
+		}
+	}
+
+	if (count_vhosts < 1 || pipeline < 1 || pipeline > 64)
+		return 1;
+
+	/* the vhost keeps a pointer to its name, not a copy */
+	names = malloc(count_vhosts * 16);
+	if (!names)
+		return 1;
+
+	memset(&info, 0, sizeof(info));
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		free(names);
+		return 1;
+	}
+
+	info.protocols = protocols;
+	info.port = port;
+	for (n = 0; n < count_vhosts; n++) {
+		info.vhost_name = names + n * 16;
+		lws_snprintf(names + n * 16, 16, "vh%d", n);
+		if (!lws_create_vhost(context, &info))
+			goto bail;
+	}
+
+	printf("%d requests, %d pipelined\n", requests, pipeline);
+
+	n = bench_serve(context, client, NULL);
+	lws_context_destroy(context);
+	free(names);
+
+	return n;
+
+bail:
+	lws_context_destroy(context);
+	free(names);
+
+	return 1;
+}
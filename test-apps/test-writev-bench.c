@@ -0,0 +1,313 @@
+/*
+ * libwebsockets-test-writev-bench - chunked body gather vs copy benchmark
+ *
+ * Copyright (C) 2010-2017 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The person who associated a work with this deed has dedicated
+ * the work to the public domain by waiving all of his or her rights
+ * to the work worldwide under copyright law, including all related
+ * and neighboring rights, to the extent allowed by law. You can copy,
+ * modify, distribute and perform the work, even for commercial purposes,
+ * all without asking permission.
+ *
+ * The test apps are intended to be adapted for use in your code, which
+ * may be proprietary.	So unlike the library itself, they are licensed
+ * Public Domain.
+ *
+ * The server answers GET /c<size> and /g<size> with a chunked body of
+ * --chunks chunks of <size> bytes, one per writeable callback, from a
+ * buffer it doesn't own, the way a proxy or cgi relays a body.
+ *
+ * /c frames each chunk the old way, copying the payload into a buffer
+ * between the chunk size line and trailer and sending it with lws_write().
+ * /g passes the payload to lws_writev() with LWS_WRITE_HTTP_CHUNK, so the
+ * framing goes out in the same gather and the payload isn't copied.
+ *
+ * A thread makes --requests requests each way for a few chunk sizes, checks
+ * the bodies, and reports the service thread CPU time per request for each,
+ * the best of three runs.
+ */
+
+#include "test-bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_SIZE 16384
+
+static int port = 7805, requests = 20000, chunks = 8;
+static unsigned char payload[MAX_SIZE];
+static clockid_t service_clock;
+
+struct pss {
+	int size;
+	int left;
+	char gather;
+};
+
+static int
+callback_writev_bench(struct lws *wsi, enum lws_callback_reasons reason,
+		      void *user, void *in, size_t len)
+{
+	unsigned char buf[LWS_PRE + 16 + MAX_SIZE + 7],
+		      *start = buf + LWS_PRE, *p = start,
+		      *end = buf + sizeof(buf) - 1;
+	struct pss *pss = (struct pss *)user;
+	struct lws_iovec v;
+	const char *path = (const char *)in;
+	int n, final;
+
+	switch (reason) {
+	case LWS_CALLBACK_HTTP:
+		if (len < 3 || (path[1] != 'c' && path[1] != 'g'))
+			return 1;
+		pss->gather = path[1] == 'g';
+		pss->size = atoi(path + 2);
+		pss->left = chunks;
+		if (pss->size < 1 || pss->size > MAX_SIZE)
+			return 1;
+
+		if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+		    lws_add_http_header_by_token(wsi,
+				WSI_TOKEN_HTTP_TRANSFER_ENCODING,
+				(unsigned char *)"chunked", 7, &p, end) ||
+		    lws_finalize_http_header(wsi, &p, end))
+			return 1;
+		if (lws_write(wsi, start, p - start,
+			      LWS_WRITE_HTTP_HEADERS) < 0)
+			return 1;
+		lws_callback_on_writable(wsi);
+		return 0;
+
+	case LWS_CALLBACK_HTTP_WRITEABLE:
+		/* a partial send can get us called again after the last chunk */
+		if (pss->left <= 0)
+			return 0;
+		final = !--pss->left;
+
+		if (pss->gather) {
+			v.base = payload;
+			v.len = pss->size;
+			if (lws_writev(wsi, &v, 1, LWS_WRITE_HTTP_CHUNK |
+				       (final ? LWS_WRITE_HTTP_FINAL :
+						LWS_WRITE_HTTP)) < 0)
+				return -1;
+		} else {
+			n = lws_snprintf((char *)p, 16, "%X\x0d\x0a",
+					 pss->size);
+			memcpy(p + n, payload, pss->size);
+			n += pss->size;
+			memcpy(p + n, "\x0d\x0a" "0\x0d\x0a\x0d\x0a", 7);
+			n += final ? 7 : 2;
+			if (lws_write(wsi, p, n, LWS_WRITE_HTTP) < 0)
+				return -1;
+		}
+
+		if (!final) {
+			lws_callback_on_writable(wsi);
+			return 0;
+		}
+		if (lws_http_transaction_completed(wsi))
+			return -1;
+		return 0;
+
+	default:
+		break;
+	}
+
+	return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+static const struct lws_protocols protocols[] = {
+	{ "writev-bench", callback_writev_bench, sizeof(struct pss), 0, },
+	{ NULL, NULL, 0, 0 }
+};
+
+static unsigned long long
+service_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(service_clock, &ts);
+
+	return ((unsigned long long)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/*
+ * Reads one response, up to the zero-length chunk, returning how many
+ * payload bytes were in it, or -1
+ */
+
+static int
+read_response(int fd)
+{
+	static const char term[] = "\x0d\x0a" "0\x0d\x0a\x0d\x0a";
+	char rx[16384], tail[8];
+	int n, k, got = 0, t = 0;
+
+	memset(tail, 0, sizeof(tail));
+
+	while (1) {
+		k = read(fd, rx, sizeof(rx));
+		if (k <= 0)
+			return -1;
+		for (n = 0; n < k; n++) {
+			/* the payload is all '~', which nothing else is */
+			if (rx[n] == '~')
+				got++;
+			memmove(tail, tail + 1, 6);
+			tail[6] = rx[n];
+			if (++t >= 7 && !memcmp(tail, term, 7)) {
+				if (n != k - 1)
+					return -1;
+				return got;
+			}
+		}
+	}
+}
+
+/* service thread CPU ns per request, or 0 if it went wrong */
+
+static double
+run(int gather, int size)
+{
+	unsigned long long cpu;
+	char req[64];
+	int fd, n, m;
+
+	fd = bench_connect(port);
+	if (fd < 0)
+		return 0;
+
+	m = lws_snprintf(req, sizeof(req), "GET /%c%d HTTP/1.1\r\n"
+			 "Host: localhost\r\n\r\n", gather ? 'g' : 'c', size);
+
+	cpu = service_cpu_ns();
+	for (n = 0; n < requests; n++)
+		if (write(fd, req, m) != m ||
+		    read_response(fd) != size * chunks)
+			break;
+	cpu = service_cpu_ns() - cpu;
+	close(fd);
+
+	if (n < requests) {
+		fprintf(stderr, "/%c%d: request %d failed\n",
+			gather ? 'g' : 'c', size, n);
+		return 0;
+	}
+
+	return (double)cpu / requests;
+}
+
+static int
+client(void *d)
+{
+	static const int sizes[] = { 64, 1024, 4096, 16384 };
+	double ns[2], t;
+	int n, m, r;
+
+	(void)d;
+
+	for (n = 0; n < (int)(sizeof(sizes) / sizeof(sizes[0])); n++) {
+		/* warm up, then keep the best of 3 runs each way, in turn */
+		ns[0] = ns[1] = 0;
+		for (r = 0; r < 4; r++)
+			for (m = 0; m < 2; m++) {
+				t = run(m, sizes[n]);
+				if (!t)
+					return 1;
+				if (r && (!ns[m] || t < ns[m]))
+					ns[m] = t;
+			}
+
+		printf("%5d byte chunks: copy %6.2fus/req, gather %6.2fus/req,"
+		       " %+.0f%%\n", sizes[n], ns[0] / 1000, ns[1] / 1000,
+		       (ns[1] - ns[0]) * 100 / ns[0]);
+	}
+
+	return 0;
+}
+
+static struct option options[] = {
+	{ "help",	no_argument,		NULL, 'h' },
+	{ "debug",	required_argument,	NULL, 'd' },
+	{ "port",	required_argument,	NULL, 'p' },
+	{ "requests",	required_argument,	NULL, 'r' },
+	{ "chunks",	required_argument,	NULL, 'c' },
+	{ NULL, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+	struct lws_context_creation_info info;
+	struct lws_context *context;
+	int n = 0;
+
+	lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+
+	while (n >= 0) {
+		n = getopt_long(argc, argv, "hd:p:r:c:", options, NULL);
+		if (n < 0)
+			continue;
+		switch (n) {
+		case 'd':
+			lws_set_log_level(atoi(optarg), NULL);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			requests = atoi(optarg);
+			break;
+		case 'c':
+			chunks = atoi(optarg);
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: test-writev-bench "
+				"[--requests <n>] [--chunks <n>] "
+				"[--port <p>] [-d <log bitfield>]\n");
+			return 1;
+		}
+	}
+
+	if (requests < 1 || chunks < 1)
+		return 1;
+
+	memset(payload, '~', sizeof(payload));
+
+	/* we service on this thread, the client times our CPU use */
+	if (pthread_getcpuclockid(pthread_self(), &service_clock))
+		return 1;
+
+	memset(&info, 0, sizeof(info));
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+	context = lws_create_context(&info);
+	if (!context) {
+		lwsl_err("lws init failed\n");
+		return 1;
+	}
+
+	info.protocols = protocols;
+	info.port = port;
+	if (!lws_create_vhost(context, &info)) {
+		lws_context_destroy(context);
+		return 1;
+	}
+
+	printf("%d requests each way, %d chunks per body\n", requests,
+	       chunks);
+
+	n = bench_serve(context, client, NULL);
+	lws_context_destroy(context);
+
+	return n;
+}